@@ -42,6 +42,8 @@
 #include <random>
 #include <unordered_map>
 #include <chrono>
+#include <array>
+#include <numeric>
 
 #include <boost/bind.hpp>
 #include <boost/format.hpp>
@@ -498,6 +500,222 @@ private:
 
 #pragma endregion
 
+#pragma region Small vector
+
+// Vector storing up to N elements in place and falling back to the heap beyond N.
+// The storage is kept on clear() so that a reused instance does not allocate.
+template <typename T, int N>
+class SmallVector
+{
+public:
+
+	using value_type = T;
+	using iterator = T*;
+	using const_iterator = const T*;
+
+public:
+
+	SmallVector() {}
+	SmallVector(const SmallVector& o) { *this = o; }
+
+	SmallVector& operator=(const SmallVector& o)
+	{
+		if (this != &o)
+		{
+			reserve(o.size_);
+			for (int i = 0; i < o.size_; i++)
+			{
+				data()[i] = o.data()[i];
+			}
+			size_ = o.size_;
+		}
+		return *this;
+	}
+
+public:
+
+	void push_back(const T& v)
+	{
+		if (size_ == capacity())
+		{
+			// #v might be an element of this vector
+			const T t = v;
+			reserve(glm::max(4, 2 * capacity()));
+			data()[size_++] = t;
+			return;
+		}
+		data()[size_++] = v;
+	}
+
+	void reserve(int n)
+	{
+		if (n <= capacity())
+		{
+			return;
+		}
+		if (!onHeap)
+		{
+			heap.resize(n);
+			for (int i = 0; i < size_; i++)
+			{
+				heap[i] = inplace[i];
+			}
+			onHeap = true;
+		}
+		else
+		{
+			heap.resize(n);
+		}
+	}
+
+	void resize(int n)
+	{
+		reserve(n);
+		for (int i = size_; i < n; i++)
+		{
+			data()[i] = T();
+		}
+		size_ = n;
+	}
+
+	void clear() { size_ = 0; }
+	size_t size() const { return size_; }
+	bool empty() const { return size_ == 0; }
+	int capacity() const { return onHeap ? static_cast<int>(heap.size()) : N; }
+
+	T* data() { return onHeap ? heap.data() : inplace.data(); }
+	const T* data() const { return onHeap ? heap.data() : inplace.data(); }
+	T& operator[](size_t i) { assert(i < size()); return data()[i]; }
+	const T& operator[](size_t i) const { assert(i < size()); return data()[i]; }
+	T& front() { return (*this)[0]; }
+	const T& front() const { return (*this)[0]; }
+	T& back() { return (*this)[size_ - 1]; }
+	const T& back() const { return (*this)[size_ - 1]; }
+	iterator begin() { return data(); }
+	iterator end() { return data() + size_; }
+	const_iterator begin() const { return data(); }
+	const_iterator end() const { return data() + size_; }
+
+private:
+
+	std::array<T, N> inplace;
+	std::vector<T> heap;
+	bool onHeap = N == 0;
+	int size_ = 0;
+
+};
+
+#pragma endregion
+
+#pragma region Memory arena
+
+// Bump allocator for the scratch memory of a sample.
+// All allocations are released at once by Reset(). If a sample needed more than one block,
+// the blocks are merged into one on reset so that the following samples do not allocate.
+class MemoryArena
+{
+public:
+
+	MemoryArena(size_t initialBlockSize = 1 << 16) : initialBlockSize(initialBlockSize) {}
+	MemoryArena(const MemoryArena&) = delete;
+	MemoryArena& operator=(const MemoryArena&) = delete;
+
+public:
+
+	void* Allocate(size_t size, size_t align)
+	{
+		while (true)
+		{
+			if (current < blocks.size())
+			{
+				auto& block = blocks[current];
+				const size_t begin = (offset + align - 1) & ~(align - 1);
+				if (begin + size <= block.size())
+				{
+					offset = begin + size;
+					usedBytes = glm::max(usedBytes, usedBytesInPrevBlocks + offset);
+					return block.data() + begin;
+				}
+				usedBytesInPrevBlocks += block.size();
+				current++;
+				offset = 0;
+				continue;
+			}
+
+			// Add a new block large enough for the request
+			const size_t lastSize = blocks.empty() ? initialBlockSize : blocks.back().size();
+			blocks.emplace_back(glm::max(2 * lastSize, size + align));
+			numAllocations++;
+		}
+	}
+
+	template <typename T>
+	T* Allocate(size_t n)
+	{
+		return static_cast<T*>(Allocate(n * sizeof(T), alignof(T)));
+	}
+
+	void Reset()
+	{
+		if (blocks.size() > 1)
+		{
+			size_t total = 0;
+			for (const auto& block : blocks) total += block.size();
+			blocks.clear();
+			blocks.emplace_back(total);
+			numAllocations++;
+		}
+		current = 0;
+		offset = 0;
+		usedBytesInPrevBlocks = 0;
+	}
+
+	long long NumAllocations() const { return numAllocations; }
+	size_t PeakUsedBytes() const { return usedBytes; }
+
+private:
+
+	size_t initialBlockSize;
+	std::vector<std::vector<unsigned char>> blocks;
+	size_t current = 0;						// Index of the current block
+	size_t offset = 0;						// Offset in the current block
+	size_t usedBytesInPrevBlocks = 0;
+	size_t usedBytes = 0;					// Peak # of bytes used in a sample
+	long long numAllocations = 0;			// # of heap allocations of the blocks
+
+};
+
+// STL allocator allocating from a memory arena.
+// Deallocation is no-op; the memory is reclaimed when the arena is reset.
+template <typename T>
+class ArenaAllocator
+{
+public:
+
+	using value_type = T;
+
+	ArenaAllocator(MemoryArena& arena) : arena(&arena) {}
+	template <typename U>
+	ArenaAllocator(const ArenaAllocator<U>& o) : arena(o.arena) {}
+
+	T* allocate(size_t n) { return arena->template Allocate<T>(n); }
+	void deallocate(T*, size_t) {}
+
+	template <typename U> bool operator==(const ArenaAllocator<U>& o) const { return arena == o.arena; }
+	template <typename U> bool operator!=(const ArenaAllocator<U>& o) const { return arena != o.arena; }
+
+private:
+
+	template <typename U> friend class ArenaAllocator;
+	MemoryArena* arena;
+
+};
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+#pragma endregion
+
 #pragma region Save image
 
 namespace
@@ -32,6 +32,7 @@
 #define NANOGI_BDPT_H
 
 #include <nanogi/rt.hpp>
+#include <eigen3/Eigen/Dense>
 
 NGI_NAMESPACE_BEGIN
 
@@ -40,20 +41,36 @@ struct PathVertex
 	int type = PrimitiveType::None;
 	SurfaceGeometry geom;
 	const Primitive* primitive = nullptr;
+	double rrProb = 1;		// Probability of continuing the subpath after this vertex
+
+	// Cached quantities used for the evaluation of the connected paths,
+	// where forward means the sampling direction of the subpath
+	double pdfFwd = 0;			// Area PDF of sampling this vertex from the previous vertices
+	double pdfRev = 0;			// Area PDF of sampling this vertex from the next vertices
+	bool connectible = false;	// True if the BSDF or emitter is non-degenerated w.r.t. the neighboring vertices
+	glm::dvec3 alpha;			// Throughput of the subpath up to this vertex (without Russian roulette)
 };
 
-struct Path
+// Path with up to InlineNumVertices vertices stored in place.
+// Longer paths fall back to the heap.
+template <int InlineNumVertices>
+struct BasicPath
 {
 
-	std::vector<PathVertex> vertices;
+	SmallVector<PathVertex, InlineNumVertices> vertices;
 
 public:
 
 	#pragma region BDPT path initialization
 
-	void SampleSubpath(const Scene& scene, Random& rng, TransportDirection transDir, int maxPathVertices)
+	// #rng is Random or a sampler with the same interface, e.g., the primary sample space sampler of MLT
+	template <typename Sampler>
+	void SampleSubpath(const Scene& scene, Sampler& rng, TransportDirection transDir, int maxPathVertices, const RussianRoulette& rr)
 	{
 		PathVertex v;
+		glm::dvec3 throughput;
+		glm::dvec3 referenceThroughput;
+		glm::dvec3 alpha;
 		vertices.clear();
 		for (int step = 0; maxPathVertices == -1 || step < maxPathVertices; step++)
 		{
@@ -66,10 +83,17 @@ public:
 				const auto* emitter = scene.SampleEmitter(type, rng.Next());
 				v.primitive = emitter;
 				v.type = type;
+				v.rrProb = 1;
 
 				// Sample a position on the emitter
 				emitter->SamplePosition(rng.Next2D(), v.geom);
 
+				// Initial throughput
+				v.pdfFwd = emitter->EvaluatePositionPDF(v.geom, true) * scene.EvaluateEmitterPDF(emitter);
+				throughput = emitter->EvaluatePosition(v.geom, true) / v.pdfFwd;
+				alpha = throughput;
+				v.alpha = alpha;
+
 				// Create a vertex
 				vertices.push_back(v);
 
@@ -93,6 +117,15 @@ public:
 					break;
 				}
 
+				// Update throughput
+				const double pdfD = pv->primitive->EvaluateDirectionPDF(pv->geom, pv->type, wi, wo, true);
+				throughput *= f / pdfD;
+				alpha *= f / pdfD;
+				if (step == 1)
+				{
+					referenceThroughput = throughput;
+				}
+
 				// Intersection query
 				Ray ray = { pv->geom.p, wo };
 				Intersection isect;
@@ -105,16 +138,30 @@ public:
 				v.geom = isect.geom;
 				v.primitive = isect.Prim;
 				v.type = isect.Prim->Type & ~PrimitiveType::Emitter;
+				v.pdfFwd = pdfD * GeometryTerm(pv->geom, v.geom);
+				v.pdfRev = 0;
+				v.connectible = false;
+				v.alpha = alpha;
+
+				// Reverse PDF of the vertex two before and connectivity of the previous vertex,
+				// which are determined by the new vertex
+				if (ppv)
+				{
+					vertices[vertices.size() - 2].pdfRev = pv->primitive->EvaluateDirectionPDF(pv->geom, pv->type, glm::normalize(v.geom.p - pv->geom.p), wi, true) * GeometryTerm(pv->geom, ppv->geom);
+				}
+				vertices.back().connectible = pv->primitive->EvaluateDirection(pv->geom, pv->type, wi, wo, transDir, false) != glm::dvec3();
 
 				// Path termination
-				const double rrProb = 0.5;
-				if (rng.Next() > rrProb)
+				// The probability is recorded in the vertex and used in SelectionProb
+				v.rrProb = rr.ContinuationProb(throughput, referenceThroughput, false);
+				if (rr.Sample(v.rrProb, rng.Next()) == 0)
 				{
 					vertices.push_back(v);
 					break;
 				}
 
 				// Add a vertex
+				throughput /= v.rrProb;
 				vertices.push_back(v);
 
 				#pragma endregion
@@ -122,85 +169,12 @@ public:
 		}
 	}
 
-	bool Connect(const Scene& scene, int s, int t, const Path& subpathL, const Path& subpathE)
-	{
-		assert(s > 0 || t > 0);
-
-		vertices.clear();
-
-		if (s == 0 && t > 0)
-		{
-			if ((subpathE.vertices[t - 1].primitive->Type & PrimitiveType::L) == 0)
-			{
-				return false;
-			}
-			for (int i = t - 1; i >= 0; i--)
-			{
-				vertices.push_back(subpathE.vertices[i]);
-			}
-			vertices.front().type = PrimitiveType::L;
-		}
-		else if (s > 0 && t == 0)
-		{
-			if ((subpathL.vertices[s - 1].primitive->Type & PrimitiveType::E) == 0)
-			{
-				return false;
-			}
-			for (int i = 0; i < s; i++)
-			{
-				vertices.push_back(subpathL.vertices[i]);
-			}
-			vertices.back().type = PrimitiveType::E;
-		}
-		else
-		{
-			assert(s > 0 && t > 0);
-			if (!scene.Visible(subpathL.vertices[s - 1].geom.p, subpathE.vertices[t - 1].geom.p))
-			{
-				return false;
-			}
-			for (int i = 0; i < s; i++)
-			{
-				vertices.push_back(subpathL.vertices[i]);
-			}
-			for (int i = t - 1; i >= 0; i--)
-			{
-				vertices.push_back(subpathE.vertices[i]);
-			}
-		}
-
-		return true;
-	}
-
 	#pragma endregion
 
 public:
 
 	#pragma region BDPT path evaluation
 
-	glm::dvec3 EvaluateContribution(const Scene& scene, int s) const
-	{
-		const auto Cstar = EvaluateUnweightContribution(scene, s);
-		return Cstar == glm::dvec3() ? glm::dvec3() : Cstar * EvaluatePowerHeuristicsMISWeightOpt(scene, s);
-	}
-
-	double SelectionProb(int s) const
-	{
-		const double rrProb = 0.5;
-		const int n = (int)(vertices.size());
-		const int t = n - s;
-		double selectionProb = 1;
-		for (int i = 1; i < s - 1; i++)
-		{
-			selectionProb *= rrProb;
-		}
-		for (int i = t - 2; i >= 1; i--)
-		{
-			selectionProb *= rrProb;
-		}
-		return selectionProb;
-	}
-
 	glm::dvec2 RasterPosition() const
 	{
 		const auto& v = vertices[vertices.size() - 1];
@@ -342,193 +316,1311 @@ public:
 		return alphaL * cst * alphaE;
 	}
 
-	double EvaluateSimpleMISWeight(const Scene& scene, int s) const
+	double EvaluatePDF(const Scene& scene, int s) const
 	{
-		const int n = (int)(vertices.size());
-		int nonzero = 0;
+		// Cases with p_{s,t}(x) = 0
+		// i.e. the strategy (s,t) cannot generate the path
+		// This condition is equivalent to c_{s,t}(x) = 0
+		if (EvaluateCst(s) == glm::dvec3())
+		{
+			return 0;
+		}
 
-		for (int i = 0; i <= n; i++)
+		// Otherwise the path can be generated with the given strategy (s,t)
+		// so p_{s,t} can be safely evaluated.
+		double pdf = 1;
+		const int n = (int)(vertices.size());
+		const int t = n - s;
+		if (s > 0)
 		{
-			if (EvaluatePDF(scene, i) > 0)
+			pdf *= vertices[0].primitive->EvaluatePositionPDF(vertices[0].geom, true) * scene.EvaluateEmitterPDF(vertices[0].primitive);
+			for (int i = 0; i < s - 1; i++)
 			{
-				nonzero++;
+				const auto* vi = &vertices[i];
+				const auto* vip = i - 1 >= 0 ? &vertices[i - 1] : nullptr;
+				const auto* vin = &vertices[i + 1];
+				pdf *= vi->primitive->EvaluateDirectionPDF(vi->geom, vi->type, vip ? glm::normalize(vip->geom.p - vi->geom.p) : glm::dvec3(), glm::normalize(vin->geom.p - vi->geom.p), true);
+				pdf *= GeometryTerm(vi->geom, vin->geom);
+			}
+		}
+		if (t > 0)
+		{
+			pdf *= vertices[n - 1].primitive->EvaluatePositionPDF(vertices[n - 1].geom, true) * scene.EvaluateEmitterPDF(vertices[n - 1].primitive);
+			for (int i = n - 1; i >= s + 1; i--)
+			{
+				const auto* vi = &vertices[i];
+				const auto* vip = &vertices[i - 1];
+				const auto* vin = i + 1 < n ? &vertices[i + 1] : nullptr;
+				pdf *= vi->primitive->EvaluateDirectionPDF(vi->geom, vi->type, vin ? glm::normalize(vin->geom.p - vi->geom.p) : glm::dvec3(), glm::normalize(vip->geom.p - vi->geom.p), true);
+				pdf *= GeometryTerm(vi->geom, vip->geom);
 			}
 		}
 
-		assert(nonzero != 0);
-		return 1.0 / nonzero;
+		return pdf;
 	}
 
-	double EvaluatePowerHeuristicsMISWeightOpt(const Scene& scene, int s) const
+	#pragma endregion
+
+};
+
+// Path used by the renderers, covering the typical maximum number of vertices without heap allocation
+using Path = BasicPath<16>;
+
+// Path without in-place storage, used for large collections of paths, e.g., the light vertex cache
+using HeapPath = BasicPath<0>;
+
+#pragma region Specular manifold
+
+namespace
+{
+	struct VertexConstraintJacobian
 	{
-		double invWeight = 0;
-		const int n = static_cast<int>(vertices.size());
-		const double ps = EvaluatePDF(scene, s);
-		assert(ps > 0);
+		glm::dmat2 A;
+		glm::dmat2 B;
+		glm::dmat2 C;
+	};
 
-		for (int i = 0; i <= n; i++)
+	typedef ArenaVector<VertexConstraintJacobian> ConstraintJacobian;
+
+	// Microfacet normal of the glossy vertex #v sampled with #u, where #wi is the direction to the light side.
+	// The normal is fixed in the local shading frame so that the derivatives of the shading normal are reused.
+	glm::dvec3 MicrofacetNormal(const PathVertex& v, const glm::dvec3& wi, const glm::dvec2& u)
+	{
+		glm::dvec3 wo(0);
+		v.primitive->SampleDirection(u, 0, PrimitiveType::G, v.geom, wi, wo);
+		return wo == glm::dvec3() ? v.geom.sn : glm::normalize(wi + wo);
+	}
+
+	// #microfacetU is the per-vertex sample of the microfacet normals of the glossy vertices (nullptr : none).
+	// The constraint of a glossy vertex aligns the half vector with the microfacet normal instead of the shading normal.
+	void ComputeConstraintJacobian(const Path& path, ConstraintJacobian& nablaC, const glm::dvec2* microfacetU = nullptr)
+	{
+		const int n = (int)(path.vertices.size());
+		for (int i = 1; i < n - 1; i++)
 		{
-			const auto pi = EvaluatePDF(scene, i);
-			if (pi > 0)
+			#pragma region Some precomputation
+
+			const auto& x  = path.vertices[i].geom;
+			const auto& xp = path.vertices[i-1].geom;
+			const auto& xn = path.vertices[i+1].geom;
+		
+			const auto wi = glm::normalize(xp.p - x.p);
+			const auto wo = glm::normalize(xn.p - x.p);
+
+			// Normal of the constraint
+			const auto n = (path.vertices[i].type & PrimitiveType::G) > 0 && microfacetU ? MicrofacetNormal(path.vertices[i], wi, microfacetU[i]) : x.sn;
+
+			// IORs of the media containing $w_i$ and $w_o$ (generalized half vector for refraction)
+			double etaI = 1;
+			double etaO = 1;
 			{
-				const auto r = pi / ps;
-				invWeight += r * r;
+				const auto* prim = path.vertices[i].primitive;
+				if ((path.vertices[i].type & PrimitiveType::S) > 0 && prim->Params.S.Type != SType::Reflection)
+				{
+					const double eta1 = prim->Params.S.Type == SType::Refraction ? prim->Params.S.Refraction.Eta1 : prim->Params.S.Fresnel.Eta1;
+					const double eta2 = prim->Params.S.Type == SType::Refraction ? prim->Params.S.Refraction.Eta2 : prim->Params.S.Fresnel.Eta2;
+					etaI = glm::dot(wi, n) > 0 ? eta1 : eta2;
+					etaO = glm::dot(wo, n) > 0 ? eta1 : eta2;
+				}
 			}
-		}
 
-		return 1.0 / invWeight;
-	}
+			const auto H  = glm::normalize(etaI * wi + etaO * wo);
 
-	double EvaluateMISWeight(const Scene& scene, int s) const
-	{
-		double piDivps;
-		bool prevPDFIsZero;
-		double invWeight = 1;
-		const int n = static_cast<int>(vertices.size());
+			const double inv_wiL = etaI / glm::length(xp.p - x.p);
+			const double inv_woL = etaO / glm::length(xn.p - x.p);
+			const double inv_HL  = 1.0 / glm::length(etaI * wi + etaO * wo);
+		
+			const double dot_H_n    = glm::dot(n, H);
+			const double dot_H_dndu = glm::dot(x.dndu, H);
+			const double dot_H_dndv = glm::dot(x.dndv, H);
+			const double dot_u_n    = glm::dot(x.dpdu, n);
+			const double dot_v_n    = glm::dot(x.dpdv, n);
 
-		const double ps = EvaluatePDF(scene, s);
-		assert(ps > 0);
+			const auto s = x.dpdu - dot_u_n * n;
+			const auto t = x.dpdv - dot_v_n * n;
 
-		piDivps = 1;
-		prevPDFIsZero = false;
-		for (int i = s - 1; i >= 0; i--)
-		{
-			if (EvaluateCst(i) == glm::dvec3())
+			const double div_inv_wiL_HL = inv_wiL * inv_HL;
+			const double div_inv_woL_HL = inv_woL * inv_HL;
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Compute $A_i$ (derivative w.r.t. $x_{i-1}$)
+		
 			{
-				prevPDFIsZero = true;
-				continue;
+				const auto tu = (xp.dpdu - wi * glm::dot(wi, xp.dpdu)) * div_inv_wiL_HL;
+				const auto tv = (xp.dpdv - wi * glm::dot(wi, xp.dpdv)) * div_inv_wiL_HL;
+				const auto dHdu = tu - H * glm::dot(tu, H);
+				const auto dHdv = tv - H * glm::dot(tv, H);
+				nablaC[i-1].A = glm::dmat2(
+					glm::dot(dHdu, s), glm::dot(dHdu, t),
+					glm::dot(dHdv, s), glm::dot(dHdv, t));
 			}
 
-			if (prevPDFIsZero)
+			#pragma endregion
+		
+			// --------------------------------------------------------------------------------
+
+			#pragma region Compute $B_i$ (derivative w.r.t. $x_i$)
+
 			{
-				piDivps = EvaluatePDF(scene, i) / ps;
-				prevPDFIsZero = false;
+				const auto tu = -x.dpdu * (div_inv_wiL_HL + div_inv_woL_HL) + wi * (glm::dot(wi, x.dpdu) * div_inv_wiL_HL) + wo * (glm::dot(wo, x.dpdu) * div_inv_woL_HL);
+				const auto tv = -x.dpdv * (div_inv_wiL_HL + div_inv_woL_HL) + wi * (glm::dot(wi, x.dpdv) * div_inv_wiL_HL) + wo * (glm::dot(wo, x.dpdv) * div_inv_woL_HL);
+				const auto dHdu = tu - H * glm::dot(tu, H);
+				const auto dHdv = tv - H * glm::dot(tv, H);
+				nablaC[i-1].B = glm::dmat2(
+					glm::dot(dHdu, s) - glm::dot(x.dpdu, x.dndu) * dot_H_n - dot_u_n * dot_H_dndu,
+					glm::dot(dHdu, t) - glm::dot(x.dpdv, x.dndu) * dot_H_n - dot_v_n * dot_H_dndu,
+					glm::dot(dHdv, s) - glm::dot(x.dpdu, x.dndv) * dot_H_n - dot_u_n * dot_H_dndv,
+					glm::dot(dHdv, t) - glm::dot(x.dpdv, x.dndv) * dot_H_n - dot_v_n * dot_H_dndv);
 			}
-			else
+
+			#pragma endregion
+		
+			// --------------------------------------------------------------------------------
+
+			#pragma region Compute $C_i$ (derivative w.r.t. $x_{i+1}$)
+
 			{
-				const double ratio = EvaluatePDFRatio(scene, i);
-				if (ratio == 0)
-				{
-					break;
-				}
-				piDivps *= 1.0 / ratio;
+				const auto tu = (xn.dpdu - wo * glm::dot(wo, xn.dpdu)) * div_inv_woL_HL;
+				const auto tv = (xn.dpdv - wo * glm::dot(wo, xn.dpdv)) * div_inv_woL_HL;
+				const auto dHdu = tu - H * glm::dot(tu, H);
+				const auto dHdv = tv - H * glm::dot(tv, H);
+				nablaC[i - 1].C = glm::dmat2(
+					glm::dot(dHdu, s), glm::dot(dHdu, t),
+					glm::dot(dHdv, s), glm::dot(dHdv, t));
 			}
 
-			invWeight += piDivps * piDivps;
+			#pragma endregion
 		}
+	}
 
-		piDivps = 1;
-		prevPDFIsZero = false;
-		for (int i = s; i < n; i++)
+#ifndef NDEBUG
+	// Reference implementation with the dense inverse of $A$, used to validate the recurrence in debug builds
+	template <int MaxSize>
+	double ComputeConstraintJacobianDeterminantDense(const ConstraintJacobian& nablaC)
+	{
+		const int n = (int)(nablaC.size());
+
+		// $A$
+		Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::ColMajor, MaxSize, MaxSize> A(2*n, 2*n);
+		A.setZero();
+		for (int i = 0; i < n; i++)
 		{
-			if (EvaluateCst(i+1) == glm::dvec3())
+			if (i > 0)
 			{
-				prevPDFIsZero = true;
-				continue;
+				A(2*i+0, 2*(i-1)+0) = nablaC[i].A[0][0];
+				A(2*i+0, 2*(i-1)+1) = nablaC[i].A[1][0];
+				A(2*i+1, 2*(i-1)+0) = nablaC[i].A[0][1];
+				A(2*i+1, 2*(i-1)+1) = nablaC[i].A[1][1];
 			}
 
-			if (prevPDFIsZero)
-			{
-				piDivps = EvaluatePDF(scene, i) / ps;
-				prevPDFIsZero = false;
-			}
-			else
+			A(2*i+0, 2*i+0) = nablaC[i].B[0][0];
+			A(2*i+0, 2*i+1) = nablaC[i].B[1][0];
+			A(2*i+1, 2*i+0) = nablaC[i].B[0][1];
+			A(2*i+1, 2*i+1) = nablaC[i].B[1][1];
+
+			if (i < n - 1)
 			{
-				const double ratio = EvaluatePDFRatio(scene, i);
-				if (ratio == 0)
-				{
-					break;
-				}
-				piDivps *= ratio;
+				A(2*i+0, 2*(i+1)+0) = nablaC[i].C[0][0];
+				A(2*i+0, 2*(i+1)+1) = nablaC[i].C[1][0];
+				A(2*i+1, 2*(i+1)+0) = nablaC[i].C[0][1];
+				A(2*i+1, 2*(i+1)+1) = nablaC[i].C[1][1];
 			}
+		}
+
+		// $A^-1$
+		const decltype(A) invA = A.inverse();
+	
+		// $P_2 A^-1 B_{n}$
+		const auto Bn_n1p = nablaC[n - 1].C;
+		glm::dmat2 invA_0_n1p;
+		invA_0_n1p[0][0] = invA(0, 2*n-2);
+		invA_0_n1p[0][1] = invA(1, 2*n-2);
+		invA_0_n1p[1][0] = invA(0, 2*n-1);
+		invA_0_n1p[1][1] = invA(1, 2*n-1);
+	
+		return glm::determinant(invA_0_n1p * Bn_n1p);
+	}
+
+	double ComputeConstraintJacobianDeterminantDense(const ConstraintJacobian& nablaC)
+	{
+		// Matrices for up to 16 specular vertices are stored on the stack
+		const int MaxStackNumSpecularVertices = 16;
+		return (int)(nablaC.size()) <= MaxStackNumSpecularVertices
+			? ComputeConstraintJacobianDeterminantDense<2 * MaxStackNumSpecularVertices>(nablaC)
+			: ComputeConstraintJacobianDeterminantDense<Eigen::Dynamic>(nablaC);
+	}
+#endif
 
-			invWeight += piDivps * piDivps;
+	double ComputeConstraintJacobianDeterminant(const ConstraintJacobian& nablaC)
+	{
+		const int n = (int)(nablaC.size());
+
+		// We only need the top-right block $(A^-1)_{0,n-1}$, i.e., the first block of the solution $X$ of
+		// $A X = E_{n-1}$, where $E_{n-1}$ is the block column with the identity at the last block.
+		// Eliminating the block-tridiagonal $A$ from the bottom gives the recurrence
+		//   $S_{n-1} = B_{n-1}$, $R_{n-1} = I$
+		//   $S_i = B_i - C_i S_{i+1}^-1 A_{i+1}$, $R_i = -C_i S_{i+1}^-1 R_{i+1}$
+		// and $(A^-1)_{0,n-1} = S_0^-1 R_0$, which needs only O(n) 2x2 operations.
+		glm::dmat2 S = nablaC[n - 1].B;
+		glm::dmat2 R(1);
+		for (int i = n - 2; i >= 0; i--)
+		{
+			const auto M = nablaC[i].C * glm::inverse(S);
+			R = -M * R;
+			S = nablaC[i].B - M * nablaC[i + 1].A;
 		}
+		const auto invA_0_n1p = glm::inverse(S) * R;
 
-		return 1.0 / invWeight;
+		// $P_2 A^-1 B_{n}$
+		const auto Bn_n1p = nablaC[n - 1].C;
+		const double Det = glm::determinant(invA_0_n1p * Bn_n1p);
+		assert(glm::abs(Det - ComputeConstraintJacobianDeterminantDense(nablaC)) <= 1e-6 * glm::max(1.0, glm::abs(Det)));
+
+		return Det;
 	}
 
-	double EvaluatePDFRatio(const Scene& scene, int i) const
+	void SolveBlockLinearEq(MemoryArena& arena, const ConstraintJacobian& nablaC, const ArenaVector<glm::dvec2>& V, ArenaVector<glm::dvec2>& W)
 	{
-		const int n = static_cast<int>(vertices.size());
+		const int n = (int)(nablaC.size());
+		assert(V.size() == nablaC.size());
+	
+		// --------------------------------------------------------------------------------
 
-		if (i == 0)
+		#pragma region LU decomposition
+
+		// A'_{0,n-1} = B_{0,n-1}
+		// B'_{0,n-2} = C_{0,n-2}
+		// C'_{0,n-2} = A_{1,n-1}
+
+		ArenaVector<glm::dmat2> L(n, glm::dmat2(), arena);
+		ArenaVector<glm::dmat2> U(n, glm::dmat2(), arena);
 		{
-			const auto* x0 = &vertices[0];
-			const auto* x1 = &vertices[1];
-			const auto* x2 = n > 2 ? &vertices[2] : nullptr;
-			const double G = GeometryTerm(x0->geom, x1->geom);
-			const double pAx0 = x0->primitive->EvaluatePositionPDF(x0->geom, true) * scene.EvaluateEmitterPDF(x0->primitive);
-			const double pDx1x0 = x1->primitive->EvaluateDirectionPDF(x1->geom, x1->type, x2 ? glm::normalize(x2->geom.p - x1->geom.p) : glm::dvec3(), glm::normalize(x0->geom.p - x1->geom.p), true);
-			return pAx0 / pDx1x0 / G;
+			// $U_1 = A'_1$
+			U[0] = nablaC[0].B;
+			for (int i = 1; i < n; i++)
+			{
+				L[i] = nablaC[i].A * glm::inverse(U[i-1]);		// $L_i = C'_i U_{i-1}^-1$
+				U[i] = nablaC[i].B - L[i] * nablaC[i-1].C;		// $U_i = A'_i - L_i * B'_{i-1}$
+			}
 		}
 
-		if (i == n - 1)
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Forward substitution
+ 
+		// Solve $L V' = V$
+		ArenaVector<glm::dvec2> Vp(n, glm::dvec2(), arena);
+		Vp[0] = V[0];
+		for (int i = 1; i < n; i++)
 		{
-			const auto* xnp = &vertices[n - 1];
-			const auto* xnp2 = &vertices[n - 2];
-			const auto* xnp3 = n > 2 ? &vertices[n - 3] : nullptr;
-			const double G = GeometryTerm(xnp->geom, xnp2->geom);
-			const double pAxnp = xnp->primitive->EvaluatePositionPDF(xnp->geom, true) * scene.EvaluateEmitterPDF(xnp->primitive);
-			const double pDxnp2xnp = xnp2->primitive->EvaluateDirectionPDF(xnp2->geom, xnp2->type, xnp3 ? glm::normalize(xnp3->geom.p - xnp2->geom.p) : glm::dvec3(), glm::normalize(xnp->geom.p - xnp2->geom.p), true);
-			return pDxnp2xnp * G / pAxnp;
+			// V'_i = V_i - L_i V'_{i-1}
+			Vp[i] = V[i] - L[i] * Vp[i - 1];
 		}
 
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Backward substitution
+
+		W.assign(n, glm::dvec2());
+
+		// Solve $U_n W_n = V'_n$
+		W[n - 1] = glm::inverse(U[n - 1]) * Vp[n - 1];
+
+		for (int i = n - 2; i >= 0; i--)
 		{
-			const auto* xi = &vertices[i];
-			const auto* xin = &vertices[i + 1];
-			const auto* xip = &vertices[i - 1];
-			const auto* xin2 = i + 2 < n ? &vertices[i + 2] : nullptr;
-			const auto* xip2 = i - 2 >= 0 ? &vertices[i - 2] : nullptr;
-			const double Gxipxi = GeometryTerm(xip->geom, xi->geom);
-			const double Gxinxi = GeometryTerm(xin->geom, xi->geom);
-			const double pDxipxi = xip->primitive->EvaluateDirectionPDF(xip->geom, xip->type, xip2 ? glm::normalize(xip2->geom.p - xip->geom.p) : glm::dvec3(), glm::normalize(xi->geom.p - xip->geom.p), true);
-			const double pDxinxi = xin->primitive->EvaluateDirectionPDF(xin->geom, xin->type, xin2 ? glm::normalize(xin2->geom.p - xin->geom.p) : glm::dvec3(), glm::normalize(xi->geom.p - xin->geom.p), true);
-			return pDxipxi * Gxipxi / pDxinxi / Gxinxi;
+			// Solve $U_i W_i = V'_i - C_i W_{i+1}$
+			W[i] = glm::inverse(U[i]) * (Vp[i] - nablaC[i].C * W[i + 1]);
 		}
+
+		#pragma endregion
 	}
 
-	double EvaluatePDF(const Scene& scene, int s) const
+	// Maximum number of specular (or glossy) vertices in a chain handled by the manifold walk
+	const int MaxNumSpecularChainVertices = 8;
+
+	// Number of the specular surfaces on the segment between #p1 and #p2 (-1 : occluded by a non-specular surface)
+	int CountSpecularSurfaces(const Scene& scene, const glm::dvec3& p1, const glm::dvec3& p2)
 	{
-		// Cases with p_{s,t}(x) = 0
-		// i.e. the strategy (s,t) cannot generate the path
-		// This condition is equivalent to c_{s,t}(x) = 0
-		if (EvaluateCst(s) == glm::dvec3())
+		int countS = 0;
+		auto currP = p1;
+		while (true)
 		{
-			return 0;
-		}
+			// Intersection query
+			Ray ray = { currP, glm::normalize(p2 - currP) };
+			Intersection isect;
+			if (!scene.Intersect(ray, isect, EpsF, (1.0f - EpsF) * (float)(glm::length(p2 - currP))))
+			{
+				break;
+			}
 
-		// Otherwise the path can be generated with the given strategy (s,t)
-		// so p_{s,t} can be safely evaluated.
-		double pdf = 1;
-		const int n = (int)(vertices.size());
-		const int t = n - s;
-		if (s > 0)
-		{
-			pdf *= vertices[0].primitive->EvaluatePositionPDF(vertices[0].geom, true) * scene.EvaluateEmitterPDF(vertices[0].primitive);
-			for (int i = 0; i < s - 1; i++)
+			// If a vertex with non-specular surface, stop the chain
+			if ((isect.Prim->Type & PrimitiveType::S) == 0)
 			{
-				const auto* vi = &vertices[i];
-				const auto* vip = i - 1 >= 0 ? &vertices[i - 1] : nullptr;
-				const auto* vin = &vertices[i + 1];
-				pdf *= vi->primitive->EvaluateDirectionPDF(vi->geom, vi->type, vip ? glm::normalize(vip->geom.p - vi->geom.p) : glm::dvec3(), glm::normalize(vin->geom.p - vi->geom.p), true);
-				pdf *= GeometryTerm(vi->geom, vin->geom);
+				return -1;
 			}
+
+			// Update information
+			countS++;
+			currP = isect.geom.p;
 		}
-		if (t > 0)
+
+		return countS;
+	}
+
+	// Generates a seed path from #v0 by projecting the segment to #target to the specular manifold.
+	// The seed path ends with a vertex on the diffuse surface, or only contains #v0 if the segment is not occluded.
+	bool GenerateSeedPath(const Scene& scene, const PathVertex& v0, const glm::dvec3& target, Path& seedPath)
+	{
+		seedPath.vertices.clear();
+
+		#pragma region Count the number of specular surfaces between the target and v0
+
+		const int countS = CountSpecularSurfaces(scene, target, v0.geom.p);
+		if (countS < 0)
 		{
-			pdf *= vertices[n - 1].primitive->EvaluatePositionPDF(vertices[n - 1].geom, true) * scene.EvaluateEmitterPDF(vertices[n - 1].primitive);
-			for (int i = n - 1; i >= s + 1; i--)
+			return false;
+		}
+
+		// If countS is zero, it is the case with NEE
+		if (countS == 0)
+		{
+			seedPath.vertices.push_back(v0);
+			return true;
+		}
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Projection to specular manifold
+
+		seedPath.vertices.push_back(v0);
+		for (int i = 0; i < countS + 1; i++)
+		{
+			// Previous & two before vertex
+			const auto* pv  = &seedPath.vertices.back();
+			const auto* ppv = seedPath.vertices.size() > 1 ? &seedPath.vertices[seedPath.vertices.size() - 2] : nullptr;
+
+			// --------------------------------------------------------------------------------
+
+			// Next direction
+			glm::dvec3 wo;
+			if (ppv)
 			{
-				const auto* vi = &vertices[i];
-				const auto* vip = &vertices[i - 1];
-				const auto* vin = i + 1 < n ? &vertices[i + 1] : nullptr;
-				pdf *= vi->primitive->EvaluateDirectionPDF(vi->geom, vi->type, vin ? glm::normalize(vin->geom.p - vi->geom.p) : glm::dvec3(), glm::normalize(vip->geom.p - vi->geom.p), true);
-				pdf *= GeometryTerm(vi->geom, vip->geom);
+				assert(pv->type == PrimitiveType::S);
+				const auto wi = glm::normalize(ppv->geom.p - pv->geom.p);
+
+				// The chain crosses the specular surfaces, so the refraction is selected (uComp = 1) for Fresnel surfaces
+				pv->primitive->SampleDirection(glm::dvec2(), 1, pv->type, pv->geom, wi, wo);
+			}
+			else
+			{
+				// Initial direction is fixed to v0 to the target
+				wo = glm::normalize(target - v0.geom.p);
+			}
+
+			// --------------------------------------------------------------------------------
+
+			// Intersection query
+			Ray ray = { pv->geom.p, wo };
+			Intersection isect;
+			if (!scene.Intersect(ray, isect))
+			{
+				return false;
+			}
+
+			// --------------------------------------------------------------------------------
+
+			if (i == countS)
+			{
+				// Failed if the last vertex is not 'D'
+				if ((isect.Prim->Type & PrimitiveType::D) == 0) { return false; }
+			}
+			else
+			{
+				// Failed if 'S' is not found
+				if ((isect.Prim->Type & PrimitiveType::S) == 0) { return false; }
 			}
+
+			// --------------------------------------------------------------------------------
+
+			// Add a vertex
+			PathVertex v;
+			v.geom = isect.geom;
+			v.primitive = isect.Prim;
+			v.type = isect.Prim->Type & ~PrimitiveType::Emitter;
+			seedPath.vertices.push_back(v);
 		}
 
-		return pdf;
+		// Number of vertices must be countS + 2
+		assert(seedPath.vertices.size() == countS + 2);
+
+		#pragma endregion
+
+		return true;
+	}
+
+	// Moves the last vertex of #seedPath to #target keeping the types of the intermediate vertices.
+	// #microfacetU is the per-vertex sample of the microfacet normals of the glossy vertices (nullptr : none).
+	bool WalkManifold(const Scene& scene, MemoryArena& arena, const Path& seedPath, const glm::dvec3& target, Path& outPath, const glm::dvec2* microfacetU = nullptr)
+	{
+		#pragma region Preprocess
+
+		// Number of path vertices
+		const int n = (int)(seedPath.vertices.size());
+
+		// Initial path
+		Path currPath = seedPath;
+
+		// Compute $\nabla C$
+		ConstraintJacobian nablaC(n - 2, VertexConstraintJacobian(), arena);
+		ComputeConstraintJacobian(currPath, nablaC, microfacetU);
+
+		// Compute $L$
+		double L = 0;
+		for (const auto& x : currPath.vertices)
+		{
+			L = glm::max(L, glm::length(x.geom.p));
+		}
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Optimization loop
+
+		int iter = 0;
+		const double MaxBeta = 1.0;			// Full Newton step
+		const double MinBeta = 1e-3;		// Give up if the step is too much shrinked
+		double beta = MaxBeta;
+		const double Eps = 10e-5;
+		const int MaxIter = 30;
+		bool converged = false;
+
+		// Buffers reused across iterations
+		ArenaVector<glm::dvec2> V(n - 2, glm::dvec2(), arena);
+		ArenaVector<glm::dvec2> W(n - 2, glm::dvec2(), arena);
+		Path nextPath;
+
+		while (true)
+		{
+			#pragma region Stop condition
+
+			if (iter++ >= MaxIter || beta < MinBeta)
+			{
+				break;
+			}
+
+			if (glm::length(currPath.vertices[n - 1].geom.p - target) < Eps * L)
+			{
+				converged = true;
+				break;
+			}
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Compute movement in tangement plane
+
+			// New position of initial specular vertex
+			glm::dvec3 p;
+			{
+				// $x_n$, $x'_n$
+				const auto& xn = currPath.vertices[n - 1].geom.p;
+				const auto& xnp = target;
+
+				// $T(x_n)^T$
+				const glm::dmat3x2 TxnT = glm::transpose(glm::dmat2x3(currPath.vertices[n - 1].geom.dpdu, currPath.vertices[n - 1].geom.dpdv));
+
+				// $V \equiv B_n T(x_n)^T (x'_n - x)$
+				const auto Bn_n2p = nablaC[n - 3].C;
+				const auto V_n2p = Bn_n2p * TxnT * (xnp - xn);
+
+				// Solve $AW = V$
+				for (int i = 0; i < n - 2; i++) { V[i] = i == n - 3 ? V_n2p : glm::dvec2(); }
+				SolveBlockLinearEq(arena, nablaC, V, W);
+
+				// $x_2$, $T(x_2)$
+				const auto& x2 = currPath.vertices[1].geom.p;
+				const glm::dmat2x3 Tx2(currPath.vertices[1].geom.dpdu, currPath.vertices[1].geom.dpdv);
+
+				// $W_2 = P_2 W$ (movement of the first specular vertex)
+				const auto W2p = W[0];
+
+				// $p = x_2 - \beta T(x_2) P_2 W$
+				p = x2 - beta * Tx2 * W2p;
+			}
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Propagate light path to $p - x1$
+
+			bool fail = false;
+
+			// Initial vertex
+			nextPath.vertices.clear();
+			nextPath.vertices.push_back(currPath.vertices[0]);
+
+			for (int i = 0; i < n - 1; i++)
+			{
+				// Current vertex & previous vertex
+				const auto* v  = &nextPath.vertices[i];
+				const auto* vp = i > 0 ? &nextPath.vertices[i-1] : nullptr;
+
+				// Next ray direction
+				glm::dvec3 wo(0);
+				if (i == 0)
+				{
+					wo = glm::normalize(p - currPath.vertices[0].geom.p);
+				}
+				else
+				{
+					// Refraction is selected for Fresnel surfaces as in the seed path
+					v->primitive->SampleDirection(microfacetU ? microfacetU[i] : glm::dvec2(), 1, v->type, v->geom, glm::normalize(vp->geom.p - v->geom.p), wo);
+					if (wo == glm::dvec3())
+					{
+						fail = true;
+						break;
+					}
+				}
+
+				// Intersection query
+				Ray ray = { v->geom.p, wo };
+				Intersection isect;
+				if (!scene.Intersect(ray, isect))
+				{
+					fail = true;
+					break;
+				}
+
+				// Fails if not intersected with the surface of the same type as the seed path
+				const int seedType = seedPath.vertices[i + 1].type;
+				if (i < n - 2 && (isect.Prim->Type & seedType) != seedType)
+				{
+					fail = true;
+					break;
+				}
+
+				// Create a new vertex
+				PathVertex vn;
+				vn.geom = isect.geom;
+				vn.type = i < n - 2 ? seedType : isect.Prim->Type;
+				vn.primitive = isect.Prim;
+				nextPath.vertices.push_back(vn);
+			}
+		
+			if (!fail)
+			{
+				if (nextPath.vertices.size() != currPath.vertices.size())
+				{
+					// # of vertices is different
+					fail = true;
+				}
+				else if ((nextPath.vertices.back().type & PrimitiveType::D) == 0)
+				{
+					// Last vertex type is not D
+					fail = true;
+				}
+				else
+				{
+					// Larger difference
+					const auto d  = glm::length2(currPath.vertices.back().geom.p - target);
+					const auto dn = glm::length2(nextPath.vertices.back().geom.p - target);
+					if (dn >= d)
+					{
+						fail = true;
+					}
+				}
+			}
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Update beta
+
+			if (fail)
+			{
+				beta *= 0.5;
+			}
+			else
+			{
+				beta = glm::min(MaxBeta, beta * 1.7);
+				//beta = glm::min(MaxBeta, beta * 2.0);
+				currPath = nextPath;
+				ComputeConstraintJacobian(currPath, nablaC, microfacetU);
+			}
+
+			#pragma endregion
+		}
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		outPath = currPath;
+		assert(seedPath.vertices.size() == outPath.vertices.size());
+
+		return converged;
+	}
+}
+
+#pragma endregion
+
+// Generalized geometry terms of the specular chains lying in one subpath.
+// Such a chain appears in the paths of all strategies using that part of the subpath,
+// so the term is evaluated once per sample of the subpaths.
+// Indexed by the index in the subpath of the end vertex of the chain farther from the origin of the subpath
+// (negative : not evaluated, zero : the chain cannot be generated by the manifold connection).
+struct ManifoldChainCache
+{
+	std::vector<double> L;
+	std::vector<double> E;
+
+	void Reset(int nL, int nE)
+	{
+		L.assign(nL, -1);
+		E.assign(nE, -1);
+	}
+};
+
+// Path connecting a light subpath and an eye subpath with the strategy (s,t).
+// The vertices are referenced from the subpaths without being copied:
+// x_i is the i-th vertex of the light subpath for i < s
+// and the (n-1-i)-th vertex of the eye subpath for i >= s.
+// Only the quantities depending on the connection are stored in the view.
+// With a manifold connection, the subpaths are connected through a chain of k specular vertices
+// x_s, ..., x_{s+k-1} found by the manifold walk, and the eye subpath starts from x_{s+k}.
+// With a vertex merging, the s-th vertex of the light subpath found around x_s is merged to x_s.
+struct ConnectedPath
+{
+
+	const PathVertex* verticesL = nullptr;		// Vertices of the light subpath
+	const PathVertex* verticesE = nullptr;		// Vertices of the eye subpath
+	const PathVertex* verticesS = nullptr;		// Vertices of the specular chain of the manifold connection
+	int s = 0;
+	int t = 0;
+	int k = 0;									// Number of the specular vertices of the manifold connection (0 : direct connection)
+
+	// Scratch memory for the manifold connections.
+	// If specified, the manifold connections are accounted in the MIS weights.
+	MemoryArena* manifoldArena = nullptr;
+
+	// Cache of the geometry terms of the specular chains in the subpaths (optional)
+	ManifoldChainCache* manifoldCache = nullptr;
+
+	// Factor pi r^2 N_L of the vertex merging with the merge radius r and the number of light subpaths N_L.
+	// If positive, the vertex merging strategies are accounted in the MIS weights.
+	double mergeFactor = 0;
+
+private:
+
+	static const int MaxNumConn = MaxNumSpecularChainVertices + 2;
+
+	const Scene* scene = nullptr;
+	double pdfFwdConn[MaxNumConn];			// pdfFwd of x_s, ..., x_{s+k+1}
+	double pdfRevConn[MaxNumConn];			// pdfRev of x_{s+k-1}, ..., x_{s-2}
+	bool connectibleConn[MaxNumConn];		// Connectivity of x_{s-1}, ..., x_{s+k}
+	bool connectibleFirst;					// Connectivity of x_0
+	bool connectibleLast;					// Connectivity of x_{n-1}
+	double detG;							// Generalized geometry term between x_{s-1} and x_{s+k} of the manifold connection
+	bool merging = false;					// True if the path is generated by the vertex merging at x_s
+
+public:
+
+	#pragma region BDPT path initialization
+
+	template <typename PathL, typename PathE>
+	bool Connect(const Scene& scene, int s, int t, const PathL& subpathL, const PathE& subpathE)
+	{
+		assert(s > 0 || t > 0);
+
+		verticesL = subpathL.vertices.data();
+		verticesE = subpathE.vertices.data();
+		verticesS = nullptr;
+		this->scene = &scene;
+		this->s = s;
+		this->t = t;
+		this->k = 0;
+		this->merging = false;
+
+		if (s == 0 && t > 0)
+		{
+			if ((subpathE.vertices[t - 1].primitive->Type & PrimitiveType::L) == 0)
+			{
+				return false;
+			}
+		}
+		else if (s > 0 && t == 0)
+		{
+			if ((subpathL.vertices[s - 1].primitive->Type & PrimitiveType::E) == 0)
+			{
+				return false;
+			}
+		}
+		else
+		{
+			assert(s > 0 && t > 0);
+			if (!scene.Visible(subpathL.vertices[s - 1].geom.p, subpathE.vertices[t - 1].geom.p))
+			{
+				return false;
+			}
+		}
+
+		EvaluateConnectionQuantities(scene);
+		return true;
+	}
+
+	// Connects x_{s-1} of the light subpath and x_{t-1} of the eye subpath through the specular vertices #chain,
+	// which are the intermediate vertices of a path converged by WalkManifold
+	template <typename PathL, typename PathE>
+	bool ConnectManifold(const Scene& scene, int s, int t, const PathL& subpathL, const PathE& subpathE, const PathVertex* chain, int k)
+	{
+		assert(s > 0 && t > 0 && k > 0 && k <= MaxNumSpecularChainVertices);
+		assert(manifoldArena);
+
+		verticesL = subpathL.vertices.data();
+		verticesE = subpathE.vertices.data();
+		verticesS = chain;
+		this->scene = &scene;
+		this->s = s;
+		this->t = t;
+		this->k = k;
+		this->merging = false;
+
+		detG = EvaluateManifoldGeometryTerm(s - 1, s + k);
+		if (detG == 0)
+		{
+			return false;
+		}
+
+		EvaluateConnectionQuantities(scene);
+		return true;
+	}
+
+	// Merges the s-th vertex of the light subpath to x_{t-1} of the eye subpath found in the merge radius.
+	// The path consists of the first s vertices of the light subpath and the eye subpath as the connection (s,t).
+	template <typename PathL, typename PathE>
+	void Merge(const Scene& scene, int s, int t, const PathL& subpathL, const PathE& subpathE)
+	{
+		assert(s > 0 && t > 1 && (int)(subpathL.vertices.size()) > s);
+		assert(mergeFactor > 0);
+
+		verticesL = subpathL.vertices.data();
+		verticesE = subpathE.vertices.data();
+		verticesS = nullptr;
+		this->scene = &scene;
+		this->s = s;
+		this->t = t;
+		this->k = 0;
+		this->merging = true;
+
+		EvaluateConnectionQuantities(scene);
+	}
+
+	#pragma endregion
+
+public:
+
+	#pragma region Vertex access
+
+	int NumVertices() const
+	{
+		return s + k + t;
+	}
+
+	const PathVertex& Vertex(int i) const
+	{
+		return i < s ? verticesL[i] : i < s + k ? verticesS[i - s] : verticesE[s + k + t - 1 - i];
+	}
+
+	int Type(int i) const
+	{
+		// Endpoints on the emitters are treated as the emitters
+		if (s == 0 && i == 0) { return PrimitiveType::L; }
+		if (t == 0 && i == s - 1) { return PrimitiveType::E; }
+		return Vertex(i).type;
+	}
+
+	double PDFFwd(int i) const
+	{
+		// Area PDF of x_i sampled from the light side
+		if (i >= s && i <= s + k + 1) { return pdfFwdConn[i - s]; }
+		return i < s ? Vertex(i).pdfFwd : Vertex(i).pdfRev;
+	}
+
+	double PDFRev(int i) const
+	{
+		// Area PDF of x_i sampled from the eye side
+		if (i >= s - 2 && i <= s + k - 1) { return pdfRevConn[s + k - 1 - i]; }
+		return i < s ? Vertex(i).pdfRev : Vertex(i).pdfFwd;
+	}
+
+	bool Connectible(int i) const
+	{
+		if (i >= s - 1 && i <= s + k) { return connectibleConn[i - s + 1]; }
+		if (i == 0) { return connectibleFirst; }
+		if (i == s + k + t - 1) { return connectibleLast; }
+		return Vertex(i).connectible;
+	}
+
+	#pragma endregion
+
+private:
+
+	#pragma region Evaluation of the quantities around the connection
+
+	void EvaluateConnectionQuantities(const Scene& scene)
+	{
+		// The PDFs and the connectivity cached in the subpaths are valid
+		// except for the vertices around the connection and the endpoints
+		const int n = NumVertices();
+		for (int j = 0; j < k + 2; j++)
+		{
+			pdfFwdConn[j] = s + j < n ? EvaluateAreaPDF(scene, s + j, TransportDirection::LE) : 0;
+			pdfRevConn[j] = s + k - 1 - j >= 0 ? EvaluateAreaPDF(scene, s + k - 1 - j, TransportDirection::EL) : 0;
+			connectibleConn[j] = s - 1 + j >= 0 && s - 1 + j < n ? EvaluateConnectible(s - 1 + j) : false;
+		}
+		connectibleFirst = EvaluateConnectible(0);
+		connectibleLast = EvaluateConnectible(n - 1);
+	}
+
+	double EvaluateAreaPDF(const Scene& scene, int i, TransportDirection transDir) const
+	{
+		// Area PDF of x_i sampled from x_{i-1} and x_{i-2} (LE) or from x_{i+1} and x_{i+2} (EL)
+		// where the degenerated components are forced to be evaluated
+		const int n = NumVertices();
+		const int d = transDir == TransportDirection::LE ? -1 : 1;
+		const auto& x = Vertex(i);
+		if (i + d < 0 || i + d >= n)
+		{
+			return x.primitive->EvaluatePositionPDF(x.geom, true) * scene.EvaluateEmitterPDF(x.primitive);
+		}
+		const auto& xp = Vertex(i + d);
+		const auto wi = i + 2 * d >= 0 && i + 2 * d < n ? glm::normalize(Vertex(i + 2 * d).geom.p - xp.geom.p) : glm::dvec3();
+		return xp.primitive->EvaluateDirectionPDF(xp.geom, Type(i + d), wi, glm::normalize(x.geom.p - xp.geom.p), true) * GeometryTerm(xp.geom, x.geom);
+	}
+
+	bool EvaluateConnectible(int i) const
+	{
+		// True if the BSDF or emitter of x_i is non-degenerated w.r.t. the neighboring vertices
+		const int n = NumVertices();
+		const auto& v = Vertex(i);
+		if (i == 0)
+		{
+			const auto wo = glm::normalize(Vertex(1).geom.p - v.geom.p);
+			return v.primitive->EvaluateDirection(v.geom, Type(0), glm::dvec3(), wo, TransportDirection::LE, false) != glm::dvec3();
+		}
+		const auto wi = i + 1 < n ? glm::normalize(Vertex(i + 1).geom.p - v.geom.p) : glm::dvec3();
+		const auto wo = glm::normalize(Vertex(i - 1).geom.p - v.geom.p);
+		return v.primitive->EvaluateDirection(v.geom, Type(i), wi, wo, TransportDirection::EL, false) != glm::dvec3();
+	}
+
+	double EvaluateManifoldGeometryTerm(int a, int b) const
+	{
+		// Generalized geometry term between x_a and x_b through the specular vertices in between,
+		// i.e., |det(dx_{a+1}^perp / dx_b^perp)| G(x_a, x_{a+1}) as in MNEE
+		Path chainPath;
+		for (int i = a; i <= b; i++)
+		{
+			chainPath.vertices.push_back(Vertex(i));
+		}
+		ConstraintJacobian nablaC(b - a - 1, VertexConstraintJacobian(), *manifoldArena);
+		ComputeConstraintJacobian(chainPath, nablaC);
+		return glm::abs(ComputeConstraintJacobianDeterminant(nablaC)) * GeometryTerm(Vertex(a).geom, Vertex(a + 1).geom);
+	}
+
+	#pragma endregion
+
+public:
+
+	#pragma region BDPT path evaluation
+
+	glm::dvec3 EvaluateContribution() const
+	{
+		const auto Cstar = EvaluateUnweightContribution();
+		return Cstar == glm::dvec3() ? glm::dvec3() : Cstar * EvaluateMISWeight();
+	}
+
+	glm::dvec3 EvaluateUnweightContribution() const
+	{
+		// Unweighted contribution from the throughputs cached in the subpaths
+		const auto alphaL = s == 0 ? glm::dvec3(1) : verticesL[merging ? s : s - 1].alpha;
+		const auto alphaE = t == 0 ? glm::dvec3(1) : verticesE[t - 1].alpha;
+		if (alphaL == glm::dvec3() || alphaE == glm::dvec3())
+		{
+			return glm::dvec3();
+		}
+		const auto cst = EvaluateCst();
+		if (cst == glm::dvec3())
+		{
+			return glm::dvec3();
+		}
+		return alphaL * cst * alphaE;
+	}
+
+	double SelectionProb() const
+	{
+		// Product of the continuation probabilities recorded in the subpaths,
+		// except for the last vertex of each subpath (the merged light vertex with the vertex merging)
+		double selectionProb = 1;
+		for (int i = 0; i < (merging ? s : s - 1); i++)
+		{
+			selectionProb *= verticesL[i].rrProb;
+		}
+		for (int i = 0; i < t - 1; i++)
+		{
+			selectionProb *= verticesE[i].rrProb;
+		}
+		return selectionProb;
+	}
+
+	glm::dvec2 RasterPosition() const
+	{
+		const int n = NumVertices();
+		const auto& v = Vertex(n - 1);
+		const auto& vPrev = Vertex(n - 2);
+		glm::dvec2 rasterPos;
+		v.primitive->RasterPosition(glm::normalize(vPrev.geom.p - v.geom.p), v.geom, rasterPos);
+		return rasterPos;
+	}
+
+	glm::dvec3 EvaluateCst() const
+	{
+		const int n = NumVertices();
+		glm::dvec3 cst;
+
+		if (s == 0 && t > 0)
+		{
+			const auto& v = Vertex(0);
+			const auto& vNext = Vertex(1);
+			cst = v.primitive->EvaluatePosition(v.geom, false) * v.primitive->EvaluateDirection(v.geom, Type(0), glm::dvec3(), glm::normalize(vNext.geom.p - v.geom.p), TransportDirection::EL, false);
+		}
+		else if (s > 0 && t == 0)
+		{
+			const auto& v = Vertex(n - 1);
+			const auto& vPrev = Vertex(n - 2);
+			cst = v.primitive->EvaluatePosition(v.geom, false) * v.primitive->EvaluateDirection(v.geom, Type(n - 1), glm::dvec3(), glm::normalize(vPrev.geom.p - v.geom.p), TransportDirection::LE, false);
+		}
+		else if (merging)
+		{
+			// Density estimation with the uniform kernel 1 / (pi r^2).
+			// The BSDF is evaluated with the direction to x_{s-1} instead of the incident direction of the merged vertex,
+			// so that the contribution and the MIS weight are evaluated with the same path.
+			const auto& vE = Vertex(s);
+			const auto& vEPrev = Vertex(s - 1);
+			const auto* vENext = s + 1 < n ? &Vertex(s + 1) : nullptr;
+			const auto fsE = vE.primitive->EvaluateDirection(vE.geom, vE.type, vENext ? glm::normalize(vENext->geom.p - vE.geom.p) : glm::dvec3(), glm::normalize(vEPrev.geom.p - vE.geom.p), TransportDirection::EL, false);
+			cst = fsE / mergeFactor;
+		}
+		else if (s > 0 && t > 0)
+		{
+			const auto* vL = &Vertex(s - 1);
+			const auto* vE = &Vertex(s + k);
+			const auto* vLPrev = s - 2 >= 0 ? &Vertex(s - 2) : nullptr;
+			const auto* vENext = s + k + 1 < n ? &Vertex(s + k + 1) : nullptr;
+			const auto* vLNext = &Vertex(s);
+			const auto* vEPrev = &Vertex(s + k - 1);
+			const auto fsL = vL->primitive->EvaluateDirection(vL->geom, vL->type, vLPrev ? glm::normalize(vLPrev->geom.p - vL->geom.p) : glm::dvec3(), glm::normalize(vLNext->geom.p - vL->geom.p), TransportDirection::LE, false);
+			const auto fsE = vE->primitive->EvaluateDirection(vE->geom, vE->type, vENext ? glm::normalize(vENext->geom.p - vE->geom.p) : glm::dvec3(), glm::normalize(vEPrev->geom.p - vE->geom.p), TransportDirection::EL, false);
+			if (k == 0)
+			{
+				const double G = GeometryTerm(vL->geom, vE->geom);
+				cst = fsL * G * fsE;
+			}
+			else
+			{
+				// Specular vertices are evaluated as in MNEE
+				glm::dvec3 fsS(1);
+				for (int i = s; i < s + k; i++)
+				{
+					const auto& v = Vertex(i);
+					fsS *= v.primitive->EvaluateDirection(v.geom, v.type, glm::normalize(Vertex(i + 1).geom.p - v.geom.p), glm::normalize(Vertex(i - 1).geom.p - v.geom.p), TransportDirection::EL, true);
+				}
+				cst = fsL * fsS * detG * fsE;
+			}
+		}
+
+		return cst;
+	}
+
+	double EvaluateSimpleMISWeight() const
+	{
+		const int n = NumVertices();
+		int nonzero = 0;
+
+		for (int i = 0; i <= n; i++)
+		{
+			if (IsSamplable(i))
+			{
+				nonzero++;
+			}
+		}
+
+		assert(nonzero != 0);
+		return 1.0 / nonzero;
+	}
+
+	double EvaluateMISWeight(const double* strategyProbs = nullptr) const
+	{
+		// Power heuristic weight evaluated in O(n) with the area PDFs cached in the vertices.
+		// p_i / p_s is computed as the product of the ratios of the neighboring strategies
+		// p_{i+1} / p_i = PDFFwd(x_i) / PDFRev(x_i), instead of the ratio of the path PDFs,
+		// which can underflow for long paths.
+		// The PDFs are evaluated with the degenerated components forced,
+		// and the strategies with p_i = 0 (equivalently c_{i,t} = 0) are excluded from the sum.
+		// If specified, p_i is scaled by the probability strategyProbs[i] of evaluating the strategy i.
+		// If the manifold connections are enabled, the manifold strategy over each specular chain x_{a+1}, ..., x_{b-1}
+		// is also accounted with p_m / p_{a+1} (see ManifoldPDFRatio). For the manifold connection,
+		// p_s is the PDF of the (non-samplable) direct connection between x_{s-1} and x_s.
+		// If the vertex merging is enabled, the merging at x_i is accounted with p_{m,i} / p_i = PDFFwd(x_i) pi r^2 N_L
+		// as in VCM [Georgiev et al. 2012]. For the vertex merging, p_s is the PDF of the connection (s,t).
+		assert(k > 0 || merging || IsSamplable(s));
+		assert((k == 0 && !merging) || !strategyProbs);
+		double invWeight = k == 0 && IsSamplable(s) ? 1 : 0;
+		const int n = NumVertices();
+		const auto StrategyProbRatio = [&](int i) -> double
+		{
+			return strategyProbs ? strategyProbs[i] / strategyProbs[s] : 1;
+		};
+
+		// Adds the manifold strategy over the specular chain starting from x_i if exists
+		const auto AddManifoldStrategy = [&](int i, double piDivps) -> void
+		{
+			if (!manifoldArena || i <= 0 || i >= n || Type(i) != PrimitiveType::S || Type(i - 1) == PrimitiveType::S)
+			{
+				return;
+			}
+			int b = i + 1;
+			while (b < n && Type(b) == PrimitiveType::S) { b++; }
+			const double chainG = IsManifoldSamplable(i - 1, b) ? ManifoldChainGeometryTerm(i - 1, b) : 0;
+			if (chainG > 0)
+			{
+				const double r = piDivps * ManifoldPDFRatio(i - 1, b, chainG);
+				invWeight += r * r;
+			}
+		};
+
+		// Adds the vertex merging at x_i if possible
+		const auto AddMergingStrategy = [&](int i, double piDivps) -> void
+		{
+			if (mergeFactor > 0 && IsMergeable(i))
+			{
+				const double r = piDivps * PDFFwd(i) * mergeFactor;
+				invWeight += r * r;
+			}
+		};
+
+		double piDivps = 1;
+		for (int i = s - 1; i >= 0; i--)
+		{
+			const double ratio = PDFFwd(i) / PDFRev(i);
+			if (ratio == 0)
+			{
+				break;
+			}
+			piDivps /= ratio;
+			if (IsSamplable(i))
+			{
+				const double r = piDivps * StrategyProbRatio(i);
+				invWeight += r * r;
+			}
+			AddManifoldStrategy(i, piDivps);
+			AddMergingStrategy(i, piDivps);
+		}
+
+		piDivps = 1;
+		for (int i = s + 1; i <= n; i++)
+		{
+			piDivps *= PDFFwd(i - 1) / PDFRev(i - 1);
+			if (piDivps == 0)
+			{
+				break;
+			}
+			if (IsSamplable(i))
+			{
+				const double r = piDivps * StrategyProbRatio(i);
+				invWeight += r * r;
+			}
+			if (i > s + k)
+			{
+				AddManifoldStrategy(i, piDivps);
+			}
+			AddMergingStrategy(i, piDivps);
+		}
+
+		if (k == 0)
+		{
+			AddManifoldStrategy(s, 1);
+			AddMergingStrategy(s, 1);
+			if (merging)
+			{
+				const double r = PDFFwd(s) * mergeFactor;
+				return r == 0 ? 0 : r * r / invWeight;
+			}
+			return 1.0 / invWeight;
+		}
+
+		// The manifold connection itself
+		const double r = ManifoldPDFRatio(s - 1, s + k, detG);
+		invWeight += r * r;
+		return r * r / invWeight;
+	}
+
+	void EvaluatePDFRatios(double* ratios) const
+	{
+		// Ratios p_i / p_s of the PDFs of the strategies i = 0, ..., n in the same way as EvaluateMISWeight,
+		// where the non-samplable strategies have zero ratios.
+		// Used for the MIS weights other than the power heuristic, e.g., the balance heuristic p_s / sum_i p_i.
+		assert(k == 0 && !merging && IsSamplable(s));
+		const int n = NumVertices();
+		std::fill(ratios, ratios + n + 1, 0.0);
+		ratios[s] = 1;
+
+		double piDivps = 1;
+		for (int i = s - 1; i >= 0; i--)
+		{
+			const double ratio = PDFFwd(i) / PDFRev(i);
+			if (ratio == 0)
+			{
+				break;
+			}
+			piDivps /= ratio;
+			if (IsSamplable(i))
+			{
+				ratios[i] = piDivps;
+			}
+		}
+
+		piDivps = 1;
+		for (int i = s + 1; i <= n; i++)
+		{
+			piDivps *= PDFFwd(i - 1) / PDFRev(i - 1);
+			if (piDivps == 0)
+			{
+				break;
+			}
+			if (IsSamplable(i))
+			{
+				ratios[i] = piDivps;
+			}
+		}
+	}
+
+	bool IsSamplable(int i) const
+	{
+		// Equivalent to c_{i,n-i}(x) != 0 with the cached connectivity
+		const int n = NumVertices();
+		if (i == 0)
+		{
+			const auto& v = Vertex(0);
+			return Connectible(0) && v.primitive->EvaluatePosition(v.geom, false) != glm::dvec3();
+		}
+		if (i == n)
+		{
+			const auto& v = Vertex(n - 1);
+			return Connectible(n - 1) && v.primitive->EvaluatePosition(v.geom, false) != glm::dvec3();
+		}
+		return Connectible(i - 1) && Connectible(i);
+	}
+
+	bool IsMergeable(int i) const
+	{
+		// The vertex merging at x_i needs a non-degenerated BSDF at x_i,
+		// where x_i is neither on the light nor the eye
+		return i >= 1 && i <= NumVertices() - 2 && Connectible(i);
+	}
+
+	#pragma endregion
+
+private:
+
+	#pragma region Manifold strategies
+
+	double ManifoldPDFRatio(int a, int b, double detG) const
+	{
+		// p_m / p_{a+1} of the manifold strategy connecting x_a and x_b with the specular vertices in between.
+		// The manifold connection estimates the path with the generalized geometry term #detG
+		// in place of the product of the geometry terms G(x_a, x_{a+1}) ... G(x_{b-1}, x_b),
+		// so p_m is obtained by replacing the PDFs of x_{a+1}, ..., x_{b-1} sampled from the eye side
+		// in p_{a+1} by G(x_{a+1}, x_{a+2}) ... G(x_{b-1}, x_b) / detG * G(x_a, x_{a+1}).
+		double ratio = 1;
+		for (int i = a + 1; i < b; i++)
+		{
+			const double pdfRev = PDFRev(i);
+			if (pdfRev == 0)
+			{
+				return 0;
+			}
+			ratio *= GeometryTerm(Vertex(i).geom, Vertex(i + 1).geom) / pdfRev;
+		}
+		return ratio * GeometryTerm(Vertex(a).geom, Vertex(a + 1).geom) / detG;
+	}
+
+	bool IsManifoldSamplable(int a, int b) const
+	{
+		// True if the endpoints x_a and x_b of the specular chain can be connected by the manifold connection,
+		// where x_b must be a diffuse vertex on the eye subpath not being the eye.
+		// The chain itself is checked by ManifoldChainGeometryTerm.
+		const int n = NumVertices();
+		return b - a - 1 <= MaxNumSpecularChainVertices && b < n - 1 && (Type(b) & PrimitiveType::D) > 0 && Connectible(a) && Connectible(b);
+	}
+
+	double ManifoldChainGeometryTerm(int a, int b) const
+	{
+		// Generalized geometry term of the specular chain between x_a and x_b,
+		// or zero if the manifold connection cannot generate the chain.
+		// The term is cached if the chain lies in one subpath.
+		double* cached = nullptr;
+		if (manifoldCache)
+		{
+			if (b < s) { cached = &manifoldCache->L[b]; }
+			else if (a >= s + k) { cached = &manifoldCache->E[NumVertices() - 1 - a]; }
+		}
+		if (cached && *cached >= 0)
+		{
+			return *cached;
+		}
+
+		const auto Evaluate = [&]() -> double
+		{
+			// The chain must be the one generated by the propagation with the refraction selected for Fresnel surfaces
+			for (int i = a + 1; i < b; i++)
+			{
+				const auto& v = Vertex(i);
+				glm::dvec3 wo;
+				v.primitive->SampleDirection(glm::dvec2(), 1, v.type, v.geom, glm::normalize(Vertex(i - 1).geom.p - v.geom.p), wo);
+				if (glm::dot(wo, glm::normalize(Vertex(i + 1).geom.p - v.geom.p)) < 0.99)
+				{
+					return 0;
+				}
+			}
+
+			// The seed path is generated from the segment between x_a and x_b
+			if (CountSpecularSurfaces(*scene, Vertex(b).geom.p, Vertex(a).geom.p) != b - a - 1)
+			{
+				return 0;
+			}
+
+			return EvaluateManifoldGeometryTerm(a, b);
+		};
+
+		const double G = Evaluate();
+		if (cached)
+		{
+			*cached = G;
+		}
+		return G;
 	}
 
 	#pragma endregion
@@ -0,0 +1,405 @@
+/*
+	nanogi - A small, reference GI renderer
+
+	Copyright (c) 2015 Light Transport Entertainment Inc.
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+	* Redistributions of source code must retain the above copyright
+	notice, this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright
+	notice, this list of conditions and the following disclaimer in the
+	documentation and/or other materials provided with the distribution.
+	* Neither the name of the <organization> nor the
+	names of its contributors may be used to endorse or promote products
+	derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+	ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#pragma once
+#ifndef NANOGI_GUIDING_H
+#define NANOGI_GUIDING_H
+
+#include <nanogi/rt.hpp>
+
+NGI_NAMESPACE_BEGIN
+
+#pragma region Atomic floating point value
+
+// Copyable atomic double used for the statistics updated from multiple threads
+struct AtomicDouble
+{
+
+	std::atomic<double> v;
+
+public:
+
+	AtomicDouble(double x = 0) : v(x) {}
+	AtomicDouble(const AtomicDouble& o) : v(o.Load()) {}
+	AtomicDouble& operator=(const AtomicDouble& o) { v.store(o.Load(), std::memory_order_relaxed); return *this; }
+
+public:
+
+	double Load() const
+	{
+		return v.load(std::memory_order_relaxed);
+	}
+
+	void Add(double x)
+	{
+		auto current = v.load(std::memory_order_relaxed);
+		while (!v.compare_exchange_weak(current, current + x, std::memory_order_relaxed));
+	}
+
+};
+
+#pragma endregion
+
+// --------------------------------------------------------------------------------
+
+#pragma region Directional quadtree
+
+/*
+	Quadtree over the unit square representing a distribution of directions.
+	The square is mapped to the unit sphere with the area-preserving cylindrical mapping,
+	so the PDF in the solid angle measure is the PDF on the square divided by 4 Pi.
+	Cf. T. Muller et al., Practical Path Guiding for Efficient Light-Transport Simulation, 2017.
+*/
+class DTree
+{
+private:
+
+	struct Node
+	{
+		AtomicDouble sums[4];					// Energy of the quadrants
+		int children[4] = { 0, 0, 0, 0 };		// Child node indices (0 : leaf)
+	};
+
+	std::vector<Node> nodes;
+
+public:
+
+	DTree() { nodes.emplace_back(); }
+
+public:
+
+	static glm::dvec2 DirToCanonical(const glm::dvec3& d)
+	{
+		const double z = glm::clamp(d.z, -1.0, 1.0);
+		double phi = std::atan2(d.y, d.x);
+		if (phi < 0) phi += 2.0 * Pi;
+		return ClampCanonical(glm::dvec2((z + 1.0) * 0.5, phi / (2.0 * Pi)));
+	}
+
+	static glm::dvec3 CanonicalToDir(const glm::dvec2& p)
+	{
+		const double z = 2.0 * p.x - 1.0;
+		const double r = glm::sqrt(glm::max(0.0, 1.0 - z * z));
+		const double phi = 2.0 * Pi * p.y;
+		return glm::dvec3(r * glm::cos(phi), r * glm::sin(phi), z);
+	}
+
+public:
+
+	double Total() const
+	{
+		const auto& n = nodes[0];
+		return n.sums[0].Load() + n.sums[1].Load() + n.sums[2].Load() + n.sums[3].Load();
+	}
+
+	int NumNodes() const
+	{
+		return (int)(nodes.size());
+	}
+
+	void Record(const glm::dvec3& d, double value)
+	{
+		auto p = DirToCanonical(d);
+		int index = 0;
+		while (true)
+		{
+			const int q = Quadrant(p);
+			nodes[index].sums[q].Add(value);
+			if (nodes[index].children[q] == 0)
+			{
+				break;
+			}
+			index = nodes[index].children[q];
+		}
+	}
+
+	glm::dvec3 Sample(const glm::dvec2& u) const
+	{
+		if (Total() <= 0)
+		{
+			return CanonicalToDir(u);
+		}
+
+		auto v = u;
+		glm::dvec2 origin;
+		double size = 1;
+		int index = 0;
+		while (true)
+		{
+			const auto& n = nodes[index];
+			const double s[4] = { n.sums[0].Load(), n.sums[1].Load(), n.sums[2].Load(), n.sums[3].Load() };
+
+			// Select a column, then a quadrant in the column, reusing the random numbers
+			const double pLeft = (s[0] + s[2]) / (s[0] + s[1] + s[2] + s[3]);
+			int qx;
+			if (v.x < pLeft) { qx = 0; v.x /= pLeft; }
+			else             { qx = 1; v.x = (v.x - pLeft) / (1.0 - pLeft); }
+			const double pBottom = s[qx] / (s[qx] + s[qx + 2]);
+			int qy;
+			if (v.y < pBottom) { qy = 0; v.y /= pBottom; }
+			else               { qy = 1; v.y = (v.y - pBottom) / (1.0 - pBottom); }
+			v = ClampCanonical(v);
+
+			size *= 0.5;
+			origin += glm::dvec2(qx, qy) * size;
+			const int q = qx + 2 * qy;
+			if (n.children[q] == 0)
+			{
+				return CanonicalToDir(origin + v * size);
+			}
+			index = n.children[q];
+		}
+	}
+
+	double EvaluatePDF(const glm::dvec3& d) const
+	{
+		const double total = Total();
+		if (total <= 0)
+		{
+			return 1.0 / (4.0 * Pi);
+		}
+
+		auto p = DirToCanonical(d);
+		double pdf = 1.0 / (4.0 * Pi);
+		int index = 0;
+		while (true)
+		{
+			const auto& n = nodes[index];
+			const int q = Quadrant(p);
+			const double sum = n.sums[0].Load() + n.sums[1].Load() + n.sums[2].Load() + n.sums[3].Load();
+			const double s = n.sums[q].Load();
+			if (s <= 0)
+			{
+				return 0;
+			}
+			pdf *= 4.0 * s / sum;
+			if (n.children[q] == 0)
+			{
+				return pdf;
+			}
+			index = n.children[q];
+		}
+	}
+
+	// Rebuild the tree structure from the statistics of #prev and clear the statistics.
+	// Quadrants with more than #threshold of the total energy are subdivided.
+	void Refine(const DTree& prev, double threshold, int maxDepth)
+	{
+		nodes.clear();
+		const double total = prev.Total();
+		if (total <= 0)
+		{
+			nodes.emplace_back();
+			return;
+		}
+		RefineNode(prev, 0, 0, total, threshold, 1, maxDepth);
+	}
+
+private:
+
+	static glm::dvec2 ClampCanonical(const glm::dvec2& p)
+	{
+		return glm::clamp(p, glm::dvec2(0), glm::dvec2(1.0 - 1e-10));
+	}
+
+	// Returns the quadrant of #p and transforms #p to the local coordinates of the quadrant
+	static int Quadrant(glm::dvec2& p)
+	{
+		const int qx = p.x < 0.5 ? 0 : 1;
+		const int qy = p.y < 0.5 ? 0 : 1;
+		p = ClampCanonical(p * 2.0 - glm::dvec2(qx, qy));
+		return qx + 2 * qy;
+	}
+
+	// #prevIndex < 0 means the node does not exist in #prev,
+	// where the energy is assumed to be distributed uniformly over the quadrants.
+	int RefineNode(const DTree& prev, int prevIndex, double energy, double total, double threshold, int depth, int maxDepth)
+	{
+		const int index = (int)(nodes.size());
+		nodes.emplace_back();
+		for (int q = 0; q < 4; q++)
+		{
+			const double e = prevIndex >= 0 ? prev.nodes[prevIndex].sums[q].Load() : energy * 0.25;
+			if (depth < maxDepth && e / total > threshold)
+			{
+				const int prevChild = prevIndex >= 0 && prev.nodes[prevIndex].children[q] != 0 ? prev.nodes[prevIndex].children[q] : -1;
+				const int child = RefineNode(prev, prevChild, e, total, threshold, depth + 1, maxDepth);
+				nodes[index].children[q] = child;
+			}
+		}
+		return index;
+	}
+
+};
+
+#pragma endregion
+
+// --------------------------------------------------------------------------------
+
+#pragma region Spatial-directional tree
+
+/*
+	Binary tree subdividing the scene bound, where each leaf holds directional quadtrees.
+	The sampling tree is learned in the previous iteration and only read during an iteration.
+	The building tree accumulates the statistics of the current iteration from multiple threads.
+*/
+class SDTree
+{
+private:
+
+	struct Node
+	{
+		int axis = 0;						// Split axis
+		int children[2] = { 0, 0 };			// Child node indices (0 : leaf)
+		int leaf = 0;						// Leaf index if the node is a leaf
+	};
+
+	struct Leaf
+	{
+		DTree sampling;
+		DTree building;
+		AtomicDouble numSamples;
+	};
+
+	glm::dvec3 boundMin;
+	glm::dvec3 boundSize;
+	std::vector<Node> nodes;
+	std::vector<Leaf> leaves;
+
+public:
+
+	void Init(const AABB& bound)
+	{
+		// Cubic bound slightly enlarged from the scene bound
+		const auto extent = bound.max - bound.min;
+		const double size = glm::max(extent.x, glm::max(extent.y, extent.z)) * 1.01;
+		boundMin = (bound.min + bound.max) * 0.5 - glm::dvec3(size * 0.5);
+		boundSize = glm::dvec3(size);
+		nodes.assign(1, Node());
+		leaves.assign(1, Leaf());
+	}
+
+	int NumLeaves() const
+	{
+		return (int)(leaves.size());
+	}
+
+	const DTree& SamplingDTree(const glm::dvec3& p) const
+	{
+		return leaves[FindLeaf(p)].sampling;
+	}
+
+	void Record(const glm::dvec3& p, const glm::dvec3& d, double value)
+	{
+		auto& leaf = leaves[FindLeaf(p)];
+		leaf.building.Record(d, value);
+		leaf.numSamples.Add(1);
+	}
+
+	// Subdivide the leaves with more than #spatialThreshold samples,
+	// and then swap the building trees to the sampling trees.
+	void Update(double spatialThreshold, double directionalThreshold, int maxDirectionalDepth)
+	{
+		#pragma region Subdivide spatial tree
+
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			if (nodes[i].children[0] != 0)
+			{
+				continue;
+			}
+
+			const int leafIndex = nodes[i].leaf;
+			if (leaves[leafIndex].numSamples.Load() <= spatialThreshold)
+			{
+				continue;
+			}
+
+			// Children inherit the statistics of the parent
+			auto leaf = leaves[leafIndex];
+			leaf.numSamples = AtomicDouble(leaf.numSamples.Load() * 0.5);
+			leaves[leafIndex] = leaf;
+			leaves.push_back(leaf);
+
+			Node child;
+			child.axis = (nodes[i].axis + 1) % 3;
+			child.leaf = leafIndex;
+			nodes[i].children[0] = (int)(nodes.size());
+			nodes.push_back(child);
+			child.leaf = (int)(leaves.size()) - 1;
+			nodes[i].children[1] = (int)(nodes.size());
+			nodes.push_back(child);
+		}
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Update directional trees
+
+		for (auto& leaf : leaves)
+		{
+			leaf.sampling = leaf.building;
+			leaf.building.Refine(leaf.sampling, directionalThreshold, maxDirectionalDepth);
+			leaf.numSamples = AtomicDouble(0);
+		}
+
+		#pragma endregion
+	}
+
+private:
+
+	int FindLeaf(const glm::dvec3& p) const
+	{
+		auto x = glm::clamp((p - boundMin) / boundSize, glm::dvec3(0), glm::dvec3(1));
+		int index = 0;
+		while (nodes[index].children[0] != 0)
+		{
+			const int axis = nodes[index].axis;
+			if (x[axis] < 0.5)
+			{
+				x[axis] *= 2.0;
+				index = nodes[index].children[0];
+			}
+			else
+			{
+				x[axis] = x[axis] * 2.0 - 1.0;
+				index = nodes[index].children[1];
+			}
+		}
+		return nodes[index].leaf;
+	}
+
+};
+
+#pragma endregion
+
+NGI_NAMESPACE_END
+
+#endif // NANOGI_GUIDING_H
@@ -0,0 +1,168 @@
+/*
+	nanogi - A small, reference GI renderer
+
+	Copyright (c) 2015 Light Transport Entertainment Inc.
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+	* Redistributions of source code must retain the above copyright
+	notice, this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright
+	notice, this list of conditions and the following disclaimer in the
+	documentation and/or other materials provided with the distribution.
+	* Neither the name of the <organization> nor the
+	names of its contributors may be used to endorse or promote products
+	derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+	ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#pragma once
+#ifndef NANOGI_HASHGRID_H
+#define NANOGI_HASHGRID_H
+
+#include <nanogi/basic.hpp>
+
+NGI_NAMESPACE_BEGIN
+
+#pragma region Hash grid
+
+// Hash grid for the fixed-radius range queries of points.
+// The points are sorted by the buckets so that the points in a cell are contiguous in memory.
+// Both counting and scattering are done in parallel with atomic counters,
+// and the grid is read-only after the build so the queries need no locks.
+struct HashGrid
+{
+
+	// Point stored in a bucket
+	struct Entry
+	{
+		glm::dvec3 p;
+		int index;					// Index of the point given in Build
+	};
+
+	double radius = 0;				// Query radius
+	double invCellSize = 0;			// Inverse of the cell size (= 2 * radius)
+	std::vector<int> bucketOffsets;	// Offsets of the buckets in #entries (size: # of buckets + 1)
+	std::vector<Entry> entries;		// Points sorted by the buckets
+
+public:
+
+	void Build(const std::vector<glm::dvec3>& points, double radius)
+	{
+		this->radius = radius;
+		invCellSize = 1.0 / (2 * radius);
+
+		// The number of buckets is set to the number of points
+		const int n = (int)(points.size());
+		const int numBuckets = glm::max(1, n);
+		std::vector<int> buckets(n);
+		std::unique_ptr<std::atomic<int>[]> counts(new std::atomic<int>[numBuckets]);
+		for (int i = 0; i < numBuckets; i++)
+		{
+			counts[i] = 0;
+		}
+
+		// Count the points in each bucket
+		tbb::parallel_for(tbb::blocked_range<int>(0, n), [&](const tbb::blocked_range<int>& range) -> void
+		{
+			for (int i = range.begin(); i != range.end(); i++)
+			{
+				buckets[i] = BucketIndex(CellIndex(points[i]), numBuckets);
+				counts[buckets[i]].fetch_add(1, std::memory_order_relaxed);
+			}
+		});
+
+		// Offsets of the buckets
+		bucketOffsets.assign(numBuckets + 1, 0);
+		for (int i = 0; i < numBuckets; i++)
+		{
+			bucketOffsets[i + 1] = bucketOffsets[i] + counts[i].load(std::memory_order_relaxed);
+			counts[i].store(bucketOffsets[i], std::memory_order_relaxed);
+		}
+
+		// Scatter the points to the buckets
+		entries.resize(n);
+		tbb::parallel_for(tbb::blocked_range<int>(0, n), [&](const tbb::blocked_range<int>& range) -> void
+		{
+			for (int i = range.begin(); i != range.end(); i++)
+			{
+				entries[counts[buckets[i]].fetch_add(1, std::memory_order_relaxed)] = { points[i], i };
+			}
+		});
+	}
+
+	// Calls #func with the index of each point within the radius from #p
+	template <typename Func>
+	void Query(const glm::dvec3& p, const Func& func) const
+	{
+		if (entries.empty())
+		{
+			return;
+		}
+
+		// As the cell size is 2 * radius, the query touches at most 2x2x2 cells.
+		// Different cells can be hashed to the same bucket, which must be visited once.
+		const int numBuckets = (int)(bucketOffsets.size()) - 1;
+		const auto minCell = CellIndex(p - radius);
+		const auto maxCell = CellIndex(p + radius);
+		int visited[8];
+		int numVisited = 0;
+		for (int z = minCell.z; z <= maxCell.z; z++)
+		{
+			for (int y = minCell.y; y <= maxCell.y; y++)
+			{
+				for (int x = minCell.x; x <= maxCell.x; x++)
+				{
+					const int bucket = BucketIndex(glm::ivec3(x, y, z), numBuckets);
+					if (std::find(visited, visited + numVisited, bucket) != visited + numVisited)
+					{
+						continue;
+					}
+					visited[numVisited++] = bucket;
+
+					for (int i = bucketOffsets[bucket]; i < bucketOffsets[bucket + 1]; i++)
+					{
+						const auto& e = entries[i];
+						if (glm::length2(e.p - p) <= radius * radius)
+						{
+							func(e.index);
+						}
+					}
+				}
+			}
+		}
+	}
+
+private:
+
+	glm::ivec3 CellIndex(const glm::dvec3& p) const
+	{
+		return glm::ivec3(glm::floor(p * invCellSize));
+	}
+
+	static int BucketIndex(const glm::ivec3& c, int numBuckets)
+	{
+		// Hash function from [Teschner et al. 2003]
+		const unsigned int h = ((unsigned int)(c.x) * 73856093u) ^ ((unsigned int)(c.y) * 19349663u) ^ ((unsigned int)(c.z) * 83492791u);
+		return (int)(h % (unsigned int)(numBuckets));
+	}
+
+};
+
+#pragma endregion
+
+NGI_NAMESPACE_END
+
+#endif // NANOGI_HASHGRID_H
@@ -0,0 +1,184 @@
+/*
+	nanogi - A small, reference GI renderer
+
+	Copyright (c) 2015 Light Transport Entertainment Inc.
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+	* Redistributions of source code must retain the above copyright
+	notice, this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright
+	notice, this list of conditions and the following disclaimer in the
+	documentation and/or other materials provided with the distribution.
+	* Neither the name of the <organization> nor the
+	names of its contributors may be used to endorse or promote products
+	derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+	ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#pragma once
+#ifndef NANOGI_IRRADIANCECACHE_H
+#define NANOGI_IRRADIANCECACHE_H
+
+#include <nanogi/basic.hpp>
+
+NGI_NAMESPACE_BEGIN
+
+#pragma region Irradiance cache
+
+// Irradiance cache [Ward et al. 1988] interpolating the irradiance from the records around a surface point.
+// The irradiance of a record is extrapolated to the point with the rotational and translational gradients [Ward & Heckbert 1992].
+// A record is valid at the points where the error estimate of the split sphere model is below the threshold,
+// i.e., within the distance of error * (harmonic mean distance) from the record.
+// The records are referenced from the buckets of a hash grid whose cells are larger than the valid regions,
+// so a lookup visits only one bucket. The buckets are lock-free lists,
+// where a record is inserted into the buckets of the overlapped cells by prepending a node with CAS.
+// The nodes are immutable once published, so the lookups need no locks either.
+struct IrradianceCache
+{
+
+	struct Record
+	{
+		glm::dvec3 p;				// Position
+		glm::dvec3 n;				// Normal
+		glm::dvec3 E;				// Irradiance
+		glm::dmat3 gradR;			// Rotational gradient, where the column i is the derivative of E by the rotation around the axis i
+		glm::dmat3 gradT;			// Translational gradient, where the column i is the derivative of E by the translation along the axis i
+		double R;					// Harmonic mean distance to the surrounding surfaces
+	};
+
+	struct Node
+	{
+		const Record* record;
+		const Node* next;
+	};
+
+	double error = 0;				// Threshold of the error estimate
+	double invCellSize = 0;			// Inverse of the cell size
+	int numBuckets = 0;
+	std::unique_ptr<std::atomic<const Node*>[]> buckets;
+	tbb::concurrent_vector<Record> records;
+	tbb::concurrent_vector<Node> nodes;
+
+public:
+
+	// #maxR is the upper bound of the harmonic mean distances of the records
+	void Init(double error, double maxR, int numBuckets)
+	{
+		this->error = error;
+		invCellSize = 1.0 / (2 * error * maxR);
+		this->numBuckets = numBuckets;
+		buckets.reset(new std::atomic<const Node*>[numBuckets]);
+		for (int i = 0; i < numBuckets; i++)
+		{
+			buckets[i] = nullptr;
+		}
+		records.clear();
+		nodes.clear();
+	}
+
+	// Interpolates the irradiance at the point #p with the normal #n.
+	// Returns false if no record is valid at the point.
+	bool Lookup(const glm::dvec3& p, const glm::dvec3& n, glm::dvec3& E) const
+	{
+		glm::dvec3 sumE;
+		double sumW = 0;
+		for (const auto* node = buckets[BucketIndex(CellIndex(p))].load(std::memory_order_acquire); node; node = node->next)
+		{
+			const auto& r = *node->record;
+
+			// Records in front of the point are excluded, which otherwise leak the irradiance of the occluded surfaces
+			if (glm::dot(p - r.p, n + r.n) < -1e-3 * r.R)
+			{
+				continue;
+			}
+
+			// Weight from the inverse of the error estimate
+			const double e = glm::length(p - r.p) / r.R + glm::sqrt(glm::max(0.0, 1 - glm::dot(n, r.n)));
+			if (e >= error)
+			{
+				continue;
+			}
+			const double w = 1 / glm::max(e, 1e-10);
+			sumE += w * glm::max(glm::dvec3(), r.E + (getenv("TMP_NOGR") ? glm::dvec3() : r.gradR * glm::cross(r.n, n)) + (getenv("TMP_NOGT") ? glm::dvec3() : r.gradT * (p - r.p)));
+			sumW += w;
+		}
+
+		if (sumW == 0)
+		{
+			return false;
+		}
+
+		E = sumE / sumW;
+		return true;
+	}
+
+	void Insert(const Record& r)
+	{
+		const Record* record = &*records.push_back(r);
+
+		// Cells overlapped by the valid region, each of whose buckets is visited once
+		const double d = error * r.R;
+		const auto minCell = CellIndex(r.p - d);
+		const auto maxCell = CellIndex(r.p + d);
+		int inserted[8];
+		int numInserted = 0;
+		for (int z = minCell.z; z <= maxCell.z; z++)
+		{
+			for (int y = minCell.y; y <= maxCell.y; y++)
+			{
+				for (int x = minCell.x; x <= maxCell.x; x++)
+				{
+					const int bucket = BucketIndex(glm::ivec3(x, y, z));
+					if (std::find(inserted, inserted + numInserted, bucket) != inserted + numInserted)
+					{
+						continue;
+					}
+					inserted[numInserted++] = bucket;
+
+					// Prepend a node
+					auto* node = &*nodes.push_back({ record, buckets[bucket].load(std::memory_order_relaxed) });
+					while (!buckets[bucket].compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed));
+				}
+			}
+		}
+	}
+
+	size_t NumRecords() const
+	{
+		return records.size();
+	}
+
+private:
+
+	glm::ivec3 CellIndex(const glm::dvec3& p) const
+	{
+		return glm::ivec3(glm::floor(p * invCellSize));
+	}
+
+	int BucketIndex(const glm::ivec3& c) const
+	{
+		// Hash function from [Teschner et al. 2003]
+		const unsigned int h = ((unsigned int)(c.x) * 73856093u) ^ ((unsigned int)(c.y) * 19349663u) ^ ((unsigned int)(c.z) * 83492791u);
+		return (int)(h % (unsigned int)(numBuckets));
+	}
+
+};
+
+#pragma endregion
+
+NGI_NAMESPACE_END
+
+#endif // NANOGI_IRRADIANCECACHE_H
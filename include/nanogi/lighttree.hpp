@@ -0,0 +1,161 @@
+/*
+	nanogi - A small, reference GI renderer
+
+	Copyright (c) 2015 Light Transport Entertainment Inc.
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+	* Redistributions of source code must retain the above copyright
+	notice, this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright
+	notice, this list of conditions and the following disclaimer in the
+	documentation and/or other materials provided with the distribution.
+	* Neither the name of the <organization> nor the
+	names of its contributors may be used to endorse or promote products
+	derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+	ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#pragma once
+#ifndef NANOGI_LIGHTTREE_H
+#define NANOGI_LIGHTTREE_H
+
+#include <nanogi/basic.hpp>
+#include <nanogi/rt.hpp>
+
+NGI_NAMESPACE_BEGIN
+
+#pragma region Light tree
+
+// Binary tree of point lights as the light tree of lightcuts [Walter et al. 2005].
+// Instead of selecting a cut with the error bounds, the tree is traversed stochastically
+// with the probabilities proportional to the estimated contributions of the children,
+// which samples a light for a shading point without bias [Estevez & Kulla 2018].
+// The nodes are stored in the depth-first order, so the first child of a node follows the node.
+struct LightTree
+{
+
+	struct Node
+	{
+		AABB bound;
+		double intensity;			// Sum of the intensities of the lights in the node
+		int child;					// Index of the second child (-1 : leaf)
+		int index;					// Index of the light given in Build (leaf)
+	};
+
+	std::vector<Node> nodes;
+
+public:
+
+	void Build(const std::vector<glm::dvec3>& points, const std::vector<double>& intensities)
+	{
+		assert(points.size() == intensities.size());
+		nodes.clear();
+		if (points.empty())
+		{
+			return;
+		}
+
+		nodes.reserve(2 * points.size() - 1);
+		std::vector<int> indices(points.size());
+		std::iota(indices.begin(), indices.end(), 0);
+		BuildNode(points, intensities, indices, 0, (int)(indices.size()));
+	}
+
+	// Samples a light for the shading point #p with #u and returns the index (-1 : no light).
+	// #prob receives the probability of the selection.
+	// #minDist2 bounds the squared distance to the nodes from below, e.g., with the clamping distance of the lights.
+	int Sample(const glm::dvec3& p, double u, double minDist2, double& prob) const
+	{
+		if (nodes.empty() || nodes[0].intensity == 0)
+		{
+			return -1;
+		}
+
+		prob = 1;
+		int i = 0;
+		while (nodes[i].child >= 0)
+		{
+			// The sample is reused by rescaling to the selected interval
+			const double w1 = Importance(nodes[i + 1], p, minDist2);
+			const double w2 = Importance(nodes[nodes[i].child], p, minDist2);
+			const double p1 = w1 / (w1 + w2);
+			if (u < p1)
+			{
+				u /= p1;
+				prob *= p1;
+				i = i + 1;
+			}
+			else
+			{
+				u = (u - p1) / (1 - p1);
+				prob *= 1 - p1;
+				i = nodes[i].child;
+			}
+		}
+
+		return nodes[i].index;
+	}
+
+private:
+
+	int BuildNode(const std::vector<glm::dvec3>& points, const std::vector<double>& intensities, std::vector<int>& indices, int begin, int end)
+	{
+		const int nodeIndex = (int)(nodes.size());
+		nodes.emplace_back();
+
+		AABB bound;
+		double intensity = 0;
+		for (int i = begin; i < end; i++)
+		{
+			bound = AABB::Union(bound, points[indices[i]]);
+			intensity += intensities[indices[i]];
+		}
+
+		if (end - begin == 1)
+		{
+			nodes[nodeIndex] = { bound, intensity, -1, indices[begin] };
+			return nodeIndex;
+		}
+
+		// Split at the median along the longest axis
+		const auto extent = bound.max - bound.min;
+		const int axis = extent.x > extent.y && extent.x > extent.z ? 0 : extent.y > extent.z ? 1 : 2;
+		const int mid = (begin + end) / 2;
+		std::nth_element(indices.begin() + begin, indices.begin() + mid, indices.begin() + end, [&](int i1, int i2) -> bool
+		{
+			return points[i1][axis] < points[i2][axis];
+		});
+
+		BuildNode(points, intensities, indices, begin, mid);
+		const int child = BuildNode(points, intensities, indices, mid, end);
+		nodes[nodeIndex] = { bound, intensity, child, -1 };
+		return nodeIndex;
+	}
+
+	static double Importance(const Node& node, const glm::dvec3& p, double minDist2)
+	{
+		// Intensity over the squared distance to the bound
+		const auto d = glm::max(glm::max(node.bound.min - p, p - node.bound.max), glm::dvec3());
+		return node.intensity / glm::max(glm::length2(d), minDist2);
+	}
+
+};
+
+#pragma endregion
+
+NGI_NAMESPACE_END
+
+#endif // NANOGI_LIGHTTREE_H
@@ -0,0 +1,180 @@
+/*
+	nanogi - A small, reference GI renderer
+
+	Copyright (c) 2015 Light Transport Entertainment Inc.
+	All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+	* Redistributions of source code must retain the above copyright
+	notice, this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright
+	notice, this list of conditions and the following disclaimer in the
+	documentation and/or other materials provided with the distribution.
+	* Neither the name of the <organization> nor the
+	names of its contributors may be used to endorse or promote products
+	derived from this software without specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+	ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+	WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+	DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+	(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+	LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+	ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+	(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+	SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+
+#pragma once
+#ifndef NANOGI_POISSON_H
+#define NANOGI_POISSON_H
+
+#include <nanogi/basic.hpp>
+
+NGI_NAMESPACE_BEGIN
+
+#pragma region Screened Poisson reconstruction
+
+// Screened Poisson reconstruction of an image from the estimates of the pixel values and their gradients,
+// the L2 reconstruction of the gradient-domain rendering [Lehtinen et al. 2013].
+// The image I minimizes alpha^2 |I - primal|^2 + |dI/dx - dx|^2 + |dI/dy - dy|^2,
+// where dx[x, y] = I[x+1, y] - I[x, y] and dy[x, y] = I[x, y+1] - I[x, y] (forward differences; the last column and row are unused).
+// The normal equation (alpha^2 + D^T D) I = alpha^2 primal + D^T g is solved with the conjugate gradient method
+// for each color channel independently, starting from #result if it has the size of the image, or from #primal otherwise.
+// Returns the number of iterations.
+inline int SolveScreenedPoisson(const std::vector<glm::dvec3>& primal, const std::vector<glm::dvec3>& dx, const std::vector<glm::dvec3>& dy, int w, int h, double alpha, int maxIterations, double tolerance, std::vector<glm::dvec3>& result)
+{
+	const int n = w * h;
+	const double alpha2 = alpha * alpha;
+	if (result.size() != primal.size())
+	{
+		result = primal;
+	}
+
+	#pragma region Helper functions
+
+	// Applies D^T D (the negated Laplacian with the Neumann boundary) and the screening term to #v
+	const auto Apply = [&](const std::vector<glm::dvec3>& v, std::vector<glm::dvec3>& Av) -> void
+	{
+		tbb::parallel_for(tbb::blocked_range<int>(0, h), [&](const tbb::blocked_range<int>& range) -> void
+		{
+			for (int y = range.begin(); y != range.end(); y++)
+			{
+				for (int x = 0; x < w; x++)
+				{
+					const int i = y * w + x;
+					auto r = alpha2 * v[i];
+					if (x > 0)     { r += v[i] - v[i - 1]; }
+					if (x < w - 1) { r += v[i] - v[i + 1]; }
+					if (y > 0)     { r += v[i] - v[i - w]; }
+					if (y < h - 1) { r += v[i] - v[i + w]; }
+					Av[i] = r;
+				}
+			}
+		});
+	};
+
+	// Per-channel dot product
+	const auto Dot = [&](const std::vector<glm::dvec3>& a, const std::vector<glm::dvec3>& b) -> glm::dvec3
+	{
+		return tbb::parallel_reduce(tbb::blocked_range<int>(0, n), glm::dvec3(), [&](const tbb::blocked_range<int>& range, glm::dvec3 sum) -> glm::dvec3
+		{
+			for (int i = range.begin(); i != range.end(); i++)
+			{
+				sum += a[i] * b[i];
+			}
+			return sum;
+		}, std::plus<glm::dvec3>());
+	};
+
+	// Per-channel division, zero for the converged channels
+	const auto Div = [](const glm::dvec3& a, const glm::dvec3& b) -> glm::dvec3
+	{
+		return glm::dvec3(b.x > 0 ? a.x / b.x : 0, b.y > 0 ? a.y / b.y : 0, b.z > 0 ? a.z / b.z : 0);
+	};
+
+	#pragma endregion
+
+	// --------------------------------------------------------------------------------
+
+	#pragma region Right hand side
+
+	std::vector<glm::dvec3> b(n);
+	tbb::parallel_for(tbb::blocked_range<int>(0, h), [&](const tbb::blocked_range<int>& range) -> void
+	{
+		for (int y = range.begin(); y != range.end(); y++)
+		{
+			for (int x = 0; x < w; x++)
+			{
+				const int i = y * w + x;
+				auto r = alpha2 * primal[i];
+				if (x > 0)     { r += dx[i - 1]; }
+				if (x < w - 1) { r -= dx[i]; }
+				if (y > 0)     { r += dy[i - w]; }
+				if (y < h - 1) { r -= dy[i]; }
+				b[i] = r;
+			}
+		}
+	});
+
+	#pragma endregion
+
+	// --------------------------------------------------------------------------------
+
+	#pragma region Conjugate gradient
+
+	std::vector<glm::dvec3> r(n), p(n), Ap(n);
+	Apply(result, Ap);
+	for (int i = 0; i < n; i++)
+	{
+		r[i] = b[i] - Ap[i];
+	}
+	p = r;
+	auto rr = Dot(r, r);
+	const auto threshold = tolerance * tolerance * Dot(b, b);
+
+	int iteration = 0;
+	for (; iteration < maxIterations; iteration++)
+	{
+		if (rr.x <= threshold.x && rr.y <= threshold.y && rr.z <= threshold.z)
+		{
+			break;
+		}
+
+		Apply(p, Ap);
+		const auto a = Div(rr, Dot(p, Ap));
+		tbb::parallel_for(tbb::blocked_range<int>(0, n), [&](const tbb::blocked_range<int>& range) -> void
+		{
+			for (int i = range.begin(); i != range.end(); i++)
+			{
+				result[i] += a * p[i];
+				r[i] -= a * Ap[i];
+			}
+		});
+
+		const auto rrNext = Dot(r, r);
+		const auto beta = Div(rrNext, rr);
+		rr = rrNext;
+		tbb::parallel_for(tbb::blocked_range<int>(0, n), [&](const tbb::blocked_range<int>& range) -> void
+		{
+			for (int i = range.begin(); i != range.end(); i++)
+			{
+				p[i] = r[i] + beta * p[i];
+			}
+		});
+	}
+
+	#pragma endregion
+
+	return iteration;
+}
+
+#pragma endregion
+
+NGI_NAMESPACE_END
+
+#endif // NANOGI_POISSON_H
@@ -1497,6 +1497,7 @@ struct Scene
 	std::vector<std::unique_ptr<Primitive>> Primitives;
 	size_t SensorPrimitiveIndex;
 	std::vector<size_t> LightPrimitiveIndices;
+	AABB Bound;					// Bounding box of the scene
 
 public:
 
@@ -2050,6 +2051,8 @@ public:
 				}
 			}
 
+			Bound = SceneBound;
+
 			#pragma endregion
 
 			// --------------------------------------------------------------------------------
@@ -2233,12 +2236,26 @@ public:
 		isect.geom.ComputeTangentSpace();
 
 		// Compute normal derivative
+		// Derivatives along dpdu and dpdv, obtained by mapping the directions to the barycentric coordinates of the triangle
 		const auto N = n1 * (double)(1.0f - rtcRay.u - rtcRay.v) + n2 * (double)(rtcRay.u) + n3 * (double)(rtcRay.v);
 		const double NLen = glm::length(N);
-		const auto dNdu = (n2 - n1) / NLen;
-		const auto dNdv = (n3 - n2) / NLen;
-		isect.geom.dndu = dNdu - isect.geom.sn * glm::dot(dNdu, isect.geom.sn);
-		isect.geom.dndv = dNdv - isect.geom.sn * glm::dot(dNdv, isect.geom.sn);
+		const auto e1 = p2 - p1;
+		const auto e2 = p3 - p1;
+		const double e11 = glm::dot(e1, e1);
+		const double e12 = glm::dot(e1, e2);
+		const double e22 = glm::dot(e2, e2);
+		const double invDet = 1.0 / (e11 * e22 - e12 * e12);
+		const auto NormalDerivative = [&](const glm::dvec3& d) -> glm::dvec3
+		{
+			const double d1 = glm::dot(e1, d);
+			const double d2 = glm::dot(e2, d);
+			const double bu = (e22 * d1 - e12 * d2) * invDet;
+			const double bv = (e11 * d2 - e12 * d1) * invDet;
+			const auto dNd = ((n2 - n1) * bu + (n3 - n1) * bv) / NLen;
+			return dNd - isect.geom.sn * glm::dot(dNd, isect.geom.sn);
+		};
+		isect.geom.dndu = NormalDerivative(isect.geom.dpdu);
+		isect.geom.dndv = NormalDerivative(isect.geom.dpdv);
 
 		return true;
 	}
@@ -2372,10 +2389,82 @@ namespace
 		if (!geom2.degenerated) { t *= glm::abs(glm::dot(geom2.sn, -p1p2)); }
 		return t / p1p2L2;
 	}
+
+	// Luminance of linear sRGB color
+	double Luminance(const glm::dvec3& v)
+	{
+		return glm::dot(glm::dvec3(0.212671, 0.715160, 0.072169), v);
+	}
+
+	// Power heuristic (beta = 2) for the strategy with #pdfA among two strategies
+	double PowerHeuristic(double pdfA, double pdfB)
+	{
+		if (pdfA == 0) { return 0; }
+		const double r = pdfB / pdfA;
+		return 1.0 / (1.0 + r * r);
+	}
 }
 
 #pragma endregion
 
+#pragma region Russian roulette & splitting
+
+enum class RRType
+{
+	Fixed,
+	Throughput,
+};
+
+struct RussianRoulette
+{
+
+	RRType Type = RRType::Throughput;
+	double FixedProb = 0.5;		// Continuation probability for RRType::Fixed
+	double MinProb = 0.05;		// Lower bound of the continuation probability
+	double MaxProb = 0.95;		// Upper bound of the continuation probability (without splitting)
+	int MaxSplit = 1;			// Maximum number of split paths (1 : disable splitting)
+
+public:
+
+	// Continuation probability given the current throughput of the path
+	// and the reference throughput (throughput after the direction sampling from the emitter).
+	// If splitting is allowed the returned value can be larger than one,
+	// which is interpreted as the expected number of split paths.
+	double ContinuationProb(const glm::dvec3& throughput, const glm::dvec3& referenceThroughput, bool allowSplit) const
+	{
+		if (Type == RRType::Fixed)
+		{
+			return FixedProb;
+		}
+
+		const auto MaxComponent = [](const glm::dvec3& v) { return glm::max(v.x, glm::max(v.y, v.z)); };
+		const double t0 = MaxComponent(referenceThroughput);
+		const double q = t0 > 0 ? MaxComponent(throughput) / t0 : 0;
+		if (allowSplit && MaxSplit > 1 && q > 1)
+		{
+			return glm::min(q, (double)(MaxSplit));
+		}
+
+		return glm::clamp(q, MinProb, MaxProb);
+	}
+
+	// Number of continued paths (0 : terminate) according to #prob.
+	// The expected number is #prob, so each continued path must be weighted by 1 / #prob.
+	int Sample(double prob, double u) const
+	{
+		if (prob <= 1)
+		{
+			return u < prob ? 1 : 0;
+		}
+
+		const int n = (int)(prob);
+		return n + (u < prob - n ? 1 : 0);
+	}
+
+};
+
+#pragma endregion
+
 NGI_NAMESPACE_END
 
 #endif // NANOGI_RT_H
@@ -33,6 +33,11 @@
 #include <nanogi/basic.hpp>
 #include <nanogi/rt.hpp>
 #include <nanogi/bdpt.hpp>
+#include <nanogi/guiding.hpp>
+#include <nanogi/hashgrid.hpp>
+#include <nanogi/lighttree.hpp>
+#include <nanogi/irradiancecache.hpp>
+#include <nanogi/poisson.hpp>
 
 #include <boost/program_options.hpp>
 
@@ -56,6 +61,18 @@ enum class RendererType
 	LTDirect,
 	BDPT,
 	PTMNEE,
+	PTMIS,
+	LVCBDPT,
+	PTSMS,
+	VCM,
+	SPPM,
+	PSSMLT,
+	MMLT,
+	MEMLT,
+	VPL,
+	PTCache,
+	GPT,
+	PTReuse,
 };
 
 const std::string RendererType_String[] =
@@ -66,10 +83,30 @@ const std::string RendererType_String[] =
 	"ltdirect",
 	"bdpt",
 	"ptmnee",
+	"ptmis",
+	"lvcbdpt",
+	"ptsms",
+	"vcm",
+	"sppm",
+	"pssmlt",
+	"mmlt",
+	"memlt",
+	"vpl",
+	"ptcache",
+	"gpt",
+	"ptreuse",
 };
 
 NGI_ENUM_TYPE_MAP(RendererType);
 
+const std::string RRType_String[] =
+{
+	"fixed",
+	"throughput",
+};
+
+NGI_ENUM_TYPE_MAP(RRType);
+
 struct Renderer
 {
 
@@ -80,6 +117,7 @@ struct Renderer
 	double ProgressImageInterval;
 	double ProgressImageUpdateInterval;
 	std::string ProgressImageUpdateFormat;
+	long long IterationNumSamples;
 	tbb::task_scheduler_init init{tbb::task_scheduler_init::deferred};
 
 	struct
@@ -89,317 +127,865 @@ struct Renderer
 		int MaxNumVertices;
 		int Width;
 		int Height;
+		RussianRoulette RR;
 
 		struct
 		{
-			std::string SubpathImageDir;
+			bool Stats;						// Collect per-strategy statistics
+			bool Pruning;					// Skip strategies stochastically according to their efficiency
+			double PruningMinProb;			// Minimum evaluation probability of a strategy
+			bool OptimalMIS;				// Use the optimal MIS weights learned per pixel bin
+			int OptimalMISBinSize;			// Width and height of a pixel bin of the optimal MIS in pixels
+			int OptimalMISMaxNumVertices;	// Maximum number of vertices of the paths with the optimal MIS weights
+			bool Manifold;					// Connect subpaths through specular chains with the manifold walk
+			std::string SubpathImageDir;	// Output directory of per-strategy images (empty: disabled)
+			int SubpathImageMaxNumVertices;	// Maximum number of vertices of the strategies written to images
 		} BDPTStrategy;
-	} Params;
 
-public:
+		struct
+		{
+			int NumCandidates;				// Number of light candidates for resampled direct lighting
+		} RIS;
 
-	struct Context
-	{
-		int id = -1;						// Thread ID
-		Random rng;							// Thread-specific RNG
-		std::vector<glm::dvec3> film;		// Thread specific film
-		long long processedSamples = 0;		// Temp for counting # of processed samples
+		struct
+		{
+			int Count;						// Number of split paths at the first scattering vertices (0 : chosen from the measured cost)
+			int Depth;						// Number of the first scattering vertices where the paths are split
+			int MaxCount;					// Upper bound of the automatically chosen number of split paths
+		} Split;
 
 		struct
 		{
-			Path subpathL, subpathE;		// BDPT subpaths
-			Path path;						// BDPT fullpath
-		} BDPT;
-	};
+			bool Enabled = false;
+			double Fraction;				// Probability of sampling directions from the guiding distribution
+			double SpatialThreshold;		// Number of samples to subdivide a spatial node in the first iteration
+			double DirectionalThreshold;	// Fraction of energy to subdivide a directional node
+			int MaxDirectionalDepth;		// Maximum depth of the directional trees
+		} Guiding;
 
-public:
+		struct
+		{
+			int NumConnections;				// Number of connections to the light vertex cache per eye vertex
+		} LVC;
 
-	bool Load(const boost::program_options::variables_map& vm)
-	{
-		try
+		struct
 		{
-			#pragma region Load parameters
+			int MaxTrials;					// Maximum number of trials to estimate the reciprocal probability of a solution
+			bool Glossy;					// Include glossy surfaces in the specular chains
+		} SMS;
 
-			Type = NGI_STRING_TO_ENUM(RendererType, vm["renderer"].as<std::string>());
-			Params.NumSamples = vm["num-samples"].as<long long>();
-			Params.RenderTime = vm["render-time"].as<double>();
-			Params.MaxNumVertices = vm["max-num-vertices"].as<int>();
-			Params.Width = vm["width"].as<int>();
-			Params.Height = vm["height"].as<int>();
+		struct
+		{
+			double RadiusScale;				// Initial merge radius relative to the radius of the scene bound
+			double RadiusAlpha;				// Reduction rate of the merge radius in iterations
+		} VCM;
 
-			#pragma endregion
+		struct
+		{
+			double RadiusScale;				// Initial radius relative to the radius of the scene bound
+			double Alpha;					// Fraction of the photons kept in the progressive radius reduction
+		} SPPM;
 
-			// --------------------------------------------------------------------------------
+		struct
+		{
+			long long NumLightPaths;		// Number of light subpaths generating the VPLs per iteration
+			double ClampDistanceScale;		// Distance clamping the geometry term relative to the radius of the scene bound
+			int NumSamples;					// Number of VPLs sampled with the light tree per vertex (0 : all VPLs)
+		} VPL;
 
-			#pragma region Renderer independent parameters
+		struct
+		{
+			double Error;					// Threshold of the error estimate of the interpolation
+			int NumRays;					// Number of rays to compute the irradiance of a record
+			double MaxRadiusScale;			// Upper bound of the radius of a record relative to the radius of the scene bound
+		} Cache;
 
-			if (vm.count("num-threads") > 0)
-			{
-				NumThreads = vm["num-threads"].as<int>();
-			}
-			else
-			{
-				#if NGI_DEBUG_MODE
-				NumThreads = 1;
-				#else
-				NumThreads = 0;
-				#endif
-			}
+		struct
+		{
+			double Alpha;					// Weight of the primal image in the screened Poisson reconstruction
+			int MaxIterations;				// Maximum number of iterations of the conjugate gradient solver
+		} GPT;
 
-			if (NumThreads <= 0)
-			{
-				NumThreads = static_cast<int>(std::thread::hardware_concurrency()) + NumThreads;
-			}
+		struct
+		{
+			int TileSize;					// Width and height of the tiles of pixels sharing the paths
+		} Reuse;
 
-			init.initialize(NumThreads);
-			NGI_LOG_INFO("Number of threads: " + std::to_string(NumThreads));
+		struct
+		{
+			long long NumBootstrapSamples;	// Number of samples to estimate the normalization factor and initial states
+			double LargeStepProb;			// Probability of the large step mutation
+			double Sigma;					// Standard deviation of the small step mutation
+			double ManifoldProb;			// Probability of the manifold perturbation in the small steps (memlt)
+		} MLT;
+	} Params;
 
-			GrainSize = vm["grain-size"].as<long long>();
-			NGI_LOG_INFO("Grain size: " + std::to_string(GrainSize));
+	mutable SDTree GuidingTree;				// Spatial-directional tree for path guiding
 
-			ProgressUpdateInterval = vm["progress-update-interval"].as<long long>();
-			NGI_LOG_INFO("Progress update interval: " + std::to_string(ProgressUpdateInterval));
+	// Reference to a vertex in the light vertex cache
+	struct LightVertexRef
+	{
+		int path;							// Index of the light subpath
+		int index;							// Index of the vertex in the light subpath
+	};
 
-			ProgressImageUpdateInterval = vm["progress-image-update-interval"].as<double>();
-			if (ProgressImageUpdateInterval > 0)
-			{
-				ProgressImageUpdateFormat = vm["progress-image-update-format"].as<std::string>();
-				NGI_LOG_INFO("Progress image update interval: " + std::to_string(ProgressImageUpdateInterval));
-				NGI_LOG_INFO("Progress image update format: " + ProgressImageUpdateFormat);
-			}
+	// Light vertex cache shared by the threads, rebuilt before each iteration
+	mutable struct
+	{
+		std::vector<HeapPath> subpaths;			// Light subpaths
+		std::vector<LightVertexRef> vertices;	// Vertices except for the vertices on the light sources
+	} LightVertexCache;
 
-			#pragma endregion
-		}
-		catch (boost::program_options::error& e)
+	// Hash grid of the cached light vertices for the vertex merging, rebuilt before each iteration
+	mutable struct
+	{
+		double radius;							// Merge radius of the current iteration
+		std::vector<LightVertexRef> vertices;	// Cached vertices on the non-specular surfaces
+		HashGrid grid;							// Grid indexing #vertices
+	} LightVertexGrid;
+
+	// Virtual point lights generated before each iteration.
+	// The quantities used in the gathering are stored in separate arrays.
+	mutable struct
+	{
+		std::vector<Path> subpaths;				// Light subpaths generating the VPLs
+		std::vector<const PathVertex*> vertices;	// Vertices of the VPLs in #subpaths
+		std::vector<glm::dvec3> positions;		// Positions of the VPLs
+		std::vector<glm::dvec3> wi;				// Directions to the previous vertices of the light subpaths (zero for the lights)
+		std::vector<glm::dvec3> powers;			// Throughputs of the light subpaths divided by the number of subpaths
+		std::vector<int> numVertices;			// Number of vertices of the light subpaths up to the VPLs
+		double maxG;							// Upper bound of the geometry term
+		LightTree tree;							// Light tree of the VPLs for --vpl-num-samples
+	} VirtualPointLights;
+
+	// Indirect irradiance at the diffuse surfaces populated during the rendering (ptcache)
+	mutable IrradianceCache IrradianceRecords;
+
+	// Forward differences of the pixel values estimated by the shifted paths (gpt)
+	struct GradientFilm
+	{
+		std::vector<glm::dvec3> dx;		// I[x+1, y] - I[x, y]
+		std::vector<glm::dvec3> dy;		// I[x, y+1] - I[x, y]
+	};
+
+	// Offset path of gpt following a base path with the shift mapping
+	struct OffsetPath
+	{
+		enum class State
 		{
-			std::cerr << "ERROR : " << e.what() << std::endl;
-			return false;
-		}
+			Replay,						// Sampled with the same random numbers as the base path
+			Reconnected,				// Reconnected to the current vertex of the base path
+			Merged,						// Sharing the remaining vertices and directions with the base path
+			Invalid,					// Shift failed
+		};
+
+		State state;
+		int pixelIndex;
+		int numNeighbors;				// Number of the neighboring pixels of the offset pixel
+		glm::dvec3* gradient;			// Gradient between the base and offset pixels
+		double sign;					// 1 if the offset pixel is the next pixel of the base pixel, -1 otherwise
+		glm::dvec3 throughput;			// f(y) |J| / p(x) of the subpaths up to the current vertices
+		double pdfRatio;				// p(y) |J| / p(x) of the subpaths up to the current vertices
+
+		// Current vertex (Replay), or the incident direction of the current vertex of the base path (Reconnected)
+		Ray ray;
+		Intersection isect;
+		const Primitive* prim;
+		int type;
+		SurfaceGeometry geom;
+		glm::dvec3 wi;
+	};
 
-		return true;
-	}
+	// Light sample shared by the base and offset paths of gpt
+	struct LightSample_GPT
+	{
+		const Primitive* L;
+		SurfaceGeometry geom;
+		double pdf;						// PDF in the area measure
+	};
 
-	void Render(const Scene& scene, std::vector<glm::dvec3>& film) const
+	// Path of a pixel in a tile of ptreuse.
+	// The first vertex x and the second vertex y are kept to connect x to the second vertices of the other paths,
+	// and y to the first vertices of the other paths, where the radiance reflected at y is evaluated from
+	// the incident radiance #A from the light sample (direction #ppL) and #B from the rest of the path (direction #wz).
+	struct ReusePath
 	{
-		#pragma region Random number generator
+		int pixelIndex;
+		glm::dvec3 L;					// Contribution of the path except for the reused indirect illumination
+		bool reusable;					// True if x samples the second vertices of the other paths
+		bool tail;						// True if y is reused by the other paths
+		glm::dvec3 throughput;			// Throughput up to x
+		const Primitive* prim;
+		int type;
+		SurfaceGeometry geom;
+		glm::dvec3 wi;
+		const Primitive* primY;
+		int typeY;
+		SurfaceGeometry geomY;
+		glm::dvec3 ppL, A;
+		glm::dvec3 wz, B;
+	};
 
-		Random initRng;
-		#if NGI_DEBUG_MODE
-		initRng.SetSeed(1008556906);
-		#else
-		initRng.SetSeed(static_cast<unsigned int>(std::time(nullptr)));
-		#endif
+	// Measured cost of the stages of the samples of pt and ptdirect
+	struct StageCost
+	{
+		double camera = 0;				// Time to sample the sensor and trace the primary ray
+		double branch = 0;				// Time to trace the rest of the path divided by the split factor
+		long long numSamples = 0;
+	};
 
-		#pragma endregion
+	// Split factor of the first scattering vertices of pt and ptdirect and its thread specific cost measurements
+	mutable struct
+	{
+		std::atomic<int> numSplits;
+		tbb::enumerable_thread_specific<StageCost> costs;
+	} FirstBounceSplit;
 
-		// --------------------------------------------------------------------------------
+	// True if the manifold connections of BDPT are enabled and the scene contains specular primitives
+	mutable bool ManifoldConnections_BDPT = false;
 
-		#pragma region Rendering
+	// Counter cycling the tiles of ptreuse
+	mutable std::atomic<long long> NextTile_PTReuse;
 
-		{
-			NGI_ENABLE_FP_EXCEPTION();
-			const auto start = std::chrono::high_resolution_clock::now();
+	// Thread specific gradient films of gpt and the last reconstructed image
+	mutable struct
+	{
+		std::atomic<long long> nextPixel;		// Counter cycling the pixels of the base paths
+		tbb::enumerable_thread_specific<GradientFilm> films;
+		std::vector<glm::dvec3> reconstruction;
+	} GradientDomain;
 
-			switch (Type)
-			{
-				case RendererType::PT:			{ RenderProcess(scene, initRng, film, std::bind(&Renderer::ProcessSample_PT,          this, std::placeholders::_1, std::placeholders::_2)); break; }
-				case RendererType::PTDirect:	{ RenderProcess(scene, initRng, film, std::bind(&Renderer::ProcessSample_PTDirect,    this, std::placeholders::_1, std::placeholders::_2)); break; }
-				case RendererType::LT:			{ RenderProcess(scene, initRng, film, std::bind(&Renderer::ProcessSample_LT,          this, std::placeholders::_1, std::placeholders::_2)); break; }
-				case RendererType::LTDirect:	{ RenderProcess(scene, initRng, film, std::bind(&Renderer::ProcessSample_LTDirect,    this, std::placeholders::_1, std::placeholders::_2)); break; }
-				case RendererType::BDPT:			{ RenderProcess(scene, initRng, film, std::bind(&Renderer::ProcessSample_BDPT,         this, std::placeholders::_1, std::placeholders::_2)); break; }
-				case RendererType::PTMNEE:		{ RenderProcess(scene, initRng, film, std::bind(&Renderer::ProcessSample_PTMNEE,      this, std::placeholders::_1, std::placeholders::_2)); break; }
-				default:						{ break; }
-			};
+	// Per-pixel state of SPPM
+	struct SPPMPixel
+	{
+		// Visible point of the current iteration
+		bool valid = false;
+		glm::dvec3 throughput;			// Throughput of the eye path up to the visible point
+		int numVertices;				// Number of vertices of the eye path including the visible point
+		const Primitive* prim = nullptr;
+		int type;
+		SurfaceGeometry geom;
+		glm::dvec3 wi;					// Direction to the previous vertex of the eye path
+
+		// Progressive estimate
+		double radius = 0;				// Radius R_i
+		double N = 0;					// Accumulated number of photons N_i
+		glm::dvec3 tau;					// Accumulated flux tau_i
+		glm::dvec3 direct;				// Sum of the emitted radiance reaching the eye through the eye paths
+
+		// Statistics of the current iteration updated by the photon pass
+		AtomicDouble M;					// Number of photons
+		AtomicDouble phi[3];			// Flux
+	};
 
-			const auto end = std::chrono::high_resolution_clock::now();
-			const double elapsed = (double)(std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()) / 1000.0;
-			NGI_LOG_INFO("Elapesed time: " + std::to_string(elapsed));
-			NGI_DISABLE_FP_EXCEPTION();
-		}
+	// Bootstrap samples of MLT
+	mutable struct
+	{
+		unsigned int seed;					// Seed of the primary samples of the first bootstrap sample
+		Distribution1D dist;				// Distribution of the bootstrap samples proportional to the luminance
+		double b;							// Normalization factor (average luminance)
+	} MLTBootstrap;
+
+	// Visible points of SPPM, one per pixel, and the hash grid indexing them, rebuilt before each iteration.
+	// The memory is bounded by the resolution as the photons are deposited to the pixels without being stored.
+	mutable struct
+	{
+		std::vector<SPPMPixel> pixels;
+		std::vector<int> visiblePixels;			// Pixels with the valid visible points, indexed by #grid
+		HashGrid grid;
+		long long numIterations = 0;
+	} VisiblePoints;
+
+	// Triangles of the surfaces forming the specular chains of SMS, sampled according to the area
+	mutable struct
+	{
+		std::vector<const Primitive*> prims;	// Primitive of the triangle
+		std::vector<int> faces;					// Face index of the triangle
+		Distribution1D dist;
+	} SMSCasters;
 
-		#pragma endregion
-	}
+public:
 
-	using ProcessSampleFuncType = std::function<void(const Scene&, Context&)>;
+	// State of a path being traced by the unidirectional renderers
+	struct PathState
+	{
+		glm::dvec3 throughput;
+		const Primitive* prim;
+		int type;
+		SurfaceGeometry geom;
+		glm::dvec3 wi;
+		int pixelIndex;
+		int numVertices;
+		int guidingVertex;				// Index of the last guiding vertex in the path (-1 : none)
+	};
 
-	void RenderProcess(const Scene& scene, Random& initRng, std::vector<glm::dvec3>& film, const ProcessSampleFuncType& processSampleFunc) const
+	// Per-strategy statistics of BDPT, indexed by StrategyIndex(s, t)
+	struct StrategyStats
 	{
-		#pragma region Thread local storage
+		long long numConnections = 0;		// # of evaluated strategies
+		long long numSkipped = 0;			// # of strategies skipped by the pruning
+		long long numOccluded = 0;			// # of connections failed due to the visibility
+		long long numZeroContributions = 0;	// # of unoccluded strategies with zero contribution (incl. endpoints not on emitters)
+		double time = 0;					// Time spent on connection and evaluation in seconds
+		glm::dvec3 contribution;			// Sum of the weighted contributions
+		double secondMoment = 0;			// Sum of the squared luminance of the contributions multiplied by the evaluation probability
+		double fourthMoment = 0;			// Sum of the squares of the terms of #secondMoment
+	};
 
-		tbb::enumerable_thread_specific<Context> contexts;
-		std::mutex contextInitMutex;
-		int currentThreadID = 0;
+	// Statistics of the current iteration for the strategy pruning
+	struct StrategyPruningStats
+	{
+		std::vector<StrategyStats> strategies;
+		double samplingTime = 0;			// Time spent on sampling subpaths in seconds
+		long long numSamples = 0;
+	};
 
-		#pragma endregion
+	// Efficiency-aware strategy pruning of BDPT
+	mutable struct
+	{
+		std::vector<double> probs;			// Evaluation probabilities indexed by StrategyIndex(s, t), 1 if out of range
+		tbb::enumerable_thread_specific<StrategyPruningStats> stats;
+	} StrategyPruning;
+
+	// Statistics of the optimal MIS accumulated over the iterations.
+	// The control variates Z of the strategies (s,t) are indexed by StrategyIndex(s, t) - StrategyIndex(0, 2).
+	// The moments of each pixel bin are stored in the order of the number of the samples,
+	// the matrix sum Z Z^T, and the vector sum Z Y (RGB values) with the contributions Y (see EvaluateOptimalMISContribution_BDPT).
+	struct OptimalMISStats
+	{
+		std::vector<double> moments;		// Moments of all pixel bins
+		glm::dvec2 luminances;				// Number of the samples and sum of the luminances of Y
+	};
 
-		// --------------------------------------------------------------------------------
+	// Optimal MIS of BDPT with the control variates learned per pixel bin
+	mutable struct
+	{
+		int binsX = 0;
+		int binsY = 0;
+		int numVariates = 0;				// Number of the control variates of a pixel bin
+		std::vector<glm::dvec3> alpha;		// Coefficients of the control variates of all pixel bins, empty if not learned
+		double maxLuminance = 0;			// Upper bound of the luminances of Y in the moments, 0 if not estimated yet
+		tbb::enumerable_thread_specific<OptimalMISStats> stats;
+	} OptimalMIS;
+
+	// Vertex recorded for learning the guiding distribution
+	struct GuidingVertex
+	{
+		glm::dvec3 p;					// Position
+		glm::dvec3 wo;					// Sampled direction
+		double pdf;						// PDF of #wo in the solid angle measure
+		glm::dvec3 throughput;			// Path throughput after sampling #wo
+		glm::dvec3 radiance;			// Estimated incident radiance from #wo
+		int parent;						// Index of the previous guiding vertex in the path (-1 : none)
+	};
 
-		#pragma region Render loop
+	// Primary sample space sampler of MLT [Kelemen et al. 2002].
+	// The sampler has the same interface as Random, so the paths are sampled by the same functions with the primary samples.
+	// The samples are split into streams so that the number of samples consumed by a stream does not shift the other streams.
+	// The mutations are applied lazily when the samples are requested, as in pbrt-v3.
+	struct MLTSampler
+	{
+		struct PrimarySample
+		{
+			double value = 0;
+			long long lastModification = -1;	// Iteration of the last modification (-1 : not initialized)
+			double valueBackup = 0;
+			long long lastModificationBackup = 0;
+		};
+
+		Random rng;
+		int numStreams = 1;
+		double largeStepProb = 0.3;
+		double sigma = 0.01;
+		std::vector<PrimarySample> X;
+		long long currentIteration = 0;
+		bool largeStep = true;
+		int fixedStream = -1;				// Stream kept unchanged by the small step (-1 : none)
+		long long lastLargeStepIteration = 0;
+		int streamIndex = 0;
+		int sampleIndex = 0;
+
+	public:
+
+		void Init(unsigned int seed, int numStreams, double largeStepProb, double sigma)
+		{
+			rng.SetSeed(seed);
+			this->numStreams = numStreams;
+			this->largeStepProb = largeStepProb;
+			this->sigma = sigma;
+			X.clear();
+			currentIteration = 0;
+			largeStep = true;
+			lastLargeStepIteration = 0;
+		}
 
-		std::atomic<long long> processedSamples(0);
-		long long progressImageCount = 0;
-		const auto renderStartTime = std::chrono::high_resolution_clock::now();
-		auto prevImageUpdateTime = renderStartTime;
-		const long long NumSamples = Params.RenderTime < 0 ? Params.NumSamples : GrainSize * 1000;
+		void StartIteration()
+		{
+			StartIteration(rng.Next() < largeStepProb, -1);
+		}
 
-		while (true)
+		void StartIteration(bool largeStep, int fixedStream)
 		{
-			#pragma region Helper function
+			currentIteration++;
+			this->largeStep = largeStep;
+			this->fixedStream = fixedStream;
+		}
 
-			const auto ProcessProgress = [&](Context& ctx) -> void
+		void StartStream(int index)
+		{
+			streamIndex = index;
+			sampleIndex = 0;
+		}
+
+		void Accept()
+		{
+			if (largeStep)
 			{
-				processedSamples += ctx.processedSamples;
-				ctx.processedSamples = 0;
+				lastLargeStepIteration = currentIteration;
+			}
+		}
 
-				if (Params.RenderTime < 0)
-				{
-					if (ctx.id == 0)
-					{
-						const double progress = (double)(processedSamples) / Params.NumSamples * 100.0;
-						NGI_LOG_INPLACE(boost::str(boost::format("Progress: %.1f%%") % progress));
-					}
-				}
-				else
+		void Reject()
+		{
+			for (auto& Xi : X)
+			{
+				if (Xi.lastModification == currentIteration)
 				{
-					if (ctx.id == 0)
-					{
-						const auto currentTime = std::chrono::high_resolution_clock::now();
-						const double elapsed = (double)(std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - renderStartTime).count()) / 1000.0;
-						const double progress = elapsed / Params.RenderTime * 100.0;
-						NGI_LOG_INPLACE(boost::str(boost::format("Progress: %.1f%% (%.1fs / %.1fs)") % progress % elapsed % Params.RenderTime));
-					}
+					Xi.value = Xi.valueBackup;
+					Xi.lastModification = Xi.lastModificationBackup;
 				}
-			};
+			}
+			currentIteration--;
+		}
 
-			#pragma endregion
+		double Next()
+		{
+			const int index = streamIndex + numStreams * sampleIndex++;
+			EnsureReady(index);
+			return X[index].value;
+		}
 
-			// --------------------------------------------------------------------------------
+		glm::dvec2 Next2D()
+		{
+			const double u1 = Next();
+			const double u2 = Next();
+			return glm::dvec2(u1, u2);
+		}
 
-			#pragma region Parallel loop
+	private:
 
-			std::atomic<bool> done(false);
-			tbb::parallel_for(tbb::blocked_range<long long>(0, NumSamples, GrainSize), [&](const tbb::blocked_range<long long>& range) -> void
+		void EnsureReady(int index)
+		{
+			if (index >= (int)(X.size()))
 			{
-				if (done)
-				{
-					return;
-				}
+				X.resize(index + 1);
+			}
+			auto& Xi = X[index];
 
-				// --------------------------------------------------------------------------------
+			// The sample not used since the last large step is reset to the state after the large step
+			if (Xi.lastModification < lastLargeStepIteration)
+			{
+				Xi.value = rng.Next();
+				Xi.lastModification = lastLargeStepIteration;
+			}
 
-				#pragma region Thread local storage
+			// The sample is mutated once per iteration
+			if (Xi.lastModification == currentIteration)
+			{
+				return;
+			}
 
-				auto& ctx = contexts.local();
-				if (ctx.id < 0)
-				{
-					std::unique_lock<std::mutex> lock(contextInitMutex);
-					ctx.id = currentThreadID++;
-					ctx.rng.SetSeed(initRng.NextUInt());
-					ctx.film.assign(Params.Width * Params.Height, glm::dvec3());
-				}
+			Xi.valueBackup = Xi.value;
+			Xi.lastModificationBackup = Xi.lastModification;
+			if (largeStep)
+			{
+				Xi.value = rng.Next();
+			}
+			else if (index % numStreams != fixedStream)
+			{
+				// The small steps skipped since the last modification are applied at once
+				const double normal = glm::sqrt(-2 * glm::log(1 - rng.Next())) * glm::cos(2 * Pi * rng.Next());
+				Xi.value += normal * sigma * glm::sqrt((double)(currentIteration - Xi.lastModification));
+				Xi.value = glm::min(Xi.value - glm::floor(Xi.value), std::nextafter(1.0, 0.0));
+			}
+			Xi.lastModification = currentIteration;
+		}
 
-				#pragma endregion
+	};
 
-				// --------------------------------------------------------------------------------
+	struct Context
+	{
+		int id = -1;						// Thread ID
+		Random rng;							// Thread-specific RNG
+		std::vector<glm::dvec3> film;		// Thread specific film
+		long long processedSamples = 0;		// Temp for counting # of processed samples
+		std::vector<PathState> splitPaths;	// Stack of split paths
+		std::vector<GuidingVertex> guidingVertices;	// Guiding vertices of the current sample
+		long long numShadowRays = 0;				// # of shadow rays traced for direct light sampling
+		long long numContributingShadowRays = 0;	// # of shadow rays with nonzero contribution
+		MemoryArena arena;							// Scratch memory of the current sample
 
-				#pragma region Sample loop
+		struct
+		{
+			Path subpathL, subpathE;		// BDPT subpaths
+			ConnectedPath path;				// View of the BDPT fullpath
+			Path seedPath, manifoldPath;	// Seed and converged paths of the manifold connections
+			ManifoldChainCache manifoldCache;						// Geometry terms of the specular chains in the subpaths
+			std::vector<char> visible;								// Visibility of the direct connections indexed by StrategyIndex(s, t) for the manifold connections
+			std::vector<StrategyStats> strategyStats;				// Per-strategy statistics
+			std::vector<double> pdfRatios;							// Ratios of the PDFs of the strategies for the optimal MIS
+			std::vector<double> controlVariates;					// Sums of the control variates and the contributions of the current sample in the pixel of the eye subpath for the optimal MIS
+			int controlVariatesPixel = -1;							// Pixel of #controlVariates (-1 : empty)
+			std::vector<double> pathControlVariates;				// Control variates and the contribution of a path in the other pixels for the optimal MIS
+			std::vector<std::vector<glm::vec3>> strategyFilms;		// Per-strategy weighted & unweighted images, allocated on first use
+		} BDPT;
 
-				for (long long sample = range.begin(); sample != range.end(); sample++)
-				{
-					// Process sample
-					processSampleFunc(scene, ctx);
+		struct
+		{
+			std::vector<glm::dvec3> radiances;	// Incident radiances of the strata of the current record
+			std::vector<double> dists;			// Distances to the hit points of the strata of the current record
+		} Cache;
 
-					// Report progress
-					ctx.processedSamples++;
-					if (ctx.processedSamples > ProgressUpdateInterval)
-					{
-						ProcessProgress(ctx);
-					}
-				}
+		struct
+		{
+			bool initialized = false;		// True if the chain is started from a bootstrap sample
+			MLTSampler sampler;				// Primary samples of the current state
+			glm::dvec3 L;					// Contribution of the current state
+			glm::dvec2 rasterPos;			// Raster position of the current state
+
+			// Connection from the light to the eye subpath of the current state (memlt).
+			// The chain is a part of the state, because the manifold perturbation can move it
+			// to a solution different from the one found from the primary samples.
+			Path chain;
+			Path proposedChain;
+			bool canonical = true;			// True if the chain is the one found from the primary samples
+		} MLT;
+	};
 
-				#pragma endregion
+public:
 
-				// --------------------------------------------------------------------------------
+	bool Load(const boost::program_options::variables_map& vm)
+	{
+		try
+		{
+			#pragma region Load parameters
 
-				#pragma region Check termination
+			Type = NGI_STRING_TO_ENUM(RendererType, vm["renderer"].as<std::string>());
+			Params.NumSamples = vm["num-samples"].as<long long>();
+			Params.RenderTime = vm["render-time"].as<double>();
+			Params.MaxNumVertices = vm["max-num-vertices"].as<int>();
+			Params.Width = vm["width"].as<int>();
+			Params.Height = vm["height"].as<int>();
 
-				if (Params.RenderTime > 0)
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Renderer specific parameters
+
+			if (Type == RendererType::BDPT || Type == RendererType::LVCBDPT)
+			{
+				Params.BDPTStrategy.Stats = vm["bdpt-strategy-stats"].as<bool>();
+				Params.BDPTStrategy.SubpathImageDir = vm["bdpt-subpath-image-dir"].as<std::string>();
+				Params.BDPTStrategy.SubpathImageMaxNumVertices = vm["bdpt-subpath-image-max-num-vertices"].as<int>();
+				Params.BDPTStrategy.Pruning = Type == RendererType::BDPT && vm["bdpt-pruning"].as<bool>();
+				Params.BDPTStrategy.PruningMinProb = vm["bdpt-pruning-min-prob"].as<double>();
+				Params.BDPTStrategy.OptimalMIS = Type == RendererType::BDPT && vm["bdpt-optimal-mis"].as<bool>();
+				Params.BDPTStrategy.OptimalMISBinSize = vm["bdpt-optimal-mis-bin-size"].as<int>();
+				Params.BDPTStrategy.OptimalMISMaxNumVertices = vm["bdpt-optimal-mis-max-num-vertices"].as<int>();
+				Params.BDPTStrategy.Manifold = Type == RendererType::BDPT && vm["bdpt-mnee"].as<bool>();
+				if (Type != RendererType::BDPT && vm["bdpt-pruning"].as<bool>())
 				{
-					const auto currentTime = std::chrono::high_resolution_clock::now();
-					const double elapsed = (double)(std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - renderStartTime).count()) / 1000.0;
-					if (elapsed > Params.RenderTime)
+					NGI_LOG_WARN("Strategy pruning is not supported by the renderer. Ignored.");
+				}
+				if (Type != RendererType::BDPT && vm["bdpt-optimal-mis"].as<bool>())
+				{
+					NGI_LOG_WARN("Optimal MIS is not supported by the renderer. Ignored.");
+				}
+				if (Type != RendererType::BDPT && vm["bdpt-mnee"].as<bool>())
+				{
+					NGI_LOG_WARN("Manifold connections are not supported by the renderer. Ignored.");
+				}
+				if (Params.BDPTStrategy.Manifold)
+				{
+					// The manifold strategies are not evaluated stochastically
+					if (Params.BDPTStrategy.Pruning)
 					{
-						done = true;
+						NGI_LOG_WARN("Strategy pruning is not supported with manifold connections. Disabled.");
+						Params.BDPTStrategy.Pruning = false;
+					}
+					if (Params.BDPTStrategy.OptimalMIS)
+					{
+						NGI_LOG_WARN("Optimal MIS is not supported with manifold connections. Disabled.");
+						Params.BDPTStrategy.OptimalMIS = false;
+					}
+					NGI_LOG_INFO("Manifold connections: enabled");
+				}
+				if (Params.BDPTStrategy.Pruning && Params.BDPTStrategy.OptimalMIS)
+				{
+					// Both techniques scale the PDFs in the MIS weights
+					NGI_LOG_WARN("Optimal MIS is not supported with strategy pruning. Disabled.");
+					Params.BDPTStrategy.OptimalMIS = false;
+				}
+				if (Params.BDPTStrategy.Pruning)
+				{
+					if (Params.BDPTStrategy.PruningMinProb <= 0 || Params.BDPTStrategy.PruningMinProb > 1)
+					{
+						NGI_LOG_ERROR("Invalid minimum evaluation probability: " + std::to_string(Params.BDPTStrategy.PruningMinProb));
+						return false;
 					}
+					NGI_LOG_INFO("Strategy pruning: enabled");
+					NGI_LOG_INFO("Minimum evaluation probability: " + std::to_string(Params.BDPTStrategy.PruningMinProb));
 				}
+				if (Params.BDPTStrategy.OptimalMIS)
+				{
+					if (Params.BDPTStrategy.OptimalMISBinSize <= 0)
+					{
+						NGI_LOG_ERROR("Invalid pixel bin size: " + std::to_string(Params.BDPTStrategy.OptimalMISBinSize));
+						return false;
+					}
+					if (Params.BDPTStrategy.OptimalMISMaxNumVertices < 2)
+					{
+						NGI_LOG_ERROR("Invalid maximum number of vertices: " + std::to_string(Params.BDPTStrategy.OptimalMISMaxNumVertices));
+						return false;
+					}
+					NGI_LOG_INFO("Optimal MIS: enabled");
+					NGI_LOG_INFO("Pixel bin size: " + std::to_string(Params.BDPTStrategy.OptimalMISBinSize));
+					NGI_LOG_INFO("Maximum number of vertices: " + std::to_string(Params.BDPTStrategy.OptimalMISMaxNumVertices));
+				}
+				if (Params.BDPTStrategy.Stats)
+				{
+					NGI_LOG_INFO("Per-strategy statistics: enabled");
+				}
+				if (!Params.BDPTStrategy.SubpathImageDir.empty())
+				{
+					NGI_LOG_INFO("Per-strategy image directory: " + Params.BDPTStrategy.SubpathImageDir);
+					NGI_LOG_INFO("Maximum number of vertices of per-strategy images: " + std::to_string(Params.BDPTStrategy.SubpathImageMaxNumVertices));
+				}
+			}
+			else
+			{
+				Params.BDPTStrategy.Stats = false;
+				Params.BDPTStrategy.Pruning = false;
+				Params.BDPTStrategy.OptimalMIS = false;
+				Params.BDPTStrategy.Manifold = false;
+			}
 
-				#pragma endregion
-			});
+			if (Type == RendererType::VCM)
+			{
+				Params.VCM.RadiusScale = vm["vcm-radius-scale"].as<double>();
+				Params.VCM.RadiusAlpha = vm["vcm-radius-alpha"].as<double>();
+				if (Params.VCM.RadiusScale <= 0)
+				{
+					NGI_LOG_ERROR("Invalid merge radius scale: " + std::to_string(Params.VCM.RadiusScale));
+					return false;
+				}
+				if (Params.VCM.RadiusAlpha <= 0 || Params.VCM.RadiusAlpha > 1)
+				{
+					NGI_LOG_ERROR("Invalid reduction rate of merge radius: " + std::to_string(Params.VCM.RadiusAlpha));
+					return false;
+				}
+				NGI_LOG_INFO("Merge radius scale: " + std::to_string(Params.VCM.RadiusScale));
+				NGI_LOG_INFO("Reduction rate of merge radius: " + std::to_string(Params.VCM.RadiusAlpha));
+			}
 
-			#pragma endregion
+			if (Type == RendererType::SPPM)
+			{
+				Params.SPPM.RadiusScale = vm["sppm-radius-scale"].as<double>();
+				Params.SPPM.Alpha = vm["sppm-alpha"].as<double>();
+				if (Params.SPPM.RadiusScale <= 0)
+				{
+					NGI_LOG_ERROR("Invalid radius scale: " + std::to_string(Params.SPPM.RadiusScale));
+					return false;
+				}
+				if (Params.SPPM.Alpha <= 0 || Params.SPPM.Alpha > 1)
+				{
+					NGI_LOG_ERROR("Invalid alpha: " + std::to_string(Params.SPPM.Alpha));
+					return false;
+				}
+				NGI_LOG_INFO("Initial radius scale: " + std::to_string(Params.SPPM.RadiusScale));
+				NGI_LOG_INFO("Alpha: " + std::to_string(Params.SPPM.Alpha));
+			}
 
-			// --------------------------------------------------------------------------------
+			if (Type == RendererType::PSSMLT || Type == RendererType::MMLT || Type == RendererType::MEMLT)
+			{
+				Params.MLT.NumBootstrapSamples = vm["mlt-num-bootstrap-samples"].as<long long>();
+				Params.MLT.LargeStepProb = vm["mlt-large-step-prob"].as<double>();
+				Params.MLT.Sigma = vm["mlt-sigma"].as<double>();
+				Params.MLT.ManifoldProb = vm["mlt-manifold-prob"].as<double>();
+				if (Params.MLT.NumBootstrapSamples <= 0)
+				{
+					NGI_LOG_ERROR("Invalid number of bootstrap samples: " + std::to_string(Params.MLT.NumBootstrapSamples));
+					return false;
+				}
+				if (Params.MLT.LargeStepProb < 0 || Params.MLT.LargeStepProb > 1)
+				{
+					NGI_LOG_ERROR("Invalid large step probability: " + std::to_string(Params.MLT.LargeStepProb));
+					return false;
+				}
+				if (Params.MLT.Sigma <= 0)
+				{
+					NGI_LOG_ERROR("Invalid standard deviation of small step: " + std::to_string(Params.MLT.Sigma));
+					return false;
+				}
+				if (Params.MLT.ManifoldProb < 0 || Params.MLT.ManifoldProb > 1)
+				{
+					NGI_LOG_ERROR("Invalid manifold perturbation probability: " + std::to_string(Params.MLT.ManifoldProb));
+					return false;
+				}
+				if ((Type == RendererType::MMLT || Type == RendererType::MEMLT) && Params.MaxNumVertices == -1)
+				{
+					// The path length is selected by a primary sample
+					NGI_LOG_ERROR("MMLT and MEMLT require the maximum number of vertices");
+					return false;
+				}
+				NGI_LOG_INFO("Number of bootstrap samples: " + std::to_string(Params.MLT.NumBootstrapSamples));
+				NGI_LOG_INFO("Large step probability: " + std::to_string(Params.MLT.LargeStepProb));
+				NGI_LOG_INFO("Standard deviation of small step: " + std::to_string(Params.MLT.Sigma));
+				if (Type == RendererType::MEMLT)
+				{
+					NGI_LOG_INFO("Manifold perturbation probability: " + std::to_string(Params.MLT.ManifoldProb));
+				}
+			}
 
-			#pragma region Add remaining processed samples
+			if (Type == RendererType::VPL)
+			{
+				Params.VPL.NumLightPaths = vm["vpl-num-light-paths"].as<long long>();
+				Params.VPL.ClampDistanceScale = vm["vpl-clamp-distance-scale"].as<double>();
+				Params.VPL.NumSamples = vm["vpl-num-samples"].as<int>();
+				if (Params.VPL.NumLightPaths <= 0)
+				{
+					NGI_LOG_ERROR("Invalid number of light paths: " + std::to_string(Params.VPL.NumLightPaths));
+					return false;
+				}
+				if (Params.VPL.ClampDistanceScale < 0)
+				{
+					NGI_LOG_ERROR("Invalid clamping distance: " + std::to_string(Params.VPL.ClampDistanceScale));
+					return false;
+				}
+				if (Params.VPL.NumSamples < 0)
+				{
+					NGI_LOG_ERROR("Invalid number of VPL samples: " + std::to_string(Params.VPL.NumSamples));
+					return false;
+				}
+				NGI_LOG_INFO("Number of light paths per iteration: " + std::to_string(Params.VPL.NumLightPaths));
+				NGI_LOG_INFO("Clamping distance scale: " + std::to_string(Params.VPL.ClampDistanceScale));
+				NGI_LOG_INFO("Number of VPL samples: " + std::to_string(Params.VPL.NumSamples));
+			}
 
-			for (auto& ctx : contexts)
+			if (Type == RendererType::PTCache)
 			{
-				ProcessProgress(ctx);
+				Params.Cache.Error = vm["cache-error"].as<double>();
+				Params.Cache.NumRays = vm["cache-num-rays"].as<int>();
+				Params.Cache.MaxRadiusScale = vm["cache-max-radius-scale"].as<double>();
+				if (Params.Cache.Error <= 0)
+				{
+					NGI_LOG_ERROR("Invalid error threshold: " + std::to_string(Params.Cache.Error));
+					return false;
+				}
+				if (Params.Cache.NumRays <= 0)
+				{
+					NGI_LOG_ERROR("Invalid number of rays: " + std::to_string(Params.Cache.NumRays));
+					return false;
+				}
+				if (Params.Cache.MaxRadiusScale <= 0)
+				{
+					NGI_LOG_ERROR("Invalid maximum radius: " + std::to_string(Params.Cache.MaxRadiusScale));
+					return false;
+				}
+				NGI_LOG_WARN("ptcache is biased due to the interpolation of the irradiance cache");
+				NGI_LOG_INFO("Error threshold: " + std::to_string(Params.Cache.Error));
+				NGI_LOG_INFO("Number of rays per record: " + std::to_string(Params.Cache.NumRays));
+				NGI_LOG_INFO("Maximum radius scale: " + std::to_string(Params.Cache.MaxRadiusScale));
 			}
 
-			#pragma endregion
+			if (Type == RendererType::GPT)
+			{
+				Params.GPT.Alpha = vm["gpt-alpha"].as<double>();
+				Params.GPT.MaxIterations = vm["gpt-max-iterations"].as<int>();
+				if (Params.GPT.Alpha <= 0)
+				{
+					NGI_LOG_ERROR("Invalid weight of the primal image: " + std::to_string(Params.GPT.Alpha));
+					return false;
+				}
+				if (Params.GPT.MaxIterations <= 0)
+				{
+					NGI_LOG_ERROR("Invalid number of iterations: " + std::to_string(Params.GPT.MaxIterations));
+					return false;
+				}
+				NGI_LOG_INFO("Weight of the primal image: " + std::to_string(Params.GPT.Alpha));
+				NGI_LOG_INFO("Maximum number of solver iterations: " + std::to_string(Params.GPT.MaxIterations));
+			}
 
-			// --------------------------------------------------------------------------------
+			if (Type == RendererType::PTReuse)
+			{
+				Params.Reuse.TileSize = vm["reuse-tile-size"].as<int>();
+				if (Params.Reuse.TileSize <= 0)
+				{
+					NGI_LOG_ERROR("Invalid tile size: " + std::to_string(Params.Reuse.TileSize));
+					return false;
+				}
+				NGI_LOG_INFO("Tile size: " + std::to_string(Params.Reuse.TileSize));
+			}
 
-			#pragma region Progress update of intermediate image
+			if (Type == RendererType::LVCBDPT)
+			{
+				Params.LVC.NumConnections = vm["lvc-num-connections"].as<int>();
+				NGI_LOG_INFO("Number of connections to light vertex cache: " + std::to_string(Params.LVC.NumConnections));
+			}
 
-			if (ProgressImageUpdateInterval > 0)
+			if (Type == RendererType::PTDirect)
 			{
-				const auto currentTime = std::chrono::high_resolution_clock::now();
-				const double elapsed = (double)(std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - prevImageUpdateTime).count()) / 1000.0;
-				if (elapsed > ProgressImageUpdateInterval)
+				Params.RIS.NumCandidates = vm["ris-num-candidates"].as<int>();
+				if (Params.RIS.NumCandidates < 1)
 				{
-					// Gather film data
-					film.assign(Params.Width * Params.Height, glm::dvec3());
-					contexts.combine_each([&](const Context& ctx)
-					{
-						std::transform(film.begin(), film.end(), ctx.film.begin(), film.begin(), std::plus<glm::dvec3>());
-					});
-					for (auto& v : film)
-					{
-						v *= (double)(Params.Width * Params.Height) / processedSamples;
-					}
+					NGI_LOG_ERROR("Invalid number of light candidates: " + std::to_string(Params.RIS.NumCandidates));
+					return false;
+				}
+				NGI_LOG_INFO("Number of light candidates: " + std::to_string(Params.RIS.NumCandidates));
+			}
 
-					// Output path
-					progressImageCount++;
-					std::string path;
-					{
-						namespace ct = ctemplate;
-						ct::TemplateDictionary dict("dict");
-						dict["count"] = boost::str(boost::format("%010d") % progressImageCount);
+			if (Type == RendererType::PTSMS)
+			{
+				Params.SMS.MaxTrials = vm["sms-max-trials"].as<int>();
+				Params.SMS.Glossy = vm["sms-glossy"].as<bool>();
+				if (Params.SMS.MaxTrials < 1)
+				{
+					NGI_LOG_ERROR("Invalid maximum number of trials: " + std::to_string(Params.SMS.MaxTrials));
+					return false;
+				}
+				NGI_LOG_INFO("Maximum number of trials: " + std::to_string(Params.SMS.MaxTrials));
+				if (Params.SMS.Glossy)
+				{
+					NGI_LOG_INFO("Glossy specular chains: enabled");
+				}
+			}
 
-						std::string output;
-						auto* tpl = ct::Template::StringToTemplate(ProgressImageUpdateFormat, ct::DO_NOT_STRIP);
-						if (!tpl->Expand(&output, &dict))
-						{
-							NGI_LOG_ERROR("Failed to expand template");
-							path = ProgressImageUpdateFormat;
-						}
-						else
-						{
-							path = output;
-						}
-					}
+			#pragma endregion
 
-					// Save image
-					{
-						NGI_LOG_INFO("Saving progress: ");
-						NGI_LOG_INDENTER();
-						SaveImage(path, film, Params.Width, Params.Height);
-					}
+			// --------------------------------------------------------------------------------
 
-					// Update time
-					prevImageUpdateTime = currentTime;
+			#pragma region First bounce splitting
+
+			Params.Split.Count = vm["split-count"].as<int>();
+			Params.Split.Depth = vm["split-depth"].as<int>();
+			Params.Split.MaxCount = vm["split-max-count"].as<int>();
+			if (Params.Split.Count != 1)
+			{
+				if (Type != RendererType::PT && Type != RendererType::PTDirect)
+				{
+					NGI_LOG_WARN("First bounce splitting is not supported by the renderer. Ignored.");
+					Params.Split.Count = 1;
+				}
+				else if (Params.Split.Count < 0 || Params.Split.Depth < 1 || Params.Split.MaxCount < 1)
+				{
+					NGI_LOG_ERROR("Invalid first bounce splitting: count " + std::to_string(Params.Split.Count) + ", depth " + std::to_string(Params.Split.Depth) + ", max count " + std::to_string(Params.Split.MaxCount));
+					return false;
+				}
+				else
+				{
+					NGI_LOG_INFO("Number of split paths: " + (Params.Split.Count == 0 ? "auto (up to " + std::to_string(Params.Split.MaxCount) + ")" : std::to_string(Params.Split.Count)));
+					NGI_LOG_INFO("Splitting depth: " + std::to_string(Params.Split.Depth));
 				}
 			}
 
@@ -407,55 +993,2958 @@ public:
 
 			// --------------------------------------------------------------------------------
 
-			#pragma region Exit condition
+			#pragma region Path guiding
 
-			if (Params.RenderTime < 0 || done)
+			Params.Guiding.Enabled = vm["guiding"].as<bool>();
+			if (Params.Guiding.Enabled)
 			{
-				break;
+				if (Type != RendererType::PT && Type != RendererType::PTDirect && Type != RendererType::PTMIS)
+				{
+					NGI_LOG_WARN("Path guiding is not supported by the renderer. Ignored.");
+					Params.Guiding.Enabled = false;
+				}
+				else
+				{
+					Params.Guiding.Fraction = vm["guiding-fraction"].as<double>();
+					Params.Guiding.SpatialThreshold = vm["guiding-spatial-threshold"].as<double>();
+					Params.Guiding.DirectionalThreshold = vm["guiding-directional-threshold"].as<double>();
+					Params.Guiding.MaxDirectionalDepth = 20;
+					NGI_LOG_INFO("Path guiding: enabled");
+					NGI_LOG_INFO("Guiding fraction: " + std::to_string(Params.Guiding.Fraction));
+					NGI_LOG_INFO("Guiding spatial threshold: " + std::to_string(Params.Guiding.SpatialThreshold));
+					NGI_LOG_INFO("Guiding directional threshold: " + std::to_string(Params.Guiding.DirectionalThreshold));
+				}
 			}
 
 			#pragma endregion
-		}
 
-		NGI_LOG_INFO("Progress: 100.0%");
-		NGI_LOG_INFO(boost::str(boost::format("# of samples: %d") % processedSamples));
+			// --------------------------------------------------------------------------------
 
-		#pragma endregion
+			#pragma region Russian roulette & splitting
 
-		// --------------------------------------------------------------------------------
+			// The renderers combining the strategies of BDPT use the fixed probability by default,
+			// since the throughput-based roulette makes the subpaths longer without reducing the cost of the connections
+			auto rrType = vm["rr-type"].as<std::string>();
+			if (rrType.empty())
+			{
+				const bool bidirectional = Type == RendererType::BDPT || Type == RendererType::LVCBDPT || Type == RendererType::VCM || Type == RendererType::MMLT;
+				rrType = bidirectional ? "fixed" : "throughput";
+			}
+			Params.RR.Type = NGI_STRING_TO_ENUM(RRType, rrType);
+			Params.RR.FixedProb = vm["rr-prob"].as<double>();
+			Params.RR.MinProb = vm["rr-min-prob"].as<double>();
+			Params.RR.MaxProb = vm["rr-max-prob"].as<double>();
+			Params.RR.MaxSplit = vm["rr-max-split"].as<int>();
+			NGI_LOG_INFO("Russian roulette: " + rrType);
+			if (Params.RR.Type == RRType::Fixed)
+			{
+				if (Params.RR.FixedProb <= 0 || Params.RR.FixedProb > 1)
+				{
+					NGI_LOG_ERROR("Invalid Russian roulette probability: " + std::to_string(Params.RR.FixedProb));
+					return false;
+				}
+				NGI_LOG_INFO("Russian roulette probability: " + std::to_string(Params.RR.FixedProb));
+			}
+			else
+			{
+				if (Params.RR.MinProb <= 0 || Params.RR.MinProb > Params.RR.MaxProb || Params.RR.MaxProb > 1)
+				{
+					NGI_LOG_ERROR("Invalid Russian roulette probability range: [" + std::to_string(Params.RR.MinProb) + ", " + std::to_string(Params.RR.MaxProb) + "]");
+					return false;
+				}
+				if (Params.RR.MaxSplit < 1)
+				{
+					NGI_LOG_ERROR("Invalid maximum number of splits: " + std::to_string(Params.RR.MaxSplit));
+					return false;
+				}
+				NGI_LOG_INFO("Russian roulette probability range: [" + std::to_string(Params.RR.MinProb) + ", " + std::to_string(Params.RR.MaxProb) + "]");
+				NGI_LOG_INFO("Maximum number of splits: " + std::to_string(Params.RR.MaxSplit));
+			}
 
-		#pragma region Gather film data
+			#pragma endregion
 
-		film.assign(Params.Width * Params.Height, glm::dvec3());
-		contexts.combine_each([&](const Context& ctx)
-		{
-			std::transform(film.begin(), film.end(), ctx.film.begin(), film.begin(), std::plus<glm::dvec3>());
-		});
-		for (auto& v : film)
-		{
-			v *= (double)(Params.Width * Params.Height) / processedSamples;
-		}
+			// --------------------------------------------------------------------------------
 
-		#pragma endregion
-	}
+			#pragma region Renderer independent parameters
 
-private:
+			if (vm.count("num-threads") > 0)
+			{
+				NumThreads = vm["num-threads"].as<int>();
+			}
+			else
+			{
+				#if NGI_DEBUG_MODE
+				NumThreads = 1;
+				#else
+				NumThreads = 0;
+				#endif
+			}
 
-	#pragma region Process sample
+			if (NumThreads <= 0)
+			{
+				NumThreads = static_cast<int>(std::thread::hardware_concurrency()) + NumThreads;
+			}
 
-	void ProcessSample_PT(const Scene& scene, Context& ctx) const
-	{
-		#pragma region Sample a sensor
+			init.initialize(NumThreads);
+			NGI_LOG_INFO("Number of threads: " + std::to_string(NumThreads));
 
-		const auto* E = scene.SampleEmitter(PrimitiveType::E, ctx.rng.Next());
-		const double pdfE = scene.EvaluateEmitterPDF(E);
-		assert(pdfE > 0);
+			GrainSize = vm["grain-size"].as<long long>();
+			NGI_LOG_INFO("Grain size: " + std::to_string(GrainSize));
 
-		#pragma endregion
+			ProgressUpdateInterval = vm["progress-update-interval"].as<long long>();
+			NGI_LOG_INFO("Progress update interval: " + std::to_string(ProgressUpdateInterval));
 
-		// --------------------------------------------------------------------------------
+			ProgressImageUpdateInterval = vm["progress-image-update-interval"].as<double>();
+			if (ProgressImageUpdateInterval > 0)
+			{
+				ProgressImageUpdateFormat = vm["progress-image-update-format"].as<std::string>();
+				NGI_LOG_INFO("Progress image update interval: " + std::to_string(ProgressImageUpdateInterval));
+				NGI_LOG_INFO("Progress image update format: " + ProgressImageUpdateFormat);
+			}
+
+			IterationNumSamples = vm["iteration-num-samples"].as<long long>();
+			if (IterationNumSamples <= 0)
+			{
+				IterationNumSamples = (long long)(Params.Width) * Params.Height;
+			}
+
+			#pragma endregion
+		}
+		catch (boost::program_options::error& e)
+		{
+			std::cerr << "ERROR : " << e.what() << std::endl;
+			return false;
+		}
+
+		return true;
+	}
+
+	bool Render(const Scene& scene, std::vector<glm::dvec3>& film) const
+	{
+		#pragma region Check sensor
+
+		// Visible points of SPPM are traced through the pixels, which needs the pinhole camera
+		if (Type == RendererType::SPPM && scene.Primitives[scene.SensorPrimitiveIndex]->Params.E.Type != EType::Pinhole)
+		{
+			NGI_LOG_ERROR("SPPM supports only the pinhole camera");
+			return false;
+		}
+
+		// The offset paths of GPT are traced through the neighboring pixels
+		if (Type == RendererType::GPT && scene.Primitives[scene.SensorPrimitiveIndex]->Params.E.Type != EType::Pinhole)
+		{
+			NGI_LOG_ERROR("GPT supports only the pinhole camera");
+			return false;
+		}
+
+		// The paths of a tile are traced through the pixels
+		if (Type == RendererType::PTReuse && scene.Primitives[scene.SensorPrimitiveIndex]->Params.E.Type != EType::Pinhole)
+		{
+			NGI_LOG_ERROR("ptreuse supports only the pinhole camera");
+			return false;
+		}
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Random number generator
+
+		Random initRng;
+		#if NGI_DEBUG_MODE
+		initRng.SetSeed(1008556906);
+		#else
+		initRng.SetSeed(static_cast<unsigned int>(std::time(nullptr)));
+		#endif
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Rendering
+
+		{
+			NGI_ENABLE_FP_EXCEPTION();
+			const auto start = std::chrono::high_resolution_clock::now();
+
+			IterationFuncs iterationFuncs;
+			if (Params.Guiding.Enabled)
+			{
+				GuidingTree.Init(scene.Bound);
+				iterationFuncs.Finalize = std::bind(&Renderer::FinalizeIteration_Guiding, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3);
+				iterationFuncs.DoubleNumSamples = true;
+			}
+			if (Params.BDPTStrategy.Pruning)
+			{
+				StrategyPruning.probs.clear();
+				iterationFuncs.Finalize = std::bind(&Renderer::FinalizeIteration_BDPTPruning, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3);
+				iterationFuncs.DoubleNumSamples = true;
+			}
+			ManifoldConnections_BDPT = Params.BDPTStrategy.Manifold && std::any_of(scene.Primitives.begin(), scene.Primitives.end(), [](const std::unique_ptr<Primitive>& prim)
+			{
+				return (prim->Type & PrimitiveType::S) > 0;
+			});
+			if (Params.BDPTStrategy.Manifold && !ManifoldConnections_BDPT)
+			{
+				NGI_LOG_INFO("No specular primitive in the scene. Manifold connections are disabled.");
+			}
+			if (Params.BDPTStrategy.OptimalMIS)
+			{
+				OptimalMIS.binsX = (Params.Width + Params.BDPTStrategy.OptimalMISBinSize - 1) / Params.BDPTStrategy.OptimalMISBinSize;
+				OptimalMIS.binsY = (Params.Height + Params.BDPTStrategy.OptimalMISBinSize - 1) / Params.BDPTStrategy.OptimalMISBinSize;
+				OptimalMIS.numVariates = StrategyIndex(0, Params.BDPTStrategy.OptimalMISMaxNumVertices + 1) - StrategyIndex(0, 2);
+				OptimalMIS.alpha.clear();
+				OptimalMIS.maxLuminance = 0;
+				OptimalMIS.stats.clear();
+				iterationFuncs.Finalize = std::bind(&Renderer::FinalizeIteration_BDPTOptimalMIS, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3);
+				iterationFuncs.DoubleNumSamples = true;
+			}
+			if (Type == RendererType::PTSMS)
+			{
+				PrepareCasters_SMS(scene);
+			}
+			if (Type == RendererType::LVCBDPT)
+			{
+				iterationFuncs.Prepare = std::bind(&Renderer::PrepareIteration_LVCBDPT, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3);
+			}
+			if (Type == RendererType::VCM)
+			{
+				iterationFuncs.Prepare = std::bind(&Renderer::PrepareIteration_VCM, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3);
+			}
+			if (Type == RendererType::VPL)
+			{
+				iterationFuncs.Prepare = std::bind(&Renderer::PrepareIteration_VPL, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3);
+			}
+			if (Type == RendererType::PTCache)
+			{
+				const double sceneRadius = glm::length(scene.Bound.max - scene.Bound.min) * 0.5;
+				IrradianceRecords.Init(Params.Cache.Error, Params.Cache.MaxRadiusScale * sceneRadius, 1 << 20);
+			}
+			if (Type == RendererType::GPT)
+			{
+				GradientDomain.nextPixel = 0;
+				GradientDomain.films.clear();
+				GradientDomain.reconstruction.clear();
+				iterationFuncs.ResolveFilm = std::bind(&Renderer::ResolveFilm_GPT, this, std::placeholders::_1, std::placeholders::_2);
+			}
+			if (Type == RendererType::PTReuse)
+			{
+				NextTile_PTReuse = 0;
+			}
+			FirstBounceSplit.numSplits = Params.Split.Count == 0 ? 1 : Params.Split.Count;
+			FirstBounceSplit.costs.clear();
+			if (Params.Split.Count == 0)
+			{
+				// The split factor is updated after each iteration, followed by the existing finalization if any
+				const auto finalize = iterationFuncs.Finalize;
+				iterationFuncs.Finalize = [this, finalize](const Scene& scene, Random& rng, long long iteration) -> void
+				{
+					FinalizeIteration_Split(scene, rng, iteration);
+					if (finalize)
+					{
+						finalize(scene, rng, iteration);
+					}
+				};
+			}
+			if (Type == RendererType::SPPM)
+			{
+				VisiblePoints.pixels.clear();
+				VisiblePoints.numIterations = 0;
+				iterationFuncs.Prepare = std::bind(&Renderer::PrepareIteration_SPPM, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3);
+				iterationFuncs.ResolveFilm = std::bind(&Renderer::ResolveFilm_SPPM, this, std::placeholders::_1, std::placeholders::_2);
+			}
+			if (Type == RendererType::PSSMLT || Type == RendererType::MMLT || Type == RendererType::MEMLT)
+			{
+				Bootstrap_MLT(scene, initRng);
+				iterationFuncs.ResolveFilm = std::bind(&Renderer::ResolveFilm_MLT, this, std::placeholders::_1, std::placeholders::_2);
+			}
+
+			switch (Type)
+			{
+				case RendererType::PT:			{ RenderProcess(scene, initRng, film, std::bind(&Renderer::ProcessSample_PT,          this, std::placeholders::_1, std::placeholders::_2), iterationFuncs); break; }
+				case RendererType::PTDirect:	{ RenderProcess(scene, initRng, film, std::bind(&Renderer::ProcessSample_PTDirect,    this, std::placeholders::_1, std::placeholders::_2), iterationFuncs); break; }
+				case RendererType::LT:			{ RenderProcess(scene, initRng, film, std::bind(&Renderer::ProcessSample_LT,          this, std::placeholders::_1, std::placeholders::_2), iterationFuncs); break; }
+				case RendererType::LTDirect:	{ RenderProcess(scene, initRng, film, std::bind(&Renderer::ProcessSample_LTDirect,    this, std::placeholders::_1, std::placeholders::_2), iterationFuncs); break; }
+				case RendererType::BDPT:			{ RenderProcess(scene, initRng, film, std::bind(&Renderer::ProcessSample_BDPT,         this, std::placeholders::_1, std::placeholders::_2), iterationFuncs); break; }
+				case RendererType::PTMNEE:		{ RenderProcess(scene, initRng, film, std::bind(&Renderer::ProcessSample_PTMNEE,      this, std::placeholders::_1, std::placeholders::_2), iterationFuncs); break; }
+				case RendererType::PTMIS:		{ RenderProcess(scene, initRng, film, std::bind(&Renderer::ProcessSample_PTMIS,       this, std::placeholders::_1, std::placeholders::_2), iterationFuncs); break; }
+				case RendererType::LVCBDPT:		{ RenderProcess(scene, initRng, film, std::bind(&Renderer::ProcessSample_LVCBDPT,     this, std::placeholders::_1, std::placeholders::_2), iterationFuncs); break; }
+				case RendererType::PTSMS:		{ RenderProcess(scene, initRng, film, std::bind(&Renderer::ProcessSample_PTSMS,       this, std::placeholders::_1, std::placeholders::_2), iterationFuncs); break; }
+				case RendererType::VCM:			{ RenderProcess(scene, initRng, film, std::bind(&Renderer::ProcessSample_VCM,         this, std::placeholders::_1, std::placeholders::_2), iterationFuncs); break; }
+				case RendererType::SPPM:		{ RenderProcess(scene, initRng, film, std::bind(&Renderer::ProcessSample_SPPM,        this, std::placeholders::_1, std::placeholders::_2), iterationFuncs); break; }
+				case RendererType::PSSMLT:		{ RenderProcess(scene, initRng, film, std::bind(&Renderer::ProcessSample_MLT,         this, std::placeholders::_1, std::placeholders::_2), iterationFuncs); break; }
+				case RendererType::MMLT:		{ RenderProcess(scene, initRng, film, std::bind(&Renderer::ProcessSample_MLT,         this, std::placeholders::_1, std::placeholders::_2), iterationFuncs); break; }
+				case RendererType::MEMLT:		{ RenderProcess(scene, initRng, film, std::bind(&Renderer::ProcessSample_MLT,         this, std::placeholders::_1, std::placeholders::_2), iterationFuncs); break; }
+				case RendererType::VPL:			{ RenderProcess(scene, initRng, film, std::bind(&Renderer::ProcessSample_VPL,         this, std::placeholders::_1, std::placeholders::_2), iterationFuncs); break; }
+				case RendererType::PTCache:		{ RenderProcess(scene, initRng, film, std::bind(&Renderer::ProcessSample_PTCache,     this, std::placeholders::_1, std::placeholders::_2), iterationFuncs); break; }
+				case RendererType::GPT:			{ RenderProcess(scene, initRng, film, std::bind(&Renderer::ProcessSample_GPT,         this, std::placeholders::_1, std::placeholders::_2), iterationFuncs); break; }
+				case RendererType::PTReuse:		{ RenderProcess(scene, initRng, film, std::bind(&Renderer::ProcessSample_PTReuse,     this, std::placeholders::_1, std::placeholders::_2), iterationFuncs); break; }
+				default:						{ break; }
+			};
+
+			if (Type == RendererType::PTCache)
+			{
+				NGI_LOG_INFO("Number of irradiance cache records: " + std::to_string(IrradianceRecords.NumRecords()));
+			}
+			if (Params.Split.Count == 0)
+			{
+				NGI_LOG_INFO("Final number of split paths: " + std::to_string(FirstBounceSplit.numSplits));
+			}
+
+			const auto end = std::chrono::high_resolution_clock::now();
+			const double elapsed = (double)(std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()) / 1000.0;
+			NGI_LOG_INFO("Elapesed time: " + std::to_string(elapsed));
+			NGI_DISABLE_FP_EXCEPTION();
+		}
+
+		#pragma endregion
+
+		return true;
+	}
+
+	using ProcessSampleFuncType = std::function<void(const Scene&, Context&)>;
+	using ProcessIterationFuncType = std::function<void(const Scene&, Random&, long long)>;
+	using ResolveFilmFuncType = std::function<void(std::vector<glm::dvec3>&, long long)>;
+
+	// Functions for iterative techniques.
+	// If any function is specified, samples are processed in iterations of IterationNumSamples samples.
+	struct IterationFuncs
+	{
+		ProcessIterationFuncType Prepare;		// Called before each iteration
+		ProcessIterationFuncType Finalize;		// Called after each iteration except for the last one
+		bool DoubleNumSamples = false;			// Double the number of samples every iteration
+		ResolveFilmFuncType ResolveFilm;		// Overwrites the gathered film with the estimate of the technique (if specified)
+	};
+
+	void RenderProcess(const Scene& scene, Random& initRng, std::vector<glm::dvec3>& film, const ProcessSampleFuncType& processSampleFunc, const IterationFuncs& iterationFuncs) const
+	{
+		#pragma region Thread local storage
+
+		tbb::enumerable_thread_specific<Context> contexts;
+		std::mutex contextInitMutex;
+		int currentThreadID = 0;
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Render loop
+
+		std::atomic<long long> processedSamples(0);
+		long long progressImageCount = 0;
+		const auto renderStartTime = std::chrono::high_resolution_clock::now();
+		auto prevImageUpdateTime = renderStartTime;
+		long long iteration = 0;
+		const bool iterative = iterationFuncs.Prepare || iterationFuncs.Finalize;
+		long long iterationNumSamples = iterative ? IterationNumSamples : Params.RenderTime < 0 ? Params.NumSamples : GrainSize * 1000;
+
+		while (true)
+		{
+			const long long NumSamples = Params.RenderTime < 0 ? std::min(iterationNumSamples, Params.NumSamples - processedSamples) : iterationNumSamples;
+			if (iterationFuncs.Prepare)
+			{
+				iterationFuncs.Prepare(scene, initRng, iteration);
+			}
+
+			#pragma region Helper function
+
+			const auto ProcessProgress = [&](Context& ctx) -> void
+			{
+				processedSamples += ctx.processedSamples;
+				ctx.processedSamples = 0;
+
+				if (Params.RenderTime < 0)
+				{
+					if (ctx.id == 0)
+					{
+						const double progress = (double)(processedSamples) / Params.NumSamples * 100.0;
+						NGI_LOG_INPLACE(boost::str(boost::format("Progress: %.1f%%") % progress));
+					}
+				}
+				else
+				{
+					if (ctx.id == 0)
+					{
+						const auto currentTime = std::chrono::high_resolution_clock::now();
+						const double elapsed = (double)(std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - renderStartTime).count()) / 1000.0;
+						const double progress = elapsed / Params.RenderTime * 100.0;
+						NGI_LOG_INPLACE(boost::str(boost::format("Progress: %.1f%% (%.1fs / %.1fs)") % progress % elapsed % Params.RenderTime));
+					}
+				}
+			};
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Parallel loop
+
+			std::atomic<bool> done(false);
+			tbb::parallel_for(tbb::blocked_range<long long>(0, NumSamples, GrainSize), [&](const tbb::blocked_range<long long>& range) -> void
+			{
+				if (done)
+				{
+					return;
+				}
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Thread local storage
+
+				auto& ctx = contexts.local();
+				if (ctx.id < 0)
+				{
+					std::unique_lock<std::mutex> lock(contextInitMutex);
+					ctx.id = currentThreadID++;
+					ctx.rng.SetSeed(initRng.NextUInt());
+					ctx.film.assign(Params.Width * Params.Height, glm::dvec3());
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Sample loop
+
+				for (long long sample = range.begin(); sample != range.end(); sample++)
+				{
+					// Process sample
+					ctx.arena.Reset();
+					processSampleFunc(scene, ctx);
+
+					// Report progress
+					ctx.processedSamples++;
+					if (ctx.processedSamples > ProgressUpdateInterval)
+					{
+						ProcessProgress(ctx);
+					}
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Check termination
+
+				if (Params.RenderTime > 0)
+				{
+					const auto currentTime = std::chrono::high_resolution_clock::now();
+					const double elapsed = (double)(std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - renderStartTime).count()) / 1000.0;
+					if (elapsed > Params.RenderTime)
+					{
+						done = true;
+					}
+				}
+
+				#pragma endregion
+			});
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Add remaining processed samples
+
+			for (auto& ctx : contexts)
+			{
+				ProcessProgress(ctx);
+			}
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Progress update of intermediate image
+
+			if (ProgressImageUpdateInterval > 0)
+			{
+				const auto currentTime = std::chrono::high_resolution_clock::now();
+				const double elapsed = (double)(std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - prevImageUpdateTime).count()) / 1000.0;
+				if (elapsed > ProgressImageUpdateInterval)
+				{
+					// Gather film data
+					film.assign(Params.Width * Params.Height, glm::dvec3());
+					contexts.combine_each([&](const Context& ctx)
+					{
+						std::transform(film.begin(), film.end(), ctx.film.begin(), film.begin(), std::plus<glm::dvec3>());
+					});
+					for (auto& v : film)
+					{
+						v *= (double)(Params.Width * Params.Height) / processedSamples;
+					}
+					if (iterationFuncs.ResolveFilm)
+					{
+						iterationFuncs.ResolveFilm(film, processedSamples);
+					}
+
+					// Output path
+					progressImageCount++;
+					std::string path;
+					{
+						namespace ct = ctemplate;
+						ct::TemplateDictionary dict("dict");
+						dict["count"] = boost::str(boost::format("%010d") % progressImageCount);
+
+						std::string output;
+						auto* tpl = ct::Template::StringToTemplate(ProgressImageUpdateFormat, ct::DO_NOT_STRIP);
+						if (!tpl->Expand(&output, &dict))
+						{
+							NGI_LOG_ERROR("Failed to expand template");
+							path = ProgressImageUpdateFormat;
+						}
+						else
+						{
+							path = output;
+						}
+					}
+
+					// Save image
+					{
+						NGI_LOG_INFO("Saving progress: ");
+						NGI_LOG_INDENTER();
+						SaveImage(path, film, Params.Width, Params.Height);
+					}
+
+					// Update time
+					prevImageUpdateTime = currentTime;
+				}
+			}
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Exit condition
+
+			if ((Params.RenderTime < 0 && processedSamples >= Params.NumSamples) || done)
+			{
+				break;
+			}
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Next iteration
+
+			if (iterationFuncs.Finalize)
+			{
+				iterationFuncs.Finalize(scene, initRng, iteration);
+			}
+			if (iterationFuncs.DoubleNumSamples)
+			{
+				iterationNumSamples *= 2;
+			}
+			iteration++;
+
+			#pragma endregion
+		}
+
+		NGI_LOG_INFO("Progress: 100.0%");
+		NGI_LOG_INFO(boost::str(boost::format("# of samples: %d") % processedSamples));
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Gather film data
+
+		film.assign(Params.Width * Params.Height, glm::dvec3());
+		contexts.combine_each([&](const Context& ctx)
+		{
+			std::transform(film.begin(), film.end(), ctx.film.begin(), film.begin(), std::plus<glm::dvec3>());
+		});
+		for (auto& v : film)
+		{
+			v *= (double)(Params.Width * Params.Height) / processedSamples;
+		}
+		if (iterationFuncs.ResolveFilm)
+		{
+			iterationFuncs.ResolveFilm(film, processedSamples);
+		}
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Statistics
+
+		long long numShadowRays = 0;
+		long long numContributingShadowRays = 0;
+		contexts.combine_each([&](const Context& ctx)
+		{
+			numShadowRays += ctx.numShadowRays;
+			numContributingShadowRays += ctx.numContributingShadowRays;
+		});
+		long long numArenaAllocations = 0;
+		size_t arenaPeakUsedBytes = 0;
+		contexts.combine_each([&](const Context& ctx)
+		{
+			numArenaAllocations += ctx.arena.NumAllocations();
+			arenaPeakUsedBytes = glm::max(arenaPeakUsedBytes, ctx.arena.PeakUsedBytes());
+		});
+		if (arenaPeakUsedBytes > 0)
+		{
+			NGI_LOG_INFO(boost::str(boost::format("# of scratch memory allocations: %d (%.3e per sample)") % numArenaAllocations % ((double)(numArenaAllocations) / processedSamples)));
+			NGI_LOG_INFO(boost::str(boost::format("Peak scratch memory per sample: %d bytes") % arenaPeakUsedBytes));
+		}
+		if (numShadowRays > 0)
+		{
+			NGI_LOG_INFO(boost::str(boost::format("# of shadow rays: %d (%.3f per sample)") % numShadowRays % ((double)(numShadowRays) / processedSamples)));
+			NGI_LOG_INFO(boost::str(boost::format("# of shadow rays per nonzero contribution: %.3f") % (numContributingShadowRays > 0 ? (double)(numShadowRays) / numContributingShadowRays : 0.0)));
+		}
+		if (Type == RendererType::BDPT || Type == RendererType::LVCBDPT)
+		{
+			ReportStrategies_BDPT(contexts, processedSamples);
+		}
+
+		#pragma endregion
+	}
+
+private:
+
+	#pragma region Process sample
+
+	void ProcessSample_PT(const Scene& scene, Context& ctx) const
+	{
+		#pragma region Sample a sensor
+
+		const auto* E = scene.SampleEmitter(PrimitiveType::E, ctx.rng.Next());
+		const double pdfE = scene.EvaluateEmitterPDF(E);
+		assert(pdfE > 0);
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Sample a position on the sensor
+
+		SurfaceGeometry geomE;
+		E->SamplePosition(ctx.rng.Next2D(), geomE);
+		const double pdfPE = E->EvaluatePositionPDF(geomE, true);
+		assert(pdfPE > 0);
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Temporary variables
+
+		// Stack of paths to be processed (more than one path with splitting)
+		auto& paths = ctx.splitPaths;
+		paths.clear();
+		paths.push_back({ E->EvaluatePosition(geomE, true) / pdfPE / pdfE, E, PrimitiveType::E, geomE, glm::dvec3(), -1, 1, -1 });
+		glm::dvec3 referenceThroughput;
+
+		// Split factor at the first scattering vertices and the time stamps of the stages
+		const int numSplits = FirstBounceSplit.numSplits;
+		const bool measureCost = Params.Split.Count == 0;
+		std::chrono::high_resolution_clock::time_point startTime, cameraTime;
+		bool cameraStageMeasured = false;
+		if (measureCost)
+		{
+			startTime = std::chrono::high_resolution_clock::now();
+		}
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		while (!paths.empty())
+		{
+			#pragma region Pop a path
+
+			auto throughput = paths.back().throughput;
+			const auto* prim = paths.back().prim;
+			int type = paths.back().type;
+			auto geom = paths.back().geom;
+			auto wi = paths.back().wi;
+			int pixelIndex = paths.back().pixelIndex;
+			int numVertices = paths.back().numVertices;
+			int guidingVertex = paths.back().guidingVertex;
+			paths.pop_back();
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			while (true)
+			{
+				if (Params.MaxNumVertices != -1 && numVertices >= Params.MaxNumVertices)
+				{
+					break;
+				}
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Sample direction
+
+				const auto* dtree = GuidingDistribution(type, geom);
+				glm::dvec3 wo;
+				SampleGuidedDirection(ctx, dtree, prim, type, geom, wi, wo);
+				const double pdfD = EvaluateGuidedDirectionPDF(dtree, prim, type, geom, wi, wo, true);
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Calculate pixel index for initial vertex
+
+				if (type == PrimitiveType::E)
+				{
+					#pragma region Calculate raster position
+
+					glm::dvec2 rasterPos;
+					if (!prim->RasterPosition(wo, geom, rasterPos))
+					{
+						break;
+					}
+
+					#pragma endregion
+
+					// --------------------------------------------------------------------------------
+
+					#pragma region Pixel position
+
+					pixelIndex = PixelIndex(rasterPos, Params.Width, Params.Height);
+
+					#pragma endregion
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Evaluate direction
+
+				const auto fs = prim->EvaluateDirection(geom, type, wi, wo, TransportDirection::EL, true);
+				if (fs == glm::dvec3())
+				{
+					break;
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Update throughput
+
+				assert(pdfD > 0);
+				throughput *= fs / pdfD;
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Record guiding vertex
+
+				if (Params.Guiding.Enabled && (type & (PrimitiveType::D | PrimitiveType::G)) > 0)
+				{
+					ctx.guidingVertices.push_back({ geom.p, wo, pdfD * glm::abs(glm::dot(geom.sn, wo)), throughput, glm::dvec3(), guidingVertex });
+					guidingVertex = (int)(ctx.guidingVertices.size()) - 1;
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Intersection
+
+				// Setup next ray
+				Ray ray = { geom.p, wo };
+
+				// Intersection query
+				Intersection isect;
+				if (!scene.Intersect(ray, isect))
+				{
+					break;
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Handle hit with light source
+
+				if ((isect.Prim->Type & PrimitiveType::L) > 0)
+				{
+					const auto C =
+						throughput
+						* isect.Prim->EvaluateDirection(isect.geom, PrimitiveType::L, glm::dvec3(), -ray.d, TransportDirection::EL, false)
+						* isect.Prim->EvaluatePosition(isect.geom, false);
+
+					// Accumulate to film
+					ctx.film[pixelIndex] += C;
+					if (Params.Guiding.Enabled)
+					{
+						AccumulateGuidingRadiance(ctx, guidingVertex, C);
+					}
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Path termination
+
+				if (numVertices == 1)
+				{
+					referenceThroughput = throughput;
+					if (measureCost)
+					{
+						cameraTime = std::chrono::high_resolution_clock::now();
+						cameraStageMeasured = true;
+					}
+				}
+
+				// The weights of the split paths are excluded from the throughput compared with the reference
+				const double rrProb = Params.RR.ContinuationProb(throughput * SplitScale_FirstBounce(numSplits, numVertices), referenceThroughput, true);
+				int numContinuations = Params.RR.Sample(rrProb, ctx.rng.Next());
+				if (numContinuations == 0)
+				{
+					break;
+				}
+				throughput /= rrProb;
+
+				// Split the path at the first scattering vertices
+				if (numVertices <= Params.Split.Depth && numSplits > 1)
+				{
+					numContinuations *= numSplits;
+					throughput /= (double)(numSplits);
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Update information
+
+				geom = isect.geom;
+				prim = isect.Prim;
+				type = isect.Prim->Type & ~PrimitiveType::Emitter;
+				wi = -ray.d;
+				numVertices++;
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Path splitting
+
+				for (int i = 1; i < numContinuations; i++)
+				{
+					paths.push_back({ throughput, prim, type, geom, wi, pixelIndex, numVertices, guidingVertex });
+				}
+
+				#pragma endregion
+			}
+		}
+
+		#pragma region Record cost of the stages
+
+		if (measureCost)
+		{
+			RecordStageCost_FirstBounce(startTime, cameraStageMeasured ? cameraTime : std::chrono::high_resolution_clock::now(), numSplits);
+		}
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Record guiding vertices
+
+		if (Params.Guiding.Enabled)
+		{
+			RecordGuidingVertices(ctx);
+		}
+
+		#pragma endregion
+	}
+
+	void ProcessSample_PTDirect(const Scene& scene, Context& ctx) const
+	{
+		#pragma region Sample a sensor
+
+		const auto* E = scene.SampleEmitter(PrimitiveType::E, ctx.rng.Next());
+		const double pdfE = scene.EvaluateEmitterPDF(E);
+		assert(pdfE > 0);
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Sample a position on the sensor
+
+		SurfaceGeometry geomE;
+		E->SamplePosition(ctx.rng.Next2D(), geomE);
+		const double pdfPE = E->EvaluatePositionPDF(geomE, true);
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Temporary variables
+
+		// Stack of paths to be processed (more than one path with splitting)
+		auto& paths = ctx.splitPaths;
+		paths.clear();
+		paths.push_back({ E->EvaluatePosition(geomE, true) / pdfPE / pdfE, E, PrimitiveType::E, geomE, glm::dvec3(), -1, 1, -1 });
+		glm::dvec3 referenceThroughput;
+
+		// Split factor at the first scattering vertices and the time stamps of the stages
+		const int numSplits = FirstBounceSplit.numSplits;
+		const bool measureCost = Params.Split.Count == 0;
+		std::chrono::high_resolution_clock::time_point startTime, cameraTime;
+		bool cameraStageMeasured = false;
+		if (measureCost)
+		{
+			startTime = std::chrono::high_resolution_clock::now();
+		}
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		while (!paths.empty())
+		{
+			#pragma region Pop a path
+
+			auto throughput = paths.back().throughput;
+			const auto* prim = paths.back().prim;
+			int type = paths.back().type;
+			auto geom = paths.back().geom;
+			auto wi = paths.back().wi;
+			int pixelIndex = paths.back().pixelIndex;
+			int numVertices = paths.back().numVertices;
+			int guidingVertex = paths.back().guidingVertex;
+			paths.pop_back();
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			while (true)
+			{
+				if (Params.MaxNumVertices != -1 && numVertices >= Params.MaxNumVertices)
+				{
+					break;
+				}
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Direct light sampling
+
+				{
+					#pragma region Resample a light sample
+
+					// Resampled importance sampling with a single reservoir.
+					// Candidates are generated by the light sampling and resampled according to
+					// the luminance of the unshadowed contribution, so only one shadow ray is traced.
+					// With one candidate this reduces to the standard next event estimation.
+					const Primitive* L = nullptr;
+					SurfaceGeometry geomL;
+					glm::dvec3 unshadowedC;
+					double target = 0;
+					double weightSum = 0;
+					for (int i = 0; i < Params.RIS.NumCandidates; i++)
+					{
+						#pragma region Sample a light
+
+						const auto* candL = scene.SampleEmitter(PrimitiveType::L, ctx.rng.Next());
+						const double pdfL = scene.EvaluateEmitterPDF(candL);
+						assert(pdfL > 0);
+
+						#pragma endregion
+
+						// --------------------------------------------------------------------------------
+
+						#pragma region Sample a position on the light
+
+						SurfaceGeometry candGeomL;
+						candL->SamplePosition(ctx.rng.Next2D(), candGeomL);
+						const double pdfPL = candL->EvaluatePositionPDF(candGeomL, true);
+						assert(pdfPL > 0);
+
+						#pragma endregion
+
+						// --------------------------------------------------------------------------------
+
+						#pragma region Evaluate unshadowed contribution
+
+						const auto ppL = glm::normalize(candGeomL.p - geom.p);
+						const auto fsE = prim->EvaluateDirection(geom, type, wi, ppL, TransportDirection::EL, false);
+						const auto fsL = candL->EvaluateDirection(candGeomL, PrimitiveType::L, glm::dvec3(), -ppL, TransportDirection::LE, false);
+						const auto G   = GeometryTerm(geom, candGeomL);
+						const auto LeP = candL->EvaluatePosition(candGeomL, true);
+						const auto C   = fsE * G * fsL * LeP;
+
+						#pragma endregion
+
+						// --------------------------------------------------------------------------------
+
+						#pragma region Update reservoir
+
+						const double candTarget = Luminance(C);
+						const double w = candTarget / (pdfL * pdfPL);
+						weightSum += w;
+						if (w > 0 && ctx.rng.Next() * weightSum < w)
+						{
+							L = candL;
+							geomL = candGeomL;
+							unshadowedC = C;
+							target = candTarget;
+						}
+
+						#pragma endregion
+					}
+
+					#pragma endregion
+
+					// --------------------------------------------------------------------------------
+
+					#pragma region Evaluate contribution & record to film
+
+					if (L != nullptr)
+					{
+						// Trace a shadow ray only for the resampled candidate
+						ctx.numShadowRays++;
+						const auto C = scene.Visible(geom.p, geomL.p) ? throughput * unshadowedC * (weightSum / Params.RIS.NumCandidates / target) : glm::dvec3();
+						if (C != glm::dvec3())
+						{
+							// Recompute pixel index if necessary
+							int index = pixelIndex;
+							if (type == PrimitiveType::E)
+							{
+								glm::dvec2 rasterPos;
+								prim->RasterPosition(glm::normalize(geomL.p - geom.p), geom, rasterPos);
+								index = PixelIndex(rasterPos, Params.Width, Params.Height);
+							}
+
+							// Accumulate to film
+							ctx.film[index] += C;
+							ctx.numContributingShadowRays++;
+							if (Params.Guiding.Enabled)
+							{
+								AccumulateGuidingRadiance(ctx, guidingVertex, C);
+							}
+						}
+					}
+
+					#pragma endregion
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Sample next direction
+
+				const auto* dtree = GuidingDistribution(type, geom);
+				glm::dvec3 wo;
+				SampleGuidedDirection(ctx, dtree, prim, type, geom, wi, wo);
+				const double pdfD = EvaluateGuidedDirectionPDF(dtree, prim, type, geom, wi, wo, true);
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Calculate pixel index for initial vertex
+
+				if (type == PrimitiveType::E)
+				{
+					glm::dvec2 rasterPos;
+					if (!prim->RasterPosition(wo, geom, rasterPos)) { break; }
+					pixelIndex = PixelIndex(rasterPos, Params.Width, Params.Height);
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Evaluate direction
+
+				const auto fs = prim->EvaluateDirection(geom, type, wi, wo, TransportDirection::EL, true);
+				if (fs == glm::dvec3())
+				{
+					break;
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Update throughput
+
+				assert(pdfD > 0);
+				throughput *= fs / pdfD;
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Record guiding vertex
+
+				if (Params.Guiding.Enabled && (type & (PrimitiveType::D | PrimitiveType::G)) > 0)
+				{
+					ctx.guidingVertices.push_back({ geom.p, wo, pdfD * glm::abs(glm::dot(geom.sn, wo)), throughput, glm::dvec3(), guidingVertex });
+					guidingVertex = (int)(ctx.guidingVertices.size()) - 1;
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Intersection
+
+				// Setup next ray
+				Ray ray = { geom.p, wo };
+
+				// Intersection query
+				Intersection isect;
+				if (!scene.Intersect(ray, isect))
+				{
+					break;
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Path termination
+
+				if (numVertices == 1)
+				{
+					referenceThroughput = throughput;
+					if (measureCost)
+					{
+						cameraTime = std::chrono::high_resolution_clock::now();
+						cameraStageMeasured = true;
+					}
+				}
+
+				// The weights of the split paths are excluded from the throughput compared with the reference
+				const double rrProb = Params.RR.ContinuationProb(throughput * SplitScale_FirstBounce(numSplits, numVertices), referenceThroughput, true);
+				int numContinuations = Params.RR.Sample(rrProb, ctx.rng.Next());
+				if (numContinuations == 0)
+				{
+					break;
+				}
+				throughput /= rrProb;
+
+				// Split the path at the first scattering vertices
+				if (numVertices <= Params.Split.Depth && numSplits > 1)
+				{
+					numContinuations *= numSplits;
+					throughput /= (double)(numSplits);
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Update information
+
+				geom = isect.geom;
+				prim = isect.Prim;
+				type = isect.Prim->Type & ~PrimitiveType::Emitter;
+				wi = -ray.d;
+				numVertices++;
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Path splitting
+
+				for (int i = 1; i < numContinuations; i++)
+				{
+					paths.push_back({ throughput, prim, type, geom, wi, pixelIndex, numVertices, guidingVertex });
+				}
+
+				#pragma endregion
+			}
+		}
+
+		#pragma region Record cost of the stages
+
+		if (measureCost)
+		{
+			RecordStageCost_FirstBounce(startTime, cameraStageMeasured ? cameraTime : std::chrono::high_resolution_clock::now(), numSplits);
+		}
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Record guiding vertices
+
+		if (Params.Guiding.Enabled)
+		{
+			RecordGuidingVertices(ctx);
+		}
+
+		#pragma endregion
+	}
+
+	void ProcessSample_PTMIS(const Scene& scene, Context& ctx) const
+	{
+		#pragma region Sample a sensor
+
+		const auto* E = scene.SampleEmitter(PrimitiveType::E, ctx.rng.Next());
+		const double pdfE = scene.EvaluateEmitterPDF(E);
+		assert(pdfE > 0);
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Sample a position on the sensor
+
+		SurfaceGeometry geomE;
+		E->SamplePosition(ctx.rng.Next2D(), geomE);
+		const double pdfPE = E->EvaluatePositionPDF(geomE, true);
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Temporary variables
+
+		// Stack of paths to be processed (more than one path with splitting)
+		auto& paths = ctx.splitPaths;
+		paths.clear();
+		paths.push_back({ E->EvaluatePosition(geomE, true) / pdfPE / pdfE, E, PrimitiveType::E, geomE, glm::dvec3(), -1, 1, -1 });
+		glm::dvec3 referenceThroughput;
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		while (!paths.empty())
+		{
+			#pragma region Pop a path
+
+			auto throughput = paths.back().throughput;
+			const auto* prim = paths.back().prim;
+			int type = paths.back().type;
+			auto geom = paths.back().geom;
+			auto wi = paths.back().wi;
+			int pixelIndex = paths.back().pixelIndex;
+			int numVertices = paths.back().numVertices;
+			int guidingVertex = paths.back().guidingVertex;
+			paths.pop_back();
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			while (true)
+			{
+				if (Params.MaxNumVertices != -1 && numVertices >= Params.MaxNumVertices)
+				{
+					break;
+				}
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Guiding distribution
+
+				const auto* dtree = GuidingDistribution(type, geom);
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Direct light sampling
+
+				{
+					#pragma region Sample a light
+
+					const auto* L = scene.SampleEmitter(PrimitiveType::L, ctx.rng.Next());
+					const double pdfL = scene.EvaluateEmitterPDF(L);
+					assert(pdfL > 0);
+
+					#pragma endregion
+
+					// --------------------------------------------------------------------------------
+
+					#pragma region Sample a position on the light
+
+					SurfaceGeometry geomL;
+					L->SamplePosition(ctx.rng.Next2D(), geomL);
+					const double pdfPL = L->EvaluatePositionPDF(geomL, true);
+					assert(pdfPL > 0);
+
+					#pragma endregion
+
+					// --------------------------------------------------------------------------------
+
+					#pragma region Evaluate contribution
+
+					const auto ppL = glm::normalize(geomL.p - geom.p);
+					const auto fsE = prim->EvaluateDirection(geom, type, wi, ppL, TransportDirection::EL, false);
+					const auto fsL = L->EvaluateDirection(geomL, PrimitiveType::L, glm::dvec3(), -ppL, TransportDirection::LE, false);
+					const auto G   = GeometryTerm(geom, geomL);
+					const auto V   = scene.Visible(geom.p, geomL.p) ? 1.0 : 0.0;
+					ctx.numShadowRays++;
+					const auto LeP = L->EvaluatePosition(geomL, true);
+					const auto C   = throughput * fsE * G * V * fsL * LeP / pdfL / pdfPL;
+
+					#pragma endregion
+
+					// --------------------------------------------------------------------------------
+
+					#pragma region MIS weight
+
+					// PDFs of the light and BSDF sampling strategies in the area measure.
+					// BSDF sampling cannot generate the path if the light is degenerated (e.g., point light).
+					const double pdfLight = pdfL * pdfPL;
+					const double pdfBSDF  = L->EvaluatePosition(geomL, false) == glm::dvec3() ? 0 : EvaluateGuidedDirectionPDF(dtree, prim, type, geom, wi, ppL, false) * G;
+					const double w = PowerHeuristic(pdfLight, pdfBSDF);
+
+					#pragma endregion
+
+					// --------------------------------------------------------------------------------
+
+					#pragma region Record to film
+
+					if (C != glm::dvec3())
+					{
+						// Recompute pixel index if necessary
+						int index = pixelIndex;
+						if (type == PrimitiveType::E)
+						{
+							glm::dvec2 rasterPos;
+							prim->RasterPosition(ppL, geom, rasterPos);
+							index = PixelIndex(rasterPos, Params.Width, Params.Height);
+						}
+
+						// Accumulate to film
+						ctx.film[index] += w * C;
+						ctx.numContributingShadowRays++;
+						if (Params.Guiding.Enabled)
+						{
+							AccumulateGuidingRadiance(ctx, guidingVertex, w * C);
+						}
+					}
+
+					#pragma endregion
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Sample next direction
+
+				glm::dvec3 wo;
+				SampleGuidedDirection(ctx, dtree, prim, type, geom, wi, wo);
+				const double pdfD = EvaluateGuidedDirectionPDF(dtree, prim, type, geom, wi, wo, true);
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Calculate pixel index for initial vertex
+
+				if (type == PrimitiveType::E)
+				{
+					glm::dvec2 rasterPos;
+					if (!prim->RasterPosition(wo, geom, rasterPos)) { break; }
+					pixelIndex = PixelIndex(rasterPos, Params.Width, Params.Height);
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Evaluate direction
+
+				const auto fs = prim->EvaluateDirection(geom, type, wi, wo, TransportDirection::EL, true);
+				if (fs == glm::dvec3())
+				{
+					break;
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Update throughput
+
+				assert(pdfD > 0);
+				throughput *= fs / pdfD;
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Record guiding vertex
+
+				if (Params.Guiding.Enabled && (type & (PrimitiveType::D | PrimitiveType::G)) > 0)
+				{
+					ctx.guidingVertices.push_back({ geom.p, wo, pdfD * glm::abs(glm::dot(geom.sn, wo)), throughput, glm::dvec3(), guidingVertex });
+					guidingVertex = (int)(ctx.guidingVertices.size()) - 1;
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Intersection
+
+				// Setup next ray
+				Ray ray = { geom.p, wo };
+
+				// Intersection query
+				Intersection isect;
+				if (!scene.Intersect(ray, isect))
+				{
+					break;
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Handle hit with light source
+
+				if ((isect.Prim->Type & PrimitiveType::L) > 0)
+				{
+					const auto C =
+						throughput
+						* isect.Prim->EvaluateDirection(isect.geom, PrimitiveType::L, glm::dvec3(), -ray.d, TransportDirection::EL, false)
+						* isect.Prim->EvaluatePosition(isect.geom, false);
+
+					if (C != glm::dvec3())
+					{
+						// PDFs of the light and BSDF sampling strategies in the area measure.
+						// Light sampling cannot generate the path if the previous vertex is degenerated (e.g., specular surface).
+						const double pdfLight = prim->EvaluateDirection(geom, type, wi, wo, TransportDirection::EL, false) == glm::dvec3() ? 0 : scene.EvaluateEmitterPDF(isect.Prim) * isect.Prim->EvaluatePositionPDF(isect.geom, false);
+						const double pdfBSDF  = pdfD * GeometryTerm(geom, isect.geom);
+						ctx.film[pixelIndex] += PowerHeuristic(pdfBSDF, pdfLight) * C;
+						if (Params.Guiding.Enabled)
+						{
+							AccumulateGuidingRadiance(ctx, guidingVertex, PowerHeuristic(pdfBSDF, pdfLight) * C);
+						}
+					}
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Path termination
+
+				if (numVertices == 1)
+				{
+					referenceThroughput = throughput;
+				}
+				const double rrProb = Params.RR.ContinuationProb(throughput, referenceThroughput, true);
+				const int numContinuations = Params.RR.Sample(rrProb, ctx.rng.Next());
+				if (numContinuations == 0)
+				{
+					break;
+				}
+				throughput /= rrProb;
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Update information
+
+				geom = isect.geom;
+				prim = isect.Prim;
+				type = isect.Prim->Type & ~PrimitiveType::Emitter;
+				wi = -ray.d;
+				numVertices++;
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Path splitting
+
+				for (int i = 1; i < numContinuations; i++)
+				{
+					paths.push_back({ throughput, prim, type, geom, wi, pixelIndex, numVertices, guidingVertex });
+				}
+
+				#pragma endregion
+			}
+		}
+
+		#pragma region Record guiding vertices
+
+		if (Params.Guiding.Enabled)
+		{
+			RecordGuidingVertices(ctx);
+		}
+
+		#pragma endregion
+	}
+
+	void ProcessSample_LT(const Scene& scene, Context& ctx) const
+	{
+		#pragma region Sample a light
+
+		const auto* L = scene.SampleEmitter(PrimitiveType::L, ctx.rng.Next());
+		const double pdfL = scene.EvaluateEmitterPDF(L);
+		assert(pdfL > 0);
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Sample a position on the light
+
+		SurfaceGeometry geomL;
+		L->SamplePosition(ctx.rng.Next2D(), geomL);
+		const double pdfPL = L->EvaluatePositionPDF(geomL, true);
+		assert(pdfPL > 0);
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Temporary variables
+
+		// Stack of paths to be processed (more than one path with splitting)
+		auto& paths = ctx.splitPaths;
+		paths.clear();
+		paths.push_back({ L->EvaluatePosition(geomL, true) / pdfPL / pdfL, L, PrimitiveType::L, geomL, glm::dvec3(), -1, 1, -1 });
+		glm::dvec3 referenceThroughput;
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		while (!paths.empty())
+		{
+			#pragma region Pop a path
+
+			auto throughput = paths.back().throughput;
+			const auto* prim = paths.back().prim;
+			int type = paths.back().type;
+			auto geom = paths.back().geom;
+			auto wi = paths.back().wi;
+			int numVertices = paths.back().numVertices;
+			paths.pop_back();
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			while (true)
+			{
+				if (Params.MaxNumVertices != -1 && numVertices >= Params.MaxNumVertices)
+				{
+					break;
+				}
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Sample direction
+
+				glm::dvec3 wo;
+				prim->SampleDirection(ctx.rng.Next2D(), ctx.rng.Next(), type, geom, wi, wo);
+				const double pdfD = prim->EvaluateDirectionPDF(geom, type, wi, wo, true);
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Evaluate direction
+
+				const auto fs = prim->EvaluateDirection(geom, type, wi, wo, TransportDirection::LE, true);
+				if (fs == glm::dvec3())
+				{
+					break;
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Update throughput
+
+				assert(pdfD > 0);
+				throughput *= fs / pdfD;
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Intersection
+
+				// Setup next ray
+				Ray ray = { geom.p, wo };
+
+				// Intersection query
+				Intersection isect;
+				if (!scene.Intersect(ray, isect))
+				{
+					break;
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Handle hit with sensor
+
+				if ((isect.Prim->Type & PrimitiveType::E) > 0)
+				{
+					#pragma region Calculate raster position
+
+					glm::dvec2 rasterPos;
+					if (!isect.Prim->RasterPosition(-wo, isect.geom, rasterPos))
+					{
+						break;
+					}
+
+					#pragma endregion
+
+					// --------------------------------------------------------------------------------
+
+					#pragma region Accumulate to film
+
+					const int pixelIndex = PixelIndex(rasterPos, Params.Width, Params.Height);
+					ctx.film[pixelIndex] +=
+						throughput
+						* isect.Prim->EvaluateDirection(isect.geom, PrimitiveType::E, glm::dvec3(), -ray.d, TransportDirection::LE, false)
+						* isect.Prim->EvaluatePosition(isect.geom, false);
+
+					#pragma endregion
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Path termination
+
+				if (numVertices == 1)
+				{
+					referenceThroughput = throughput;
+				}
+				const double rrProb = Params.RR.ContinuationProb(throughput, referenceThroughput, true);
+				const int numContinuations = Params.RR.Sample(rrProb, ctx.rng.Next());
+				if (numContinuations == 0)
+				{
+					break;
+				}
+				throughput /= rrProb;
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Update information
+
+				geom = isect.geom;
+				prim = isect.Prim;
+				type = isect.Prim->Type & ~PrimitiveType::Emitter;
+				wi = -ray.d;
+				numVertices++;
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Path splitting
+
+				for (int i = 1; i < numContinuations; i++)
+				{
+					paths.push_back({ throughput, prim, type, geom, wi, -1, numVertices, -1 });
+				}
+
+				#pragma endregion
+			}
+		}
+	}
+
+	void ProcessSample_LTDirect(const Scene& scene, Context& ctx) const
+	{
+		#pragma region Sample a light
+
+		const auto* L = scene.SampleEmitter(PrimitiveType::L, ctx.rng.Next());
+		const double pdfL = scene.EvaluateEmitterPDF(L);
+		assert(pdfL > 0);
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Sample a position on the light
+
+		SurfaceGeometry geomL;
+		L->SamplePosition(ctx.rng.Next2D(), geomL);
+		const double pdfPL = L->EvaluatePositionPDF(geomL, true);
+		assert(pdfPL > 0);
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Temporary variables
+
+		// Stack of paths to be processed (more than one path with splitting)
+		auto& paths = ctx.splitPaths;
+		paths.clear();
+		paths.push_back({ L->EvaluatePosition(geomL, true) / pdfPL / pdfL, L, PrimitiveType::L, geomL, glm::dvec3(), -1, 1, -1 });
+		glm::dvec3 referenceThroughput;
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		while (!paths.empty())
+		{
+			#pragma region Pop a path
+
+			auto throughput = paths.back().throughput;
+			const auto* prim = paths.back().prim;
+			int type = paths.back().type;
+			auto geom = paths.back().geom;
+			auto wi = paths.back().wi;
+			int numVertices = paths.back().numVertices;
+			paths.pop_back();
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			while (true)
+			{
+				if (Params.MaxNumVertices != -1 && numVertices >= Params.MaxNumVertices)
+				{
+					break;
+				}
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Direct sensor sampling
+
+				{
+					#pragma region Sample a sensor
+
+					const auto* E = scene.SampleEmitter(PrimitiveType::E, ctx.rng.Next());
+					const double pdfE = scene.EvaluateEmitterPDF(E);
+					assert(pdfE > 0);
+
+					#pragma endregion
+
+					// --------------------------------------------------------------------------------
+
+					#pragma region Sample a position on the sensor
+
+					SurfaceGeometry geomE;
+					E->SamplePosition(ctx.rng.Next2D(), geomE);
+					const double pdfPE = L->EvaluatePositionPDF(geomE, true);
+					assert(pdfPE > 0);
+
+					#pragma endregion
+
+					// --------------------------------------------------------------------------------
+
+					#pragma region Evaluate contribution
+
+					const auto ppE = glm::normalize(geomE.p - geom.p);
+					const auto fsL = prim->EvaluateDirection(geom, type, wi, ppE, TransportDirection::LE, false);
+					const auto fsE = E->EvaluateDirection(geomE, PrimitiveType::E, glm::dvec3(), -ppE, TransportDirection::EL, false);
+					const auto G   = GeometryTerm(geom, geomE);
+					const auto V   = scene.Visible(geom.p, geomE.p) ? 1.0 : 0.0;
+					const auto LeP = L->EvaluatePosition(geomE, true);
+					const auto C   = throughput * fsL * G * V * fsE * LeP / pdfE / pdfPE;
+
+					#pragma endregion
+
+					// --------------------------------------------------------------------------------
+
+					#pragma region Record to film
+
+					if (C != glm::dvec3())
+					{
+						// Pixel index
+						glm::dvec2 rasterPos;
+						E->RasterPosition(-ppE, geomE, rasterPos);
+						int index = PixelIndex(rasterPos, Params.Width, Params.Height);
+
+						// Accumulate to film
+						ctx.film[index] += C;
+					}
+
+					#pragma endregion
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Sample next direction
+
+				glm::dvec3 wo;
+				prim->SampleDirection(ctx.rng.Next2D(), ctx.rng.Next(), type, geom, wi, wo);
+				const double pdfD = prim->EvaluateDirectionPDF(geom, type, wi, wo, true);
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Evaluate direction
+
+				const auto fs = prim->EvaluateDirection(geom, type, wi, wo, TransportDirection::LE, true);
+				if (fs == glm::dvec3())
+				{
+					break;
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Update throughput
+
+				assert(pdfD > 0);
+				throughput *= fs / pdfD;
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Intersection
+
+				// Setup next ray
+				Ray ray = { geom.p, wo };
+
+				// Intersection query
+				Intersection isect;
+				if (!scene.Intersect(ray, isect))
+				{
+					break;
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Path termination
+
+				if (numVertices == 1)
+				{
+					referenceThroughput = throughput;
+				}
+				const double rrProb = Params.RR.ContinuationProb(throughput, referenceThroughput, true);
+				const int numContinuations = Params.RR.Sample(rrProb, ctx.rng.Next());
+				if (numContinuations == 0)
+				{
+					break;
+				}
+				throughput /= rrProb;
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Update information
+
+				geom = isect.geom;
+				prim = isect.Prim;
+				type = isect.Prim->Type & ~PrimitiveType::Emitter;
+				wi = -ray.d;
+				numVertices++;
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Path splitting
+
+				for (int i = 1; i < numContinuations; i++)
+				{
+					paths.push_back({ throughput, prim, type, geom, wi, -1, numVertices, -1 });
+				}
+
+				#pragma endregion
+			}
+		}
+	}
+
+	void ProcessSample_BDPT(const Scene& scene, Context& ctx) const
+	{
+		#pragma region Sample subpaths
+
+		std::chrono::high_resolution_clock::time_point start;
+		if (Params.BDPTStrategy.Pruning)
+		{
+			start = std::chrono::high_resolution_clock::now();
+		}
+
+		ctx.BDPT.subpathL.SampleSubpath(scene, ctx.rng, TransportDirection::LE, Params.MaxNumVertices, Params.RR);
+		ctx.BDPT.subpathE.SampleSubpath(scene, ctx.rng, TransportDirection::EL, Params.MaxNumVertices, Params.RR);
+
+		if (Params.BDPTStrategy.Pruning)
+		{
+			const auto end = std::chrono::high_resolution_clock::now();
+			auto& pruningStats = StrategyPruning.stats.local();
+			pruningStats.samplingTime += (double)(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()) * 1e-9;
+			pruningStats.numSamples++;
+		}
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Evaluate path combinations
+
+		const int nL = static_cast<int>(ctx.BDPT.subpathL.vertices.size());
+		const int nE = static_cast<int>(ctx.BDPT.subpathE.vertices.size());
+
+		// The manifold strategies are accounted in the MIS weights if enabled
+		ctx.BDPT.path.manifoldArena = ManifoldConnections_BDPT ? &ctx.arena : nullptr;
+		ctx.BDPT.path.manifoldCache = ManifoldConnections_BDPT ? &ctx.BDPT.manifoldCache : nullptr;
+		if (ManifoldConnections_BDPT)
+		{
+			ctx.BDPT.manifoldCache.Reset(nL, nE);
+			ctx.BDPT.visible.assign(StrategyIndex(0, nL + nE + 1), 0);
+		}
+		for (int n = 2; n <= nE + nL; n++)
+		{
+			if (Params.MaxNumVertices != -1 && n > Params.MaxNumVertices)
+			{
+				continue;
+			}
+
+			// --------------------------------------------------------------------------------
+
+			const int minS = glm::max(0, n - nE);
+			const int maxS = glm::min(nL, n);
+			for (int s = minS; s <= maxS; s++)
+			{
+				EvaluateStrategy_BDPT(scene, ctx, s, n - s, ctx.BDPT.subpathL, 1);
+			}
+		}
+		if (ctx.BDPT.controlVariatesPixel >= 0)
+		{
+			AccumulateOptimalMISStats_BDPT(ctx.BDPT.controlVariates, ctx.BDPT.controlVariatesPixel);
+			ctx.BDPT.controlVariatesPixel = -1;
+		}
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Evaluate manifold connections
+
+		if (ManifoldConnections_BDPT)
+		{
+			for (int s = 1; s <= nL; s++)
+			{
+				for (int t = 2; t <= nE; t++)
+				{
+					EvaluateManifoldStrategy_BDPT(scene, ctx, s, t);
+				}
+			}
+		}
+
+		#pragma endregion
+	}
+
+	void ProcessSample_LVCBDPT(const Scene& scene, Context& ctx) const
+	{
+		#pragma region Sample eye subpath & select a light subpath
+
+		// The light subpath is selected from the cache and used for the strategies with s <= 1 or t <= 1
+		ctx.BDPT.subpathE.SampleSubpath(scene, ctx.rng, TransportDirection::EL, Params.MaxNumVertices, Params.RR);
+		const auto& subpaths = LightVertexCache.subpaths;
+		const auto& subpathL = subpaths[std::min((size_t)(ctx.rng.Next() * subpaths.size()), subpaths.size() - 1)];
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Function to evaluate a strategy
+
+		const auto EvaluateStrategy = [&](int s, int t, const HeapPath& subpathL, double scale) -> void
+		{
+			if (Params.MaxNumVertices != -1 && s + t > Params.MaxNumVertices)
+			{
+				return;
+			}
+
+			EvaluateStrategy_BDPT(scene, ctx, s, t, subpathL, scale);
+		};
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Evaluate path combinations
+
+		const int nL = static_cast<int>(subpathL.vertices.size());
+		const int nE = static_cast<int>(ctx.BDPT.subpathE.vertices.size());
+		const int numCachedVertices = static_cast<int>(LightVertexCache.vertices.size());
+		for (int t = 0; t <= nE; t++)
+		{
+			if (t <= 1)
+			{
+				#pragma region Strategies with the selected light subpath
+
+				for (int s = glm::max(0, 2 - t); s <= nL; s++)
+				{
+					EvaluateStrategy(s, t, subpathL, 1);
+				}
+
+				#pragma endregion
+			}
+			else
+			{
+				#pragma region Strategies with s <= 1
+
+				for (int s = 0; s <= glm::min(1, nL); s++)
+				{
+					EvaluateStrategy(s, t, subpathL, 1);
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				#pragma region Connections to the light vertex cache
+
+				// Uniformly selecting #NumConnections vertices from the cache,
+				// the expected contribution is scaled by (# of cached vertices) / (# of light subpaths) / #NumConnections.
+				if (numCachedVertices > 0)
+				{
+					const double scale = (double)(numCachedVertices) / subpaths.size() / Params.LVC.NumConnections;
+					for (int i = 0; i < Params.LVC.NumConnections; i++)
+					{
+						const auto& ref = LightVertexCache.vertices[glm::min((int)(ctx.rng.Next() * numCachedVertices), numCachedVertices - 1)];
+						EvaluateStrategy(ref.index + 1, t, subpaths[ref.path], scale);
+					}
+				}
+
+				#pragma endregion
+			}
+		}
+
+		#pragma endregion
+	}
+
+	void ProcessSample_VCM(const Scene& scene, Context& ctx) const
+	{
+		#pragma region Sample eye subpath & select a light subpath
+
+		// The light subpath for the vertex connections is selected from the cache
+		ctx.BDPT.subpathE.SampleSubpath(scene, ctx.rng, TransportDirection::EL, Params.MaxNumVertices, Params.RR);
+		const auto& subpaths = LightVertexCache.subpaths;
+		const auto& subpathL = subpaths[std::min((size_t)(ctx.rng.Next() * subpaths.size()), subpaths.size() - 1)];
+
+		// The vertex merging strategies are accounted in the MIS weights of all strategies
+		const double radius = LightVertexGrid.radius;
+		ctx.BDPT.path.mergeFactor = Pi * radius * radius * subpaths.size();
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Vertex connections
+
+		const int nL = static_cast<int>(subpathL.vertices.size());
+		const int nE = static_cast<int>(ctx.BDPT.subpathE.vertices.size());
+		for (int n = 2; n <= nE + nL; n++)
+		{
+			if (Params.MaxNumVertices != -1 && n > Params.MaxNumVertices)
+			{
+				continue;
+			}
+
+			const int minS = glm::max(0, n - nE);
+			const int maxS = glm::min(nL, n);
+			for (int s = minS; s <= maxS; s++)
+			{
+				EvaluateStrategy_BDPT(scene, ctx, s, n - s, subpathL, 1);
+			}
+		}
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Vertex merging
+
+		// Each eye vertex on the non-specular surfaces is merged with all cached light vertices in the merge radius
+		auto& path = ctx.BDPT.path;
+		for (int t = 2; t <= nE; t++)
+		{
+			const auto& vE = ctx.BDPT.subpathE.vertices[t - 1];
+			if ((vE.type & (PrimitiveType::D | PrimitiveType::G)) == 0 || vE.alpha == glm::dvec3())
+			{
+				continue;
+			}
+
+			LightVertexGrid.grid.Query(vE.geom.p, [&](int i) -> void
+			{
+				const auto& ref = LightVertexGrid.vertices[i];
+				if (Params.MaxNumVertices != -1 && ref.index + t > Params.MaxNumVertices)
+				{
+					return;
+				}
+
+				path.Merge(scene, ref.index, t, subpaths[ref.path], ctx.BDPT.subpathE);
+				const auto Cstar = path.EvaluateUnweightContribution();
+				if (Cstar == glm::dvec3())
+				{
+					return;
+				}
+
+				ctx.film[PixelIndex(path.RasterPosition(), Params.Width, Params.Height)] += Cstar * path.EvaluateMISWeight() / path.SelectionProb();
+			});
+		}
+
+		#pragma endregion
+	}
+
+	void ProcessSample_SPPM(const Scene& scene, Context& ctx) const
+	{
+		#pragma region Sample a light
+
+		const auto* L = scene.SampleEmitter(PrimitiveType::L, ctx.rng.Next());
+		const double pdfL = scene.EvaluateEmitterPDF(L);
+		assert(pdfL > 0);
+
+		SurfaceGeometry geomL;
+		L->SamplePosition(ctx.rng.Next2D(), geomL);
+		const double pdfPL = L->EvaluatePositionPDF(geomL, true);
+		assert(pdfPL > 0);
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Trace a photon
+
+		auto throughput = L->EvaluatePosition(geomL, true) / pdfPL / pdfL;
+		const auto* prim = L;
+		int type = PrimitiveType::L;
+		auto geom = geomL;
+		glm::dvec3 wi;
+		int numVertices = 1;
+		glm::dvec3 referenceThroughput;
+		auto& pixels = VisiblePoints.pixels;
+
+		while (true)
+		{
+			if (Params.MaxNumVertices != -1 && numVertices >= Params.MaxNumVertices)
+			{
+				break;
+			}
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Sample direction & update throughput
+
+			glm::dvec3 wo;
+			prim->SampleDirection(ctx.rng.Next2D(), ctx.rng.Next(), type, geom, wi, wo);
+			const auto fs = prim->EvaluateDirection(geom, type, wi, wo, TransportDirection::LE, true);
+			if (fs == glm::dvec3())
+			{
+				break;
+			}
+
+			const double pdfD = prim->EvaluateDirectionPDF(geom, type, wi, wo, true);
+			assert(pdfD > 0);
+			throughput *= fs / pdfD;
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Intersection
+
+			Ray ray = { geom.p, wo };
+			Intersection isect;
+			if (!scene.Intersect(ray, isect))
+			{
+				break;
+			}
+
+			geom = isect.geom;
+			prim = isect.Prim;
+			type = isect.Prim->Type & ~PrimitiveType::Emitter;
+			wi = -ray.d;
+			numVertices++;
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Deposit the photon to the visible points
+
+			if ((type & (PrimitiveType::D | PrimitiveType::G)) > 0)
+			{
+				VisiblePoints.grid.Query(geom.p, [&](int i) -> void
+				{
+					auto& pixel = pixels[VisiblePoints.visiblePixels[i]];
+					if (glm::length2(pixel.geom.p - geom.p) > pixel.radius * pixel.radius)
+					{
+						return;
+					}
+					if (Params.MaxNumVertices != -1 && pixel.numVertices + numVertices - 1 > Params.MaxNumVertices)
+					{
+						return;
+					}
+
+					const auto fsE = pixel.prim->EvaluateDirection(pixel.geom, pixel.type, pixel.wi, wi, TransportDirection::EL, false);
+					if (fsE == glm::dvec3())
+					{
+						return;
+					}
+
+					const auto phi = pixel.throughput * fsE * throughput;
+					pixel.M.Add(1);
+					for (int j = 0; j < 3; j++)
+					{
+						pixel.phi[j].Add(phi[j]);
+					}
+				});
+			}
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Path termination
+
+			if (numVertices == 2)
+			{
+				referenceThroughput = throughput;
+			}
+			const double rrProb = Params.RR.ContinuationProb(throughput, referenceThroughput, false);
+			if (Params.RR.Sample(rrProb, ctx.rng.Next()) == 0)
+			{
+				break;
+			}
+			throughput /= rrProb;
+
+			#pragma endregion
+		}
+
+		#pragma endregion
+	}
+
+	void ProcessSample_VPL(const Scene& scene, Context& ctx) const
+	{
+		#pragma region Sample a sensor
+
+		const auto* E = scene.SampleEmitter(PrimitiveType::E, ctx.rng.Next());
+		const double pdfE = scene.EvaluateEmitterPDF(E);
+		assert(pdfE > 0);
+
+		SurfaceGeometry geomE;
+		E->SamplePosition(ctx.rng.Next2D(), geomE);
+		const double pdfPE = E->EvaluatePositionPDF(geomE, true);
+		assert(pdfPE > 0);
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Temporary variables
+
+		auto throughput = E->EvaluatePosition(geomE, true) / pdfPE / pdfE;
+		const auto* prim = E;
+		int type = PrimitiveType::E;
+		auto geom = geomE;
+		glm::dvec3 wi;
+		int pixelIndex = -1;
+		int numVertices = 1;
+		glm::dvec3 referenceThroughput;
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		while (true)
+		{
+			if (Params.MaxNumVertices != -1 && numVertices >= Params.MaxNumVertices)
+			{
+				break;
+			}
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Gather VPLs
+
+			if ((type & (PrimitiveType::D | PrimitiveType::G)) > 0)
+			{
+				ctx.film[pixelIndex] += throughput * GatherVPLs(scene, ctx, prim, type, geom, wi, numVertices);
+			}
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Sample direction
+
+			glm::dvec3 wo;
+			prim->SampleDirection(ctx.rng.Next2D(), ctx.rng.Next(), type, geom, wi, wo);
+			const double pdfD = prim->EvaluateDirectionPDF(geom, type, wi, wo, true);
+
+			if (type == PrimitiveType::E)
+			{
+				glm::dvec2 rasterPos;
+				if (!prim->RasterPosition(wo, geom, rasterPos))
+				{
+					break;
+				}
+				pixelIndex = PixelIndex(rasterPos, Params.Width, Params.Height);
+			}
+
+			const auto fs = prim->EvaluateDirection(geom, type, wi, wo, TransportDirection::EL, true);
+			if (fs == glm::dvec3())
+			{
+				break;
+			}
+
+			assert(pdfD > 0);
+			throughput *= fs / pdfD;
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Intersection
+
+			Ray ray = { geom.p, wo };
+			Intersection isect;
+			if (!scene.Intersect(ray, isect))
+			{
+				break;
+			}
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Bias compensation
+
+			// The transport between a non-specular vertex and the vertex where the VPLs can be placed is gathered
+			// with the clamped geometry term, so the path continues only with the residual [Kollig & Keller 2004]
+			if ((type & (PrimitiveType::D | PrimitiveType::G)) > 0 && (isect.Prim->Type & (PrimitiveType::D | PrimitiveType::G | PrimitiveType::L)) > 0)
+			{
+				const double G = GeometryTerm(geom, isect.geom);
+				const double r = G > VirtualPointLights.maxG ? 1 - VirtualPointLights.maxG / G : 0;
+				if (r == 0)
+				{
+					break;
+				}
+				throughput *= r;
+			}
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Handle hit with light source
+
+			if ((isect.Prim->Type & PrimitiveType::L) > 0)
+			{
+				ctx.film[pixelIndex] +=
+					throughput
+					* isect.Prim->EvaluateDirection(isect.geom, PrimitiveType::L, glm::dvec3(), -ray.d, TransportDirection::EL, false)
+					* isect.Prim->EvaluatePosition(isect.geom, false);
+			}
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Path termination
+
+			if (numVertices == 1)
+			{
+				referenceThroughput = throughput;
+			}
+			const double rrProb = Params.RR.ContinuationProb(throughput, referenceThroughput, false);
+			if (Params.RR.Sample(rrProb, ctx.rng.Next()) == 0)
+			{
+				break;
+			}
+			throughput /= rrProb;
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Update information
+
+			geom = isect.geom;
+			prim = isect.Prim;
+			type = isect.Prim->Type & ~PrimitiveType::Emitter;
+			wi = -ray.d;
+			numVertices++;
+
+			#pragma endregion
+		}
+	}
+
+	void ProcessSample_PTCache(const Scene& scene, Context& ctx) const
+	{
+		#pragma region Sample a sensor
+
+		const auto* E = scene.SampleEmitter(PrimitiveType::E, ctx.rng.Next());
+		const double pdfE = scene.EvaluateEmitterPDF(E);
+		assert(pdfE > 0);
+
+		SurfaceGeometry geomE;
+		E->SamplePosition(ctx.rng.Next2D(), geomE);
+		const double pdfPE = E->EvaluatePositionPDF(geomE, true);
+		assert(pdfPE > 0);
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Temporary variables
+
+		auto throughput = E->EvaluatePosition(geomE, true) / pdfPE / pdfE;
+		const auto* prim = E;
+		int type = PrimitiveType::E;
+		auto geom = geomE;
+		glm::dvec3 wi;
+		int pixelIndex = -1;
+		int numVertices = 1;
+		glm::dvec3 referenceThroughput;
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		while (true)
+		{
+			if (Params.MaxNumVertices != -1 && numVertices >= Params.MaxNumVertices)
+			{
+				break;
+			}
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Diffuse vertex
+
+			// The path ends at the first diffuse vertex, where the direct illumination is estimated with the light sampling
+			// and the indirect illumination is interpolated from the irradiance cache
+			if (type == PrimitiveType::D)
+			{
+				const auto n = glm::dot(geom.sn, wi) > 0 ? geom.sn : -geom.sn;
+				glm::dvec3 irradiance;
+				if (!IrradianceRecords.Lookup(geom.p, n, irradiance))
+				{
+					const auto record = ComputeIrradiance_PTCache(scene, ctx, geom, n);
+					IrradianceRecords.Insert(record);
+					if (getenv("TMP_REC")) fprintf(stderr, "REC %g %g %g %g %g %g %g %g\n", record.p.x, record.p.y, record.p.z, record.n.x, record.n.y, record.n.z, Luminance(record.E), record.R);
+					irradiance = record.E;
+				}
+
+				// The BSDF is constant for the diffuse surface
+				const auto fs = prim->EvaluateDirection(geom, type, wi, n, TransportDirection::EL, false);
+				ctx.film[pixelIndex] += throughput * (EstimateDirectIllumination_PTCache(scene, ctx, prim, type, geom, wi) + fs * irradiance);
+				break;
+			}
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Sample direction
+
+			glm::dvec3 wo;
+			prim->SampleDirection(ctx.rng.Next2D(), ctx.rng.Next(), type, geom, wi, wo);
+			const double pdfD = prim->EvaluateDirectionPDF(geom, type, wi, wo, true);
+
+			if (type == PrimitiveType::E)
+			{
+				glm::dvec2 rasterPos;
+				if (!prim->RasterPosition(wo, geom, rasterPos))
+				{
+					break;
+				}
+				pixelIndex = PixelIndex(rasterPos, Params.Width, Params.Height);
+			}
+
+			const auto fs = prim->EvaluateDirection(geom, type, wi, wo, TransportDirection::EL, true);
+			if (fs == glm::dvec3())
+			{
+				break;
+			}
+
+			assert(pdfD > 0);
+			throughput *= fs / pdfD;
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Intersection
+
+			Ray ray = { geom.p, wo };
+			Intersection isect;
+			if (!scene.Intersect(ray, isect))
+			{
+				break;
+			}
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Handle hit with light source
+
+			if ((isect.Prim->Type & PrimitiveType::L) > 0)
+			{
+				ctx.film[pixelIndex] +=
+					throughput
+					* isect.Prim->EvaluateDirection(isect.geom, PrimitiveType::L, glm::dvec3(), -ray.d, TransportDirection::EL, false)
+					* isect.Prim->EvaluatePosition(isect.geom, false);
+			}
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Path termination
+
+			if (numVertices == 1)
+			{
+				referenceThroughput = throughput;
+			}
+			const double rrProb = Params.RR.ContinuationProb(throughput, referenceThroughput, false);
+			if (Params.RR.Sample(rrProb, ctx.rng.Next()) == 0)
+			{
+				break;
+			}
+			throughput /= rrProb;
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Update information
+
+			geom = isect.geom;
+			prim = isect.Prim;
+			type = isect.Prim->Type & ~PrimitiveType::Emitter;
+			wi = -ray.d;
+			numVertices++;
+
+			#pragma endregion
+		}
+	}
+
+	void ProcessSample_GPT(const Scene& scene, Context& ctx) const
+	{
+		#pragma region Select a pixel
+
+		// The pixels are visited in turn, because the variation of the number of samples per pixel
+		// would be the dominant noise of the image where the pixel value is almost constant (e.g., emitters)
+		const int numPixels = Params.Width * Params.Height;
+		const int pixelIndex = (int)(GradientDomain.nextPixel++ % numPixels);
+		const int x = pixelIndex % Params.Width;
+		const int y = pixelIndex / Params.Width;
+
+		const auto NumNeighbors = [&](int px, int py) -> int
+		{
+			return (px > 0) + (px + 1 < Params.Width) + (py > 0) + (py + 1 < Params.Height);
+		};
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Sample a sensor
+
+		const auto* E = scene.SampleEmitter(PrimitiveType::E, ctx.rng.Next());
+		const double pdfE = scene.EvaluateEmitterPDF(E);
+		assert(pdfE > 0);
+
+		SurfaceGeometry geomE;
+		E->SamplePosition(ctx.rng.Next2D(), geomE);
+		const double pdfPE = E->EvaluatePositionPDF(geomE, true);
+		assert(pdfPE > 0);
+
+		// Ray through the pixel (#px, #py) at the sub-pixel position #u.
+		// The pinhole camera maps the sample to the raster position, whose density is uniform over the image.
+		const auto TraceCameraRay = [&](int px, int py, const glm::dvec2& u, glm::dvec3& throughput, Ray& ray, Intersection& isect) -> bool
+		{
+			const glm::dvec2 rasterPos(((double)(px) + u.x) / Params.Width, ((double)(py) + u.y) / Params.Height);
+			glm::dvec3 wo;
+			E->SampleDirection(rasterPos, 0, PrimitiveType::E, geomE, glm::dvec3(), wo);
+			const auto fs = E->EvaluateDirection(geomE, PrimitiveType::E, glm::dvec3(), wo, TransportDirection::EL, true);
+			if (fs == glm::dvec3())
+			{
+				return false;
+			}
+			const double pdfD = E->EvaluateDirectionPDF(geomE, PrimitiveType::E, glm::dvec3(), wo, true);
+			assert(pdfD > 0);
+			throughput = E->EvaluatePosition(geomE, true) / pdfPE / pdfE * fs / pdfD;
+			ray = { geomE.p, wo };
+			return scene.Intersect(ray, isect);
+		};
+
+		const auto EmittedRadiance = [&](const Intersection& isect, const glm::dvec3& wo) -> glm::dvec3
+		{
+			return
+				isect.Prim->EvaluateDirection(isect.geom, PrimitiveType::L, glm::dvec3(), wo, TransportDirection::EL, false)
+				* isect.Prim->EvaluatePosition(isect.geom, false);
+		};
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Base path and offset paths
+
+		const auto u = ctx.rng.Next2D();
+		glm::dvec3 throughput;
+		Ray ray;
+		Intersection isect;
+		if (!TraceCameraRay(x, y, u, throughput, ray, isect))
+		{
+			return;
+		}
+
+		// The offset paths are traced through the four neighbors with the same sub-pixel position
+		auto& gradients = GradientDomain.films.local();
+		if (gradients.dx.empty())
+		{
+			gradients.dx.assign(numPixels, glm::dvec3());
+			gradients.dy.assign(numPixels, glm::dvec3());
+		}
+		const int numBaseNeighbors = NumNeighbors(x, y);
+		OffsetPath offsetPaths[4];
+		int numOffsetPaths = 0;
+		const auto AddOffsetPath = [&](int px, int py, glm::dvec3* gradient, double sign) -> void
+		{
+			if (px < 0 || px >= Params.Width || py < 0 || py >= Params.Height)
+			{
+				return;
+			}
+			auto& o = offsetPaths[numOffsetPaths++];
+			o.pixelIndex = py * Params.Width + px;
+			o.numNeighbors = NumNeighbors(px, py);
+			o.gradient = gradient;
+			o.sign = sign;
+			o.pdfRatio = 1;
+			o.state = TraceCameraRay(px, py, u, o.throughput, o.ray, o.isect) && Specular_GPT(o.isect.Prim->Type) == Specular_GPT(isect.Prim->Type) ? OffsetPath::State::Replay : OffsetPath::State::Invalid;
+		};
+		AddOffsetPath(x + 1, y, &gradients.dx[pixelIndex], 1);
+		AddOffsetPath(x - 1, y, x > 0 ? &gradients.dx[pixelIndex - 1] : nullptr, -1);
+		AddOffsetPath(x, y + 1, &gradients.dy[pixelIndex], 1);
+		AddOffsetPath(x, y - 1, y > 0 ? &gradients.dy[pixelIndex - Params.Width] : nullptr, -1);
+
+		// Records the estimates of a path sampled from the base pixel and its shift.
+		// Both pixels sample the pair of the paths, so the estimates are weighted by the balance heuristic
+		// with the ratio of the PDFs of sampling the offset path from the offset pixel and the base path, which includes the Jacobian.
+		// A pixel value is estimated by the pair with each neighbor, so the primal estimates are averaged over the neighbors.
+		const auto Accumulate = [&](const OffsetPath& o, const glm::dvec3& Cb, const glm::dvec3& Co) -> void
+		{
+			if (Cb == glm::dvec3() && Co == glm::dvec3())
+			{
+				return;
+			}
+			const double pdfRatio = o.state == OffsetPath::State::Invalid ? 0 : o.pdfRatio;
+			const double w = 1 / (1 + pdfRatio);
+			ctx.film[pixelIndex] += w * Cb / (double)(numBaseNeighbors);
+			ctx.film[o.pixelIndex] += w * Co / (double)(o.numNeighbors);
+			*o.gradient += o.sign * w * (Co - Cb);
+		};
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Handle hit with light source
+
+		// The emission from the first hit point cannot be sampled by the light sampling
+		{
+			const auto Cb = (isect.Prim->Type & PrimitiveType::L) > 0 ? throughput * EmittedRadiance(isect, -ray.d) : glm::dvec3();
+			for (int i = 0; i < numOffsetPaths; i++)
+			{
+				auto& o = offsetPaths[i];
+				const auto Co = o.state != OffsetPath::State::Invalid && (o.isect.Prim->Type & PrimitiveType::L) > 0 ? o.throughput * EmittedRadiance(o.isect, -o.ray.d) : glm::dvec3();
+				Accumulate(o, Cb, Co);
+			}
+		}
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		glm::dvec3 referenceThroughput = throughput;
+		int numVertices = 2;
+		while (true)
+		{
+			if (Params.MaxNumVertices != -1 && numVertices >= Params.MaxNumVertices)
+			{
+				break;
+			}
+
+			#pragma region Update information
+
+			const auto geom = isect.geom;
+			const auto* prim = isect.Prim;
+			const int type = isect.Prim->Type & ~PrimitiveType::Emitter;
+			const auto wi = -ray.d;
+
+			// The vertices of the offset paths following the base path by the random number replay,
+			// and the incident direction of the offset path reconnected to the current vertex
+			for (int i = 0; i < numOffsetPaths; i++)
+			{
+				auto& o = offsetPaths[i];
+				if (o.state == OffsetPath::State::Replay)
+				{
+					o.geom = o.isect.geom;
+					o.prim = o.isect.Prim;
+					o.type = o.isect.Prim->Type & ~PrimitiveType::Emitter;
+					o.wi = -o.ray.d;
+				}
+				else if (o.state == OffsetPath::State::Reconnected)
+				{
+					o.geom = geom;
+					o.prim = prim;
+					o.type = type;
+				}
+			}
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Direct light sampling
+
+			{
+				// The light sample is shared by the base and offset paths
+				LightSample_GPT lightSample;
+				lightSample.L = scene.SampleEmitter(PrimitiveType::L, ctx.rng.Next());
+				lightSample.L->SamplePosition(ctx.rng.Next2D(), lightSample.geom);
+				lightSample.pdf = scene.EvaluateEmitterPDF(lightSample.L) * lightSample.L->EvaluatePositionPDF(lightSample.geom, true);
+				assert(lightSample.pdf > 0);
+
+				ctx.numShadowRays++;
+				const auto directB = EstimateDirectLight_GPT(scene, lightSample, prim, type, geom, wi);
+				if (directB != glm::dvec3())
+				{
+					ctx.numContributingShadowRays++;
+				}
+				const auto Cb = throughput * directB;
+				for (int i = 0; i < numOffsetPaths; i++)
+				{
+					auto& o = offsetPaths[i];
+					glm::dvec3 Co;
+					switch (o.state)
+					{
+						case OffsetPath::State::Merged:		 { Co = o.throughput * directB; break; }
+						case OffsetPath::State::Reconnected:
+						case OffsetPath::State::Replay:		 { Co = o.throughput * EstimateDirectLight_GPT(scene, lightSample, o.prim, o.type, o.geom, o.wi); break; }
+						case OffsetPath::State::Invalid:	 { break; }
+					}
+					Accumulate(o, Cb, Co);
+				}
+			}
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Sample next direction
+
+			const auto uD = ctx.rng.Next2D();
+			const double uComp = ctx.rng.Next();
+
+			glm::dvec3 wo;
+			prim->SampleDirection(uD, uComp, type, geom, wi, wo);
+			const double pdfD = prim->EvaluateDirectionPDF(geom, type, wi, wo, true);
+			const auto fs = prim->EvaluateDirection(geom, type, wi, wo, TransportDirection::EL, true);
+			if (fs == glm::dvec3())
+			{
+				break;
+			}
+			assert(pdfD > 0);
+			throughput *= fs / pdfD;
+
+			ray = { geom.p, wo };
+			if (!scene.Intersect(ray, isect))
+			{
+				break;
+			}
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Handle hit with light source
+
+			// PDFs of the light and BSDF sampling strategies in the area measure.
+			// Light sampling cannot generate the path if the previous vertex is degenerated (e.g., specular surface).
+			const bool hitL = (isect.Prim->Type & PrimitiveType::L) > 0;
+			const double G = GeometryTerm(geom, isect.geom);
+			const double pdfLight = hitL ? scene.EvaluateEmitterPDF(isect.Prim) * isect.Prim->EvaluatePositionPDF(isect.geom, false) : 0;
+			const double pdfLightB = prim->EvaluateDirection(geom, type, wi, wo, TransportDirection::EL, false) == glm::dvec3() ? 0 : pdfLight;
+			const auto LeB = hitL ? EmittedRadiance(isect, -ray.d) : glm::dvec3();
+			const auto Cb = PowerHeuristic(pdfD * G, pdfLightB) * throughput * LeB;
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Shift
+
+			// Hybrid shift [Kettunen et al. 2015] with the random number replay:
+			// the offset path follows the base path by sampling with the same random numbers
+			// until the first vertex where both paths are not specular and the next vertex of the base path is not specular,
+			// where the offset path is reconnected to the base path and shares the remaining vertices.
+			// The Jacobian of the replay is the ratio of the PDFs, and that of the reconnection is one in the area measure.
+			// The shift fails if the replayed vertex is specular but the vertex of the base path is not, or vice versa,
+			// so that the shift from the offset pixel decides the reconnection at the same vertex, i.e., the shift is invertible.
+			const bool nextReconnectable = !Specular_GPT(isect.Prim->Type);
+			for (int i = 0; i < numOffsetPaths; i++)
+			{
+				auto& o = offsetPaths[i];
+				glm::dvec3 Co;
+				switch (o.state)
+				{
+					case OffsetPath::State::Merged:
+					{
+						o.throughput *= fs / pdfD;
+						Co = PowerHeuristic(pdfD * G, pdfLightB) * o.throughput * LeB;
+						break;
+					}
+
+					case OffsetPath::State::Reconnected:
+					{
+						// Same outgoing direction with the different incident direction
+						const auto fsO = o.prim->EvaluateDirection(o.geom, o.type, o.wi, wo, TransportDirection::EL, true);
+						if (fsO == glm::dvec3())
+						{
+							o.state = OffsetPath::State::Invalid;
+							break;
+						}
+						const double pdfO = o.prim->EvaluateDirectionPDF(o.geom, o.type, o.wi, wo, true);
+						o.throughput *= fsO / pdfD;
+						o.pdfRatio *= pdfO / pdfD;
+						o.state = OffsetPath::State::Merged;
+						Co = PowerHeuristic(pdfO * G, pdfLight) * o.throughput * LeB;
+						break;
+					}
+
+					case OffsetPath::State::Replay:
+					{
+						if (Reconnectable_GPT(type) && Reconnectable_GPT(o.type) && nextReconnectable)
+						{
+							#pragma region Reconnection
+
+							const auto woO = glm::normalize(isect.geom.p - o.geom.p);
+							const auto fsO = o.prim->EvaluateDirection(o.geom, o.type, o.wi, woO, TransportDirection::EL, true);
+							if (fsO == glm::dvec3() || !scene.Visible(o.geom.p, isect.geom.p))
+							{
+								o.state = OffsetPath::State::Invalid;
+								break;
+							}
+							const double pdfO = o.prim->EvaluateDirectionPDF(o.geom, o.type, o.wi, woO, true);
+							const double GO = GeometryTerm(o.geom, isect.geom);
+							o.throughput *= fsO * GO / (pdfD * G);
+							o.pdfRatio *= pdfO * GO / (pdfD * G);
+							o.wi = -woO;
+							o.state = OffsetPath::State::Reconnected;
+							Co = hitL ? PowerHeuristic(pdfO * GO, pdfLight) * o.throughput * EmittedRadiance(isect, o.wi) : glm::dvec3();
+
+							#pragma endregion
+						}
+						else
+						{
+							#pragma region Random number replay
+
+							glm::dvec3 woO;
+							o.prim->SampleDirection(uD, uComp, o.type, o.geom, o.wi, woO);
+							const auto fsO = o.prim->EvaluateDirection(o.geom, o.type, o.wi, woO, TransportDirection::EL, true);
+							o.ray = { o.geom.p, woO };
+							if (fsO == glm::dvec3() || !scene.Intersect(o.ray, o.isect) || Specular_GPT(o.isect.Prim->Type) == nextReconnectable)
+							{
+								o.state = OffsetPath::State::Invalid;
+								break;
+							}
+							const double pdfO = o.prim->EvaluateDirectionPDF(o.geom, o.type, o.wi, woO, true);
+							o.throughput *= fsO / pdfO;
+							if ((o.isect.Prim->Type & PrimitiveType::L) > 0)
+							{
+								const double pdfLightO = o.prim->EvaluateDirection(o.geom, o.type, o.wi, woO, TransportDirection::EL, false) == glm::dvec3() ? 0 : scene.EvaluateEmitterPDF(o.isect.Prim) * o.isect.Prim->EvaluatePositionPDF(o.isect.geom, false);
+								Co = PowerHeuristic(pdfO * GeometryTerm(o.geom, o.isect.geom), pdfLightO) * o.throughput * EmittedRadiance(o.isect, -o.ray.d);
+							}
+
+							#pragma endregion
+						}
+						break;
+					}
+
+					case OffsetPath::State::Invalid:
+					{
+						break;
+					}
+				}
+				Accumulate(o, Cb, Co);
+			}
+
+			#pragma endregion
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Path termination
+
+			// The base path decides the termination for all paths
+			const double rrProb = Params.RR.ContinuationProb(throughput, referenceThroughput, false);
+			if (Params.RR.Sample(rrProb, ctx.rng.Next()) == 0)
+			{
+				break;
+			}
+			throughput /= rrProb;
+			for (int i = 0; i < numOffsetPaths; i++)
+			{
+				offsetPaths[i].throughput /= rrProb;
+			}
+			numVertices++;
+
+			#pragma endregion
+		}
+	}
+
+	void ProcessSample_PTReuse(const Scene& scene, Context& ctx) const
+	{
+		#pragma region Select a tile
 
-		#pragma region Sample a position on the sensor
+		// A sample processes a tile of pixels, and the tiles are visited in turn like the pixels of gpt
+		const int tileSize = Params.Reuse.TileSize;
+		const int numTilesX = (Params.Width + tileSize - 1) / tileSize;
+		const int numTilesY = (Params.Height + tileSize - 1) / tileSize;
+		const int tileIndex = (int)(NextTile_PTReuse++ % (numTilesX * numTilesY));
+		const int minX = (tileIndex % numTilesX) * tileSize;
+		const int minY = (tileIndex / numTilesX) * tileSize;
+		const int maxX = glm::min(minX + tileSize, Params.Width);
+		const int maxY = glm::min(minY + tileSize, Params.Height);
+
+		// A pixel receives an estimate per visit of its tile
+		const double scale = (double)(numTilesX * numTilesY) / (Params.Width * Params.Height);
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Sample a sensor
+
+		const auto* E = scene.SampleEmitter(PrimitiveType::E, ctx.rng.Next());
+		const double pdfE = scene.EvaluateEmitterPDF(E);
+		assert(pdfE > 0);
 
 		SurfaceGeometry geomE;
 		E->SamplePosition(ctx.rng.Next2D(), geomE);
@@ -466,1290 +3955,2631 @@ private:
 
 		// --------------------------------------------------------------------------------
 
-		#pragma region Temporary variables
+		#pragma region Trace paths
 
-		auto throughput = E->EvaluatePosition(geomE, true) / pdfPE / pdfE;
-		const auto* prim = E;
-		int type = PrimitiveType::E;
-		auto geom = geomE;
-		glm::dvec3 wi;
-		int pixelIndex = -1;
-		int numVertices = 1;
+		// Every pixel traces its own path, whose tail after the first vertex is reused by the other pixels
+		ArenaVector<ReusePath> paths(ArenaAllocator<ReusePath>(ctx.arena));
+		paths.reserve((maxX - minX) * (maxY - minY));
+		for (int y = minY; y < maxY; y++)
+		{
+			for (int x = minX; x < maxX; x++)
+			{
+				paths.emplace_back();
+				auto& path = paths.back();
+				path.pixelIndex = y * Params.Width + x;
+				TracePath_PTReuse(scene, ctx, E, geomE, pdfE * pdfPE, x, y, path);
+				ctx.film[path.pixelIndex] += scale * path.L;
+			}
+		}
 
 		#pragma endregion
 
 		// --------------------------------------------------------------------------------
 
-		while (true)
+		#pragma region Visibility between the first and second vertices
+
+		// V(x_k, y_j) is needed both for the connections and for the PDFs of the other paths sampling y_j
+		const int n = (int)(paths.size());
+		ArenaVector<char> visible(n * n, 0, ArenaAllocator<char>(ctx.arena));
+		for (int k = 0; k < n; k++)
 		{
-			if (Params.MaxNumVertices != -1 && numVertices >= Params.MaxNumVertices)
+			if (!paths[k].reusable)
 			{
-				break;
+				continue;
+			}
+			for (int j = 0; j < n; j++)
+			{
+				if (!paths[j].reusable || !paths[j].tail)
+				{
+					continue;
+				}
+				if (j == k)
+				{
+					visible[k * n + j] = 1;
+					continue;
+				}
+				ctx.numShadowRays++;
+				visible[k * n + j] = scene.Visible(paths[k].geom.p, paths[j].geomY.p) ? 1 : 0;
+			}
+		}
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Reuse tails
+
+		// The second vertex y_j of a reusable path is a sample of every reusable path in the tile,
+		// so the indirect illumination of the pixel i is estimated with the balance heuristic over the paths [Bekaert et al. 2002]:
+		// sum_j f_i(y_j) G(x_i, y_j) V(x_i, y_j) L_r(y_j -> x_i) / sum_k p_k(y_j),
+		// where p_k(y) is the PDF of sampling y from x_k in the area measure, which is zero if y is not visible from x_k.
+		// The paths with the non-reusable first vertices (e.g., specular) use only their own tails, which is handled in TracePath_PTReuse.
+		for (int j = 0; j < n; j++)
+		{
+			const auto& pathJ = paths[j];
+			if (!pathJ.reusable || !pathJ.tail)
+			{
+				continue;
+			}
+
+			double sumPDF = 0;
+			for (int k = 0; k < n; k++)
+			{
+				const auto& pathK = paths[k];
+				if (!visible[k * n + j])
+				{
+					continue;
+				}
+				const auto wo = glm::normalize(pathJ.geomY.p - pathK.geom.p);
+				sumPDF += pathK.prim->EvaluateDirectionPDF(pathK.geom, pathK.type, pathK.wi, wo, false) * GeometryTerm(pathK.geom, pathJ.geomY);
+			}
+			if (sumPDF == 0)
+			{
+				continue;
+			}
+
+			for (int i = 0; i < n; i++)
+			{
+				const auto& pathI = paths[i];
+				if (!visible[i * n + j])
+				{
+					continue;
+				}
+				const auto wo = glm::normalize(pathJ.geomY.p - pathI.geom.p);
+				const auto fs = pathI.prim->EvaluateDirection(pathI.geom, pathI.type, pathI.wi, wo, TransportDirection::EL, false);
+				if (fs == glm::dvec3())
+				{
+					continue;
+				}
+				const auto Lr = ReflectedRadiance_PTReuse(pathJ, -wo);
+				ctx.film[pathI.pixelIndex] += scale * pathI.throughput * fs * GeometryTerm(pathI.geom, pathJ.geomY) * Lr / sumPDF;
+			}
+		}
+
+		#pragma endregion
+	}
+
+	void ProcessSample_MLT(const Scene& scene, Context& ctx) const
+	{
+		// Each thread runs a Markov chain, which is processed one mutation per sample
+		auto& chain = ctx.MLT;
+		auto& sampler = chain.sampler;
+
+		#pragma region Start chain
+
+		if (!chain.initialized)
+		{
+			// The initial state is selected from the bootstrap samples proportional to the luminance,
+			// which is reproduced from the seed of the primary samples
+			if (MLTBootstrap.b == 0)
+			{
+				return;
+			}
+			const int index = MLTBootstrap.dist.Sample(ctx.rng.Next());
+			sampler.Init(MLTBootstrap.seed + static_cast<unsigned int>(index), NumStreams_MLT(), Params.MLT.LargeStepProb, Params.MLT.Sigma);
+			chain.L = EvaluateSample_MLT(scene, ctx, sampler, chain.rasterPos);
+			std::swap(chain.chain, chain.proposedChain);
+			chain.canonical = true;
+			sampler.rng.SetSeed(ctx.rng.NextUInt());
+			chain.initialized = true;
+		}
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Mutation
+
+		glm::dvec2 rasterPos;
+		glm::dvec3 L;
+		bool proposedCanonical = true;
+		if (Type == RendererType::MEMLT)
+		{
+			// Large step, manifold perturbation, or small step.
+			// The manifold perturbation moves the eye subpath keeping the samples of the light (stream 1)
+			// and walks the specular chain of the current state to the new shading point.
+			const double u = ctx.rng.Next();
+			const bool largeStep = u < Params.MLT.LargeStepProb;
+			const bool manifold = !largeStep && u < Params.MLT.LargeStepProb + (1 - Params.MLT.LargeStepProb) * Params.MLT.ManifoldProb;
+			sampler.StartIteration(largeStep, manifold ? 1 : -1);
+			L = EvaluateSample_MEMLT(scene, ctx, sampler, manifold ? &chain.chain : nullptr, chain.proposedChain, proposedCanonical, rasterPos);
+
+			// The other mutations find the chain from the primary samples,
+			// so they can move back only to the state with such a chain
+			if (!manifold && !chain.canonical)
+			{
+				L = glm::dvec3();
+			}
+		}
+		else
+		{
+			sampler.StartIteration();
+			L = EvaluateSample_MLT(scene, ctx, sampler, rasterPos);
+		}
+		const double lumCurr = Luminance(chain.L);
+		const double lumProp = Luminance(L);
+		const double a = lumCurr > 0 ? glm::min(1.0, lumProp / lumCurr) : 1;
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Accumulate contributions
+
+		// Both states are accumulated with the expected values [Veach 1997]
+		// normalized by the luminance, and the film is scaled by the normalization factor in the end
+		if (lumProp > 0)
+		{
+			ctx.film[PixelIndex(rasterPos, Params.Width, Params.Height)] += a * L / lumProp;
+		}
+		if (lumCurr > 0)
+		{
+			ctx.film[PixelIndex(chain.rasterPos, Params.Width, Params.Height)] += (1 - a) * chain.L / lumCurr;
+		}
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Accept or reject
+
+		if (ctx.rng.Next() < a)
+		{
+			chain.L = L;
+			chain.rasterPos = rasterPos;
+			std::swap(chain.chain, chain.proposedChain);
+			chain.canonical = proposedCanonical;
+			sampler.Accept();
+		}
+		else
+		{
+			sampler.Reject();
+		}
+
+		#pragma endregion
+	}
+
+	void ProcessSample_PTMNEE(const Scene& scene, Context& ctx) const
+	{
+		Path path;
+
+		for (int step = 0; Params.MaxNumVertices == -1 || step < Params.MaxNumVertices - 1; step++)
+		{
+			if (step == 0)
+			{
+				#pragma region Sample initial vertex
+
+				PathVertex v;
+
+				// Sample an emitter
+				const auto* emitter = scene.SampleEmitter(PrimitiveType::E, ctx.rng.Next());
+				v.primitive = emitter;
+				v.type = PrimitiveType::E;
+
+				// Sample a position on the emitter
+				emitter->SamplePosition(ctx.rng.Next2D(), v.geom);
+
+				// Create a vertex
+				path.vertices.push_back(v);
+
+				#pragma endregion
+			}
+			else
+			{
+				#pragma region Sample intermediate vertex
+
+				// Previous & two before vertex
+				const auto* pv = &path.vertices.back();
+				const auto* ppv = path.vertices.size() > 1 ? &path.vertices[path.vertices.size() - 2] : nullptr;
+
+				// Sample a next direction
+				glm::dvec3 wo;
+				const auto wi = ppv ? glm::normalize(ppv->geom.p - pv->geom.p) : glm::dvec3();
+				pv->primitive->SampleDirection(ctx.rng.Next2D(), ctx.rng.Next(), pv->type, pv->geom, wi, wo);
+
+				// Intersection query
+				Ray ray = { pv->geom.p, wo };
+				Intersection isect;
+				if (!scene.Intersect(ray, isect))
+				{
+					break;
+				}
+
+				// Set vertex information
+				PathVertex v;
+				v.geom = isect.geom;
+				v.primitive = isect.Prim;
+				v.type = isect.Prim->Type & ~PrimitiveType::Emitter;
+				path.vertices.push_back(v);
+
+				#pragma endregion
+			}
+
+			// --------------------------------------------------------------------------------
+
+			#pragma region Apply NEE or MNEE
+				
+			if ((path.vertices.back().type & (PrimitiveType::D | PrimitiveType::E)) > 0)
+			{
+				#pragma region Sample a seed path
+					
+				const auto SampleSeedPath = [&scene, &ctx](const Path& path, Path& seedPath) -> bool
+				{
+					// Sample a light
+					const auto* L = scene.SampleEmitter(PrimitiveType::L, ctx.rng.Next());
+
+					// Sample a position on the light (x_c in the paper)
+					PathVertex vL;
+					L->SamplePosition(ctx.rng.Next2D(), vL.geom);
+					vL.primitive = L;
+					vL.type = PrimitiveType::L;
+
+					return GenerateSeedPath(scene, vL, path.vertices.back().geom.p, seedPath);
+				};
+
+				Path seedPath;
+				if (!SampleSeedPath(path, seedPath))
+				{
+					continue;
+				}
+
+				assert(seedPath.vertices.size() >= 1);
+
+				if (seedPath.vertices.size() > 1 && Params.MaxNumVertices != -1 && (int)(path.vertices.size() + seedPath.vertices.size() - 1) > Params.MaxNumVertices)
+				{
+					continue;
+				}
+
+				#pragma endregion
+
+				// --------------------------------------------------------------------------------
+
+				if (seedPath.vertices.size() == 1)
+				{
+					#pragma region Case with NEE
+
+					Path evalPath = path;
+					evalPath.vertices.push_back(seedPath.vertices[0]);
+					std::reverse(evalPath.vertices.begin(), evalPath.vertices.end());
+					ctx.film[PixelIndex(evalPath.RasterPosition(), Params.Width, Params.Height)] += evalPath.EvaluateUnweightContribution(scene, 1);
+
+					#pragma endregion
+				}
+				else
+				{
+					#pragma region Case with MNEE
+
+					{
+						#pragma region Manifold walk
+
+						Path optPath;
+						if (!WalkManifold(scene, ctx.arena, seedPath, path.vertices.back().geom.p, optPath))
+						{
+							continue;
+						}
+
+						Path revOptPath;
+						if (!WalkManifold(scene, ctx.arena, optPath, seedPath.vertices.back().geom.p, revOptPath))
+						{
+							continue;
+						}
+
+						#pragma endregion
+
+						// --------------------------------------------------------------------------------
+
+						#pragma region Evaluate contribution
+
+						AccumulateContribution_MNEE(scene, ctx, path, optPath, nullptr, 1);
+
+						#pragma endregion
+					}
+
+					#pragma endregion
+				}
 			}
 
-			// --------------------------------------------------------------------------------
+			#pragma endregion
+		}
+		
+	}
+
+
+	void ProcessSample_PTSMS(const Scene& scene, Context& ctx) const
+	{
+		Path path;
+
+		for (int step = 0; Params.MaxNumVertices == -1 || step < Params.MaxNumVertices - 1; step++)
+		{
+			if (step == 0)
+			{
+				#pragma region Sample initial vertex
+
+				PathVertex v;
 
-			#pragma region Sample direction
+				// Sample an emitter
+				const auto* emitter = scene.SampleEmitter(PrimitiveType::E, ctx.rng.Next());
+				v.primitive = emitter;
+				v.type = PrimitiveType::E;
 
-			glm::dvec3 wo;
-			prim->SampleDirection(ctx.rng.Next2D(), ctx.rng.Next(), type, geom, wi, wo);
-			const double pdfD = prim->EvaluateDirectionPDF(geom, type, wi, wo, true);
+				// Sample a position on the emitter
+				emitter->SamplePosition(ctx.rng.Next2D(), v.geom);
 
-			#pragma endregion
+				// Create a vertex
+				path.vertices.push_back(v);
 
-			// --------------------------------------------------------------------------------
+				#pragma endregion
+			}
+			else
+			{
+				#pragma region Sample intermediate vertex
 
-			#pragma region Calculate pixel index for initial vertex
+				// Previous & two before vertex
+				const auto* pv = &path.vertices.back();
+				const auto* ppv = path.vertices.size() > 1 ? &path.vertices[path.vertices.size() - 2] : nullptr;
 
-			if (type == PrimitiveType::E)
-			{
-				#pragma region Calculate raster position
+				// Sample a next direction
+				glm::dvec3 wo;
+				const auto wi = ppv ? glm::normalize(ppv->geom.p - pv->geom.p) : glm::dvec3();
+				pv->primitive->SampleDirection(ctx.rng.Next2D(), ctx.rng.Next(), pv->type, pv->geom, wi, wo);
 
-				glm::dvec2 rasterPos;
-				if (!prim->RasterPosition(wo, geom, rasterPos))
+				// Intersection query
+				Ray ray = { pv->geom.p, wo };
+				Intersection isect;
+				if (!scene.Intersect(ray, isect))
 				{
 					break;
 				}
 
+				// Set vertex information
+				PathVertex v;
+				v.geom = isect.geom;
+				v.primitive = isect.Prim;
+				v.type = isect.Prim->Type & ~PrimitiveType::Emitter;
+				path.vertices.push_back(v);
+
 				#pragma endregion
+			}
 
-				// --------------------------------------------------------------------------------
+			// --------------------------------------------------------------------------------
 
-				#pragma region Pixel position
+			if ((path.vertices.back().type & (PrimitiveType::D | PrimitiveType::E)) == 0)
+			{
+				continue;
+			}
 
-				pixelIndex = PixelIndex(rasterPos, Params.Width, Params.Height);
+			#pragma region Sample a light
 
-				#pragma endregion
+			PathVertex vL;
+			{
+				const auto* L = scene.SampleEmitter(PrimitiveType::L, ctx.rng.Next());
+				L->SamplePosition(ctx.rng.Next2D(), vL.geom);
+				vL.primitive = L;
+				vL.type = PrimitiveType::L;
 			}
 
 			#pragma endregion
 
 			// --------------------------------------------------------------------------------
 
-			#pragma region Evaluate direction
+			#pragma region NEE
 
-			const auto fs = prim->EvaluateDirection(geom, type, wi, wo, TransportDirection::EL, true);
-			if (fs == glm::dvec3())
+			if (scene.Visible(path.vertices.back().geom.p, vL.geom.p))
 			{
-				break;
+				Path evalPath = path;
+				evalPath.vertices.push_back(vL);
+				std::reverse(evalPath.vertices.begin(), evalPath.vertices.end());
+				ctx.film[PixelIndex(evalPath.RasterPosition(), Params.Width, Params.Height)] += evalPath.EvaluateUnweightContribution(scene, 1);
 			}
 
 			#pragma endregion
 
 			// --------------------------------------------------------------------------------
 
-			#pragma region Update throughput
-
-			assert(pdfD > 0);
-			throughput *= fs / pdfD;
-
-			#pragma endregion
+			#pragma region SMS
 
-			// --------------------------------------------------------------------------------
+			if ((path.vertices.back().type & PrimitiveType::D) > 0 && !SMSCasters.prims.empty())
+			{
+				// Microfacet normals of the glossy vertices, fixed for all trials
+				std::array<glm::dvec2, MaxNumSpecularChainVertices + 2> microfacetU;
+				if (Params.SMS.Glossy)
+				{
+					for (auto& u : microfacetU) { u = ctx.rng.Next2D(); }
+				}
 
-			#pragma region Intersection
+				// Find a solution from a random seed path
+				const auto& target = path.vertices.back().geom.p;
+				Path seedPath;
+				Path optPath;
+				if (!SampleSeedPath_SMS(scene, ctx, vL, microfacetU.data(), seedPath) ||
+					(Params.MaxNumVertices != -1 && (int)(path.vertices.size() + seedPath.vertices.size() - 1) > Params.MaxNumVertices) ||
+					!WalkManifold(scene, ctx.arena, seedPath, target, optPath, microfacetU.data()))
+				{
+					continue;
+				}
 
-			// Setup next ray
-			Ray ray = { geom.p, wo };
+				// Estimate the reciprocal probability of finding the solution with the number of trials
+				// until the same solution is found again, which is a geometric random variable with the mean 1/p.
+				// The estimate is unbiased unless truncated by the maximum number of trials.
+				int numTrials = 1;
+				for (; numTrials < Params.SMS.MaxTrials; numTrials++)
+				{
+					Path trialPath;
+					if (SampleSeedPath_SMS(scene, ctx, vL, microfacetU.data(), seedPath) &&
+						WalkManifold(scene, ctx.arena, seedPath, target, trialPath, microfacetU.data()) &&
+						SameSolution_SMS(optPath, trialPath))
+					{
+						break;
+					}
+				}
 
-			// Intersection query
-			Intersection isect;
-			if (!scene.Intersect(ray, isect))
-			{
-				break;
+				AccumulateContribution_MNEE(scene, ctx, path, optPath, microfacetU.data(), (double)(numTrials));
 			}
 
 			#pragma endregion
+		}
+	}
+	#pragma endregion
 
-			// --------------------------------------------------------------------------------
+private:
 
-			#pragma region Handle hit with light source
+	#pragma region MNEE specific functions
 
-			if ((isect.Prim->Type & PrimitiveType::L) > 0)
-			{
-				// Accumulate to film
-				ctx.film[pixelIndex] +=
-					throughput
-					* isect.Prim->EvaluateDirection(isect.geom, PrimitiveType::L, glm::dvec3(), -ray.d, TransportDirection::EL, false)
-					* isect.Prim->EvaluatePosition(isect.geom, false);
-			}
+	// Evaluates the contribution of the eye subpath #path connected to the light through the specular chain #optPath
+	// (ordered from the light) and accumulates it to the film with #scale.
+	// #microfacetU is the per-vertex sample of the microfacet normals of the glossy vertices in #optPath (nullptr : none).
+	void AccumulateContribution_MNEE(const Scene& scene, Context& ctx, const Path& path, const Path& optPath, const glm::dvec2* microfacetU, double scale) const
+	{
+		const auto C = EvaluateContribution_MNEE(scene, ctx, path, optPath, microfacetU);
+		if (C == glm::dvec3())
+		{
+			return;
+		}
 
-			#pragma endregion
+		// Pixel index
+		int index;
+		{
+			glm::dvec2 rasterPos;
+			const auto& vE  = path.vertices[0];
+			const auto& vEn = path.vertices[1];
+			vE.primitive->RasterPosition(glm::normalize(vEn.geom.p - vE.geom.p), vE.geom, rasterPos);
+			index = PixelIndex(rasterPos, Params.Width, Params.Height);
+		}
 
-			// --------------------------------------------------------------------------------
+		// Accumulate to film
+		ctx.film[index] += C * scale;
+	}
 
-			#pragma region Path termination
+	// Contribution of the eye subpath #path connected to the light through the specular chain #optPath
+	glm::dvec3 EvaluateContribution_MNEE(const Scene& scene, Context& ctx, const Path& path, const Path& optPath, const glm::dvec2* microfacetU) const
+	{
+		#pragma region Compute throughput
 
-			double rrProb = 0.5;
-			if (ctx.rng.Next() > rrProb)
+		glm::dvec3 throughputE;
+		{
+			const auto LocalContrb = [](const glm::dvec3& f, double p) -> glm::dvec3
 			{
-				break;
-			}
-			else
+				assert(p != 0 || (p == 0 && f == glm::dvec3()));
+				if (f == glm::dvec3()) return glm::dvec3();
+				return f / p;
+			};
+
+			const auto& v = path.vertices[0];
+			throughputE = LocalContrb(v.primitive->EvaluatePosition(v.geom, true), v.primitive->EvaluatePositionPDF(v.geom, true) * scene.EvaluateEmitterPDF(v.primitive));
+			for (size_t i = 0; i < path.vertices.size() - 1; i++)
 			{
-				throughput /= rrProb;
+				const auto* v = &path.vertices[i];
+				const auto* vPrev = i >= 1 ? &path.vertices[i - 1] : nullptr;
+				const auto* vNext = &path.vertices[i + 1];
+				const auto wi = vPrev ? glm::normalize(vPrev->geom.p - v->geom.p) : glm::dvec3();
+				const auto wo = glm::normalize(vNext->geom.p - v->geom.p);
+				throughputE *= LocalContrb(v->primitive->EvaluateDirection(v->geom, v->type, wi, wo, TransportDirection::EL, true), v->primitive->EvaluateDirectionPDF(v->geom, v->type, wi, wo, true));
 			}
+		}
 
-			#pragma endregion
+		#pragma endregion
 
-			// --------------------------------------------------------------------------------
+		// --------------------------------------------------------------------------------
 
-			#pragma region Update information
+		#pragma region Compute Fs, fsE, fsL, LeP
 
-			geom = isect.geom;
-			prim = isect.Prim;
-			type = isect.Prim->Type & ~PrimitiveType::Emitter;
-			wi = -ray.d;
-			numVertices++;
+		glm::dvec3 Fs(1);
+		{
+			const int n = (int)(optPath.vertices.size());
+			for (int i = n-2; i >= 1; i--)
+			{
+				const auto& v  = &optPath.vertices[i];
+				const auto& vp = &optPath.vertices[i + 1];
+				const auto& vn = &optPath.vertices[i - 1];
+				const auto wi = glm::normalize(vp->geom.p - v->geom.p);
+				const auto wo = glm::normalize(vn->geom.p - v->geom.p);
+				if ((v->type & PrimitiveType::G) > 0)
+				{
+					// The microfacet normal of a glossy vertex is sampled from the light side,
+					// so the BSDF is weighted by the sampling weight as the specular reflectance
+					const double pdf = v->primitive->EvaluateDirectionPDF(v->geom, v->type, wo, wi, true);
+					if (pdf == 0)
+					{
+						return glm::dvec3();
+					}
+					Fs *= v->primitive->EvaluateDirection(v->geom, v->type, wi, wo, TransportDirection::EL, true) / pdf;
+				}
+				else
+				{
+					Fs *= v->primitive->EvaluateDirection(v->geom, v->type, wi, wo, TransportDirection::EL, true);
+				}
+			}
+		}
 
-			#pragma endregion
+		glm::dvec3 fsE;
+		{
+			const auto& vE  = path.vertices[path.vertices.size()-1];
+			const auto& vEp = path.vertices[path.vertices.size()-2];
+			const auto& vEn = optPath.vertices[optPath.vertices.size()-2];
+			fsE = vE.primitive->EvaluateDirection(vE.geom, vE.type, glm::normalize(vEp.geom.p - vE.geom.p), glm::normalize(vEn.geom.p - vE.geom.p), TransportDirection::EL, true);
 		}
-	}
 
-	void ProcessSample_PTDirect(const Scene& scene, Context& ctx) const
-	{
-		#pragma region Sample a sensor
+		glm::dvec3 fsL;
+		{
+			const auto& vL = optPath.vertices[0];
+			const auto& vLn = optPath.vertices[1];
+			fsL = vL.primitive->EvaluateDirection(vL.geom, vL.type, glm::dvec3(), glm::normalize(vLn.geom.p - vL.geom.p), TransportDirection::LE, true);
+		}
 
-		const auto* E = scene.SampleEmitter(PrimitiveType::E, ctx.rng.Next());
-		const double pdfE = scene.EvaluateEmitterPDF(E);
-		assert(pdfE > 0);
+		glm::dvec3 LeP;
+		{
+			const auto& vL = optPath.vertices[0];
+			LeP = vL.primitive->EvaluatePosition(vL.geom, true);
+		}
 
 		#pragma endregion
 
 		// --------------------------------------------------------------------------------
 
-		#pragma region Sample a position on the sensor
+		#pragma region Compute Jacobian
 
-		SurfaceGeometry geomE;
-		E->SamplePosition(ctx.rng.Next2D(), geomE);
-		const double pdfPE = E->EvaluatePositionPDF(geomE, true);
+		double J = 1;
+		{
+			const int n = (int)(optPath.vertices.size());
+
+			ConstraintJacobian nablaC(n - 2, VertexConstraintJacobian(), ctx.arena);
+			ComputeConstraintJacobian(optPath, nablaC, microfacetU);
+			const double Det = ComputeConstraintJacobianDeterminant(nablaC);
+			J *= glm::abs(Det);		// The determinant can be negative, e.g., with reflections
+
+			const double G = GeometryTerm(optPath.vertices[0].geom, optPath.vertices[1].geom);
+			J *= G;
+		}
 
 		#pragma endregion
 
 		// --------------------------------------------------------------------------------
 
-		#pragma region Temporary variables
+		#pragma region Compute PDFs
 
-		auto throughput = E->EvaluatePosition(geomE, true) / pdfPE / pdfE;
-		const auto* prim = E;
-		int type = PrimitiveType::E;
-		auto geom = geomE;
-		glm::dvec3 wi;
-		int pixelIndex = -1;
-		int numVertices = 1;
+		double pdfL;
+		double pdfPL;
+		{
+			const auto& vL = optPath.vertices[0];
+			pdfL = scene.EvaluateEmitterPDF(vL.primitive);
+			pdfPL = vL.primitive->EvaluatePositionPDF(vL.geom, true);
+		}
+
+		assert(pdfL > 0);
+		assert(pdfPL > 0);
 
 		#pragma endregion
 
 		// --------------------------------------------------------------------------------
 
-		while (true)
+		return throughputE * fsE * Fs * fsL * LeP * J / pdfL / pdfPL;
+	}
+
+	#pragma endregion
+
+private:
+
+	#pragma region SMS specific functions
+
+	void PrepareCasters_SMS(const Scene& scene) const
+	{
+		SMSCasters.prims.clear();
+		SMSCasters.faces.clear();
+		SMSCasters.dist.Clear();
+
+		const int chainType = PrimitiveType::S | (Params.SMS.Glossy ? PrimitiveType::G : PrimitiveType::None);
+		for (const auto& prim : scene.Primitives)
 		{
-			if (Params.MaxNumVertices != -1 && numVertices >= Params.MaxNumVertices)
+			const auto* mesh = prim->MeshRef;
+			if ((prim->Type & chainType) == 0 || !mesh)
 			{
-				break;
+				continue;
 			}
 
-			// --------------------------------------------------------------------------------
-
-			#pragma region Direct light sampling
-
+			for (size_t i = 0; i < mesh->Faces.size() / 3; i++)
 			{
-				#pragma region Sample a light
+				glm::dvec3 p[3];
+				for (int j = 0; j < 3; j++)
+				{
+					const unsigned int k = mesh->Faces[3 * i + j];
+					p[j] = glm::dvec3(mesh->Positions[3 * k], mesh->Positions[3 * k + 1], mesh->Positions[3 * k + 2]);
+				}
 
-				const auto* L = scene.SampleEmitter(PrimitiveType::L, ctx.rng.Next());
-				const double pdfL = scene.EvaluateEmitterPDF(L);
-				assert(pdfL > 0);
+				SMSCasters.prims.push_back(prim.get());
+				SMSCasters.faces.push_back((int)(i));
+				SMSCasters.dist.Add(glm::length(glm::cross(p[1] - p[0], p[2] - p[0])) * 0.5);
+			}
+		}
 
-				#pragma endregion
+		if (SMSCasters.prims.empty())
+		{
+			NGI_LOG_WARN("No specular surfaces found. Only NEE is evaluated.");
+			return;
+		}
 
-				// --------------------------------------------------------------------------------
+		SMSCasters.dist.Normalize();
+		NGI_LOG_INFO("Number of specular triangles: " + std::to_string(SMSCasters.prims.size()));
+	}
 
-				#pragma region Sample a position on the light
+	// Samples a seed path from the light vertex #vL through a random point on the specular surfaces,
+	// propagated through the specular (or glossy) surfaces until a diffuse surface is found.
+	bool SampleSeedPath_SMS(const Scene& scene, Context& ctx, const PathVertex& vL, const glm::dvec2* microfacetU, Path& seedPath) const
+	{
+		seedPath.vertices.clear();
+		seedPath.vertices.push_back(vL);
 
-				SurfaceGeometry geomL;
-				L->SamplePosition(ctx.rng.Next2D(), geomL);
-				const double pdfPL = L->EvaluatePositionPDF(geomL, true);
-				assert(pdfPL > 0);
+		#pragma region Sample a point on the specular surfaces
 
-				#pragma endregion
+		glm::dvec3 p;
+		{
+			const int i = SMSCasters.dist.Sample(ctx.rng.Next());
+			const auto* mesh = SMSCasters.prims[i]->MeshRef;
+			const int f = SMSCasters.faces[i];
+			const auto b = UniformSampleTriangle(ctx.rng.Next2D());
+			glm::dvec3 pf[3];
+			for (int j = 0; j < 3; j++)
+			{
+				const unsigned int k = mesh->Faces[3 * f + j];
+				pf[j] = glm::dvec3(mesh->Positions[3 * k], mesh->Positions[3 * k + 1], mesh->Positions[3 * k + 2]);
+			}
+			p = pf[0] * (1.0 - b.x - b.y) + pf[1] * b.x + pf[2] * b.y;
+		}
 
-				// --------------------------------------------------------------------------------
+		#pragma endregion
 
-				#pragma region Evaluate contribution
+		// --------------------------------------------------------------------------------
 
-				const auto ppL = glm::normalize(geomL.p - geom.p);
-				const auto fsE = prim->EvaluateDirection(geom, type, wi, ppL, TransportDirection::EL, false);
-				const auto fsL = L->EvaluateDirection(geomL, PrimitiveType::L, glm::dvec3(), -ppL, TransportDirection::LE, false);
-				const auto G   = GeometryTerm(geom, geomL);
-				const auto V   = scene.Visible(geom.p, geomL.p) ? 1.0 : 0.0;
-				const auto LeP = L->EvaluatePosition(geomL, true);
-				const auto C   = throughput * fsE * G * V * fsL * LeP / pdfL / pdfPL;
+		#pragma region Propagate the chain
 
-				#pragma endregion
+		const int chainType = PrimitiveType::S | (Params.SMS.Glossy ? PrimitiveType::G : PrimitiveType::None);
+		auto wo = glm::normalize(p - vL.geom.p);
+		while (true)
+		{
+			const auto& pv = seedPath.vertices.back();
 
-				// --------------------------------------------------------------------------------
+			// Intersection query
+			Ray ray = { pv.geom.p, wo };
+			Intersection isect;
+			if (!scene.Intersect(ray, isect))
+			{
+				return false;
+			}
 
-				#pragma region Record to film
+			PathVertex v;
+			v.geom = isect.geom;
+			v.primitive = isect.Prim;
 
-				if (C != glm::dvec3())
+			if ((isect.Prim->Type & chainType) == 0)
+			{
+				// The chain ends with a diffuse surface with at least one specular vertex
+				if ((isect.Prim->Type & PrimitiveType::D) == 0 || seedPath.vertices.size() < 2)
 				{
-					// Recompute pixel index if necessary
-					int index = pixelIndex;
-					if (type == PrimitiveType::E)
-					{
-						glm::dvec2 rasterPos;
-						prim->RasterPosition(ppL, geom, rasterPos);
-						index = PixelIndex(rasterPos, Params.Width, Params.Height);
-					}
-
-					// Accumulate to film
-					ctx.film[index] += C;
+					return false;
 				}
-
-				#pragma endregion
+				v.type = isect.Prim->Type & ~PrimitiveType::Emitter;
+				seedPath.vertices.push_back(v);
+				break;
 			}
 
-			#pragma endregion
-
-			// --------------------------------------------------------------------------------
-
-			#pragma region Sample next direction
-
-			glm::dvec3 wo;
-			prim->SampleDirection(ctx.rng.Next2D(), ctx.rng.Next(), type, geom, wi, wo);
-			const double pdfD = prim->EvaluateDirectionPDF(geom, type, wi, wo, true);
-
-			#pragma endregion
-
-			// --------------------------------------------------------------------------------
+			if ((int)(seedPath.vertices.size()) > MaxNumSpecularChainVertices)
+			{
+				return false;
+			}
 
-			#pragma region Calculate pixel index for initial vertex
+			// Specular surfaces are preferred for the surfaces with both types
+			v.type = (isect.Prim->Type & PrimitiveType::S) > 0 ? PrimitiveType::S : PrimitiveType::G;
+			seedPath.vertices.push_back(v);
 
-			if (type == PrimitiveType::E)
+			// Next direction. The refraction is selected (uComp = 1) for Fresnel surfaces
+			const auto& cv = seedPath.vertices.back();
+			const int i = (int)(seedPath.vertices.size()) - 1;
+			wo = glm::dvec3();
+			cv.primitive->SampleDirection(microfacetU[i], 1, cv.type, cv.geom, -ray.d, wo);
+			if (wo == glm::dvec3())
 			{
-				glm::dvec2 rasterPos;
-				if (!prim->RasterPosition(wo, geom, rasterPos)) { break; }
-				pixelIndex = PixelIndex(rasterPos, Params.Width, Params.Height);
+				return false;
 			}
+		}
 
-			#pragma endregion
+		#pragma endregion
 
-			// --------------------------------------------------------------------------------
+		return true;
+	}
 
-			#pragma region Evaluate direction
+	// Checks if two converged paths are the same solution
+	bool SameSolution_SMS(const Path& path1, const Path& path2) const
+	{
+		if (path1.vertices.size() != path2.vertices.size())
+		{
+			return false;
+		}
 
-			const auto fs = prim->EvaluateDirection(geom, type, wi, wo, TransportDirection::EL, true);
-			if (fs == glm::dvec3())
+		// Compare the specular vertices with the same threshold as the manifold walk
+		double L = 0;
+		for (const auto& v : path1.vertices)
+		{
+			L = glm::max(L, glm::length(v.geom.p));
+		}
+
+		for (size_t i = 1; i < path1.vertices.size() - 1; i++)
+		{
+			const auto& v1 = path1.vertices[i];
+			const auto& v2 = path2.vertices[i];
+			if (v1.primitive != v2.primitive || glm::length(v1.geom.p - v2.geom.p) >= 10e-5 * L)
 			{
-				break;
+				return false;
 			}
+		}
 
-			#pragma endregion
+		return true;
+	}
 
-			// --------------------------------------------------------------------------------
+	#pragma endregion
 
-			#pragma region Update throughput
+private:
 
-			assert(pdfD > 0);
-			throughput *= fs / pdfD;
+	#pragma region BDPT specific functions
 
-			#pragma endregion
+	static int StrategyIndex(int s, int t)
+	{
+		// Strategies are packed in the order of the number of vertices n = s + t >= 2,
+		// so that only the valid (s,t) pairs up to the given n are stored
+		const int n = s + t;
+		return n * (n + 1) / 2 - 3 + s;
+	}
 
-			// --------------------------------------------------------------------------------
+	template <typename PathL>
+	void EvaluateStrategy_BDPT(const Scene& scene, Context& ctx, int s, int t, const PathL& subpathL, double scale) const
+	{
+		#pragma region Strategy statistics
 
-			#pragma region Intersection
+		const int index = StrategyIndex(s, t);
+		StrategyStats* stats = nullptr;
+		StrategyStats* pruningStats = nullptr;
+		if (Params.BDPTStrategy.Stats)
+		{
+			if (index >= (int)(ctx.BDPT.strategyStats.size()))
+			{
+				ctx.BDPT.strategyStats.resize(index + 1);
+			}
+			stats = &ctx.BDPT.strategyStats[index];
+		}
+		if (Params.BDPTStrategy.Pruning)
+		{
+			auto& strategies = StrategyPruning.stats.local().strategies;
+			if (index >= (int)(strategies.size()))
+			{
+				strategies.resize(index + 1);
+			}
+			pruningStats = &strategies[index];
+		}
 
-			// Setup next ray
-			Ray ray = { geom.p, wo };
+		#pragma endregion
 
-			// Intersection query
-			Intersection isect;
-			if (!scene.Intersect(ray, isect))
+		// --------------------------------------------------------------------------------
+
+		#pragma region Strategy pruning
+
+		// The strategy is evaluated with the probability q_{s,t} learned in the previous iterations.
+		// The MIS weights are evaluated with the PDFs scaled by q and the contribution is divided by q_{s,t},
+		// so that the estimator is kept unbiased.
+		const double* strategyProbs = nullptr;
+		double q = 1;
+		if (Params.BDPTStrategy.Pruning)
+		{
+			const int rowIndex = StrategyIndex(0, s + t);
+			if (rowIndex + s + t < (int)(StrategyPruning.probs.size()))
 			{
-				break;
+				strategyProbs = &StrategyPruning.probs[rowIndex];
+				q = strategyProbs[s];
 			}
+			if (q < 1 && ctx.rng.Next() >= q)
+			{
+				if (stats) { stats->numSkipped++; }
+				pruningStats->numSkipped++;
+				return;
+			}
+		}
 
-			#pragma endregion
+		#pragma endregion
 
-			// --------------------------------------------------------------------------------
+		// --------------------------------------------------------------------------------
 
-			#pragma region Path termination
+		#pragma region Connect subpaths & evaluate contribution
 
-			double rrProb = 0.5;
-			if (ctx.rng.Next() > rrProb)
+		std::chrono::high_resolution_clock::time_point start;
+		if (stats || pruningStats)
+		{
+			start = std::chrono::high_resolution_clock::now();
+		}
+
+		auto& path = ctx.BDPT.path;
+		const bool connected = path.Connect(scene, s, t, subpathL, ctx.BDPT.subpathE);
+		if (ManifoldConnections_BDPT && s > 0 && t > 0)
+		{
+			ctx.BDPT.visible[index] = connected;
+		}
+		const auto Cstar = connected ? path.EvaluateUnweightContribution() : glm::dvec3();
+		glm::dvec3 C;
+		int pixelIndex = -1;
+		if (Cstar != glm::dvec3())
+		{
+			const double invSelectionProb = scale / path.SelectionProb() / q;
+			pixelIndex = PixelIndex(path.RasterPosition(), Params.Width, Params.Height);
+			if (Params.BDPTStrategy.OptimalMIS && s + t <= Params.BDPTStrategy.OptimalMISMaxNumVertices)
 			{
-				break;
+				C = EvaluateOptimalMISContribution_BDPT(ctx, Cstar, invSelectionProb, pixelIndex);
 			}
 			else
 			{
-				throughput /= rrProb;
+				C = Cstar * path.EvaluateMISWeight(strategyProbs) * invSelectionProb;
+			}
+			ctx.film[pixelIndex] += C;
+
+			#pragma region Per-strategy images
+
+			if (!Params.BDPTStrategy.SubpathImageDir.empty() && s + t <= Params.BDPTStrategy.SubpathImageMaxNumVertices)
+			{
+				// Images are stored in single precision and allocated only for the strategies with contributions
+				if (index >= (int)(ctx.BDPT.strategyFilms.size()))
+				{
+					ctx.BDPT.strategyFilms.resize(index + 1);
+				}
+				auto& strategyFilm = ctx.BDPT.strategyFilms[index];
+				if (strategyFilm.empty())
+				{
+					strategyFilm.assign(2 * Params.Width * Params.Height, glm::vec3());
+				}
+				strategyFilm[pixelIndex] += glm::vec3(C);
+				strategyFilm[Params.Width * Params.Height + pixelIndex] += glm::vec3(Cstar * invSelectionProb);
 			}
 
 			#pragma endregion
+		}
 
-			// --------------------------------------------------------------------------------
+		#pragma endregion
 
-			#pragma region Update information
+		// --------------------------------------------------------------------------------
 
-			geom = isect.geom;
-			prim = isect.Prim;
-			type = isect.Prim->Type & ~PrimitiveType::Emitter;
-			wi = -ray.d;
-			numVertices++;
+		#pragma region Strategy statistics
 
-			#pragma endregion
+		if (stats || pruningStats)
+		{
+			const auto end = std::chrono::high_resolution_clock::now();
+			const double time = (double)(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()) * 1e-9;
+			const double L = Luminance(C);
+			for (auto* st : { stats, pruningStats })
+			{
+				if (!st)
+				{
+					continue;
+				}
+				st->numConnections++;
+				if (!connected && s > 0 && t > 0) { st->numOccluded++; }
+				else if (C == glm::dvec3()) { st->numZeroContributions++; }
+				st->time += time;
+				st->contribution += C;
+				st->secondMoment += L * L * q;
+				st->fourthMoment += (L * L * q) * (L * L * q);
+			}
 		}
+
+		#pragma endregion
 	}
 
-	void ProcessSample_LT(const Scene& scene, Context& ctx) const
+	glm::dvec3 EvaluateOptimalMISContribution_BDPT(Context& ctx, const glm::dvec3& F, double invSelectionProb, int pixelIndex) const
 	{
-		#pragma region Sample a light
+		// The optimal MIS weights w_i(x) = alpha_i p_i / f + w'_i (1 - sum_j alpha_j p_j / f) [Kondapaneni et al. 2019],
+		// here with the power heuristic w'_i, give the contribution of the strategy s
+		//   (w'_s F + sum_i alpha_i Z_i) / q_s,  Z_i = delta_{is} - w'_s r_i
+		// with the unweighted contribution F = f / p_s, the ratios r_i = p_i / p_s,
+		// and the selection probability q_s of the strategy by the Russian roulette.
+		// The estimator is unbiased for any alpha, because sum_i p_i Z_i = 0 for any path.
+		// For the same reason, the control variates of the paths with zero contributions can be omitted.
+		// The coefficients alpha are learned per pixel bin in the previous iterations,
+		// where alpha = 0 gives the power heuristic.
+		const auto& path = ctx.BDPT.path;
+		const int n = path.NumVertices();
+		const int m = n + 1;
+		auto& ratios = ctx.BDPT.pdfRatios;
+		ratios.resize(m);
+		path.EvaluatePDFRatios(ratios.data());
+		double invWeight = 0;
+		for (int i = 0; i < m; i++)
+		{
+			invWeight += ratios[i] * ratios[i];
+		}
+		const double w = 1.0 / invWeight;
+		const int numVariates = OptimalMIS.numVariates;
+		const int offset = StrategyIndex(0, n) - StrategyIndex(0, 2);
 
-		const auto* L = scene.SampleEmitter(PrimitiveType::L, ctx.rng.Next());
-		const double pdfL = scene.EvaluateEmitterPDF(L);
-		assert(pdfL > 0);
+		#pragma region Contribution
+
+		auto C = w * F;
+		if (!OptimalMIS.alpha.empty())
+		{
+			const auto* alpha = &OptimalMIS.alpha[OptimalMISBin(pixelIndex) * numVariates + offset];
+			C += alpha[path.s];
+			for (int i = 0; i < m; i++)
+			{
+				C -= alpha[i] * (w * ratios[i]);
+			}
+		}
+		C *= invSelectionProb;
 
 		#pragma endregion
 
 		// --------------------------------------------------------------------------------
 
-		#pragma region Sample a position on the light
+		#pragma region Control variates
 
-		SurfaceGeometry geomL;
-		L->SamplePosition(ctx.rng.Next2D(), geomL);
-		const double pdfPL = L->EvaluatePositionPDF(geomL, true);
-		assert(pdfPL > 0);
+		// The paths with t >= 2 of the current sample contribute to the pixel of the eye subpath,
+		// where the terms are summed up over all n, because their contributions are correlated through the shared subpaths.
+		// The paths with t <= 1 contributing to the other pixels are accumulated separately.
+		const bool eyePixel = path.t >= 2;
+		auto& terms = eyePixel ? ctx.BDPT.controlVariates : ctx.BDPT.pathControlVariates;
+		if (!eyePixel || ctx.BDPT.controlVariatesPixel < 0)
+		{
+			terms.assign(numVariates + 3, 0);
+		}
+		for (int i = 0; i < m; i++)
+		{
+			terms[offset + i] -= w * ratios[i] * invSelectionProb;
+		}
+		terms[offset + path.s] += invSelectionProb;
+		terms[numVariates] += w * F.x * invSelectionProb;
+		terms[numVariates + 1] += w * F.y * invSelectionProb;
+		terms[numVariates + 2] += w * F.z * invSelectionProb;
+		if (eyePixel)
+		{
+			ctx.BDPT.controlVariatesPixel = pixelIndex;
+		}
+		else
+		{
+			AccumulateOptimalMISStats_BDPT(terms, pixelIndex);
+		}
 
 		#pragma endregion
 
-		// --------------------------------------------------------------------------------
-
-		#pragma region Temporary variables
-
-		auto throughput = L->EvaluatePosition(geomL, true) / pdfPL / pdfL;
-		const auto* prim = L;
-		int type = PrimitiveType::L;
-		auto geom = geomL;
-		glm::dvec3 wi;
-		int numVertices = 1;
+		return C;
+	}
 
-		#pragma endregion
+	int OptimalMISBin(int pixelIndex) const
+	{
+		const int binSize = Params.BDPTStrategy.OptimalMISBinSize;
+		return (pixelIndex / Params.Width / binSize) * OptimalMIS.binsX + (pixelIndex % Params.Width) / binSize;
+	}
 
-		// --------------------------------------------------------------------------------
+	void AccumulateOptimalMISStats_BDPT(const std::vector<double>& terms, int pixelIndex) const
+	{
+		// Accumulates the moments of the control variates Z and the contribution Y of a sample in the pixel
+		// for the least squares minimizing E[(Y + alpha^T Z)^2]
+		const int numVariates = OptimalMIS.numVariates;
+		const int stride = 1 + numVariates * numVariates + 3 * numVariates;
+		auto& stats = OptimalMIS.stats.local();
+		const glm::dvec3 Y(terms[numVariates], terms[numVariates + 1], terms[numVariates + 2]);
+		const double lum = Luminance(Y);
+		stats.luminances += glm::dvec2(1, lum);
+		if (OptimalMIS.maxLuminance == 0)
+		{
+			return;
+		}
 
-		while (true)
+		// Rare large contributions are clamped in the moments, because they make alpha noisy.
+		// The estimator is unbiased for any alpha, so that the clamping only affects the variance.
+		const auto clampedY = lum > OptimalMIS.maxLuminance ? Y * (OptimalMIS.maxLuminance / lum) : Y;
+		if (stats.moments.empty())
 		{
-			if (Params.MaxNumVertices != -1 && numVertices >= Params.MaxNumVertices)
+			stats.moments.assign(OptimalMIS.binsX * OptimalMIS.binsY * stride, 0);
+		}
+		auto* binMoments = &stats.moments[OptimalMISBin(pixelIndex) * stride];
+		binMoments[0] += 1;
+		auto* ZZ = binMoments + 1;
+		auto* ZY = ZZ + numVariates * numVariates;
+		for (int i = 0; i < numVariates; i++)
+		{
+			if (terms[i] == 0)
 			{
-				break;
+				continue;
 			}
+			for (int j = 0; j < numVariates; j++)
+			{
+				ZZ[i * numVariates + j] += terms[i] * terms[j];
+			}
+			for (int c = 0; c < 3; c++)
+			{
+				ZY[i * 3 + c] += terms[i] * clampedY[c];
+			}
+		}
+	}
 
-			// --------------------------------------------------------------------------------
-
-			#pragma region Sample direction
+	void EvaluateManifoldStrategy_BDPT(const Scene& scene, Context& ctx, int s, int t) const
+	{
+		// Connects x_{s-1} of the light subpath and x_{t-1} of the eye subpath
+		// through the specular surfaces between them as in MNEE
+		const auto& subpathL = ctx.BDPT.subpathL;
+		const auto& subpathE = ctx.BDPT.subpathE;
+		const auto& vL = subpathL.vertices[s - 1];
+		const auto& vE = subpathE.vertices[t - 1];
+		if ((vE.type & PrimitiveType::D) == 0 || vL.alpha == glm::dvec3() || vE.alpha == glm::dvec3())
+		{
+			return;
+		}
 
-			glm::dvec3 wo;
-			prim->SampleDirection(ctx.rng.Next2D(), ctx.rng.Next(), type, geom, wi, wo);
-			const double pdfD = prim->EvaluateDirectionPDF(geom, type, wi, wo, true);
+		#pragma region Manifold walk
 
-			#pragma endregion
+		// The seed path needs a specular surface occluding the direct connection (s,t) evaluated before
+		if (ctx.BDPT.visible[StrategyIndex(s, t)])
+		{
+			return;
+		}
 
-			// --------------------------------------------------------------------------------
+		auto& seedPath = ctx.BDPT.seedPath;
+		if (!GenerateSeedPath(scene, vL, vE.geom.p, seedPath) || seedPath.vertices.size() <= 2)
+		{
+			// Connections without specular surfaces are handled by the standard strategies
+			return;
+		}
 
-			#pragma region Evaluate direction
+		const int k = (int)(seedPath.vertices.size()) - 2;
+		if (k > MaxNumSpecularChainVertices || (Params.MaxNumVertices != -1 && s + k + t > Params.MaxNumVertices))
+		{
+			return;
+		}
 
-			const auto fs = prim->EvaluateDirection(geom, type, wi, wo, TransportDirection::LE, true);
-			if (fs == glm::dvec3())
-			{
-				break;
-			}
+		auto& optPath = ctx.BDPT.manifoldPath;
+		if (!WalkManifold(scene, ctx.arena, seedPath, vE.geom.p, optPath))
+		{
+			return;
+		}
 
-			#pragma endregion
+		#pragma endregion
 
-			// --------------------------------------------------------------------------------
+		// --------------------------------------------------------------------------------
 
-			#pragma region Update throughput
+		#pragma region Connect subpaths & evaluate contribution
 
-			assert(pdfD > 0);
-			throughput *= fs / pdfD;
+		auto& path = ctx.BDPT.path;
+		if (!path.ConnectManifold(scene, s, t, subpathL, subpathE, optPath.vertices.data() + 1, k))
+		{
+			return;
+		}
 
-			#pragma endregion
+		const auto Cstar = path.EvaluateUnweightContribution();
+		if (Cstar == glm::dvec3())
+		{
+			return;
+		}
 
-			// --------------------------------------------------------------------------------
+		ctx.film[PixelIndex(path.RasterPosition(), Params.Width, Params.Height)] += Cstar * path.EvaluateMISWeight() / path.SelectionProb();
 
-			#pragma region Intersection
+		#pragma endregion
+	}
 
-			// Setup next ray
-			Ray ray = { geom.p, wo };
+	void FinalizeIteration_BDPTPruning(const Scene& scene, Random& rng, long long iteration) const
+	{
+		#pragma region Gather statistics of the iteration
 
-			// Intersection query
-			Intersection isect;
-			if (!scene.Intersect(ray, isect))
+		std::vector<StrategyStats> strategies;
+		double samplingTime = 0;
+		long long numSamples = 0;
+		for (auto& local : StrategyPruning.stats)
+		{
+			if (strategies.size() < local.strategies.size())
 			{
-				break;
+				strategies.resize(local.strategies.size());
 			}
+			for (size_t i = 0; i < local.strategies.size(); i++)
+			{
+				auto& dst = strategies[i];
+				const auto& src = local.strategies[i];
+				dst.numConnections += src.numConnections;
+				dst.numSkipped += src.numSkipped;
+				dst.time += src.time;
+				dst.secondMoment += src.secondMoment;
+				dst.fourthMoment += src.fourthMoment;
+			}
+			samplingTime += local.samplingTime;
+			numSamples += local.numSamples;
+			local = StrategyPruningStats();
+		}
+		if (numSamples == 0)
+		{
+			return;
+		}
 
-			#pragma endregion
-
-			// --------------------------------------------------------------------------------
+		#pragma endregion
 
-			#pragma region Handle hit with sensor
+		// --------------------------------------------------------------------------------
 
-			if ((isect.Prim->Type & PrimitiveType::E) > 0)
+		#pragma region Update evaluation probabilities
+
+		// With m_i the second moment and k_i the cost per sample of the strategy i when it is always evaluated,
+		// q_i = sqrt((m_i / sum_j m_j) / (k_i / sum_j k_j)) minimizes the product of the variance and the cost
+		// when the sum of the second moments is taken as the variance.
+		// The second moments are dominated by rare large contributions (e.g., caustics sampled only by a few strategies),
+		// whose underestimation makes the pruning increase the variance far more than it saves the cost.
+		// So q_i is kept one unless the relative standard error of the estimate of m_i has converged below MaxRelError.
+		// Strategies are stored in complete rows of n so that the same probabilities are used for all strategies of a path.
+		const double MaxRelError = 0.2;
+		int maxN = 1;
+		while (StrategyIndex(0, maxN + 1) < (int)(strategies.size()))
+		{
+			maxN++;
+		}
+		strategies.resize(StrategyIndex(0, maxN + 1));
+		std::vector<double> m(strategies.size(), 0);
+		std::vector<double> relError(strategies.size(), 0);
+		std::vector<double> k(strategies.size(), 0);
+		double sumM = 0;
+		double sumK = samplingTime / numSamples;
+		for (size_t i = 0; i < strategies.size(); i++)
+		{
+			const auto& st = strategies[i];
+			if (st.numConnections == 0)
 			{
-				#pragma region Calculate raster position
+				continue;
+			}
+			m[i] = st.secondMoment / numSamples;
+			relError[i] = m[i] > 0 ? glm::sqrt(glm::max(0.0, st.fourthMoment / numSamples - m[i] * m[i]) / numSamples) / m[i] : 0;
+			k[i] = st.time / st.numConnections * (st.numConnections + st.numSkipped) / numSamples;
+			sumM += m[i];
+			sumK += k[i];
+		}
 
-				glm::dvec2 rasterPos;
-				if (!isect.Prim->RasterPosition(-wo, isect.geom, rasterPos))
+		auto& probs = StrategyPruning.probs;
+		probs.assign(strategies.size(), 1);
+		if (sumM > 0)
+		{
+			for (size_t i = 0; i < strategies.size(); i++)
+			{
+				if (strategies[i].numConnections == 0 || k[i] == 0 || m[i] == 0 || relError[i] > MaxRelError)
 				{
-					break;
+					continue;
 				}
-
-				#pragma endregion
-
-				// --------------------------------------------------------------------------------
-
-				#pragma region Accumulate to film
-
-				const int pixelIndex = PixelIndex(rasterPos, Params.Width, Params.Height);
-				ctx.film[pixelIndex] +=
-					throughput
-					* isect.Prim->EvaluateDirection(isect.geom, PrimitiveType::E, glm::dvec3(), -ray.d, TransportDirection::LE, false)
-					* isect.Prim->EvaluatePosition(isect.geom, false);
-
-				#pragma endregion
+				probs[i] = glm::clamp(glm::sqrt((m[i] / sumM) * (sumK / k[i])), Params.BDPTStrategy.PruningMinProb, 1.0);
 			}
+		}
 
-			#pragma endregion
-
-			// --------------------------------------------------------------------------------
+		#pragma endregion
+	}
 
-			#pragma region Path termination
+	void FinalizeIteration_BDPTOptimalMIS(const Scene& scene, Random& rng, long long iteration) const
+	{
+		#pragma region Gather statistics
 
-			double rrProb = 0.5;
-			if (ctx.rng.Next() > rrProb)
-			{
-				break;
-			}
-			else
+		// The statistics are accumulated over all iterations,
+		// because the contributions and the control variates do not depend on the coefficients used in the iterations
+		std::vector<double> moments;
+		glm::dvec2 luminances;
+		for (const auto& local : OptimalMIS.stats)
+		{
+			luminances += local.luminances;
+			if (local.moments.empty())
 			{
-				throughput /= rrProb;
+				continue;
 			}
+			moments.resize(local.moments.size(), 0);
+			std::transform(moments.begin(), moments.end(), local.moments.begin(), moments.begin(), std::plus<double>());
+		}
 
-			#pragma endregion
+		#pragma endregion
 
-			// --------------------------------------------------------------------------------
+		// --------------------------------------------------------------------------------
 
-			#pragma region Update information
+		#pragma region Update bound of contributions
 
-			geom = isect.geom;
-			prim = isect.Prim;
-			type = isect.Prim->Type & ~PrimitiveType::Emitter;
-			wi = -ray.d;
-			numVertices++;
+		// The contributions larger than MaxLuminanceRatio times the average are clamped in the moments
+		// accumulated from the next iteration (see AccumulateOptimalMISStats_BDPT)
+		const double MaxLuminanceRatio = 16;
+		if (luminances.x > 0)
+		{
+			OptimalMIS.maxLuminance = MaxLuminanceRatio * luminances.y / luminances.x;
+		}
 
-			#pragma endregion
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Update coefficients
+
+		// For each pixel bin, alpha minimizing the second moment E[(Y + alpha^T Z)^2]
+		// of the contribution Y and the control variates Z of a sample satisfies E[Z Z^T] alpha = -E[Z Y].
+		// The rarely used strategies give small diagonal elements of E[Z Z^T], so that their alpha is dominated by noise.
+		// The diagonal is increased by RidgeScale times the average of the diagonal elements to shrink such alpha toward 0.
+		// The moments are dominated by rare large contributions, so that alpha solved only with the samples of a bin
+		// is too noisy and increases the variance. The moments of all bins are added to the moments of each bin
+		// as PriorNumSamples samples, so that alpha falls back to the solution of the image in the bins with few samples.
+		const double PriorNumSamples = 4096;
+		const double RidgeScale = 0.01;
+		if (moments.empty())
+		{
+			return;
+		}
+		const int D = OptimalMIS.numVariates;
+		const int stride = 1 + D * D + 3 * D;
+		const int numBins = OptimalMIS.binsX * OptimalMIS.binsY;
+		std::vector<double> imageMoments(stride, 0);
+		for (int bin = 0; bin < numBins; bin++)
+		{
+			std::transform(imageMoments.begin(), imageMoments.end(), moments.begin() + bin * stride, imageMoments.begin(), std::plus<double>());
+		}
+		if (imageMoments[0] == 0)
+		{
+			return;
+		}
+		const double priorWeight = PriorNumSamples / imageMoments[0];
+		auto& alpha = OptimalMIS.alpha;
+		alpha.assign(numBins * D, glm::dvec3());
+		for (int bin = 0; bin < numBins; bin++)
+		{
+			const auto* binMoments = &moments[bin * stride];
+			const auto Moment = [&](int k) -> double
+			{
+				return binMoments[k] + priorWeight * imageMoments[k];
+			};
+			Eigen::MatrixXd A(D, D);
+			Eigen::MatrixXd B(D, 3);
+			for (int i = 0; i < D; i++)
+			{
+				for (int j = 0; j < D; j++)
+				{
+					A(i, j) = Moment(1 + i * D + j);
+				}
+				for (int c = 0; c < 3; c++)
+				{
+					B(i, c) = -Moment(1 + D * D + i * 3 + c);
+				}
+			}
+			const double trace = A.trace();
+			if (trace == 0)
+			{
+				continue;
+			}
+			A.diagonal().array() += RidgeScale * trace / D;
+			const Eigen::MatrixXd X = A.ldlt().solve(B);
+			for (int i = 0; i < D; i++)
+			{
+				alpha[bin * D + i] = glm::dvec3(X(i, 0), X(i, 1), X(i, 2));
+			}
 		}
+
+		#pragma endregion
 	}
 
-	void ProcessSample_LTDirect(const Scene& scene, Context& ctx) const
+	void ReportStrategies_BDPT(tbb::enumerable_thread_specific<Context>& contexts, long long processedSamples) const
 	{
-		#pragma region Sample a light
+		#pragma region Statistics
 
-		const auto* L = scene.SampleEmitter(PrimitiveType::L, ctx.rng.Next());
-		const double pdfL = scene.EvaluateEmitterPDF(L);
-		assert(pdfL > 0);
+		if (Params.BDPTStrategy.Stats)
+		{
+			std::vector<StrategyStats> strategyStats;
+			contexts.combine_each([&](const Context& ctx)
+			{
+				if (strategyStats.size() < ctx.BDPT.strategyStats.size())
+				{
+					strategyStats.resize(ctx.BDPT.strategyStats.size());
+				}
+				for (size_t i = 0; i < ctx.BDPT.strategyStats.size(); i++)
+				{
+					const auto& src = ctx.BDPT.strategyStats[i];
+					auto& dst = strategyStats[i];
+					dst.numConnections += src.numConnections;
+					dst.numSkipped += src.numSkipped;
+					dst.numOccluded += src.numOccluded;
+					dst.numZeroContributions += src.numZeroContributions;
+					dst.time += src.time;
+					dst.contribution += src.contribution;
+				}
+			});
+
+			NGI_LOG_INFO("Per-strategy statistics");
+			NGI_LOG_INDENTER();
+			NGI_LOG_INFO("  n   s   t  connections   skipped   occluded(%)   zero(%)   time(s)   mean luminance");
+			for (int n = 2, index = 0; index < (int)(strategyStats.size()); n++)
+			{
+				for (int s = 0; s <= n && index < (int)(strategyStats.size()); s++, index++)
+				{
+					const auto& stats = strategyStats[index];
+					if (stats.numConnections == 0)
+					{
+						continue;
+					}
+					const double invN = 1.0 / stats.numConnections;
+					const double contribution = Luminance(stats.contribution) / processedSamples;
+					NGI_LOG_INFO(boost::str(boost::format("%3d %3d %3d %12d %9d %13.2f %9.2f %9.3f %16.6f") % n % s % (n - s) % stats.numConnections % stats.numSkipped % (100.0 * stats.numOccluded * invN) % (100.0 * stats.numZeroContributions * invN) % stats.time % contribution));
+				}
+			}
+		}
 
 		#pragma endregion
 
 		// --------------------------------------------------------------------------------
 
-		#pragma region Sample a position on the light
+		#pragma region Per-strategy images
 
-		SurfaceGeometry geomL;
-		L->SamplePosition(ctx.rng.Next2D(), geomL);
-		const double pdfPL = L->EvaluatePositionPDF(geomL, true);
-		assert(pdfPL > 0);
+		if (!Params.BDPTStrategy.SubpathImageDir.empty())
+		{
+			std::vector<glm::dvec3> film;
+			const int numPixels = Params.Width * Params.Height;
+			const int maxN = Params.BDPTStrategy.SubpathImageMaxNumVertices;
+			for (int n = 2; n <= maxN; n++)
+			{
+				for (int s = 0; s <= n; s++)
+				{
+					const int index = StrategyIndex(s, n - s);
+					for (int weighted = 1; weighted >= 0; weighted--)
+					{
+						bool found = false;
+						film.assign(numPixels, glm::dvec3());
+						contexts.combine_each([&](const Context& ctx)
+						{
+							if (index >= (int)(ctx.BDPT.strategyFilms.size()) || ctx.BDPT.strategyFilms[index].empty())
+							{
+								return;
+							}
+							found = true;
+							const auto* src = &ctx.BDPT.strategyFilms[index][weighted ? 0 : numPixels];
+							for (int i = 0; i < numPixels; i++)
+							{
+								film[i] += glm::dvec3(src[i]);
+							}
+						});
+						if (!found)
+						{
+							continue;
+						}
+						for (auto& v : film)
+						{
+							v *= (double)(numPixels) / processedSamples;
+						}
+						const auto path = boost::str(boost::format("%s/n%02d_s%02d_t%02d%s.hdr") % Params.BDPTStrategy.SubpathImageDir % n % s % (n - s) % (weighted ? "" : "_unweighted"));
+						SaveImage(path, film, Params.Width, Params.Height);
+					}
+				}
+			}
+		}
 
 		#pragma endregion
+	}
 
-		// --------------------------------------------------------------------------------
-
-		#pragma region Temporary variables
+	#pragma endregion
 
-		auto throughput = L->EvaluatePosition(geomL, true) / pdfPL / pdfL;
-		const auto* prim = L;
-		int type = PrimitiveType::L;
-		auto geom = geomL;
-		glm::dvec3 wi;
-		int numVertices = 1;
+private:
 
-		#pragma endregion
+	#pragma region LVC specific functions
 
-		// --------------------------------------------------------------------------------
+	void PrepareIteration_LVCBDPT(const Scene& scene, Random& rng, long long iteration) const
+	{
+		#pragma region Sample light subpaths
 
-		while (true)
+		// Each light subpath is written only by the task processing the index
+		auto& subpaths = LightVertexCache.subpaths;
+		subpaths.resize(IterationNumSamples);
+		const unsigned int seed = rng.NextUInt();
+		tbb::parallel_for(tbb::blocked_range<long long>(0, IterationNumSamples, GrainSize), [&](const tbb::blocked_range<long long>& range) -> void
 		{
-			if (Params.MaxNumVertices != -1 && numVertices >= Params.MaxNumVertices)
+			Random rng;
+			rng.SetSeed(seed + static_cast<unsigned int>(range.begin()));
+			for (long long i = range.begin(); i != range.end(); i++)
 			{
-				break;
+				subpaths[i].SampleSubpath(scene, rng, TransportDirection::LE, Params.MaxNumVertices, Params.RR);
 			}
+		});
 
-			// --------------------------------------------------------------------------------
-
-			#pragma region Direct sensor sampling
+		#pragma endregion
 
-			{
-				#pragma region Sample a sensor
+		// --------------------------------------------------------------------------------
 
-				const auto* E = scene.SampleEmitter(PrimitiveType::E, ctx.rng.Next());
-				const double pdfE = scene.EvaluateEmitterPDF(E);
-				assert(pdfE > 0);
+		#pragma region Build vertex references
 
-				#pragma endregion
+		// Offsets of the vertices of each subpath in the cache
+		std::vector<int> offsets(subpaths.size() + 1, 0);
+		for (size_t i = 0; i < subpaths.size(); i++)
+		{
+			offsets[i + 1] = offsets[i] + glm::max(0, (int)(subpaths[i].vertices.size()) - 1);
+		}
 
-				// --------------------------------------------------------------------------------
+		auto& vertices = LightVertexCache.vertices;
+		vertices.resize(offsets.back());
+		tbb::parallel_for(tbb::blocked_range<long long>(0, IterationNumSamples, GrainSize), [&](const tbb::blocked_range<long long>& range) -> void
+		{
+			for (long long i = range.begin(); i != range.end(); i++)
+			{
+				for (int j = offsets[i]; j < offsets[i + 1]; j++)
+				{
+					vertices[j] = { (int)(i), j - offsets[i] + 1 };
+				}
+			}
+		});
 
-				#pragma region Sample a position on the sensor
+		#pragma endregion
+	}
 
-				SurfaceGeometry geomE;
-				E->SamplePosition(ctx.rng.Next2D(), geomE);
-				const double pdfPE = L->EvaluatePositionPDF(geomE, true);
-				assert(pdfPE > 0);
+	#pragma endregion
 
-				#pragma endregion
+private:
 
-				// --------------------------------------------------------------------------------
+	#pragma region VCM specific functions
 
-				#pragma region Evaluate contribution
+	void PrepareIteration_VCM(const Scene& scene, Random& rng, long long iteration) const
+	{
+		// Light subpaths are sampled and cached as LVCBDPT
+		PrepareIteration_LVCBDPT(scene, rng, iteration);
 
-				const auto ppE = glm::normalize(geomE.p - geom.p);
-				const auto fsL = prim->EvaluateDirection(geom, type, wi, ppE, TransportDirection::LE, false);
-				const auto fsE = E->EvaluateDirection(geomE, PrimitiveType::E, glm::dvec3(), -ppE, TransportDirection::EL, false);
-				const auto G   = GeometryTerm(geom, geomE);
-				const auto V   = scene.Visible(geom.p, geomE.p) ? 1.0 : 0.0;
-				const auto LeP = L->EvaluatePosition(geomE, true);
-				const auto C   = throughput * fsL * G * V * fsE * LeP / pdfE / pdfPE;
+		// --------------------------------------------------------------------------------
 
-				#pragma endregion
+		#pragma region Merge radius
 
-				// --------------------------------------------------------------------------------
+		// The radius is reduced as r_i = r_0 i^{(alpha-1)/2} as in progressive photon mapping
+		const double sceneRadius = glm::length(scene.Bound.max - scene.Bound.min) * 0.5;
+		LightVertexGrid.radius = Params.VCM.RadiusScale * sceneRadius * std::pow((double)(iteration + 1), (Params.VCM.RadiusAlpha - 1) * 0.5);
 
-				#pragma region Record to film
+		#pragma endregion
 
-				if (C != glm::dvec3())
-				{
-					// Pixel index
-					glm::dvec2 rasterPos;
-					E->RasterPosition(-ppE, geomE, rasterPos);
-					int index = PixelIndex(rasterPos, Params.Width, Params.Height);
+		// --------------------------------------------------------------------------------
 
-					// Accumulate to film
-					ctx.film[index] += C;
-				}
+		#pragma region Build hash grid
 
-				#pragma endregion
+		// Only the vertices on the non-specular surfaces are merged
+		const auto& subpaths = LightVertexCache.subpaths;
+		auto& vertices = LightVertexGrid.vertices;
+		vertices.clear();
+		for (const auto& ref : LightVertexCache.vertices)
+		{
+			if ((subpaths[ref.path].vertices[ref.index].type & (PrimitiveType::D | PrimitiveType::G)) > 0)
+			{
+				vertices.push_back(ref);
 			}
+		}
 
-			#pragma endregion
+		std::vector<glm::dvec3> points(vertices.size());
+		tbb::parallel_for(tbb::blocked_range<size_t>(0, vertices.size()), [&](const tbb::blocked_range<size_t>& range) -> void
+		{
+			for (size_t i = range.begin(); i != range.end(); i++)
+			{
+				points[i] = subpaths[vertices[i].path].vertices[vertices[i].index].geom.p;
+			}
+		});
 
-			// --------------------------------------------------------------------------------
+		LightVertexGrid.grid.Build(points, LightVertexGrid.radius);
 
-			#pragma region Sample next direction
+		#pragma endregion
+	}
 
-			glm::dvec3 wo;
-			prim->SampleDirection(ctx.rng.Next2D(), ctx.rng.Next(), type, geom, wi, wo);
-			const double pdfD = prim->EvaluateDirectionPDF(geom, type, wi, wo, true);
+	#pragma endregion
 
-			#pragma endregion
+private:
 
-			// --------------------------------------------------------------------------------
+	#pragma region SPPM specific functions
 
-			#pragma region Evaluate direction
+	void PrepareIteration_SPPM(const Scene& scene, Random& rng, long long iteration) const
+	{
+		#pragma region Update pixels with the photons of the previous iteration
 
-			const auto fs = prim->EvaluateDirection(geom, type, wi, wo, TransportDirection::LE, true);
-			if (fs == glm::dvec3())
+		auto& pixels = VisiblePoints.pixels;
+		if (pixels.empty())
+		{
+			pixels.resize(Params.Width * Params.Height);
+			const double sceneRadius = glm::length(scene.Bound.max - scene.Bound.min) * 0.5;
+			for (auto& pixel : pixels)
 			{
-				break;
+				pixel.radius = Params.SPPM.RadiusScale * sceneRadius;
 			}
+		}
+		else
+		{
+			UpdatePixels_SPPM();
+		}
+		VisiblePoints.numIterations++;
 
-			#pragma endregion
+		#pragma endregion
 
-			// --------------------------------------------------------------------------------
+		// --------------------------------------------------------------------------------
 
-			#pragma region Update throughput
+		#pragma region Trace visible points
 
-			assert(pdfD > 0);
-			throughput *= fs / pdfD;
+		// Each eye path is traced through a pixel with the jittered raster position
+		// until it hits a non-specular surface, where the visible point is recorded.
+		// The emitted radiance reaching the eye through the path is accumulated separately.
+		const unsigned int seed = rng.NextUInt();
+		tbb::parallel_for(tbb::blocked_range<int>(0, (int)(pixels.size()), (int)(GrainSize)), [&](const tbb::blocked_range<int>& range) -> void
+		{
+			Random rng;
+			rng.SetSeed(seed + static_cast<unsigned int>(range.begin()));
+			for (int pixelIndex = range.begin(); pixelIndex != range.end(); pixelIndex++)
+			{
+				auto& pixel = pixels[pixelIndex];
+				pixel.valid = false;
 
-			#pragma endregion
+				// Sample a sensor
+				const auto* E = scene.SampleEmitter(PrimitiveType::E, rng.Next());
+				const double pdfE = scene.EvaluateEmitterPDF(E);
+				SurfaceGeometry geomE;
+				E->SamplePosition(rng.Next2D(), geomE);
+				const double pdfPE = E->EvaluatePositionPDF(geomE, true);
+
+				// The raster position is the direction sample of the pinhole camera
+				const glm::dvec2 rasterPos(
+					((pixelIndex % Params.Width) + rng.Next()) / Params.Width,
+					((pixelIndex / Params.Width) + rng.Next()) / Params.Height);
+
+				auto throughput = E->EvaluatePosition(geomE, true) / pdfPE / pdfE;
+				const auto* prim = E;
+				int type = PrimitiveType::E;
+				auto geom = geomE;
+				glm::dvec3 wi;
+				int numVertices = 1;
+				glm::dvec3 referenceThroughput;
+				while (Params.MaxNumVertices == -1 || numVertices < Params.MaxNumVertices)
+				{
+					// Sample direction & update throughput
+					glm::dvec3 wo;
+					prim->SampleDirection(type == PrimitiveType::E ? rasterPos : rng.Next2D(), rng.Next(), type, geom, wi, wo);
+					const auto fs = prim->EvaluateDirection(geom, type, wi, wo, TransportDirection::EL, true);
+					if (fs == glm::dvec3())
+					{
+						break;
+					}
+					throughput *= fs / prim->EvaluateDirectionPDF(geom, type, wi, wo, true);
 
-			// --------------------------------------------------------------------------------
+					// Intersection
+					Ray ray = { geom.p, wo };
+					Intersection isect;
+					if (!scene.Intersect(ray, isect))
+					{
+						break;
+					}
 
-			#pragma region Intersection
+					// Emitted radiance
+					if ((isect.Prim->Type & PrimitiveType::L) > 0)
+					{
+						pixel.direct +=
+							throughput
+							* isect.Prim->EvaluateDirection(isect.geom, PrimitiveType::L, glm::dvec3(), -ray.d, TransportDirection::EL, false)
+							* isect.Prim->EvaluatePosition(isect.geom, false);
+					}
 
-			// Setup next ray
-			Ray ray = { geom.p, wo };
+					geom = isect.geom;
+					prim = isect.Prim;
+					type = isect.Prim->Type & ~PrimitiveType::Emitter;
+					wi = -ray.d;
+					numVertices++;
 
-			// Intersection query
-			Intersection isect;
-			if (!scene.Intersect(ray, isect))
-			{
-				break;
+					// Record the visible point
+					if ((type & (PrimitiveType::D | PrimitiveType::G)) > 0)
+					{
+						pixel.valid = true;
+						pixel.throughput = throughput;
+						pixel.numVertices = numVertices;
+						pixel.prim = prim;
+						pixel.type = type;
+						pixel.geom = geom;
+						pixel.wi = wi;
+						break;
+					}
+
+					// Path termination on the specular surfaces
+					if (numVertices == 2)
+					{
+						referenceThroughput = throughput;
+					}
+					const double rrProb = Params.RR.ContinuationProb(throughput, referenceThroughput, false);
+					if (Params.RR.Sample(rrProb, rng.Next()) == 0)
+					{
+						break;
+					}
+					throughput /= rrProb;
+				}
 			}
+		});
 
-			#pragma endregion
+		#pragma endregion
 
-			// --------------------------------------------------------------------------------
+		// --------------------------------------------------------------------------------
 
-			#pragma region Path termination
+		#pragma region Build hash grid
 
-			double rrProb = 0.5;
-			if (ctx.rng.Next() > rrProb)
-			{
-				break;
-			}
-			else
+		// The grid is queried with the maximum radius and the points are tested with their own radii
+		auto& visiblePixels = VisiblePoints.visiblePixels;
+		visiblePixels.clear();
+		std::vector<glm::dvec3> points;
+		double maxRadius = 0;
+		for (int i = 0; i < (int)(pixels.size()); i++)
+		{
+			if (pixels[i].valid)
 			{
-				throughput /= rrProb;
+				visiblePixels.push_back(i);
+				points.push_back(pixels[i].geom.p);
+				maxRadius = glm::max(maxRadius, pixels[i].radius);
 			}
+		}
 
-			#pragma endregion
-
-			// --------------------------------------------------------------------------------
+		VisiblePoints.grid.Build(points, maxRadius);
 
-			#pragma region Update information
+		#pragma endregion
+	}
 
-			geom = isect.geom;
-			prim = isect.Prim;
-			type = isect.Prim->Type & ~PrimitiveType::Emitter;
-			wi = -ray.d;
-			numVertices++;
+	void UpdatePixels_SPPM() const
+	{
+		// Progressive radius reduction [Hachisuka & Jensen 2009]
+		//   N_{i+1} = N_i + alpha M_i, R_{i+1} = R_i sqrt(N_{i+1} / (N_i + M_i)),
+		//   tau_{i+1} = (tau_i + Phi_i) R_{i+1}^2 / R_i^2
+		// The update is skipped for the pixels without photons, so it can be called more than once per iteration.
+		auto& pixels = VisiblePoints.pixels;
+		tbb::parallel_for(tbb::blocked_range<size_t>(0, pixels.size()), [&](const tbb::blocked_range<size_t>& range) -> void
+		{
+			for (size_t i = range.begin(); i != range.end(); i++)
+			{
+				auto& pixel = pixels[i];
+				const double M = pixel.M.Load();
+				if (M == 0)
+				{
+					continue;
+				}
 
-			#pragma endregion
-		}
+				const double N = pixel.N + Params.SPPM.Alpha * M;
+				const double ratio = N / (pixel.N + M);
+				const glm::dvec3 phi(pixel.phi[0].Load(), pixel.phi[1].Load(), pixel.phi[2].Load());
+				pixel.radius *= glm::sqrt(ratio);
+				pixel.tau = (pixel.tau + phi) * ratio;
+				pixel.N = N;
+				pixel.M = 0;
+				for (auto& v : pixel.phi)
+				{
+					v = 0;
+				}
+			}
+		});
 	}
 
-	void ProcessSample_BDPT(const Scene& scene, Context& ctx) const
+	void ResolveFilm_SPPM(std::vector<glm::dvec3>& film, long long processedSamples) const
 	{
-		#pragma region Sample subpaths
+		// L = tau / (pi R^2 N_e) with the number of emitted photons N_e,
+		// in addition to the emitted radiance averaged over the iterations
+		UpdatePixels_SPPM();
+		const auto& pixels = VisiblePoints.pixels;
+		for (size_t i = 0; i < pixels.size(); i++)
+		{
+			const auto& pixel = pixels[i];
+			film[i] = pixel.tau / (Pi * pixel.radius * pixel.radius * processedSamples) + pixel.direct / (double)(VisiblePoints.numIterations);
+		}
+	}
 
-		ctx.BDPT.subpathL.SampleSubpath(scene, ctx.rng, TransportDirection::LE, Params.MaxNumVertices);
-		ctx.BDPT.subpathE.SampleSubpath(scene, ctx.rng, TransportDirection::EL, Params.MaxNumVertices);
+	#pragma endregion
 
-		#pragma endregion
+private:
 
-		// --------------------------------------------------------------------------------
+	#pragma region Irradiance cache specific functions
 
-		#pragma region Evaluate path combinations
+	// Direct illumination at the vertex estimated with a light sample
+	glm::dvec3 EstimateDirectIllumination_PTCache(const Scene& scene, Context& ctx, const Primitive* prim, int type, const SurfaceGeometry& geom, const glm::dvec3& wi) const
+	{
+		const auto* L = scene.SampleEmitter(PrimitiveType::L, ctx.rng.Next());
+		const double pdfL = scene.EvaluateEmitterPDF(L);
+		SurfaceGeometry geomL;
+		L->SamplePosition(ctx.rng.Next2D(), geomL);
+		const double pdfPL = L->EvaluatePositionPDF(geomL, true);
 
-		const int nL = static_cast<int>(ctx.BDPT.subpathL.vertices.size());
-		const int nE = static_cast<int>(ctx.BDPT.subpathE.vertices.size());
-		for (int n = 2; n <= nE + nL; n++)
+		const auto ppL = glm::normalize(geomL.p - geom.p);
+		const auto fsE = prim->EvaluateDirection(geom, type, wi, ppL, TransportDirection::EL, false);
+		if (fsE == glm::dvec3())
 		{
-			if (Params.MaxNumVertices != -1 && n > Params.MaxNumVertices)
-			{
-				continue;
-			}
+			return glm::dvec3();
+		}
+		const auto fsL = L->EvaluateDirection(geomL, PrimitiveType::L, glm::dvec3(), -ppL, TransportDirection::LE, false);
+		if (fsL == glm::dvec3() || !scene.Visible(geom.p, geomL.p))
+		{
+			return glm::dvec3();
+		}
 
-			// --------------------------------------------------------------------------------
+		return fsE * GeometryTerm(geom, geomL) * fsL * L->EvaluatePosition(geomL, true) / pdfL / pdfPL;
+	}
 
-			const int minS = glm::max(0, n - nE);
-			const int maxS = glm::min(nL, n);
-			for (int s = minS; s <= maxS; s++)
+	// Record of the indirect irradiance at the diffuse vertex with the normal #n,
+	// estimated with the rays stratified in the cosine-weighted hemisphere,
+	// where the incident radiance is estimated by path tracing with the light sampling.
+	// The gradients are estimated from the radiances and the hit distances of the strata [Ward & Heckbert 1992].
+	// The radius is the harmonic mean distance of the hit points limited by the translational gradient,
+	// and clamped by the range of the radius.
+	IrradianceCache::Record ComputeIrradiance_PTCache(const Scene& scene, Context& ctx, const SurfaceGeometry& geomD, const glm::dvec3& n) const
+	{
+		const double sceneRadius = glm::length(scene.Bound.max - scene.Bound.min) * 0.5;
+		const double maxR = Params.Cache.MaxRadiusScale * sceneRadius;
+		const double minR = maxR * 0.01;
+
+		// M x N strata uniformly dividing sin^2(theta) and phi, so that the cosine-weighted hemisphere is equally divided
+		const int M = glm::max(1, (int)(glm::sqrt((double)(Params.Cache.NumRays) / Pi) + 0.5));
+		const int N = glm::max(1, Params.Cache.NumRays / M);
+		glm::dvec3 T, B;
+		OrthonormalBasis(n, T, B);
+
+		auto& radiances = ctx.Cache.radiances;
+		auto& dists = ctx.Cache.dists;
+		radiances.assign(M * N, glm::dvec3());
+		dists.assign(M * N, Inf);
+		double sumInvDist = 0;
+		for (int j = 0; j < M; j++)
+		{
+			for (int k = 0; k < N; k++)
 			{
-				#pragma region Connect subpaths & create fullpath
+				#pragma region Sample a ray
 
-				const int t = n - s;
-				if (!ctx.BDPT.path.Connect(scene, s, t, ctx.BDPT.subpathL, ctx.BDPT.subpathE))
+				const auto u = ctx.rng.Next2D();
+				const double sinTheta = glm::sqrt(((double)(j) + u.x) / M);
+				const double cosTheta = glm::sqrt(glm::max(0.0, 1 - sinTheta * sinTheta));
+				const double phi = 2 * Pi * ((double)(k) + u.y) / N;
+				const auto wo = sinTheta * glm::cos(phi) * T + sinTheta * glm::sin(phi) * B + cosTheta * n;
+
+				Ray ray = { geomD.p, wo };
+				Intersection isect;
+				if (!scene.Intersect(ray, isect))
 				{
 					continue;
 				}
+				const double dist = glm::length(isect.geom.p - geomD.p);
+				dists[j * N + k] = dist;
+				sumInvDist += 1.0 / glm::max(dist, minR);
 
 				#pragma endregion
 
 				// --------------------------------------------------------------------------------
 
-				#pragma region Evaluate contribution
+				#pragma region Estimate incident radiance
 
-				const auto C = ctx.BDPT.path.EvaluateContribution(scene, s) / ctx.BDPT.path.SelectionProb(s);
-				if (C == glm::dvec3())
+				// The emission from the first hit point is excluded as it is the direct illumination
+				glm::dvec3 L;
+				glm::dvec3 throughput(1);
+				glm::dvec3 referenceThroughput = throughput;
+				while (true)
 				{
-					continue;
-				}
-
-				#pragma endregion
+					auto geom = isect.geom;
+					const auto* prim = isect.Prim;
+					const int type = isect.Prim->Type & ~PrimitiveType::Emitter;
+					const auto wi = -ray.d;
+
+					// Direct illumination
+					L += throughput * EstimateDirectIllumination_PTCache(scene, ctx, prim, type, geom, wi);
+
+					// Sample next direction
+					glm::dvec3 wo;
+					prim->SampleDirection(ctx.rng.Next2D(), ctx.rng.Next(), type, geom, wi, wo);
+					const auto fs = prim->EvaluateDirection(geom, type, wi, wo, TransportDirection::EL, true);
+					if (fs == glm::dvec3())
+					{
+						break;
+					}
+					throughput *= fs / prim->EvaluateDirectionPDF(geom, type, wi, wo, true);
 
-				// --------------------------------------------------------------------------------
+					ray = { geom.p, wo };
+					if (!scene.Intersect(ray, isect))
+					{
+						break;
+					}
 
-				#pragma region Accumulate to film
+					// The emission is accounted only if the light sampling cannot generate the path
+					if ((isect.Prim->Type & PrimitiveType::L) > 0 && prim->EvaluateDirection(geom, type, wi, wo, TransportDirection::EL, false) == glm::dvec3())
+					{
+						L +=
+							throughput
+							* isect.Prim->EvaluateDirection(isect.geom, PrimitiveType::L, glm::dvec3(), -ray.d, TransportDirection::EL, false)
+							* isect.Prim->EvaluatePosition(isect.geom, false);
+					}
 
-				ctx.film[PixelIndex(ctx.BDPT.path.RasterPosition(), Params.Width, Params.Height)] += C;
+					// Path termination
+					const double rrProb = Params.RR.ContinuationProb(throughput, referenceThroughput, false);
+					if (Params.RR.Sample(rrProb, ctx.rng.Next()) == 0)
+					{
+						break;
+					}
+					throughput /= rrProb;
+				}
+				radiances[j * N + k] = L;
 
 				#pragma endregion
 			}
 		}
 
-		#pragma endregion
-	}
+		// --------------------------------------------------------------------------------
 
-	void ProcessSample_PTMNEE(const Scene& scene, Context& ctx) const
-	{
-		Path path;
+		#pragma region Irradiance and gradients
 
-		for (int step = 0; Params.MaxNumVertices == -1 || step < Params.MaxNumVertices - 1; step++)
+		// Each stratum has the projected solid angle Pi / (M N)
+		IrradianceCache::Record record;
+		record.p = geomD.p;
+		record.n = n;
+		record.gradR = glm::dmat3(0.0);
+		record.gradT = glm::dmat3(0.0);
+		for (int j = 0; j < M; j++)
 		{
-			if (step == 0)
+			// Boundaries of the strata in theta
+			const double sinThetaMinus = glm::sqrt((double)(j) / M);
+			const double sinThetaPlus = glm::sqrt((double)(j + 1) / M);
+			const double cosThetaMinus = glm::sqrt(1 - (double)(j) / M);
+			const double tanTheta = glm::sqrt(((double)(j) + 0.5) / (M - (double)(j) - 0.5));
+			for (int k = 0; k < N; k++)
 			{
-				#pragma region Sample initial vertex
-
-				PathVertex v;
-
-				// Sample an emitter
-				const auto* emitter = scene.SampleEmitter(PrimitiveType::E, ctx.rng.Next());
-				v.primitive = emitter;
-				v.type = PrimitiveType::E;
+				const auto& L = radiances[j * N + k];
+				record.E += L;
 
-				// Sample a position on the emitter
-				emitter->SamplePosition(ctx.rng.Next2D(), v.geom);
+				// Rotational gradient from the derivative of the cosine by the rotation of the normal
+				const double phi = 2 * Pi * ((double)(k) + 0.5) / N;
+				const auto v = -glm::sin(phi) * T + glm::cos(phi) * B;
+				record.gradR += glm::outerProduct(L, (Pi / (M * N)) * tanTheta * v);
 
-				// Create a vertex
-				path.vertices.push_back(v);
+				// Translational gradient from the changes of the radiances across the boundaries of the strata
+				// in theta, moving along the azimuth of the stratum
+				if (j > 0)
+				{
+					const auto u = glm::cos(phi) * T + glm::sin(phi) * B;
+					const double r = glm::max(glm::min(dists[j * N + k], dists[(j - 1) * N + k]), minR);
+					const double c = (2 * Pi / N) * sinThetaMinus * cosThetaMinus * cosThetaMinus / r;
+					record.gradT += glm::outerProduct(L - radiances[(j - 1) * N + k], c * u);
+				}
 
-				#pragma endregion
+				// and in phi, moving perpendicular to the boundary
+				const int kPrev = (k + N - 1) % N;
+				const double phiMinus = 2 * Pi * (double)(k) / N;
+				const auto vMinus = -glm::sin(phiMinus) * T + glm::cos(phiMinus) * B;
+				const double r = glm::max(glm::min(dists[j * N + k], dists[j * N + kPrev]), minR);
+				const double c = (sinThetaPlus - sinThetaMinus) / r;
+				record.gradT += glm::outerProduct(L - radiances[j * N + kPrev], c * vMinus);
 			}
-			else
-			{
-				#pragma region Sample intermediate vertex
+		}
+		record.E *= Pi / (M * N);
 
-				// Previous & two before vertex
-				const auto* pv = &path.vertices.back();
-				const auto* ppv = path.vertices.size() > 1 ? &path.vertices[path.vertices.size() - 2] : nullptr;
+		#pragma endregion
 
-				// Sample a next direction
-				glm::dvec3 wo;
-				const auto wi = ppv ? glm::normalize(ppv->geom.p - pv->geom.p) : glm::dvec3();
-				pv->primitive->SampleDirection(ctx.rng.Next2D(), ctx.rng.Next(), pv->type, pv->geom, wi, wo);
+		// --------------------------------------------------------------------------------
 
-				// Intersection query
-				Ray ray = { pv->geom.p, wo };
-				Intersection isect;
-				if (!scene.Intersect(ray, isect))
-				{
-					break;
-				}
+		#pragma region Radius
 
-				// Set vertex information
-				PathVertex v;
-				v.geom = isect.geom;
-				v.primitive = isect.Prim;
-				v.type = isect.Prim->Type & ~PrimitiveType::Emitter;
-				path.vertices.push_back(v);
+		// The radius is limited so that the extrapolation by the translational gradient is at most the irradiance
+		record.R = sumInvDist > 0 ? (double)(M * N) / sumInvDist : maxR;
+		const glm::dvec3 gradTLum(Luminance(record.gradT[0]), Luminance(record.gradT[1]), Luminance(record.gradT[2]));
+		const double gradTLumLength = glm::length(gradTLum);
+		if (gradTLumLength > 0 && !getenv("TMP_NOLIM"))
+		{
+			record.R = glm::min(record.R, Luminance(record.E) / gradTLumLength);
+		}
+		record.R = glm::clamp(record.R, minR, maxR);
 
-				#pragma endregion
-			}
+		#pragma endregion
 
-			// --------------------------------------------------------------------------------
+		return record;
+	}
 
-			#pragma region Apply NEE or MNEE
-				
-			if ((path.vertices.back().type & (PrimitiveType::D | PrimitiveType::E)) > 0)
-			{
-				#pragma region Sample a seed path
-					
-				const auto SampleSeedPath = [&scene, &ctx](const Path& path, Path& seedPath) -> bool
-				{
-					seedPath.vertices.clear();
+	#pragma endregion
 
-					// --------------------------------------------------------------------------------
+private:
 
-					#pragma region Sample a light
+	#pragma region GPT specific functions
 
-					PathVertex vL;
-					{
-						// Sample a light
-						const auto* L = scene.SampleEmitter(PrimitiveType::L, ctx.rng.Next());
+	bool Specular_GPT(int type) const
+	{
+		return (type & PrimitiveType::S) > 0;
+	}
 
-						// Sample a position on the light (x_c in the paper)
-						SurfaceGeometry geomL;
-						L->SamplePosition(ctx.rng.Next2D(), geomL);
+	// True if the offset path can be reconnected from the vertex, which needs a non-degenerated BSDF
+	bool Reconnectable_GPT(int type) const
+	{
+		return !Specular_GPT(type) && (type & (PrimitiveType::D | PrimitiveType::G)) > 0;
+	}
 
-						vL.geom = geomL;
-						vL.primitive = L;
-						vL.type = PrimitiveType::L;
-					}
+	// Direct illumination at the vertex estimated with the light sample, weighted by MIS with the BSDF sampling
+	glm::dvec3 EstimateDirectLight_GPT(const Scene& scene, const LightSample_GPT& lightSample, const Primitive* prim, int type, const SurfaceGeometry& geom, const glm::dvec3& wi) const
+	{
+		const auto* L = lightSample.L;
+		const auto& geomL = lightSample.geom;
+		const auto ppL = glm::normalize(geomL.p - geom.p);
+		const auto fs = prim->EvaluateDirection(geom, type, wi, ppL, TransportDirection::EL, false);
+		if (fs == glm::dvec3())
+		{
+			return glm::dvec3();
+		}
+		const auto fsL = L->EvaluateDirection(geomL, PrimitiveType::L, glm::dvec3(), -ppL, TransportDirection::LE, false);
+		if (fsL == glm::dvec3() || !scene.Visible(geom.p, geomL.p))
+		{
+			return glm::dvec3();
+		}
 
-					#pragma endregion
+		// BSDF sampling cannot generate the path if the light is degenerated (e.g., point light)
+		const double G = GeometryTerm(geom, geomL);
+		const double pdfBSDF = L->EvaluatePosition(geomL, false) == glm::dvec3() ? 0 : prim->EvaluateDirectionPDF(geom, type, wi, ppL, false) * G;
+		return PowerHeuristic(lightSample.pdf, pdfBSDF) * fs * G * fsL * L->EvaluatePosition(geomL, true) / lightSample.pdf;
+	}
 
-					// --------------------------------------------------------------------------------
+	// Reconstructs the image from the primal film and the gradients with the screened Poisson equation.
+	// The previous reconstruction is the initial guess of the solver, which is close to the solution in the progress updates.
+	void ResolveFilm_GPT(std::vector<glm::dvec3>& film, long long processedSamples) const
+	{
+		const int numPixels = Params.Width * Params.Height;
+		const double scale = (double)(numPixels) / processedSamples;
+		std::vector<glm::dvec3> dx(numPixels), dy(numPixels);
+		GradientDomain.films.combine_each([&](const GradientFilm& gradients)
+		{
+			for (int i = 0; i < numPixels; i++)
+			{
+				dx[i] += gradients.dx[i] * scale;
+				dy[i] += gradients.dy[i] * scale;
+			}
+		});
 
-					#pragma region Count the number of specular surfaces between x_b and x_c
+		auto& result = GradientDomain.reconstruction;
+		const int numIterations = SolveScreenedPoisson(film, dx, dy, Params.Width, Params.Height, Params.GPT.Alpha, Params.GPT.MaxIterations, 1e-6, result);
+		NGI_LOG_INFO("Screened Poisson reconstruction: " + std::to_string(numIterations) + " iterations");
+		film = result;
+	}
 
-					int countS = 0;
-					{
-						auto currP = path.vertices.back().geom.p;	
-						while (true)
-						{
-							// Intersection query
-							Ray ray = { currP, glm::normalize(vL.geom.p - currP) };
-							Intersection isect;
-							if (!scene.Intersect(ray, isect, EpsF, (1.0f - EpsF) * (float)(glm::length(vL.geom.p - currP))))
-							{
-								break;
-							}
+	#pragma endregion
 
-							// --------------------------------------------------------------------------------
+private:
 
-							// If a vertex with non-specular surface, stop the chain
-							if ((isect.Prim->Type & PrimitiveType::S) == 0)
-							{
-								return false;
-							}
+	#pragma region Path reuse specific functions
 
-							// --------------------------------------------------------------------------------
+	// Traces the path of the pixel (#x, #y) and records the first two vertices and the tail for the reuse.
+	// #path.L receives the emission at the first vertex, the direct illumination of the first vertex,
+	// and the indirect illumination of the first vertex if the tail is not reused.
+	void TracePath_PTReuse(const Scene& scene, Context& ctx, const Primitive* E, const SurfaceGeometry& geomE, double pdfSensor, int x, int y, ReusePath& path) const
+	{
+		path.L = glm::dvec3();
+		path.reusable = false;
+		path.tail = false;
+
+		#pragma region Ray through the pixel
+
+		// The pinhole camera maps the sample to the raster position, whose density is uniform over the image
+		const auto u = ctx.rng.Next2D();
+		const glm::dvec2 rasterPos(((double)(x) + u.x) / Params.Width, ((double)(y) + u.y) / Params.Height);
+		glm::dvec3 woE;
+		E->SampleDirection(rasterPos, 0, PrimitiveType::E, geomE, glm::dvec3(), woE);
+		const auto fsE = E->EvaluateDirection(geomE, PrimitiveType::E, glm::dvec3(), woE, TransportDirection::EL, true);
+		if (fsE == glm::dvec3())
+		{
+			return;
+		}
+		const double pdfDE = E->EvaluateDirectionPDF(geomE, PrimitiveType::E, glm::dvec3(), woE, true);
+		assert(pdfDE > 0);
 
-							// Update information
-							countS++;
-							currP = isect.geom.p;
-						}
-					}
+		Ray ray = { geomE.p, woE };
+		Intersection isect;
+		if (!scene.Intersect(ray, isect))
+		{
+			return;
+		}
 
-					// If countS is zero, it is the case with NEE
-					if (countS == 0)
-					{
-						seedPath.vertices.push_back(vL);
-						return true;
-					}
+		auto throughput = E->EvaluatePosition(geomE, true) / pdfSensor * fsE / pdfDE;
+		if ((isect.Prim->Type & PrimitiveType::L) > 0)
+		{
+			path.L += throughput
+				* isect.Prim->EvaluateDirection(isect.geom, PrimitiveType::L, glm::dvec3(), -ray.d, TransportDirection::EL, false)
+				* isect.Prim->EvaluatePosition(isect.geom, false);
+		}
+		if (Params.MaxNumVertices != -1 && Params.MaxNumVertices <= 2)
+		{
+			return;
+		}
 
-					#pragma endregion
+		#pragma endregion
 
-					// --------------------------------------------------------------------------------
+		// --------------------------------------------------------------------------------
 
-					#pragma region Projection to specular manifold
+		#pragma region First vertex
 
-					seedPath.vertices.push_back(vL);
-					for (int i = 0; i < countS + 1; i++)
-					{
-						// Previous & two before vertex
-						const auto* pv  = &seedPath.vertices.back();
-						const auto* ppv = seedPath.vertices.size() > 1 ? &seedPath.vertices[seedPath.vertices.size() - 2] : nullptr;
+		path.throughput = throughput;
+		path.prim = isect.Prim;
+		path.type = isect.Prim->Type & ~PrimitiveType::Emitter;
+		path.geom = isect.geom;
+		path.wi = -ray.d;
 
-						// --------------------------------------------------------------------------------
+		// The PDF of sampling a direction is evaluated at the first vertex of the other paths
+		path.reusable = (path.type & PrimitiveType::S) == 0 && (path.type & (PrimitiveType::D | PrimitiveType::G)) > 0;
 
-						// Next direction
-						glm::dvec3 wo;
-						if (ppv)
-						{
-							assert(pv->type == PrimitiveType::S);
-							const auto wi = glm::normalize(ppv->geom.p - pv->geom.p);
-							pv->primitive->SampleDirection(glm::dvec2(), 0, pv->type, pv->geom, wi, wo);
-						}
-						else
-						{
-							// Initial direction is fixed to x_c to x_b
-							wo = glm::normalize(path.vertices.back().geom.p - vL.geom.p);
-						}
-			
-						// --------------------------------------------------------------------------------
+		glm::dvec3 ppL, A;
+		path.L += throughput * EstimateDirectLight_PTReuse(scene, ctx, path.prim, path.type, path.geom, path.wi, ppL, A);
 
-						// Intersection query
-						Ray ray = { pv->geom.p, wo };
-						Intersection isect;
-						if (!scene.Intersect(ray, isect))
-						{
-							return false;
-						}
+		#pragma endregion
 
-						// --------------------------------------------------------------------------------
+		// --------------------------------------------------------------------------------
 
-						if (i == countS)
-						{
-							// Failed if the last vertex is not 'D'
-							if ((isect.Prim->Type & PrimitiveType::D) == 0) { return false; }
-						}
-						else
-						{
-							// Failed if 'S' is not found
-							if ((isect.Prim->Type & PrimitiveType::S) == 0) { return false; }
-						}
+		#pragma region Second vertex
 
-						// --------------------------------------------------------------------------------
+		// The path is not terminated by the Russian roulette until the second vertex
+		glm::dvec3 wo;
+		path.prim->SampleDirection(ctx.rng.Next2D(), ctx.rng.Next(), path.type, path.geom, path.wi, wo);
+		const double pdfD = path.prim->EvaluateDirectionPDF(path.geom, path.type, path.wi, wo, true);
+		const auto fs = path.prim->EvaluateDirection(path.geom, path.type, path.wi, wo, TransportDirection::EL, true);
+		if (fs == glm::dvec3())
+		{
+			return;
+		}
+		assert(pdfD > 0);
+		throughput *= fs / pdfD;
 
-						// Add a vertex
-						PathVertex v;
-						v.geom = isect.geom;
-						v.primitive = isect.Prim;
-						v.type = isect.Prim->Type & ~PrimitiveType::Emitter;
-						seedPath.vertices.push_back(v);
-					}
+		ray = { path.geom.p, wo };
+		if (!scene.Intersect(ray, isect))
+		{
+			return;
+		}
 
-					// Number of vertices must be countS + 2
-					assert(seedPath.vertices.size() == countS + 2);
+		if ((isect.Prim->Type & PrimitiveType::L) > 0)
+		{
+			const auto C =
+				throughput
+				* isect.Prim->EvaluateDirection(isect.geom, PrimitiveType::L, glm::dvec3(), -ray.d, TransportDirection::EL, false)
+				* isect.Prim->EvaluatePosition(isect.geom, false);
+			if (C != glm::dvec3())
+			{
+				const double pdfLight = path.prim->EvaluateDirection(path.geom, path.type, path.wi, wo, TransportDirection::EL, false) == glm::dvec3() ? 0 : scene.EvaluateEmitterPDF(isect.Prim) * isect.Prim->EvaluatePositionPDF(isect.geom, false);
+				const double pdfBSDF  = pdfD * GeometryTerm(path.geom, isect.geom);
+				path.L += PowerHeuristic(pdfBSDF, pdfLight) * C;
+			}
+		}
+		if (Params.MaxNumVertices != -1 && Params.MaxNumVertices <= 3)
+		{
+			return;
+		}
 
-					#pragma endregion
+		path.primY = isect.Prim;
+		path.typeY = isect.Prim->Type & ~PrimitiveType::Emitter;
+		path.geomY = isect.geom;
+		const auto wiY = -ray.d;
 
-					// --------------------------------------------------------------------------------
+		#pragma endregion
 
-					return true;
-				};
+		// --------------------------------------------------------------------------------
 
-				Path seedPath;
-				if (!SampleSeedPath(path, seedPath))
+		#pragma region Tail
+
+		// The reflected radiance at the second vertex is recorded as the incident radiance from the two directions
+		// sampled with the light sampling and the BSDF sampling, divided by the PDFs of the original path,
+		// so that it can be evaluated for another incident direction by replacing the BSDF.
+		// The PDFs must cover the BSDF for any incident direction, so only the diffuse vertices are reused.
+		EstimateDirectLight_PTReuse(scene, ctx, path.primY, path.typeY, path.geomY, wiY, path.ppL, path.A);
+		path.B = glm::dvec3();
+		path.primY->SampleDirection(ctx.rng.Next2D(), ctx.rng.Next(), path.typeY, path.geomY, wiY, path.wz);
+		const double pdfZ = path.primY->EvaluateDirectionPDF(path.geomY, path.typeY, wiY, path.wz, true);
+		const auto fsZ = path.primY->EvaluateDirection(path.geomY, path.typeY, wiY, path.wz, TransportDirection::EL, true);
+		if (fsZ != glm::dvec3())
+		{
+			assert(pdfZ > 0);
+			auto throughputZ = glm::dvec3(1.0 / pdfZ);
+			ray = { path.geomY.p, path.wz };
+			auto prim = path.primY;
+			int type = path.typeY;
+			auto geom = path.geomY;
+			auto wi = wiY;
+			int numVertices = 3;
+			double pdfD = pdfZ;
+			while (scene.Intersect(ray, isect))
+			{
+				// Emission from the next vertex
+				if ((isect.Prim->Type & PrimitiveType::L) > 0)
 				{
-					continue;
+					const auto C =
+						throughputZ
+						* isect.Prim->EvaluateDirection(isect.geom, PrimitiveType::L, glm::dvec3(), -ray.d, TransportDirection::EL, false)
+						* isect.Prim->EvaluatePosition(isect.geom, false);
+					if (C != glm::dvec3())
+					{
+						const double pdfLight = prim->EvaluateDirection(geom, type, wi, ray.d, TransportDirection::EL, false) == glm::dvec3() ? 0 : scene.EvaluateEmitterPDF(isect.Prim) * isect.Prim->EvaluatePositionPDF(isect.geom, false);
+						path.B += PowerHeuristic(pdfD * GeometryTerm(geom, isect.geom), pdfLight) * C;
+					}
 				}
 
-				assert(seedPath.vertices.size() >= 1);
-
-				if (seedPath.vertices.size() > 1 && (int)(path.vertices.size() + seedPath.vertices.size() - 1) > Params.MaxNumVertices)
+				// Path termination with the throughput of the original path
+				const double rrProb = Params.RR.ContinuationProb(throughput * fsZ * throughputZ, path.throughput, false);
+				if (Params.RR.Sample(rrProb, ctx.rng.Next()) == 0)
 				{
-					continue;
+					break;
 				}
+				throughputZ /= rrProb;
 
-				#pragma endregion
-
-				// --------------------------------------------------------------------------------
-
-				if (seedPath.vertices.size() == 1)
+				numVertices++;
+				if (Params.MaxNumVertices != -1 && numVertices >= Params.MaxNumVertices)
 				{
-					#pragma region Case with NEE
+					break;
+				}
+				prim = isect.Prim;
+				type = isect.Prim->Type & ~PrimitiveType::Emitter;
+				geom = isect.geom;
+				wi = -ray.d;
 
-					Path evalPath = path;
-					evalPath.vertices.push_back(seedPath.vertices[0]);
-					std::reverse(evalPath.vertices.begin(), evalPath.vertices.end());
-					ctx.film[PixelIndex(evalPath.RasterPosition(), Params.Width, Params.Height)] += evalPath.EvaluateUnweightContribution(scene, 1);
+				// Direct light sampling
+				path.B += throughputZ * EstimateDirectLight_PTReuse(scene, ctx, prim, type, geom, wi, ppL, A);
 
-					#pragma endregion
-				}
-				else
+				// Sample next direction
+				glm::dvec3 wo;
+				prim->SampleDirection(ctx.rng.Next2D(), ctx.rng.Next(), type, geom, wi, wo);
+				pdfD = prim->EvaluateDirectionPDF(geom, type, wi, wo, true);
+				const auto fs = prim->EvaluateDirection(geom, type, wi, wo, TransportDirection::EL, true);
+				if (fs == glm::dvec3())
 				{
-					#pragma region Case with MNEE
+					break;
+				}
+				assert(pdfD > 0);
+				throughputZ *= fs / pdfD;
+				ray = { geom.p, wo };
+			}
+		}
 
-					{
-						#pragma region Manifold walk
+		#pragma endregion
 
-						Path optPath;
-						if (!WalkManifold(scene, seedPath, path.vertices.back().geom.p, optPath))
-						{
-							continue;
-						}
+		// --------------------------------------------------------------------------------
 
-						Path revOptPath;
-						if (!WalkManifold(scene, optPath, seedPath.vertices.back().geom.p, revOptPath))
-						{
-							continue;
-						}
+		#pragma region Indirect illumination
 
-						#pragma endregion
+		path.tail = path.reusable && path.typeY == PrimitiveType::D;
+		if (!path.tail)
+		{
+			path.L += throughput * ReflectedRadiance_PTReuse(path, wiY);
+		}
 
-						// --------------------------------------------------------------------------------
+		#pragma endregion
+	}
 
-						#pragma region Evaluate contribution
+	// Direct illumination at the vertex estimated with a light sample, weighted by MIS with the BSDF sampling.
+	// #ppL and #A receive the direction to the light sample and the contribution without the BSDF.
+	glm::dvec3 EstimateDirectLight_PTReuse(const Scene& scene, Context& ctx, const Primitive* prim, int type, const SurfaceGeometry& geom, const glm::dvec3& wi, glm::dvec3& ppL, glm::dvec3& A) const
+	{
+		A = glm::dvec3();
+		const auto* L = scene.SampleEmitter(PrimitiveType::L, ctx.rng.Next());
+		const double pdfL = scene.EvaluateEmitterPDF(L);
+		assert(pdfL > 0);
+		SurfaceGeometry geomL;
+		L->SamplePosition(ctx.rng.Next2D(), geomL);
+		const double pdfPL = L->EvaluatePositionPDF(geomL, true);
+		assert(pdfPL > 0);
 
-						{
-							#pragma region Compute throughput
+		ppL = glm::normalize(geomL.p - geom.p);
+		const auto fsL = L->EvaluateDirection(geomL, PrimitiveType::L, glm::dvec3(), -ppL, TransportDirection::LE, false);
+		if (fsL == glm::dvec3())
+		{
+			return glm::dvec3();
+		}
+		ctx.numShadowRays++;
+		if (!scene.Visible(geom.p, geomL.p))
+		{
+			return glm::dvec3();
+		}
+		ctx.numContributingShadowRays++;
+
+		// BSDF sampling cannot generate the path if the light is degenerated (e.g., point light)
+		const double G = GeometryTerm(geom, geomL);
+		const double pdfLight = pdfL * pdfPL;
+		const double pdfBSDF  = L->EvaluatePosition(geomL, false) == glm::dvec3() ? 0 : prim->EvaluateDirectionPDF(geom, type, wi, ppL, false) * G;
+		A = PowerHeuristic(pdfLight, pdfBSDF) * G * fsL * L->EvaluatePosition(geomL, true) / pdfLight;
+		return prim->EvaluateDirection(geom, type, wi, ppL, TransportDirection::EL, false) * A;
+	}
 
-							glm::dvec3 throughputE;
-							{
-								const auto LocalContrb = [](const glm::dvec3& f, double p) -> glm::dvec3
-								{
-									assert(p != 0 || (p == 0 && f == glm::dvec3()));
-									if (f == glm::dvec3()) return glm::dvec3();
-									return f / p;
-								};
-
-								const auto& v = path.vertices[0];
-								throughputE = LocalContrb(v.primitive->EvaluatePosition(v.geom, true), v.primitive->EvaluatePositionPDF(v.geom, true) * scene.EvaluateEmitterPDF(v.primitive));
-								for (size_t i = 0; i < path.vertices.size() - 1; i++)
-								{
-									const auto* v = &path.vertices[i];
-									const auto* vPrev = i >= 1 ? &path.vertices[i - 1] : nullptr;
-									const auto* vNext = &path.vertices[i + 1];
-									const auto wi = vPrev ? glm::normalize(vPrev->geom.p - v->geom.p) : glm::dvec3();
-									const auto wo = glm::normalize(vNext->geom.p - v->geom.p);
-									throughputE *= LocalContrb(v->primitive->EvaluateDirection(v->geom, v->type, wi, wo, TransportDirection::EL, true), v->primitive->EvaluateDirectionPDF(v->geom, v->type, wi, wo, true));
-								}
-							}
+	// Radiance reflected at the second vertex of the path toward #wi
+	glm::dvec3 ReflectedRadiance_PTReuse(const ReusePath& path, const glm::dvec3& wi) const
+	{
+		return
+			path.primY->EvaluateDirection(path.geomY, path.typeY, wi, path.ppL, TransportDirection::EL, false) * path.A +
+			path.primY->EvaluateDirection(path.geomY, path.typeY, wi, path.wz, TransportDirection::EL, true) * path.B;
+	}
 
-							#pragma endregion
+	#pragma endregion
 
-							// --------------------------------------------------------------------------------
+private:
 
-							#pragma region Compute Fs, fsE, fsL, LeP
+	#pragma region VPL specific functions
 
-							glm::dvec3 Fs(1);
-							{
-								const int n = (int)(optPath.vertices.size());
-								for (int i = n-2; i >= 1; i--)
-								{
-									const auto& v  = &optPath.vertices[i];
-									const auto& vp = &optPath.vertices[i + 1];
-									const auto& vn = &optPath.vertices[i - 1];
-									Fs *= v->primitive->EvaluateDirection(v->geom, v->type, glm::normalize(vp->geom.p - v->geom.p), glm::normalize(vn->geom.p - v->geom.p), TransportDirection::EL, true);
-								}
-							}
+	void PrepareIteration_VPL(const Scene& scene, Random& rng, long long iteration) const
+	{
+		auto& vpls = VirtualPointLights;
 
-							glm::dvec3 fsE;
-							{
-								const auto& vE  = path.vertices[path.vertices.size()-1];
-								const auto& vEp = path.vertices[path.vertices.size()-2];
-								const auto& vEn = optPath.vertices[optPath.vertices.size()-2];
-								fsE = vE.primitive->EvaluateDirection(vE.geom, vE.type, glm::normalize(vEp.geom.p - vE.geom.p), glm::normalize(vEn.geom.p - vE.geom.p), TransportDirection::EL, true);
-							}
+		#pragma region Sample light subpaths
 
-							glm::dvec3 fsL;
-							{
-								const auto& vL = optPath.vertices[0];
-								const auto& vLn = optPath.vertices[1];
-								fsL = vL.primitive->EvaluateDirection(vL.geom, vL.type, glm::dvec3(), glm::normalize(vLn.geom.p - vL.geom.p), TransportDirection::LE, true);
-							}
+		const long long numLightPaths = Params.VPL.NumLightPaths;
+		vpls.subpaths.resize(numLightPaths);
+		const unsigned int seed = rng.NextUInt();
+		tbb::parallel_for(tbb::blocked_range<long long>(0, numLightPaths, GrainSize), [&](const tbb::blocked_range<long long>& range) -> void
+		{
+			Random rng;
+			rng.SetSeed(seed + static_cast<unsigned int>(range.begin()));
+			for (long long i = range.begin(); i != range.end(); i++)
+			{
+				vpls.subpaths[i].SampleSubpath(scene, rng, TransportDirection::LE, Params.MaxNumVertices, Params.RR);
+			}
+		});
 
-							glm::dvec3 LeP;
-							{
-								const auto& vL = optPath.vertices[0];
-								LeP = vL.primitive->EvaluatePosition(vL.geom, true);
-							}
+		#pragma endregion
 
-							#pragma endregion
+		// --------------------------------------------------------------------------------
+
+		#pragma region Build VPLs
 
-							// --------------------------------------------------------------------------------
+		// The VPLs are placed on the lights and the non-specular surfaces
+		const auto IsVPL = [](const PathVertex& v) -> bool
+		{
+			return (v.type & (PrimitiveType::L | PrimitiveType::D | PrimitiveType::G)) > 0;
+		};
 
-							#pragma region Compute Jacobian
+		// Offsets of the VPLs of each subpath
+		std::vector<int> offsets(numLightPaths + 1, 0);
+		for (long long i = 0; i < numLightPaths; i++)
+		{
+			offsets[i + 1] = offsets[i] + (int)(std::count_if(vpls.subpaths[i].vertices.begin(), vpls.subpaths[i].vertices.end(), IsVPL));
+		}
 
-							double J = 1;
-							{
-								const int n = (int)(optPath.vertices.size());
-								
-								ConstraintJacobian nablaC(n - 2);
-								ComputeConstraintJacobian(optPath, nablaC);
-								const double Det = ComputeConstraintJacobianDeterminant(nablaC);
-								J *= Det;
-
-								const double G = GeometryTerm(optPath.vertices[0].geom, optPath.vertices[1].geom);
-								J *= G;
-							}
+		const int numVPLs = offsets.back();
+		vpls.vertices.resize(numVPLs);
+		vpls.positions.resize(numVPLs);
+		vpls.wi.resize(numVPLs);
+		vpls.powers.resize(numVPLs);
+		vpls.numVertices.resize(numVPLs);
+		tbb::parallel_for(tbb::blocked_range<long long>(0, numLightPaths, GrainSize), [&](const tbb::blocked_range<long long>& range) -> void
+		{
+			for (long long i = range.begin(); i != range.end(); i++)
+			{
+				// The throughput is divided by the probabilities of the Russian roulette up to the vertex
+				const auto& vertices = vpls.subpaths[i].vertices;
+				double rrProb = 1;
+				int j = offsets[i];
+				for (size_t k = 0; k < vertices.size(); k++)
+				{
+					const auto& v = vertices[k];
+					if (IsVPL(v))
+					{
+						vpls.vertices[j] = &v;
+						vpls.positions[j] = v.geom.p;
+						vpls.wi[j] = k > 0 ? glm::normalize(vertices[k - 1].geom.p - v.geom.p) : glm::dvec3();
+						vpls.powers[j] = v.alpha / rrProb / (double)(numLightPaths);
+						vpls.numVertices[j] = (int)(k) + 1;
+						j++;
+					}
+					rrProb *= v.rrProb;
+				}
+			}
+		});
 
-							#pragma endregion
+		#pragma endregion
 
-							// --------------------------------------------------------------------------------
+		// --------------------------------------------------------------------------------
 
-							#pragma region Compute PDFs
+		#pragma region Clamping
 
-							double pdfL;
-							double pdfPL;
-							{
-								const auto& vL = optPath.vertices[0];
-								pdfL = scene.EvaluateEmitterPDF(vL.primitive);
-								pdfPL = vL.primitive->EvaluatePositionPDF(vL.geom, true);
-							}
+		const double sceneRadius = glm::length(scene.Bound.max - scene.Bound.min) * 0.5;
+		const double clampDist = Params.VPL.ClampDistanceScale * sceneRadius;
+		vpls.maxG = clampDist > 0 ? 1.0 / (clampDist * clampDist) : Inf;
 
-							assert(pdfL > 0);
-							assert(pdfPL > 0);
+		#pragma endregion
 
-							#pragma endregion
+		// --------------------------------------------------------------------------------
 
-							// --------------------------------------------------------------------------------
+		#pragma region Build light tree
 
-							#pragma region Compute contribution & Accumulate to film
+		if (Params.VPL.NumSamples > 0)
+		{
+			std::vector<double> intensities(numVPLs);
+			for (int i = 0; i < numVPLs; i++)
+			{
+				intensities[i] = Luminance(vpls.powers[i]);
+			}
+			vpls.tree.Build(vpls.positions, intensities);
+		}
 
-							// Contribution
-							const auto C = throughputE * fsE * Fs * fsL * LeP * J / pdfL / pdfPL;
+		#pragma endregion
+	}
 
-							// Pixel index
-							int index;
-							{
-								glm::dvec2 rasterPos;
-								const auto& vE  = path.vertices[0];
-								const auto& vEn = path.vertices[1];
-								vE.primitive->RasterPosition(glm::normalize(vEn.geom.p - vE.geom.p), vE.geom, rasterPos);
-								index = PixelIndex(rasterPos, Params.Width, Params.Height);
-							}
+	// Contribution of the VPLs to the non-specular vertex #geom reached by the eye subpath with #numVertices vertices,
+	// evaluated for all VPLs or the VPLs sampled with the light tree
+	glm::dvec3 GatherVPLs(const Scene& scene, Context& ctx, const Primitive* prim, int type, const SurfaceGeometry& geom, const glm::dvec3& wi, int numVertices) const
+	{
+		const auto& vpls = VirtualPointLights;
 
-							// Accumulate to film
-							ctx.film[index] += C;
+		const auto EvaluateVPL = [&](int i) -> glm::dvec3
+		{
+			if (Params.MaxNumVertices != -1 && numVertices + vpls.numVertices[i] > Params.MaxNumVertices)
+			{
+				return glm::dvec3();
+			}
 
-							#pragma endregion
-						}
+			const auto* v = vpls.vertices[i];
+			const auto wo = glm::normalize(v->geom.p - geom.p);
+			const auto fsE = prim->EvaluateDirection(geom, type, wi, wo, TransportDirection::EL, false);
+			if (fsE == glm::dvec3())
+			{
+				return glm::dvec3();
+			}
+			const auto fsL = v->primitive->EvaluateDirection(v->geom, v->type, vpls.wi[i], -wo, TransportDirection::LE, false);
+			if (fsL == glm::dvec3())
+			{
+				return glm::dvec3();
+			}
+			if (!scene.Visible(geom.p, v->geom.p))
+			{
+				return glm::dvec3();
+			}
 
-						#pragma endregion
-					}
+			const double G = glm::min(GeometryTerm(geom, v->geom), vpls.maxG);
+			return fsE * G * fsL * vpls.powers[i];
+		};
 
-					#pragma endregion
+		glm::dvec3 L;
+		const int numVPLs = (int)(vpls.vertices.size());
+		if (Params.VPL.NumSamples == 0)
+		{
+			for (int i = 0; i < numVPLs; i++)
+			{
+				L += EvaluateVPL(i);
+			}
+		}
+		else
+		{
+			// The distance to the nodes is bounded by the clamping distance as the geometry term
+			const double minDist2 = 1.0 / vpls.maxG;
+			for (int k = 0; k < Params.VPL.NumSamples; k++)
+			{
+				double prob;
+				const int i = vpls.tree.Sample(geom.p, ctx.rng.Next(), minDist2, prob);
+				if (i < 0)
+				{
+					break;
 				}
+				L += EvaluateVPL(i) / prob / (double)(Params.VPL.NumSamples);
 			}
-
-			#pragma endregion
 		}
-		
+
+		return L;
 	}
 
 	#pragma endregion
 
 private:
 
-	#pragma region MNEE specific functions
+	#pragma region MLT specific functions
 
-	struct VertexConstraintJacobian
+	void Bootstrap_MLT(const Scene& scene, Random& rng) const
 	{
-		glm::dmat2 A;
-		glm::dmat2 B;
-		glm::dmat2 C;
-	};
+		// Luminance of the independent samples, each with the primary samples generated from the seed
+		const long long n = Params.MLT.NumBootstrapSamples;
+		const unsigned int seed = rng.NextUInt();
+		std::vector<double> weights(n);
+		tbb::parallel_for(tbb::blocked_range<long long>(0, n, GrainSize), [&](const tbb::blocked_range<long long>& range) -> void
+		{
+			Context ctx;
+			MLTSampler sampler;
+			for (long long i = range.begin(); i != range.end(); i++)
+			{
+				sampler.Init(seed + static_cast<unsigned int>(i), NumStreams_MLT(), Params.MLT.LargeStepProb, Params.MLT.Sigma);
+				glm::dvec2 rasterPos;
+				weights[i] = Luminance(EvaluateSample_MLT(scene, ctx, sampler, rasterPos));
+			}
+		});
 
-	typedef std::vector<VertexConstraintJacobian> ConstraintJacobian;
+		MLTBootstrap.seed = seed;
+		MLTBootstrap.dist.Clear();
+		double sum = 0;
+		for (const double w : weights)
+		{
+			MLTBootstrap.dist.Add(w);
+			sum += w;
+		}
+		MLTBootstrap.b = sum / n;
+		if (sum > 0)
+		{
+			MLTBootstrap.dist.Normalize();
+		}
+		else
+		{
+			NGI_LOG_WARN("No bootstrap samples with nonzero contribution");
+		}
+		NGI_LOG_INFO(boost::str(boost::format("Normalization factor: %.6e") % MLTBootstrap.b));
+	}
 
-	void ComputeConstraintJacobian(const Path& path, ConstraintJacobian& nablaC) const
+	// Contribution of the path sampled with the primary samples of #sampler
+	glm::dvec3 EvaluateSample_MLT(const Scene& scene, Context& ctx, MLTSampler& sampler, glm::dvec2& rasterPos) const
 	{
-		const int n = (int)(path.vertices.size());
-		for (int i = 1; i < n - 1; i++)
+		if (Type == RendererType::MEMLT)
 		{
-			#pragma region Some precomputation
-
-			const auto& x  = path.vertices[i].geom;
-			const auto& xp = path.vertices[i-1].geom;
-			const auto& xn = path.vertices[i+1].geom;
-			
-			const auto wi = glm::normalize(xp.p - x.p);
-			const auto wo = glm::normalize(xn.p - x.p);
-			const auto H  = glm::normalize(wi + wo);
-
-			const double inv_wiL = 1.0 / glm::length(xp.p - x.p);
-			const double inv_woL = 1.0 / glm::length(xn.p - x.p);
-			const double inv_HL  = 1.0 / glm::length(wi + wo);
-			
-			const double dot_H_n    = glm::dot(x.sn, H);
-			const double dot_H_dndu = glm::dot(x.dndu, H);
-			const double dot_H_dndv = glm::dot(x.dndv, H);
-			const double dot_u_n    = glm::dot(x.dpdu, x.sn);
-			const double dot_v_n    = glm::dot(x.dpdv, x.sn);
-
-			const auto s = x.dpdu - dot_u_n * x.sn;
-			const auto t = x.dpdv - dot_v_n * x.sn;
-
-			const double div_inv_wiL_HL = inv_wiL * inv_HL;
-			const double div_inv_woL_HL = inv_woL * inv_HL;
-
-			#pragma endregion
+			bool canonical;
+			return EvaluateSample_MEMLT(scene, ctx, sampler, nullptr, ctx.MLT.proposedChain, canonical, rasterPos);
+		}
 
-			// --------------------------------------------------------------------------------
+		auto& subpathL = ctx.BDPT.subpathL;
+		auto& subpathE = ctx.BDPT.subpathE;
+		auto& path = ctx.BDPT.path;
 
-			#pragma region Compute $A_i$ (derivative w.r.t. $x_{i-1}$)
-			
+		if (Type == RendererType::PSSMLT)
+		{
+			#pragma region Path tracing
+
+			// Sum of the contributions of the eye subpath hitting the lights (strategies with s = 0),
+			// all of which are on the same raster position
+			sampler.StartStream(0);
+			subpathL.vertices.clear();
+			subpathE.SampleSubpath(scene, sampler, TransportDirection::EL, Params.MaxNumVertices, Params.RR);
+			const int nE = static_cast<int>(subpathE.vertices.size());
+			glm::dvec3 L;
+			for (int t = 2; t <= nE; t++)
 			{
-				const auto tu = (xp.dpdu - wi * glm::dot(wi, xp.dpdu)) * div_inv_wiL_HL;
-				const auto tv = (xp.dpdv - wi * glm::dot(wi, xp.dpdv)) * div_inv_wiL_HL;
-				const auto dHdu = tu - H * glm::dot(tu, H);
-				const auto dHdv = tv - H * glm::dot(tv, H);
-				nablaC[i-1].A = glm::dmat2(
-					glm::dot(dHdu, s), glm::dot(dHdu, t),
-					glm::dot(dHdv, s), glm::dot(dHdv, t));
+				if (!path.Connect(scene, 0, t, subpathL, subpathE))
+				{
+					continue;
+				}
+				const auto Cstar = path.EvaluateUnweightContribution();
+				if (Cstar == glm::dvec3())
+				{
+					continue;
+				}
+				L += Cstar / path.SelectionProb();
+				rasterPos = path.RasterPosition();
 			}
+			return L;
 
 			#pragma endregion
-			
-			// --------------------------------------------------------------------------------
-
-			#pragma region Compute $B_i$ (derivative w.r.t. $x_i$)
-
+		}
+		else
+		{
+			#pragma region Bidirectional path tracing with a strategy
+
+			// The path length n in [2, MaxNumVertices] and the strategy (s,n-s) are selected uniformly by the samples of the stream 2,
+			// and the light and eye subpaths are sampled with the streams 0 and 1 respectively
+			const int numLengths = Params.MaxNumVertices - 1;
+			sampler.StartStream(2);
+			const int n = 2 + glm::min((int)(sampler.Next() * numLengths), numLengths - 1);
+			const int s = glm::min((int)(sampler.Next() * (n + 1)), n);
+			const int t = n - s;
+
+			sampler.StartStream(0);
+			subpathL.SampleSubpath(scene, sampler, TransportDirection::LE, s, Params.RR);
+			sampler.StartStream(1);
+			subpathE.SampleSubpath(scene, sampler, TransportDirection::EL, t, Params.RR);
+			if ((int)(subpathL.vertices.size()) != s || (int)(subpathE.vertices.size()) != t)
 			{
-				const auto tu = -x.dpdu * (div_inv_wiL_HL + div_inv_woL_HL) + wi * (glm::dot(wi, x.dpdu) * div_inv_wiL_HL) + wo * (glm::dot(wo, x.dpdu) * div_inv_woL_HL);
-				const auto tv = -x.dpdv * (div_inv_wiL_HL + div_inv_woL_HL) + wi * (glm::dot(wi, x.dpdv) * div_inv_wiL_HL) + wo * (glm::dot(wo, x.dpdv) * div_inv_woL_HL);
-				const auto dHdu = tu - H * glm::dot(tu, H);
-				const auto dHdv = tv - H * glm::dot(tv, H);
-				nablaC[i-1].B = glm::dmat2(
-					glm::dot(dHdu, s) - glm::dot(x.dpdu, x.dndu) * dot_H_n - dot_u_n * dot_H_dndu,
-					glm::dot(dHdu, t) - glm::dot(x.dpdv, x.dndu) * dot_H_n - dot_v_n * dot_H_dndu,
-					glm::dot(dHdv, s) - glm::dot(x.dpdu, x.dndv) * dot_H_n - dot_u_n * dot_H_dndv,
-					glm::dot(dHdv, t) - glm::dot(x.dpdv, x.dndv) * dot_H_n - dot_v_n * dot_H_dndv);
+				return glm::dvec3();
 			}
 
-			#pragma endregion
-			
-			// --------------------------------------------------------------------------------
-
-			#pragma region Compute $C_i$ (derivative w.r.t. $x_{i+1}$)
-
+			if (!path.Connect(scene, s, t, subpathL, subpathE))
+			{
+				return glm::dvec3();
+			}
+			const auto Cstar = path.EvaluateUnweightContribution();
+			if (Cstar == glm::dvec3())
 			{
-				const auto tu = (xn.dpdu - wo * glm::dot(wo, xn.dpdu)) * div_inv_woL_HL;
-				const auto tv = (xn.dpdv - wo * glm::dot(wo, xn.dpdv)) * div_inv_woL_HL;
-				const auto dHdu = tu - H * glm::dot(tu, H);
-				const auto dHdv = tv - H * glm::dot(tv, H);
-				nablaC[i - 1].C = glm::dmat2(
-					glm::dot(dHdu, s), glm::dot(dHdu, t),
-					glm::dot(dHdv, s), glm::dot(dHdv, t));
+				return glm::dvec3();
 			}
 
+			rasterPos = path.RasterPosition();
+			return Cstar * path.EvaluateMISWeight() / path.SelectionProb() * (double)(numLengths * (n + 1));
+
 			#pragma endregion
 		}
 	}
 
-	double ComputeConstraintJacobianDeterminant(const ConstraintJacobian& nablaC) const
+	// Contribution of the path of ptmnee sampled with #sampler, where the eye subpath x_0, ..., x_i uses the stream 0,
+	// and the selection of i in [0, MaxNumVertices-2] and the light use the stream 1.
+	// The chain connecting the light and x_i is found from the seed path projected from the light as ptmnee,
+	// or, if #seedChain is given, walked from #seedChain to x_i (manifold perturbation).
+	// #chain receives the chain (only the light vertex for NEE) and #canonical is set to true if it is the one found from the seed path.
+	// The contribution is zero if the manifold perturbation cannot be reversed.
+	glm::dvec3 EvaluateSample_MEMLT(const Scene& scene, Context& ctx, MLTSampler& sampler, const Path* seedChain, Path& chain, bool& canonical, glm::dvec2& rasterPos) const
 	{
-		const int n = (int)(nablaC.size());
+		canonical = true;
+		chain.vertices.clear();
+
+		#pragma region Sample a light
+
+		const int numVertices = Params.MaxNumVertices - 1;
+		sampler.StartStream(1);
+		const int i = glm::min((int)(sampler.Next() * numVertices), numVertices - 1);
 
-		// $A$
-		Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic> A(2*n, 2*n);
-		A.setZero();
-		for (int i = 0; i < n; i++)
+		PathVertex vL;
+		vL.primitive = scene.SampleEmitter(PrimitiveType::L, sampler.Next());
+		vL.primitive->SamplePosition(sampler.Next2D(), vL.geom);
+		vL.type = PrimitiveType::L;
+
+		#pragma endregion
+
+		// --------------------------------------------------------------------------------
+
+		#pragma region Sample eye subpath
+
+		sampler.StartStream(0);
+		Path path;
+		for (int step = 0; step <= i; step++)
 		{
-			if (i > 0)
+			PathVertex v;
+			if (step == 0)
 			{
-				A(2*i+0, 2*(i-1)+0) = nablaC[i].A[0][0];
-				A(2*i+0, 2*(i-1)+1) = nablaC[i].A[1][0];
-				A(2*i+1, 2*(i-1)+0) = nablaC[i].A[0][1];
-				A(2*i+1, 2*(i-1)+1) = nablaC[i].A[1][1];
+				v.primitive = scene.SampleEmitter(PrimitiveType::E, sampler.Next());
+				v.primitive->SamplePosition(sampler.Next2D(), v.geom);
+				v.type = PrimitiveType::E;
 			}
-
-			A(2*i+0, 2*i+0) = nablaC[i].B[0][0];
-			A(2*i+0, 2*i+1) = nablaC[i].B[1][0];
-			A(2*i+1, 2*i+0) = nablaC[i].B[0][1];
-			A(2*i+1, 2*i+1) = nablaC[i].B[1][1];
-
-			if (i < n - 1)
+			else
 			{
-				A(2*i+0, 2*(i+1)+0) = nablaC[i+1].C[0][0];
-				A(2*i+0, 2*(i+1)+1) = nablaC[i+1].C[1][0];
-				A(2*i+1, 2*(i+1)+0) = nablaC[i+1].C[0][1];
-				A(2*i+1, 2*(i+1)+1) = nablaC[i+1].C[1][1];
+				const auto* pv = &path.vertices.back();
+				const auto* ppv = path.vertices.size() > 1 ? &path.vertices[path.vertices.size() - 2] : nullptr;
+				glm::dvec3 wo;
+				const auto wi = ppv ? glm::normalize(ppv->geom.p - pv->geom.p) : glm::dvec3();
+				pv->primitive->SampleDirection(sampler.Next2D(), sampler.Next(), pv->type, pv->geom, wi, wo);
+
+				Ray ray = { pv->geom.p, wo };
+				Intersection isect;
+				if (!scene.Intersect(ray, isect))
+				{
+					return glm::dvec3();
+				}
+				v.geom = isect.geom;
+				v.primitive = isect.Prim;
+				v.type = isect.Prim->Type & ~PrimitiveType::Emitter;
 			}
+			path.vertices.push_back(v);
 		}
 
-		// $A^-1$
-		const decltype(A) invA = A.inverse();
-		
-		// $P_2 A^-1 B_{n}$
-		const auto Bn_n1p = nablaC[n - 1].C;
-		glm::dmat2 invA_0_n1p;
-		invA_0_n1p[0][0] = invA(0, 2*n-2);
-		invA_0_n1p[0][1] = invA(1, 2*n-2);
-		invA_0_n1p[1][0] = invA(0, 2*n-1);
-		invA_0_n1p[1][1] = invA(1, 2*n-1);
-		
-		return glm::determinant(invA_0_n1p * Bn_n1p);
-	}
+		if ((path.vertices.back().type & (PrimitiveType::D | PrimitiveType::E)) == 0)
+		{
+			return glm::dvec3();
+		}
 
-	void SolveBlockLinearEq(const ConstraintJacobian& nablaC, const std::vector<glm::dvec2>& V, std::vector<glm::dvec2>& W) const
-	{
-		const int n = (int)(nablaC.size());
-		assert(V.size() == nablaC.size());
-		
-		// --------------------------------------------------------------------------------
+		#pragma endregion
 
-		#pragma region LU decomposition
+		// --------------------------------------------------------------------------------
 
-		// A'_{0,n-1} = B_{0,n-1}
-		// B'_{0,n-2} = C_{0,n-2}
-		// C'_{0,n-2} = A_{1,n-1}
+		#pragma region Chain found from seed path
 
-		std::vector<glm::dmat2> L(n);
-		std::vector<glm::dmat2> U(n);
+		// The chains to the eye are excluded as the contribution is evaluated with x_0 and x_1
+		const auto& target = path.vertices.back().geom.p;
 		{
-			// $U_1 = A'_1$
-			U[0] = nablaC[0].B;
-			for (int i = 1; i < n; i++)
+			Path seedPath;
+			if (GenerateSeedPath(scene, vL, target, seedPath))
 			{
-				L[i] = nablaC[i].A * glm::inverse(U[i-1]);		// $L_i = C'_i U_{i-1}^-1$
-				U[i] = nablaC[i].B - L[i] * nablaC[i-1].C;		// $U_i = A'_i - L_i * B'_{i-1}$
+				if (seedPath.vertices.size() == 1)
+				{
+					chain = seedPath;
+				}
+				else if (i > 0 && i + (int)(seedPath.vertices.size()) <= Params.MaxNumVertices)
+				{
+					Path optPath;
+					Path revOptPath;
+					if (WalkManifold(scene, ctx.arena, seedPath, target, optPath) && WalkManifold(scene, ctx.arena, optPath, seedPath.vertices.back().geom.p, revOptPath))
+					{
+						chain = optPath;
+					}
+				}
 			}
 		}
 
@@ -1757,229 +6587,222 @@ private:
 
 		// --------------------------------------------------------------------------------
 
-		#pragma region Forward substitution
- 
-		// Solve $L V' = V$
-		std::vector<glm::dvec2> Vp(n);
-		Vp[0] = V[0];
-		for (int i = 1; i < n; i++)
+		#pragma region Manifold perturbation
+
+		if (seedChain)
 		{
-			// V'_i = V_i - L_i V'_{i-1}
-			Vp[i] = V[i] - L[i] * Vp[i - 1];
+			if (seedChain->vertices.size() == 1)
+			{
+				// The NEE is kept as it is only reached from the NEE
+				if (chain.vertices.size() != 1)
+				{
+					return glm::dvec3();
+				}
+			}
+			else
+			{
+				// The chain must be walked back to #seedChain by the reverse perturbation
+				Path optPath;
+				Path revOptPath;
+				if (!WalkManifold(scene, ctx.arena, *seedChain, target, optPath) ||
+					!WalkManifold(scene, ctx.arena, optPath, seedChain->vertices.back().geom.p, revOptPath) ||
+					!SameChain_MEMLT(revOptPath, *seedChain))
+				{
+					return glm::dvec3();
+				}
+				canonical = SameChain_MEMLT(optPath, chain);
+				chain = optPath;
+			}
 		}
 
 		#pragma endregion
 
 		// --------------------------------------------------------------------------------
 
-		#pragma region Backward substitution
+		#pragma region Evaluate contribution
 
-		W.assign(n, glm::dvec2());
-
-		// Solve $U_n W_n = V'_n$
-		W[n - 1] = glm::inverse(U[n - 1]) * Vp[n - 1];
+		if (chain.vertices.empty())
+		{
+			return glm::dvec3();
+		}
 
-		for (int i = n - 2; i >= 0; i--)
+		if (chain.vertices.size() == 1)
 		{
-			// Solve $U_i W_i = V'_i - V_i W_{i+1}$
-			W[i] = glm::inverse(U[i]) * (Vp[i] - V[i] * W[i + 1]);
+			Path evalPath = path;
+			evalPath.vertices.push_back(chain.vertices[0]);
+			std::reverse(evalPath.vertices.begin(), evalPath.vertices.end());
+			rasterPos = evalPath.RasterPosition();
+			return evalPath.EvaluateUnweightContribution(scene, 1) * (double)(numVertices);
 		}
 
+		const auto& vE = path.vertices[0];
+		vE.primitive->RasterPosition(glm::normalize(path.vertices[1].geom.p - vE.geom.p), vE.geom, rasterPos);
+		return EvaluateContribution_MNEE(scene, ctx, path, chain, nullptr) * (double)(numVertices);
+
 		#pragma endregion
 	}
 
-	bool WalkManifold(const Scene& scene, const Path& seedPath, const glm::dvec3& target, Path& outPath) const
+	// True if the chains are the same solution up to the tolerance of the manifold walk
+	bool SameChain_MEMLT(const Path& chain1, const Path& chain2) const
 	{
-		#pragma region Preprocess
-
-		// Number of path vertices
-		const int n = (int)(seedPath.vertices.size());
-
-		// Initial path
-		Path currPath = seedPath;
-
-		// Compute $\nabla C$
-		ConstraintJacobian nablaC(n - 2);
-		ComputeConstraintJacobian(currPath, nablaC);
+		if (chain1.vertices.size() != chain2.vertices.size())
+		{
+			return false;
+		}
 
-		// Compute $L$
 		double L = 0;
-		for (const auto& x : currPath.vertices)
+		for (const auto& v : chain1.vertices)
 		{
-			L = glm::max(L, glm::length(x.geom.p));
+			L = glm::max(L, glm::length(v.geom.p));
 		}
 
-		#pragma endregion
-
-		// --------------------------------------------------------------------------------
-
-		#pragma region Optimization loop
-
-		int iter = 0;
-		const double MaxBeta = 100.0;
-		double beta = MaxBeta;
-		const double Eps = 10e-5;
-		const int MaxIter = 30;
-		bool converged = false;
-
-		while (true)
+		const double Eps = 1e-3;
+		for (size_t i = 0; i < chain1.vertices.size(); i++)
 		{
-			#pragma region Stop condition
-
-			if (iter++ >= MaxIter)
-			{
-				break;
-			}
-
-			if (glm::length(currPath.vertices[n - 1].geom.p - target) < Eps * L)
+			if (glm::length(chain1.vertices[i].geom.p - chain2.vertices[i].geom.p) > Eps * L)
 			{
-				converged = true;
-				break;
+				return false;
 			}
+		}
 
-			#pragma endregion
+		return true;
+	}
 
-			// --------------------------------------------------------------------------------
+	int NumStreams_MLT() const
+	{
+		return Type == RendererType::MMLT ? 3 : Type == RendererType::MEMLT ? 2 : 1;
+	}
 
-			#pragma region Compute movement in tangement plane
+	void ResolveFilm_MLT(std::vector<glm::dvec3>& film, long long processedSamples) const
+	{
+		for (auto& v : film)
+		{
+			v *= MLTBootstrap.b;
+		}
+	}
 
-			// New position of initial specular vertex
-			glm::dvec3 p;
-			{
-				// $x_n$, $x'_n$
-				const auto& xn = currPath.vertices[n - 1].geom.p;
-				const auto& xnp = target;
+	#pragma endregion
 
-				// $T(x_n)^T$
-				const glm::dmat3x2 TxnT = glm::transpose(glm::dmat2x3(currPath.vertices[n - 1].geom.dpdu, currPath.vertices[n - 1].geom.dpdv));
+private:
 
-				// $V \equiv B_n T(x_n)^T (x'_n - x)$
-				const auto Bn_n2p = nablaC[n - 3].C;
-				const auto V_n2p = Bn_n2p * TxnT * (xnp - xn);
+	#pragma region First bounce splitting specific functions
 
-				// Solve $AW = V$
-				std::vector<glm::dvec2> V(n - 2);
-				std::vector<glm::dvec2> W(n - 2);
-				for (int i = 0; i < n - 2; i++) { V[i] = i == n - 3 ? V_n2p : glm::dvec2(); }
-				SolveBlockLinearEq(nablaC, V, W);
+	// Product of the split factors of the vertices before the #numVertices-th vertex
+	double SplitScale_FirstBounce(int numSplits, int numVertices) const
+	{
+		return std::pow((double)(numSplits), (double)(glm::min(numVertices - 1, Params.Split.Depth)));
+	}
 
-				// $x_2$, $T(x_2)$
-				const auto& x2 = currPath.vertices[1].geom.p;
-				const glm::dmat2x3 Tx2(currPath.vertices[1].geom.dpdu, currPath.vertices[1].geom.dpdv);
+	// Record the cost of the camera stage ending at #cameraTime and the rest of the sample ending now
+	void RecordStageCost_FirstBounce(const std::chrono::high_resolution_clock::time_point& startTime, const std::chrono::high_resolution_clock::time_point& cameraTime, int numSplits) const
+	{
+		const auto endTime = std::chrono::high_resolution_clock::now();
+		auto& cost = FirstBounceSplit.costs.local();
+		cost.camera += std::chrono::duration<double>(cameraTime - startTime).count();
+		cost.branch += std::chrono::duration<double>(endTime - cameraTime).count() / numSplits;
+		cost.numSamples++;
+	}
 
-				// $W_{n-2} = P_2 W$
-				const auto Wn2p = W[n - 3];
+	// Choose the split factor from the measured costs.
+	// Assuming the variances due to the camera stage and the rest of the path are comparable,
+	// the efficiency of the sample with N split paths is maximized at N = sqrt(c_camera / c_branch).
+	void FinalizeIteration_Split(const Scene& scene, Random& rng, long long iteration) const
+	{
+		StageCost total;
+		FirstBounceSplit.costs.combine_each([&](const StageCost& cost)
+		{
+			total.camera += cost.camera;
+			total.branch += cost.branch;
+			total.numSamples += cost.numSamples;
+		});
+		if (total.numSamples == 0 || total.branch <= 0)
+		{
+			return;
+		}
 
-				// $p = x_2 - \beta T(x_2) P_2 W_{n-2}$
-				p = x2 - beta * Tx2 * Wn2p;
-			}
+		const int numSplits = glm::clamp((int)(std::round(glm::sqrt(total.camera / total.branch))), 1, Params.Split.MaxCount);
+		FirstBounceSplit.numSplits = numSplits;
+		NGI_LOG_DEBUG("Split iteration " + std::to_string(iteration) + ": cost ratio " + std::to_string(total.camera / total.branch) + ", " + std::to_string(numSplits) + " split paths");
+	}
 
-			#pragma endregion
+	#pragma endregion
 
-			// --------------------------------------------------------------------------------
+	// --------------------------------------------------------------------------------
 
-			#pragma region Propagate light path to $p - x1$
+	#pragma region Path guiding specific functions
 
-			bool fail = false;
+	void FinalizeIteration_Guiding(const Scene& scene, Random& rng, long long iteration) const
+	{
+		GuidingTree.Update(Params.Guiding.SpatialThreshold * glm::sqrt(std::pow(2.0, (double)(iteration))), Params.Guiding.DirectionalThreshold, Params.Guiding.MaxDirectionalDepth);
+		NGI_LOG_DEBUG("Guiding iteration " + std::to_string(iteration) + ": " + std::to_string(GuidingTree.NumLeaves()) + " spatial leaves");
+	}
 
-			Path nextPath;
+	// Guiding distribution used at the vertex (nullptr if the guiding is not used)
+	const DTree* GuidingDistribution(int type, const SurfaceGeometry& geom) const
+	{
+		if (!Params.Guiding.Enabled || (type & (PrimitiveType::D | PrimitiveType::G)) == 0)
+		{
+			return nullptr;
+		}
 
-			// Initial vertex
-			nextPath.vertices.push_back(currPath.vertices[0]);
+		const auto& dtree = GuidingTree.SamplingDTree(geom.p);
+		return dtree.Total() > 0 ? &dtree : nullptr;
+	}
 
-			for (int i = 0; i < n - 1; i++)
-			{
-				// Current vertex & previous vertex
-				const auto* v  = &nextPath.vertices[i];
-				const auto* vp = i > 0 ? &nextPath.vertices[i-1] : nullptr;
+	// Sample a direction from the mixture of the BSDF sampling and the guiding distribution
+	void SampleGuidedDirection(Context& ctx, const DTree* dtree, const Primitive* prim, int type, const SurfaceGeometry& geom, const glm::dvec3& wi, glm::dvec3& wo) const
+	{
+		if (dtree && ctx.rng.Next() < Params.Guiding.Fraction)
+		{
+			wo = dtree->Sample(ctx.rng.Next2D());
+			return;
+		}
 
-				// Next ray direction
-				glm::dvec3 wo;
-				if (i == 0)
-				{
-					wo = glm::normalize(p - currPath.vertices[0].geom.p);
-				}
-				else
-				{
-					v->primitive->SampleDirection(glm::dvec2(), 0, v->type, v->geom, glm::normalize(vp->geom.p - v->geom.p), wo);
-				}
+		prim->SampleDirection(ctx.rng.Next2D(), ctx.rng.Next(), type, geom, wi, wo);
+	}
 
-				// Intersection query
-				Ray ray = { v->geom.p, wo };
-				Intersection isect;
-				if (!scene.Intersect(ray, isect))
-				{
-					fail = true;
-					break;
-				}
+	// PDF of SampleGuidedDirection in the projected solid angle measure
+	double EvaluateGuidedDirectionPDF(const DTree* dtree, const Primitive* prim, int type, const SurfaceGeometry& geom, const glm::dvec3& wi, const glm::dvec3& wo, bool forceDegenerated) const
+	{
+		const double pdfBSDF = prim->EvaluateDirectionPDF(geom, type, wi, wo, forceDegenerated);
+		if (!dtree)
+		{
+			return pdfBSDF;
+		}
 
-				// Fails if not intersected with specular vertex
-				if (i < n - 2 && (isect.Prim->Type & PrimitiveType::S) == 0)
-				{
-					fail = true;
-					break;
-				}
+		const double cos = glm::abs(glm::dot(geom.sn, wo));
+		const double pdfGuiding = cos > 0 ? dtree->EvaluatePDF(wo) / cos : 0;
+		return Params.Guiding.Fraction * pdfGuiding + (1.0 - Params.Guiding.Fraction) * pdfBSDF;
+	}
 
-				// Create a new vertex
-				PathVertex vn;
-				vn.geom = isect.geom;
-				vn.type = isect.Prim->Type;
-				vn.primitive = isect.Prim;
-				nextPath.vertices.push_back(vn);
-			}
-			
-			if (!fail)
+	// Add the contribution to the incident radiance estimates of the guiding vertices
+	// from #index to the beginning of the path
+	void AccumulateGuidingRadiance(Context& ctx, int index, const glm::dvec3& C) const
+	{
+		for (int i = index; i >= 0; i = ctx.guidingVertices[i].parent)
+		{
+			auto& v = ctx.guidingVertices[i];
+			for (int j = 0; j < 3; j++)
 			{
-				if (nextPath.vertices.size() != currPath.vertices.size())
-				{
-					// # of vertices is different
-					fail = true;
-				}
-				else if ((nextPath.vertices.back().type & PrimitiveType::D) == 0)
+				if (v.throughput[j] > 0)
 				{
-					// Last vertex type is not D
-					fail = true;
-				}
-				else
-				{
-					// Larger difference
-					const auto d  = glm::length2(currPath.vertices.back().geom.p - target);
-					const auto dn = glm::length2(nextPath.vertices.back().geom.p - target);
-					if (dn >= d)
-					{
-						fail = true;
-					}
+					v.radiance[j] += C[j] / v.throughput[j];
 				}
 			}
+		}
+	}
 
-			#pragma endregion
-
-			// --------------------------------------------------------------------------------
-
-			#pragma region Update beta
-
-			if (fail)
-			{
-				beta *= 0.5;
-			}
-			else
+	// Record the guiding vertices of the sample to the building tree
+	void RecordGuidingVertices(Context& ctx) const
+	{
+		for (const auto& v : ctx.guidingVertices)
+		{
+			if (v.pdf > 0)
 			{
-				beta = glm::min(MaxBeta, beta * 1.7);
-				//beta = glm::min(MaxBeta, beta * 2.0);
-				currPath = nextPath;
+				GuidingTree.Record(v.p, v.wo, Luminance(v.radiance) / v.pdf);
 			}
-
-			#pragma endregion
 		}
-
-		#pragma endregion
-
-		// --------------------------------------------------------------------------------
-
-		outPath = currPath;
-		assert(seedPath.vertices.size() == outPath.vertices.size());
-
-		return converged;
+		ctx.guidingVertices.clear();
 	}
 
 	#pragma endregion
@@ -2007,6 +6830,48 @@ bool Run(int argc, char** argv)
 		("max-num-vertices,m", po::value<int>()->default_value(-1), "Maximum number of vertices")
 		("width,w", po::value<int>()->default_value(1280), "Width of the rendered image")
 		("height,h", po::value<int>()->default_value(720), "Height of the rendered image")
+		("ris-num-candidates", po::value<int>()->default_value(1), "Number of light candidates resampled for direct lighting (ptdirect)")
+		("split-count", po::value<int>()->default_value(1), "Number of split paths at the first scattering vertices, or 0 to choose it from the measured cost (pt, ptdirect)")
+		("split-depth", po::value<int>()->default_value(1), "Number of the first scattering vertices where the paths are split (pt, ptdirect)")
+		("split-max-count", po::value<int>()->default_value(16), "Upper bound of the automatically chosen number of split paths (pt, ptdirect)")
+		("lvc-num-connections", po::value<int>()->default_value(3), "Number of connections to the light vertex cache per eye vertex (lvcbdpt)")
+		("vcm-radius-scale", po::value<double>()->default_value(0.003), "Initial merge radius relative to the radius of the scene bound (vcm)")
+		("vcm-radius-alpha", po::value<double>()->default_value(0.75), "Reduction rate of the merge radius in iterations (vcm)")
+		("sppm-radius-scale", po::value<double>()->default_value(0.01), "Initial radius relative to the radius of the scene bound (sppm)")
+		("sppm-alpha", po::value<double>()->default_value(0.7), "Fraction of the photons kept in the progressive radius reduction (sppm)")
+		("mlt-num-bootstrap-samples", po::value<long long>()->default_value(100000), "Number of samples to estimate the normalization factor and initial states (pssmlt, mmlt, memlt)")
+		("mlt-large-step-prob", po::value<double>()->default_value(0.3), "Probability of the large step mutation (pssmlt, mmlt, memlt)")
+		("mlt-sigma", po::value<double>()->default_value(0.01), "Standard deviation of the small step mutation (pssmlt, mmlt, memlt)")
+		("mlt-manifold-prob", po::value<double>()->default_value(0.5), "Probability of the manifold perturbation in the small steps (memlt)")
+		("vpl-num-light-paths", po::value<long long>()->default_value(1000), "Number of light subpaths generating the VPLs per iteration (vpl)")
+		("vpl-clamp-distance-scale", po::value<double>()->default_value(0.05), "Distance clamping the geometry term relative to the radius of the scene bound (vpl)")
+		("vpl-num-samples", po::value<int>()->default_value(32), "Number of VPLs sampled with the light tree per vertex, or 0 to gather all VPLs (vpl)")
+		("cache-error", po::value<double>()->default_value(0.3), "Threshold of the error estimate of the irradiance interpolation (ptcache)")
+		("cache-num-rays", po::value<int>()->default_value(256), "Number of rays to compute the irradiance of a record (ptcache)")
+		("cache-max-radius-scale", po::value<double>()->default_value(0.1), "Upper bound of the radius of a record relative to the radius of the scene bound (ptcache)")
+		("gpt-alpha", po::value<double>()->default_value(0.2), "Weight of the primal image in the screened Poisson reconstruction (gpt)")
+		("gpt-max-iterations", po::value<int>()->default_value(1000), "Maximum number of iterations of the conjugate gradient solver (gpt)")
+		("reuse-tile-size", po::value<int>()->default_value(3), "Width and height of the tiles of pixels sharing the paths (ptreuse)")
+		("sms-max-trials", po::value<int>()->default_value(64), "Maximum number of trials to estimate the reciprocal probability of a solution (ptsms)")
+		("sms-glossy", po::bool_switch(), "Include glossy surfaces in the specular chains (ptsms)")
+		("bdpt-strategy-stats", po::bool_switch(), "Collect per-strategy statistics (bdpt, lvcbdpt)")
+		("bdpt-subpath-image-dir", po::value<std::string>()->default_value(""), "Output directory of per-strategy images (bdpt, lvcbdpt)")
+		("bdpt-subpath-image-max-num-vertices", po::value<int>()->default_value(6), "Maximum number of vertices of the strategies written to per-strategy images")
+		("bdpt-pruning", po::bool_switch(), "Skip strategies stochastically according to their efficiency learned in iterations (bdpt)")
+		("bdpt-pruning-min-prob", po::value<double>()->default_value(0.05), "Minimum evaluation probability of a strategy for the strategy pruning")
+		("bdpt-optimal-mis", po::bool_switch(), "Use the optimal MIS weights learned per pixel bin in iterations (bdpt)")
+		("bdpt-optimal-mis-bin-size", po::value<int>()->default_value(8), "Width and height of a pixel bin of the optimal MIS in pixels")
+		("bdpt-optimal-mis-max-num-vertices", po::value<int>()->default_value(6), "Maximum number of vertices of the paths with the optimal MIS weights")
+		("bdpt-mnee", po::bool_switch(), "Connect subpaths through specular surfaces with the manifold walk (bdpt)")
+		("guiding", po::bool_switch(), "Enable path guiding (pt, ptdirect, ptmis)")
+		("guiding-fraction", po::value<double>()->default_value(0.5), "Probability of sampling directions from the guiding distribution")
+		("guiding-spatial-threshold", po::value<double>()->default_value(12000), "Number of samples to subdivide a spatial node in the first iteration (scaled by sqrt(2^iteration))")
+		("guiding-directional-threshold", po::value<double>()->default_value(0.01), "Fraction of energy to subdivide a directional node")
+		("rr-type", po::value<std::string>()->default_value(""), "Russian roulette policy (default: fixed for bdpt, lvcbdpt, vcm, mmlt, throughput otherwise) \n - fixed: constant continuation probability \n - throughput: proportional to path throughput")
+		("rr-prob", po::value<double>()->default_value(0.5), "Continuation probability for fixed Russian roulette")
+		("rr-min-prob", po::value<double>()->default_value(0.05), "Minimum continuation probability for throughput-based Russian roulette")
+		("rr-max-prob", po::value<double>()->default_value(0.95), "Maximum continuation probability for throughput-based Russian roulette")
+		("rr-max-split", po::value<int>()->default_value(4), "Maximum number of split paths for throughput-based Russian roulette (1: disable splitting)")
 		("num-threads,j", po::value<int>(), "Number of threads")
 		#if NGI_DEBUG_MODE
 		("grain-size", po::value<long long>()->default_value(10), "Grain size")
@@ -2015,6 +6880,7 @@ bool Run(int argc, char** argv)
 		#endif
 		("progress-update-interval", po::value<long long>()->default_value(100000), "Progress update interval")
 		("render-time,t", po::value<double>()->default_value(-1), "Render time in seconds (-1 to use # of samples)")
+		("iteration-num-samples", po::value<long long>()->default_value(-1), "Number of samples in the first iteration of iterative techniques, doubled every iteration (-1: number of pixels)")
 		("progress-image-update-interval", po::value<double>()->default_value(-1), "Progress image update interval (-1: disable)")
 		("progress-image-update-format", po::value<std::string>()->default_value("progress/{{count}}.png"), "Progress image update format string \n - {{count}}: image count");
 
@@ -2098,7 +6964,10 @@ bool Run(int argc, char** argv)
 	{
 		NGI_LOG_INFO("Rendering");
 		NGI_LOG_INDENTER();
-		renderer.Render(scene, film);
+		if (!renderer.Render(scene, film))
+		{
+			return false;
+		}
 	}
 
 	#pragma endregion